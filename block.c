@@ -894,6 +894,28 @@ int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough)
     return 0;
 }
 
+/**
+ * Set open flags for aio engine
+ *
+ * Return 0 on success, -1 if the engine specified is invalid
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    if (!strcmp(mode, "threads")) {
+        /* do nothing, default */
+    } else if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+#endif
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 static char *bdrv_child_get_parent_desc(BdrvChild *c)
 {
     BlockDriverState *parent = c->opaque;
@@ -4272,6 +4294,7 @@ static void bdrv_delete(BlockDriverState *bs)
     QTAILQ_REMOVE(&all_bdrv_states, bs, bs_list);
 
     bdrv_close(bs);
+    block_node_latency_cleanup(&bs->latency);
 
     g_free(bs);
 }
@@ -6100,6 +6123,58 @@ int bdrv_try_set_aio_context(BlockDriverState *bs, AioContext *ctx,
     return bdrv_child_try_set_aio_context(bs, ctx, NULL, errp);
 }
 
+/*
+ * Prepare @bs and all its children to process requests submitted from @ctx
+ * while other AioContexts submit requests as well, see blk_set_multiqueue().
+ *
+ * Fails if a node in the graph does not support this.  Block jobs and
+ * before-write notifiers (backup, write threshold) keep their state without
+ * locks, so nodes that have any of them do not support it either.
+ */
+int bdrv_prepare_multiqueue(BlockDriverState *bs, AioContext *ctx,
+                            Error **errp)
+{
+    BdrvChild *child;
+    BlockJob *job;
+    int ret;
+
+    if (!bs->drv || !bs->drv->supports_multiqueue) {
+        error_setg(errp, "Node '%s' does not support requests from "
+                   "several iothreads", bdrv_get_device_or_node_name(bs));
+        return -ENOTSUP;
+    }
+
+    for (job = block_job_next(NULL); job; job = block_job_next(job)) {
+        if (block_job_has_bdrv(job, bs)) {
+            error_setg(errp, "Node '%s' is used by a block job",
+                       bdrv_get_device_or_node_name(bs));
+            return -EBUSY;
+        }
+    }
+
+    if (!QLIST_EMPTY(&bs->before_write_notifiers.notifiers)) {
+        error_setg(errp, "Node '%s' has a before-write notifier",
+                   bdrv_get_device_or_node_name(bs));
+        return -EBUSY;
+    }
+
+    if (bs->drv->bdrv_prepare_multiqueue) {
+        ret = bs->drv->bdrv_prepare_multiqueue(bs, ctx, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        ret = bdrv_prepare_multiqueue(child->bs, ctx, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 void bdrv_add_aio_context_notifier(BlockDriverState *bs,
         void (*attached_aio_context)(AioContext *new_context, void *opaque),
         void (*detach_aio_context)(void *opaque), void *opaque)
@@ -27,6 +27,7 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
 #include "sysemu/qtest.h"
 
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
@@ -182,6 +183,147 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+static unsigned block_latency_hdr_index(uint64_t latency_ns)
+{
+    int e;
+
+    if (latency_ns < BLOCK_LATENCY_HDR_SUB_COUNT) {
+        return latency_ns;
+    }
+
+    e = 63 - clz64(latency_ns);
+    if (e >= BLOCK_LATENCY_HDR_MAX_BITS) {
+        return BLOCK_LATENCY_HDR_BUCKETS - 1;
+    }
+
+    return (e - BLOCK_LATENCY_HDR_SUB_BITS + 1) * BLOCK_LATENCY_HDR_SUB_COUNT +
+           ((latency_ns >> (e - BLOCK_LATENCY_HDR_SUB_BITS)) &
+            (BLOCK_LATENCY_HDR_SUB_COUNT - 1));
+}
+
+/* Largest latency that is accounted in bucket @index */
+static uint64_t block_latency_hdr_value(unsigned index)
+{
+    int e;
+    uint64_t lower;
+
+    if (index < BLOCK_LATENCY_HDR_SUB_COUNT) {
+        return index;
+    }
+
+    e = index / BLOCK_LATENCY_HDR_SUB_COUNT + BLOCK_LATENCY_HDR_SUB_BITS - 1;
+    lower = (1ULL << e) +
+            ((uint64_t)(index % BLOCK_LATENCY_HDR_SUB_COUNT)
+             << (e - BLOCK_LATENCY_HDR_SUB_BITS));
+    return lower + (1ULL << (e - BLOCK_LATENCY_HDR_SUB_BITS)) - 1;
+}
+
+static void block_latency_hdr_account(BlockLatencyHdr *hdr,
+                                      int64_t latency_ns)
+{
+    uint64_t ns = MAX(latency_ns, 0);
+
+    stat64_add(&hdr->buckets[block_latency_hdr_index(ns)], 1);
+    stat64_max(&hdr->max, ns);
+}
+
+uint64_t block_latency_hdr_count(BlockLatencyHdr *hdr)
+{
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < BLOCK_LATENCY_HDR_BUCKETS; i++) {
+        count += stat64_get(&hdr->buckets[i]);
+    }
+    return count;
+}
+
+/*
+ * Return the latency below which @fraction of the @count requests in @hdr
+ * completed.  The result is an upper bound that is never larger than the
+ * maximum recorded latency.  Concurrent updates may make the buckets add up
+ * to more than @count, which only means the newest samples are ignored.
+ */
+uint64_t block_latency_hdr_percentile(BlockLatencyHdr *hdr, uint64_t count,
+                                      double fraction)
+{
+    uint64_t max = stat64_get(&hdr->max);
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (!count) {
+        return 0;
+    }
+
+    rank = MAX((uint64_t)(fraction * count + 0.5), 1);
+    for (i = 0; i < BLOCK_LATENCY_HDR_BUCKETS; i++) {
+        seen += stat64_get(&hdr->buckets[i]);
+        if (seen >= rank) {
+            return MIN(block_latency_hdr_value(i), max);
+        }
+    }
+    return max;
+}
+
+void block_node_latency_start(BlockNodeLatencyCookie *cookie,
+                              BlockNodeLatencyOp op)
+{
+    assert(op < BLOCK_NODE_LATENCY_OP__MAX);
+
+    cookie->op = op;
+    cookie->start_time_ns = qemu_clock_get_ns(clock_type);
+    cookie->dispatch_time_ns = 0;
+}
+
+/*
+ * Mark the point where the node starts processing the request, i.e. after
+ * it waited for overlapping requests.  Only the first call counts, so that
+ * requests which are split or retried internally are not double-accounted.
+ */
+void block_node_latency_dispatch(BlockNodeLatencyCookie *cookie)
+{
+    if (!cookie->dispatch_time_ns) {
+        cookie->dispatch_time_ns = qemu_clock_get_ns(clock_type);
+    }
+}
+
+void block_node_latency_done(BlockNodeLatencyStats *lat,
+                             BlockNodeLatencyCookie *cookie)
+{
+    BlockNodeLatencyOpStats *s = atomic_rcu_read(&lat->ops[cookie->op]);
+    int64_t time_ns = qemu_clock_get_ns(clock_type);
+
+    if (!s) {
+        BlockNodeLatencyOpStats *old;
+
+        s = g_new0(BlockNodeLatencyOpStats, 1);
+        old = atomic_cmpxchg(&lat->ops[cookie->op], NULL, s);
+        if (old) {
+            g_free(s);
+            s = old;
+        }
+    }
+
+    if (!cookie->dispatch_time_ns) {
+        /* Completed without ever reaching the driver */
+        cookie->dispatch_time_ns = time_ns;
+    }
+
+    block_latency_hdr_account(&s->queue,
+                              cookie->dispatch_time_ns - cookie->start_time_ns);
+    block_latency_hdr_account(&s->driver, time_ns - cookie->dispatch_time_ns);
+}
+
+void block_node_latency_cleanup(BlockNodeLatencyStats *lat)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_NODE_LATENCY_OP__MAX; i++) {
+        g_free(lat->ops[i]);
+        lat->ops[i] = NULL;
+    }
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
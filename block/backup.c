@@ -27,6 +27,16 @@
 #include "qemu/error-report.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_CBW_MAX_WORKERS 16
+
+/* Old data of one cluster waiting to be written to the target */
+typedef struct BackupCbwRequest {
+    int64_t offset;
+    int bytes;
+    void *buf;          /* old data, or NULL if it is in cbw_buffer */
+    int64_t slot;       /* cluster index in cbw_buffer, or -1 */
+    QSIMPLEQ_ENTRY(BackupCbwRequest) next;
+} BackupCbwRequest;
 
 typedef struct CowRequest {
     int64_t start_byte;
@@ -58,6 +68,26 @@ typedef struct BackupBlockJob {
 
     BdrvRequestFlags write_flags;
     bool initializing_bitmap;
+
+    /*
+     * Asynchronous copy-before-write: guest writes save the old data here and
+     * continue, cbw_workers coroutines write it to the target later.
+     */
+    int64_t cbw_buffer_size;    /* 0 if copy-before-write is synchronous */
+    int64_t cbw_in_flight;      /* bytes saved but not yet on the target */
+    BlockBackend *cbw_buffer;   /* stores the old data, or NULL for RAM */
+    unsigned long *cbw_slots;   /* used clusters in cbw_buffer */
+    int64_t cbw_nb_slots;
+    int cbw_workers;
+    int cbw_running_workers;
+    int cbw_busy_workers;       /* workers with a request in flight */
+    bool cbw_stop;
+    bool cbw_paused;            /* the job is paused, start no new requests */
+    int cbw_ret;                /* write error waiting for on-target-error */
+    bool cbw_failed;            /* the error is reported, drop saved data */
+    QSIMPLEQ_HEAD(, BackupCbwRequest) cbw_queue;
+    CoQueue cbw_wait;           /* idle workers */
+    CoQueue cbw_done;           /* waiting for the workers to go idle or exit */
 } BackupBlockJob;
 
 static const BlockJobDriver backup_job_driver;
@@ -248,6 +278,279 @@ static int64_t backup_bitmap_reset_unallocated(BackupBlockJob *s,
     return ret;
 }
 
+static void backup_cbw_release(BackupBlockJob *job, int64_t slot, void *buf)
+{
+    if (slot >= 0) {
+        clear_bit(slot, job->cbw_slots);
+    } else {
+        qemu_vfree(buf);
+    }
+    job->cbw_in_flight -= job->cluster_size;
+}
+
+/*
+ * Save the old data of the cluster at @start for the workers, so that the
+ * guest write does not have to wait for the target.  Returns the number of
+ * bytes saved, 0 if there is no room and the cluster must be copied
+ * synchronously, or a negative errno if reading the source failed.
+ */
+static int coroutine_fn backup_cbw_save(BackupBlockJob *job, int64_t start,
+                                        void **bounce_buffer)
+{
+    BlockBackend *blk = job->common.blk;
+    BackupCbwRequest *req;
+    int nbytes = MIN(job->cluster_size, job->len - start);
+    int64_t slot = -1;
+    void *buf;
+    int ret;
+
+    assert(QEMU_IS_ALIGNED(start, job->cluster_size));
+
+    if (job->cbw_in_flight + job->cluster_size > job->cbw_buffer_size) {
+        trace_backup_cbw_full(job, start);
+        return 0;
+    }
+
+    if (job->cbw_buffer) {
+        slot = find_first_zero_bit(job->cbw_slots, job->cbw_nb_slots);
+        assert(slot < job->cbw_nb_slots);
+        set_bit(slot, job->cbw_slots);
+        if (!*bounce_buffer) {
+            *bounce_buffer = blk_blockalign(blk, job->cluster_size);
+        }
+        buf = *bounce_buffer;
+    } else {
+        buf = blk_try_blockalign(blk, job->cluster_size);
+        if (!buf) {
+            return 0;
+        }
+    }
+    job->cbw_in_flight += job->cluster_size;
+    bdrv_reset_dirty_bitmap(job->copy_bitmap, start, job->cluster_size);
+
+    ret = blk_co_pread(blk, start, nbytes, buf, BDRV_REQ_NO_SERIALISING);
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, start, ret);
+        goto fail;
+    }
+
+    if (job->cbw_buffer) {
+        ret = blk_co_pwrite(job->cbw_buffer, slot * job->cluster_size, nbytes,
+                            buf, 0);
+        if (ret < 0) {
+            /* Not fatal, fall back to copying synchronously */
+            trace_backup_cbw_buffer_write_fail(job, start, ret);
+            ret = 0;
+            goto fail;
+        }
+    }
+
+    req = g_new(BackupCbwRequest, 1);
+    *req = (BackupCbwRequest) {
+        .offset = start,
+        .bytes  = nbytes,
+        .buf    = job->cbw_buffer ? NULL : buf,
+        .slot   = slot,
+    };
+    QSIMPLEQ_INSERT_TAIL(&job->cbw_queue, req, next);
+    qemu_co_queue_next(&job->cbw_wait);
+
+    trace_backup_cbw_save(job, start, slot);
+    return nbytes;
+
+fail:
+    bdrv_set_dirty_bitmap(job->copy_bitmap, start, job->cluster_size);
+    backup_cbw_release(job, slot, job->cbw_buffer ? NULL : buf);
+    return ret;
+}
+
+/* Write the saved data of @req to the target */
+static int coroutine_fn backup_cbw_write(BackupBlockJob *job,
+                                         BackupCbwRequest *req,
+                                         void **bounce_buffer)
+{
+    void *buf = req->buf;
+    int ret;
+
+    if (!buf) {
+        if (!*bounce_buffer) {
+            *bounce_buffer = blk_blockalign(job->target, job->cluster_size);
+        }
+        buf = *bounce_buffer;
+        ret = blk_co_pread(job->cbw_buffer, req->slot * job->cluster_size,
+                           req->bytes, buf, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return blk_co_pwrite(job->target, req->offset, req->bytes, buf,
+                         job->write_flags);
+}
+
+static void backup_cbw_complete(BackupBlockJob *job, BackupCbwRequest *req,
+                                int ret)
+{
+    if (ret < 0) {
+        /*
+         * The guest has overwritten the data in the meantime, so the
+         * backup cannot be completed any more.  The bit is set again so
+         * that a bitmap synced on failure still covers the cluster.
+         */
+        bdrv_set_dirty_bitmap(job->copy_bitmap, req->offset,
+                              job->cluster_size);
+    } else {
+        job->bytes_read += req->bytes;
+        job_progress_update(&job->common.job, req->bytes);
+    }
+
+    backup_cbw_release(job, req->slot, req->buf);
+    g_free(req);
+}
+
+static void coroutine_fn backup_cbw_worker(void *opaque)
+{
+    BackupBlockJob *job = opaque;
+    void *bounce_buffer = NULL;
+
+    while (true) {
+        BackupCbwRequest *req = QSIMPLEQ_FIRST(&job->cbw_queue);
+        int ret;
+
+        if (req && job->cbw_failed) {
+            QSIMPLEQ_REMOVE_HEAD(&job->cbw_queue, next);
+            backup_cbw_complete(job, req, -ECANCELED);
+            continue;
+        }
+
+        /*
+         * Keep writing on cancel: with sync=none, cancelling is how the job
+         * ends and the target must still get the old data.  A paused or
+         * drained job must not touch the target, though, and after an error
+         * the job decides whether to retry.
+         */
+        if (!req || job->cbw_paused || job->cbw_ret < 0) {
+            if (!req && job->cbw_stop) {
+                break;
+            }
+            qemu_co_queue_wait(&job->cbw_wait, NULL);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&job->cbw_queue, next);
+
+        job->cbw_busy_workers++;
+        ret = backup_cbw_write(job, req, &bounce_buffer);
+        job->cbw_busy_workers--;
+
+        if (ret < 0 && !job->cbw_failed) {
+            /* Keep the data, on-target-error may ask for a retry */
+            trace_backup_do_cow_write_fail(job, req->offset, ret);
+            QSIMPLEQ_INSERT_HEAD(&job->cbw_queue, req, next);
+            if (!job->cbw_ret) {
+                job->cbw_ret = ret;
+                job_enter(&job->common.job);
+            }
+        } else {
+            backup_cbw_complete(job, req, ret);
+        }
+        qemu_co_queue_restart_all(&job->cbw_done);
+    }
+
+    qemu_vfree(bounce_buffer);
+    job->cbw_running_workers--;
+    qemu_co_queue_restart_all(&job->cbw_done);
+}
+
+static void coroutine_fn backup_cbw_start(BackupBlockJob *job)
+{
+    int i;
+
+    QSIMPLEQ_INIT(&job->cbw_queue);
+    qemu_co_queue_init(&job->cbw_wait);
+    qemu_co_queue_init(&job->cbw_done);
+
+    for (i = 0; i < job->cbw_workers; i++) {
+        Coroutine *co = qemu_coroutine_create(backup_cbw_worker, job);
+
+        job->cbw_running_workers++;
+        qemu_coroutine_enter(co);
+    }
+}
+
+/*
+ * Apply on-target-error to a failed write of saved data.  Returns the error
+ * if the job must fail, or 0 if the workers go on and retry the write.
+ */
+static int coroutine_fn backup_cbw_handle_error(BackupBlockJob *job)
+{
+    int ret = job->cbw_ret;
+
+    if (!ret) {
+        return 0;
+    }
+
+    /* A cancelled job can neither stop nor retry for ever */
+    if (job_is_cancelled(&job->common.job) ||
+        backup_error_action(job, false, -ret) == BLOCK_ERROR_ACTION_REPORT) {
+        job->cbw_failed = true;
+    } else {
+        ret = 0;
+        /* Wait here for the user if the policy is "stop" */
+        job_pause_point(&job->common.job);
+    }
+
+    job->cbw_ret = 0;
+    qemu_co_queue_restart_all(&job->cbw_wait);
+    return ret;
+}
+
+/* Write all saved data to the target and stop the workers */
+static int coroutine_fn backup_cbw_stop(BackupBlockJob *job)
+{
+    int ret = 0;
+
+    job->cbw_stop = true;
+    qemu_co_queue_restart_all(&job->cbw_wait);
+    while (job->cbw_running_workers) {
+        if (job->cbw_ret < 0) {
+            int error = backup_cbw_handle_error(job);
+            if (error < 0 && !ret) {
+                ret = error;
+            }
+            continue;
+        }
+        qemu_co_queue_wait(&job->cbw_done, NULL);
+    }
+    assert(!job->cbw_in_flight);
+
+    return ret;
+}
+
+static void coroutine_fn backup_pause(Job *job)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
+
+    if (!s->cbw_buffer_size) {
+        return;
+    }
+
+    /* Paused jobs must not have requests in flight on the target */
+    s->cbw_paused = true;
+    while (s->cbw_busy_workers) {
+        qemu_co_queue_wait(&s->cbw_done, NULL);
+    }
+}
+
+static void coroutine_fn backup_resume(Job *job)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
+
+    if (s->cbw_paused) {
+        s->cbw_paused = false;
+        qemu_co_queue_restart_all(&s->cbw_wait);
+    }
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t offset, uint64_t bytes,
                                       bool *error_is_read,
@@ -297,6 +600,18 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
 
         trace_backup_do_cow_process(job, start);
 
+        if (is_write_notifier && job->cbw_buffer_size) {
+            ret = backup_cbw_save(job, start, &bounce_buffer);
+            if (ret < 0) {
+                break;
+            } else if (ret > 0) {
+                /* Progress is published once the data is on the target */
+                start += ret;
+                ret = 0;
+                continue;
+            }
+        }
+
         if (job->use_copy_range) {
             ret = backup_cow_with_offload(job, start, dirty_end,
                                           is_write_notifier);
@@ -408,6 +723,13 @@ static void backup_clean(Job *job)
     assert(s->target);
     blk_unref(s->target);
     s->target = NULL;
+
+    if (s->cbw_buffer) {
+        blk_unref(s->cbw_buffer);
+        s->cbw_buffer = NULL;
+    }
+    g_free(s->cbw_slots);
+    s->cbw_slots = NULL;
 }
 
 void backup_do_checkpoint(BlockJob *job, Error **errp)
@@ -486,6 +808,10 @@ static int coroutine_fn backup_loop(BackupBlockJob *job)
             if (yield_and_check(job)) {
                 goto out;
             }
+            ret = backup_cbw_handle_error(job);
+            if (ret < 0) {
+                goto out;
+            }
             ret = backup_do_cow(job, offset,
                                 job->cluster_size, &error_is_read, false);
             if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
@@ -537,6 +863,10 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
 
     backup_init_copy_bitmap(s);
 
+    if (s->cbw_buffer_size) {
+        backup_cbw_start(s);
+    }
+
     s->before_write.notify = backup_before_write_notify;
     bdrv_add_before_write_notifier(bs, &s->before_write);
 
@@ -564,6 +894,10 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
         /* All bits are set in copy_bitmap to allow any cluster to be copied.
          * This does not actually require them to be copied. */
         while (!job_is_cancelled(job)) {
+            ret = backup_cbw_handle_error(s);
+            if (ret < 0) {
+                goto out;
+            }
             /* Yield until the job is cancelled.  We just let our before_write
              * notify callback service CoW requests. */
             job_yield(job);
@@ -579,6 +913,13 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
     qemu_co_rwlock_wrlock(&s->flush_rwlock);
     qemu_co_rwlock_unlock(&s->flush_rwlock);
 
+    if (s->cbw_buffer_size) {
+        int cbw_ret = backup_cbw_stop(s);
+        if (ret >= 0 && cbw_ret < 0) {
+            ret = cbw_ret;
+        }
+    }
+
     return ret;
 }
 
@@ -590,6 +931,8 @@ static const BlockJobDriver backup_job_driver = {
         .user_resume            = block_job_user_resume,
         .drain                  = block_job_drain,
         .run                    = backup_run,
+        .pause                  = backup_pause,
+        .resume                 = backup_resume,
         .commit                 = backup_commit,
         .abort                  = backup_abort,
         .clean                  = backup_clean,
@@ -638,6 +981,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BitmapSyncMode bitmap_mode,
                   bool compress,
+                  int64_t cbw_buffer_size, int cbw_workers,
+                  BlockDriverState *cbw_buffer,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   int creation_flags,
@@ -680,6 +1025,40 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    if (cbw_buffer_size < 0) {
+        error_setg(errp, "cbw-buffer-size must not be negative");
+        return NULL;
+    }
+
+    if (cbw_buffer_size &&
+        (cbw_workers < 1 || cbw_workers > BACKUP_CBW_MAX_WORKERS)) {
+        error_setg(errp, "cbw-workers must be between 1 and %d",
+                   BACKUP_CBW_MAX_WORKERS);
+        return NULL;
+    }
+
+    if (cbw_buffer && !cbw_buffer_size) {
+        error_setg(errp, "cbw-buffer-node requires cbw-buffer-size");
+        return NULL;
+    }
+
+    if (cbw_buffer && (cbw_buffer == bs || cbw_buffer == target)) {
+        error_setg(errp, "cbw-buffer-node must differ from the source and "
+                   "the target");
+        return NULL;
+    }
+
+    /*
+     * With image fleecing, readers of the target fall back to the source for
+     * clusters that have not been copied, so the old data must be on the
+     * target before the guest write completes.
+     */
+    if (cbw_buffer_size && bdrv_chain_contains(target, bs)) {
+        error_setg(errp, "cbw-buffer-size cannot be used when the target is "
+                   "backed by the source");
+        return NULL;
+    }
+
     if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_BACKUP_SOURCE, errp)) {
         return NULL;
     }
@@ -713,6 +1092,29 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         goto error;
     }
 
+    if (cbw_buffer_size && cbw_buffer_size < cluster_size) {
+        error_setg(errp, "cbw-buffer-size must be at least the backup cluster "
+                   "size (%" PRId64 " bytes)", cluster_size);
+        goto error;
+    }
+    cbw_buffer_size = QEMU_ALIGN_DOWN(cbw_buffer_size, cluster_size);
+    if (cbw_buffer) {
+        int64_t buffer_len = bdrv_getlength(cbw_buffer);
+
+        if (buffer_len < 0) {
+            error_setg_errno(errp, -buffer_len, "unable to get length for '%s'",
+                             bdrv_get_device_or_node_name(cbw_buffer));
+            goto error;
+        }
+        cbw_buffer_size = MIN(cbw_buffer_size,
+                              QEMU_ALIGN_DOWN(buffer_len, cluster_size));
+    }
+    if (cbw_buffer && !cbw_buffer_size) {
+        error_setg(errp, "cbw-buffer-node '%s' is smaller than the backup "
+                   "cluster size", bdrv_get_device_or_node_name(cbw_buffer));
+        goto error;
+    }
+
     copy_bitmap = bdrv_create_dirty_bitmap(bs, cluster_size, NULL, errp);
     if (!copy_bitmap) {
         goto error;
@@ -740,6 +1142,25 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     }
     blk_set_disable_request_queuing(job->target, true);
 
+    if (cbw_buffer) {
+        /* Nobody else may modify the saved data */
+        job->cbw_buffer = blk_new(job->common.job.aio_context,
+                                  BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE,
+                                  BLK_PERM_CONSISTENT_READ |
+                                  BLK_PERM_WRITE_UNCHANGED |
+                                  BLK_PERM_GRAPH_MOD);
+        ret = blk_insert_bs(job->cbw_buffer, cbw_buffer, errp);
+        if (ret < 0) {
+            goto error;
+        }
+        blk_set_disable_request_queuing(job->cbw_buffer, true);
+
+        job->cbw_nb_slots = cbw_buffer_size / cluster_size;
+        job->cbw_slots = bitmap_new(job->cbw_nb_slots);
+    }
+    job->cbw_buffer_size = cbw_buffer_size;
+    job->cbw_workers = cbw_workers;
+
     job->on_source_error = on_source_error;
     job->on_target_error = on_target_error;
     job->sync_mode = sync_mode;
@@ -768,6 +1189,10 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     /* Required permissions are already taken with target's blk_new() */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
                        &error_abort);
+    if (cbw_buffer) {
+        block_job_add_bdrv(&job->common, "cbw-buffer", cbw_buffer, 0,
+                           BLK_PERM_ALL, &error_abort);
+    }
     job->len = len;
 
     return &job->common;
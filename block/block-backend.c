@@ -29,9 +29,17 @@
 /* Number of coroutines to reserve per attached device model */
 #define COROUTINE_POOL_RESERVATION 64
 
+/* Maximum number of aio requests that are held back for merging */
+#define BLK_MERGE_MAX_REQS 32
+
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
 static AioContext *blk_aiocb_get_aio_context(BlockAIOCB *acb);
+static void blk_merge_attach_aio_context(BlockBackend *blk, AioContext *ctx);
+static void blk_merge_detach_aio_context(BlockBackend *blk);
+static void blk_clear_multiqueue(BlockBackend *blk);
+static void blk_update_multiqueue(BlockBackend *blk);
+static void blk_merge_flush(BlockBackend *blk);
 
 typedef struct BlockBackendAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
@@ -77,11 +85,26 @@ struct BlockBackend {
     bool allow_aio_context_change;
     bool allow_write_beyond_eof;
 
+    /* Accept requests from any AioContext, see blk_set_multiqueue() */
+    bool multiqueue;
+    AioContext **mq_ctx;
+    int mq_nr_ctx;
+
+    /* Request merging, see blk_set_request_merging() */
+    bool merge_requests;
+    int64_t merge_window_ns;
+    QSIMPLEQ_HEAD(, BlkAioEmAIOCB) merge_queue;
+    int merge_queue_len;
+    QEMUTimer *merge_timer;
+    QEMUBH *merge_bh;
+    unsigned int io_plugged;    /* nesting of blk_io_plug(), atomic */
+
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
     QLIST_HEAD(, BlockBackendAioNotifier) aio_notifiers;
 
     int quiesce_counter;
     CoQueue queued_requests;
+    QemuMutex queued_requests_lock; /* protects queued_requests */
     bool disable_request_queuing;
 
     VMChangeStateEntry *vmsh;
@@ -345,6 +368,8 @@ BlockBackend *blk_new(AioContext *ctx, uint64_t perm, uint64_t shared_perm)
     block_acct_init(&blk->stats);
 
     qemu_co_queue_init(&blk->queued_requests);
+    QSIMPLEQ_INIT(&blk->merge_queue);
+    qemu_mutex_init(&blk->queued_requests_lock);
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
     QLIST_INIT(&blk->aio_notifiers);
@@ -426,9 +451,12 @@ static void blk_delete(BlockBackend *blk)
     assert(QLIST_EMPTY(&blk->remove_bs_notifiers.notifiers));
     assert(QLIST_EMPTY(&blk->insert_bs_notifiers.notifiers));
     assert(QLIST_EMPTY(&blk->aio_notifiers));
+    blk_merge_detach_aio_context(blk);
+    blk_clear_multiqueue(blk);
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
     block_acct_cleanup(&blk->stats);
+    qemu_mutex_destroy(&blk->queued_requests_lock);
     g_free(blk);
 }
 
@@ -820,6 +848,7 @@ int blk_insert_bs(BlockBackend *blk, BlockDriverState *bs, Error **errp)
         throttle_group_detach_aio_context(tgm);
         throttle_group_attach_aio_context(tgm, bdrv_get_aio_context(bs));
     }
+    blk_update_multiqueue(blk);
 
     return 0;
 }
@@ -1107,6 +1136,147 @@ void blk_set_disable_request_queuing(BlockBackend *blk, bool disable)
     blk->disable_request_queuing = disable;
 }
 
+static void blk_clear_multiqueue(BlockBackend *blk)
+{
+    int i;
+
+    for (i = 0; i < blk->mq_nr_ctx; i++) {
+        aio_context_unref(blk->mq_ctx[i]);
+    }
+    g_free(blk->mq_ctx);
+    blk->mq_ctx = NULL;
+    blk->mq_nr_ctx = 0;
+    blk->multiqueue = false;
+}
+
+/* Prepare the nodes below @blk for requests from the multiqueue AioContexts */
+static int blk_prepare_multiqueue(BlockBackend *blk, Error **errp)
+{
+    int i, ret;
+
+    if (!blk_bs(blk)) {
+        return 0;
+    }
+
+    for (i = 0; i < blk->mq_nr_ctx; i++) {
+        ret = bdrv_prepare_multiqueue(blk_bs(blk), blk->mq_ctx[i], errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Check the graph again after it may have changed.  Called while no
+ * requests are in flight.
+ */
+static void blk_update_multiqueue(BlockBackend *blk)
+{
+    Error *local_err = NULL;
+
+    if (!blk->mq_nr_ctx) {
+        return;
+    }
+
+    if (blk_prepare_multiqueue(blk, &local_err) < 0) {
+        if (blk->multiqueue) {
+            warn_reportf_err(local_err, "Processing all requests of '%s' in "
+                             "one iothread: ", blk_name(blk));
+        } else {
+            error_free(local_err);
+        }
+        blk->multiqueue = false;
+    } else {
+        blk->multiqueue = true;
+    }
+}
+
+/*
+ * Allow aio requests to be submitted from the @n AioContexts in @ctxs in
+ * addition to the one of @blk.  Such requests are processed and completed in
+ * the AioContext of the thread that submitted them instead of being handed
+ * over to the AioContext of @blk, so that several threads can drive the same
+ * BlockBackend.  Pass @n == 0 to process all requests in the AioContext of
+ * @blk again.
+ *
+ * Every node below @blk must support this, see bdrv_prepare_multiqueue().
+ * The graph can change in drained sections, so it is checked again at the
+ * end of each of them; attaching a block job or a write threshold drains the
+ * node for this reason.  While it does not qualify, requests are handed over
+ * to the AioContext of @blk as usual.
+ *
+ * The device model is responsible for serializing its own state and must stop
+ * submitting requests from all of its AioContexts in its drained_begin
+ * callback.
+ */
+int blk_set_multiqueue(BlockBackend *blk, AioContext *const *ctxs, int n,
+                       Error **errp)
+{
+    int i, ret;
+
+    blk_clear_multiqueue(blk);
+    if (!n) {
+        return 0;
+    }
+
+    blk->mq_ctx = g_new(AioContext *, n);
+    blk->mq_nr_ctx = n;
+    for (i = 0; i < n; i++) {
+        aio_context_ref(ctxs[i]);
+        blk->mq_ctx[i] = ctxs[i];
+    }
+
+    ret = blk_prepare_multiqueue(blk, errp);
+    if (ret < 0) {
+        blk_clear_multiqueue(blk);
+        return ret;
+    }
+    blk->multiqueue = true;
+    return 0;
+}
+
+/* Whether requests from the multiqueue AioContexts are processed there */
+bool blk_get_multiqueue(BlockBackend *blk)
+{
+    return blk->multiqueue;
+}
+
+/*
+ * Hold back aio reads and writes so that contiguous requests can be merged
+ * into one vectored request before they reach the block driver.  Requests
+ * submitted between blk_io_plug() and the matching blk_io_unplug() are
+ * submitted at blk_io_unplug(), other requests after @window_ns nanoseconds,
+ * or at the end of the current event loop iteration if @window_ns is 0.
+ *
+ * Requests from other AioContexts than the one of @blk, see
+ * blk_set_multiqueue(), are never merged.
+ */
+void blk_set_request_merging(BlockBackend *blk, bool enable, int64_t window_ns)
+{
+    if (!enable && !blk->merge_requests) {
+        return;
+    }
+
+    blk_merge_flush(blk);
+    blk_merge_detach_aio_context(blk);
+
+    blk->merge_requests = enable;
+    blk->merge_window_ns = window_ns;
+    if (enable) {
+        blk_merge_attach_aio_context(blk, blk_get_aio_context(blk));
+    }
+}
+
+/* The AioContext in which a new aio request is processed */
+static AioContext *blk_request_aio_context(BlockBackend *blk)
+{
+    if (blk->multiqueue) {
+        return qemu_get_current_aio_context();
+    }
+    return blk_get_aio_context(blk);
+}
+
 static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
                                   size_t size)
 {
@@ -1141,7 +1311,12 @@ static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
 static void coroutine_fn blk_wait_while_drained(BlockBackend *blk)
 {
     if (blk->quiesce_counter && !blk->disable_request_queuing) {
-        qemu_co_queue_wait(&blk->queued_requests, NULL);
+        qemu_mutex_lock(&blk->queued_requests_lock);
+        if (blk->quiesce_counter) {
+            qemu_co_queue_wait(&blk->queued_requests,
+                               &blk->queued_requests_lock);
+        }
+        qemu_mutex_unlock(&blk->queued_requests_lock);
     }
 }
 
@@ -1284,6 +1459,14 @@ void blk_dec_in_flight(BlockBackend *blk)
 {
     atomic_dec(&blk->in_flight);
     aio_wait_kick();
+
+    /*
+     * A drain may be polling the AioContext of @blk while the request
+     * completed in another one.
+     */
+    if (blk->multiqueue && atomic_read(&blk->quiesce_counter)) {
+        aio_notify(blk_get_aio_context(blk));
+    }
 }
 
 static void error_callback_bh(void *opaque)
@@ -1306,7 +1489,8 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     acb->blk = blk;
     acb->ret = ret;
 
-    aio_bh_schedule_oneshot(blk_get_aio_context(blk), error_callback_bh, acb);
+    aio_bh_schedule_oneshot(blk_request_aio_context(blk),
+                            error_callback_bh, acb);
     return &acb->common;
 }
 
@@ -1315,8 +1499,23 @@ typedef struct BlkAioEmAIOCB {
     BlkRwCo rwco;
     int bytes;
     bool has_returned;
+
+    /* Only used while the request waits in blk->merge_queue */
+    bool is_write;
+    int merge_index;
+    QSIMPLEQ_ENTRY(BlkAioEmAIOCB) merge_next;
 } BlkAioEmAIOCB;
 
+typedef struct BlkMergedRequest {
+    BlockBackend *blk;
+    int64_t offset;
+    QEMUIOVector qiov;
+    BdrvRequestFlags flags;
+    bool is_write;
+    int num_reqs;
+    BlkAioEmAIOCB *reqs[BLK_MERGE_MAX_REQS];
+} BlkMergedRequest;
+
 static const AIOCBInfo blk_aio_em_aiocb_info = {
     .aiocb_size         = sizeof(BlkAioEmAIOCB),
 };
@@ -1337,6 +1536,233 @@ static void blk_aio_complete_bh(void *opaque)
     blk_aio_complete(acb);
 }
 
+static void blk_aio_read_entry(void *opaque);
+static void blk_aio_write_entry(void *opaque);
+
+static void blk_aio_merged_entry(void *opaque)
+{
+    BlkMergedRequest *mreq = opaque;
+    BlockBackend *blk = mreq->blk;
+    int i, ret;
+
+    if (blk->quiesce_counter) {
+        for (i = 0; i < mreq->num_reqs; i++) {
+            blk_dec_in_flight(blk);
+        }
+        blk_wait_while_drained(blk);
+        for (i = 0; i < mreq->num_reqs; i++) {
+            blk_inc_in_flight(blk);
+        }
+    }
+
+    if (mreq->is_write) {
+        ret = blk_co_pwritev(blk, mreq->offset, mreq->qiov.size, &mreq->qiov,
+                             mreq->flags);
+    } else {
+        ret = blk_co_preadv(blk, mreq->offset, mreq->qiov.size, &mreq->qiov,
+                            mreq->flags);
+    }
+
+    for (i = 0; i < mreq->num_reqs; i++) {
+        mreq->reqs[i]->rwco.ret = ret;
+        blk_aio_complete(mreq->reqs[i]);
+    }
+
+    qemu_iovec_destroy(&mreq->qiov);
+    g_free(mreq);
+}
+
+/* Submit @num_reqs contiguous requests of the same type as one request */
+static void blk_merge_submit(BlockBackend *blk, BlkAioEmAIOCB **reqs,
+                             int num_reqs)
+{
+    BlkMergedRequest *mreq = g_new0(BlkMergedRequest, 1);
+    Coroutine *co;
+    int i, niov = 0;
+
+    for (i = 0; i < num_reqs; i++) {
+        niov += ((QEMUIOVector *)reqs[i]->rwco.iobuf)->niov;
+    }
+
+    mreq->blk = blk;
+    mreq->offset = reqs[0]->rwco.offset;
+    mreq->flags = reqs[0]->rwco.flags;
+    mreq->is_write = reqs[0]->is_write;
+    mreq->num_reqs = num_reqs;
+    memcpy(mreq->reqs, reqs, num_reqs * sizeof(reqs[0]));
+    qemu_iovec_init(&mreq->qiov, niov);
+    for (i = 0; i < num_reqs; i++) {
+        QEMUIOVector *qiov = reqs[i]->rwco.iobuf;
+        qemu_iovec_concat(&mreq->qiov, qiov, 0, qiov->size);
+        reqs[i]->has_returned = false;
+    }
+
+    if (num_reqs > 1) {
+        trace_blk_merge_submit(blk, mreq->offset, mreq->qiov.size, num_reqs,
+                               mreq->is_write);
+        block_acct_merge_done(&blk->stats, mreq->is_write ?
+                              BLOCK_ACCT_WRITE : BLOCK_ACCT_READ,
+                              num_reqs - 1);
+    }
+
+    /* Complete in a BH if the coroutine finishes before we return */
+    co = qemu_coroutine_create(blk_aio_merged_entry, mreq);
+    bdrv_coroutine_enter(blk_bs(blk), co);
+
+    for (i = 0; i < num_reqs; i++) {
+        reqs[i]->has_returned = true;
+        if (reqs[i]->rwco.ret != NOT_DONE) {
+            aio_bh_schedule_oneshot(blk_get_aio_context(blk),
+                                    blk_aio_complete_bh, reqs[i]);
+        }
+    }
+}
+
+static int blk_merge_compare(const void *a, const void *b)
+{
+    const BlkAioEmAIOCB *req1 = *(BlkAioEmAIOCB **)a;
+    const BlkAioEmAIOCB *req2 = *(BlkAioEmAIOCB **)b;
+
+    if (req1->is_write != req2->is_write) {
+        return req1->is_write - req2->is_write;
+    }
+    if (req1->rwco.offset != req2->rwco.offset) {
+        return req1->rwco.offset < req2->rwco.offset ? -1 : 1;
+    }
+
+    /* Keep overlapping requests in submission order */
+    return req1->merge_index - req2->merge_index;
+}
+
+/* Submit all held back requests, merging contiguous ones */
+static void blk_merge_flush(BlockBackend *blk)
+{
+    BlkAioEmAIOCB *reqs[BLK_MERGE_MAX_REQS];
+    BlkAioEmAIOCB *req;
+    int64_t end = 0;
+    uint64_t max_transfer;
+    int max_iov;
+    int i, n = 0, start = 0, niov = 0;
+    uint64_t bytes = 0;
+
+    if (!blk->merge_queue_len) {
+        return;
+    }
+
+    if (blk->merge_timer) {
+        timer_del(blk->merge_timer);
+    }
+
+    while ((req = QSIMPLEQ_FIRST(&blk->merge_queue))) {
+        QSIMPLEQ_REMOVE_HEAD(&blk->merge_queue, merge_next);
+        reqs[n++] = req;
+    }
+    blk->merge_queue_len = 0;
+
+    qsort(reqs, n, sizeof(reqs[0]), blk_merge_compare);
+
+    max_transfer = blk_get_max_transfer(blk);
+    max_iov = blk_bs(blk) ? blk_get_max_iov(blk) : IOV_MAX;
+
+    for (i = 0; i < n; i++) {
+        QEMUIOVector *qiov = reqs[i]->rwco.iobuf;
+
+        if (i > start &&
+            (reqs[i]->is_write != reqs[start]->is_write ||
+             reqs[i]->rwco.flags != reqs[start]->rwco.flags ||
+             reqs[i]->rwco.offset != end ||
+             niov + qiov->niov > max_iov ||
+             bytes + qiov->size > max_transfer)) {
+            blk_merge_submit(blk, &reqs[start], i - start);
+            start = i;
+        }
+        if (i == start) {
+            niov = 0;
+            bytes = 0;
+        }
+
+        end = reqs[i]->rwco.offset + qiov->size;
+        niov += qiov->niov;
+        bytes += qiov->size;
+    }
+    blk_merge_submit(blk, &reqs[start], n - start);
+}
+
+static void blk_merge_bh(void *opaque)
+{
+    blk_merge_flush(opaque);
+}
+
+static void blk_merge_timer_cb(void *opaque)
+{
+    blk_merge_flush(opaque);
+}
+
+static void blk_merge_attach_aio_context(BlockBackend *blk, AioContext *ctx)
+{
+    if (!blk->merge_requests) {
+        return;
+    }
+
+    blk->merge_bh = aio_bh_new(ctx, blk_merge_bh, blk);
+    if (blk->merge_window_ns) {
+        blk->merge_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                         blk_merge_timer_cb, blk);
+    }
+}
+
+static void blk_merge_detach_aio_context(BlockBackend *blk)
+{
+    assert(QSIMPLEQ_EMPTY(&blk->merge_queue));
+
+    if (blk->merge_bh) {
+        qemu_bh_delete(blk->merge_bh);
+        blk->merge_bh = NULL;
+    }
+    if (blk->merge_timer) {
+        timer_del(blk->merge_timer);
+        timer_free(blk->merge_timer);
+        blk->merge_timer = NULL;
+    }
+}
+
+/*
+ * Hold back @acb for merging if possible.  Returns true if the request was
+ * queued and will be submitted by blk_merge_flush().
+ */
+static bool blk_merge_queue(BlockBackend *blk, BlkAioEmAIOCB *acb,
+                            CoroutineEntry co_entry)
+{
+    if (!blk->merge_requests || !acb->rwco.iobuf || !blk_bs(blk) ||
+        (co_entry != blk_aio_read_entry && co_entry != blk_aio_write_entry) ||
+        (blk->multiqueue &&
+         qemu_get_current_aio_context() != blk_get_aio_context(blk))) {
+        return false;
+    }
+
+    acb->is_write = co_entry == blk_aio_write_entry;
+    acb->merge_index = blk->merge_queue_len++;
+    acb->has_returned = true;
+    QSIMPLEQ_INSERT_TAIL(&blk->merge_queue, acb, merge_next);
+
+    if (blk->merge_queue_len == BLK_MERGE_MAX_REQS) {
+        /*
+         * blk_merge_flush() can only take this many.  The requests complete
+         * in a BH, so @acb is still valid when the caller gets it.
+         */
+        blk_merge_flush(blk);
+    } else if (!atomic_read(&blk->io_plugged)) {
+        if (!blk->merge_window_ns) {
+            qemu_bh_schedule(blk->merge_bh);
+        } else if (!timer_pending(blk->merge_timer)) {
+            timer_mod(blk->merge_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                      blk->merge_window_ns);
+        }
+    }
+    return true;
+}
+
 static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
                                 void *iobuf, CoroutineEntry co_entry,
                                 BdrvRequestFlags flags,
@@ -1357,12 +1783,20 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     acb->bytes = bytes;
     acb->has_returned = false;
 
+    if (blk_merge_queue(blk, acb, co_entry)) {
+        return &acb->common;
+    }
+
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    if (blk->multiqueue) {
+        aio_co_enter(blk_request_aio_context(blk), co);
+    } else {
+        bdrv_coroutine_enter(blk_bs(blk), co);
+    }
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        aio_bh_schedule_oneshot(blk_get_aio_context(blk),
+        aio_bh_schedule_oneshot(blk_request_aio_context(blk),
                                 blk_aio_complete_bh, acb);
     }
 
@@ -1924,6 +2358,10 @@ static int blk_do_set_aio_context(BlockBackend *blk, AioContext *new_context,
         }
     }
 
+    blk_merge_flush(blk);
+    blk_merge_detach_aio_context(blk);
+    blk_merge_attach_aio_context(blk, new_context);
+
     blk->ctx = new_context;
     return 0;
 }
@@ -2021,6 +2459,7 @@ void blk_io_plug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    atomic_inc(&blk->io_plugged);
     if (bs) {
         bdrv_io_plug(bs);
     }
@@ -2030,6 +2469,12 @@ void blk_io_unplug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    assert(blk->io_plugged);
+    if (atomic_fetch_dec(&blk->io_plugged) == 1 && blk->merge_queue_len &&
+        !(blk->multiqueue &&
+          qemu_get_current_aio_context() != blk_get_aio_context(blk))) {
+        blk_merge_flush(blk);
+    }
     if (bs) {
         bdrv_io_unplug(bs);
     }
@@ -2245,6 +2690,9 @@ static void blk_root_drained_begin(BdrvChild *child)
 {
     BlockBackend *blk = child->opaque;
 
+    /* Held back requests would only complete after the merge window */
+    blk_merge_flush(blk);
+
     if (++blk->quiesce_counter == 1) {
         if (blk->dev_ops && blk->dev_ops->drained_begin) {
             blk->dev_ops->drained_begin(blk->dev_opaque);
@@ -2274,14 +2722,20 @@ static void blk_root_drained_end(BdrvChild *child, int *drained_end_counter)
     assert(blk->public.throttle_group_member.io_limits_disabled);
     atomic_dec(&blk->public.throttle_group_member.io_limits_disabled);
 
+    qemu_mutex_lock(&blk->queued_requests_lock);
     if (--blk->quiesce_counter == 0) {
+        qemu_mutex_unlock(&blk->queued_requests_lock);
+        blk_update_multiqueue(blk);
         if (blk->dev_ops && blk->dev_ops->drained_end) {
             blk->dev_ops->drained_end(blk->dev_opaque);
         }
-        while (qemu_co_enter_next(&blk->queued_requests, NULL)) {
+        qemu_mutex_lock(&blk->queued_requests_lock);
+        while (qemu_co_enter_next(&blk->queued_requests,
+                                  &blk->queued_requests_lock)) {
             /* Resume all queued requests */
         }
     }
+    qemu_mutex_unlock(&blk->queued_requests_lock);
 }
 
 void blk_register_buf(BlockBackend *blk, void *host, size_t size)
@@ -150,14 +150,20 @@ typedef struct BDRVRawState {
     BDRVReopenState *reopen_state;
 
 #ifdef CONFIG_XFS
-    bool is_xfs:1;
+    bool is_xfs;
 #endif
-    bool has_discard:1;
-    bool has_write_zeroes:1;
-    bool discard_zeroes:1;
-    bool use_linux_aio:1;
-    bool page_cache_inconsistent:1;
+    bool discard_zeroes;
+    bool use_linux_aio;
+    bool use_linux_io_uring;
+    /*
+     * Cleared by thread pool workers and, for multiqueue BlockBackends,
+     * by requests from several iothreads; accessed with atomic_read() and
+     * atomic_set() once the node is open.
+     */
+    bool has_discard;
+    bool has_write_zeroes;
     bool has_fallocate;
+    bool page_cache_inconsistent;
     bool needs_alignment;
     bool drop_cache;
     bool check_cache_dropped;
@@ -498,9 +504,16 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
-    aio_default = (bdrv_flags & BDRV_O_NATIVE_AIO)
-                  ? BLOCKDEV_AIO_OPTIONS_NATIVE
-                  : BLOCKDEV_AIO_OPTIONS_THREADS;
+    if (bdrv_flags & BDRV_O_NATIVE_AIO) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_NATIVE;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (bdrv_flags & BDRV_O_IO_URING) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_IO_URING;
+#endif
+    } else {
+        aio_default = BLOCKDEV_AIO_OPTIONS_THREADS;
+    }
+
     aio = qapi_enum_parse(&BlockdevAioOptions_lookup,
                           qemu_opt_get(opts, "aio"),
                           aio_default, &local_err);
@@ -510,6 +523,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+#endif
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -595,6 +611,17 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Unlike Linux AIO, io_uring does not require O_DIRECT */
+    if (s->use_linux_io_uring) {
+        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+            error_prepend(errp, "Unable to use io_uring: ");
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+#endif
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0) {
@@ -1234,7 +1261,7 @@ static int handle_aiocb_flush(void *opaque)
     BDRVRawState *s = aiocb->bs->opaque;
     int ret;
 
-    if (s->page_cache_inconsistent) {
+    if (atomic_read(&s->page_cache_inconsistent)) {
         return -EIO;
     }
 
@@ -1254,7 +1281,7 @@ static int handle_aiocb_flush(void *opaque)
          * Obviously, this doesn't affect O_DIRECT, which bypasses the page
          * cache. */
         if ((s->open_flags & O_DIRECT) == 0) {
-            s->page_cache_inconsistent = true;
+            atomic_set(&s->page_cache_inconsistent, true);
         }
         return -errno;
     }
@@ -1538,7 +1565,7 @@ static ssize_t handle_aiocb_write_zeroes_block(RawPosixAIOData *aiocb)
     int ret = -ENOTSUP;
     BDRVRawState *s = aiocb->bs->opaque;
 
-    if (!s->has_write_zeroes) {
+    if (!atomic_read(&s->has_write_zeroes)) {
         return -ENOTSUP;
     }
 
@@ -1559,7 +1586,7 @@ static ssize_t handle_aiocb_write_zeroes_block(RawPosixAIOData *aiocb)
 #endif
 
     if (ret == -ENOTSUP) {
-        s->has_write_zeroes = false;
+        atomic_set(&s->has_write_zeroes, false);
     }
     return ret;
 }
@@ -1585,18 +1612,18 @@ static int handle_aiocb_write_zeroes(void *opaque)
 #endif
 
 #ifdef CONFIG_FALLOCATE_ZERO_RANGE
-    if (s->has_write_zeroes) {
+    if (atomic_read(&s->has_write_zeroes)) {
         int ret = do_fallocate(s->fd, FALLOC_FL_ZERO_RANGE,
                                aiocb->aio_offset, aiocb->aio_nbytes);
         if (ret == 0 || ret != -ENOTSUP) {
             return ret;
         }
-        s->has_write_zeroes = false;
+        atomic_set(&s->has_write_zeroes, false);
     }
 #endif
 
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
-    if (s->has_discard && s->has_fallocate) {
+    if (atomic_read(&s->has_discard) && atomic_read(&s->has_fallocate)) {
         int ret = do_fallocate(s->fd,
                                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
                                aiocb->aio_offset, aiocb->aio_nbytes);
@@ -1605,11 +1632,11 @@ static int handle_aiocb_write_zeroes(void *opaque)
             if (ret == 0 || ret != -ENOTSUP) {
                 return ret;
             }
-            s->has_fallocate = false;
+            atomic_set(&s->has_fallocate, false);
         } else if (ret != -ENOTSUP) {
             return ret;
         } else {
-            s->has_discard = false;
+            atomic_set(&s->has_discard, false);
         }
     }
 #endif
@@ -1618,12 +1645,13 @@ static int handle_aiocb_write_zeroes(void *opaque)
     /* Last resort: we are trying to extend the file with zeroed data. This
      * can be done via fallocate(fd, 0) */
     len = bdrv_getlength(aiocb->bs);
-    if (s->has_fallocate && len >= 0 && aiocb->aio_offset >= len) {
+    if (atomic_read(&s->has_fallocate) && len >= 0 &&
+        aiocb->aio_offset >= len) {
         int ret = do_fallocate(s->fd, 0, aiocb->aio_offset, aiocb->aio_nbytes);
         if (ret == 0 || ret != -ENOTSUP) {
             return ret;
         }
-        s->has_fallocate = false;
+        atomic_set(&s->has_fallocate, false);
     }
 #endif
 
@@ -1714,7 +1742,7 @@ static int handle_aiocb_discard(void *opaque)
     int ret = -EOPNOTSUPP;
     BDRVRawState *s = aiocb->bs->opaque;
 
-    if (!s->has_discard) {
+    if (!atomic_read(&s->has_discard)) {
         return -ENOTSUP;
     }
 
@@ -1744,7 +1772,7 @@ static int handle_aiocb_discard(void *opaque)
 
     ret = translate_err(ret);
     if (ret == -ENOTSUP) {
-        s->has_discard = false;
+        atomic_set(&s->has_discard, false);
     }
     return ret;
 }
@@ -1870,11 +1898,46 @@ out:
     return result;
 }
 
+/*
+ * Requests are processed in the AioContext of the calling coroutine.  This is
+ * usually the AioContext of @bs, but a multiqueue BlockBackend submits
+ * requests from several AioContexts (see blk_set_multiqueue()).
+ */
+static AioContext *raw_get_aio_context(BlockDriverState *bs)
+{
+    /* @bs can be NULL, use the main context then */
+    return bs ? qemu_get_current_aio_context() : qemu_get_aio_context();
+}
+
+/*
+ * The AIO engine of the current AioContext if it has one, otherwise the one
+ * of @bs.  raw_open_common() and raw_aio_attach_aio_context() set up the
+ * engine in the AioContext of @bs, raw_prepare_multiqueue() in the other
+ * AioContexts that submit requests.
+ */
+#ifdef CONFIG_LINUX_AIO
+static LinuxAioState *raw_get_linux_aio(BlockDriverState *bs)
+{
+    AioContext *ctx = raw_get_aio_context(bs);
+
+    return ctx->linux_aio ?: aio_get_linux_aio(bdrv_get_aio_context(bs));
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+static LuringState *raw_get_linux_io_uring(BlockDriverState *bs)
+{
+    AioContext *ctx = raw_get_aio_context(bs);
+
+    return ctx->linux_io_uring ?:
+           aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+}
+#endif
+
 static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
                                                ThreadPoolFunc func, void *arg)
 {
-    /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ThreadPool *pool = aio_get_thread_pool(raw_get_aio_context(bs));
     return thread_pool_submit_co(pool, func, arg);
 }
 
@@ -1893,16 +1956,20 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
      * If this is the case tell the low-level driver that it needs
      * to copy the buffer.
      */
-    if (s->needs_alignment) {
-        if (!bdrv_qiov_is_aligned(bs, qiov)) {
-            type |= QEMU_AIO_MISALIGNED;
+    if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
+        type |= QEMU_AIO_MISALIGNED;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (s->use_linux_io_uring) {
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        assert(qiov->size == bytes);
+        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+#endif
 #ifdef CONFIG_LINUX_AIO
-        } else if (s->use_linux_aio) {
-            LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-            assert(qiov->size == bytes);
-            return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
+    } else if (s->use_linux_aio && s->needs_alignment) {
+        LinuxAioState *aio = raw_get_linux_aio(bs);
+        assert(qiov->size == bytes);
+        return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
-        }
     }
 
     acb = (RawPosixAIOData) {
@@ -1936,26 +2003,39 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
     return raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_WRITE);
 }
 
+/* Plugging applies to the AIO engine of the current AioContext */
 static void raw_aio_plug(BlockDriverState *bs)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        LinuxAioState *aio = raw_get_linux_aio(bs);
         laio_io_plug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        luring_io_plug(bs, aio);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        LinuxAioState *aio = raw_get_linux_aio(bs);
         laio_io_unplug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        luring_io_unplug(bs, aio);
+    }
+#endif
 }
 
 static int raw_co_flush_to_disk(BlockDriverState *bs)
@@ -1969,6 +2049,13 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
         return ret;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+    }
+#endif
+
     acb = (RawPosixAIOData) {
         .bs             = bs,
         .aio_fildes     = s->fd,
@@ -1981,8 +2068,8 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                        AioContext *new_context)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
         Error *local_err;
         if (!aio_setup_linux_aio(new_context, &local_err)) {
@@ -1992,6 +2079,36 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
         }
     }
 #endif
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        Error *local_err = NULL;
+        if (!aio_setup_linux_io_uring(new_context, &local_err)) {
+            error_reportf_err(local_err, "Unable to use linux io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        }
+    }
+#endif
+}
+
+static int raw_prepare_multiqueue(BlockDriverState *bs, AioContext *ctx,
+                                  Error **errp)
+{
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_linux_aio && !aio_setup_linux_aio(ctx, errp)) {
+        error_prepend(errp, "Unable to use native AIO: ");
+        return -EINVAL;
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring && !aio_setup_linux_io_uring(ctx, errp)) {
+        error_prepend(errp, "Unable to use io_uring: ");
+        return -EINVAL;
+    }
+#endif
+    return 0;
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -2953,6 +3070,8 @@ BlockDriver bdrv_file = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .supports_multiqueue = true,
+    .bdrv_prepare_multiqueue = raw_prepare_multiqueue,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3429,6 +3548,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .supports_multiqueue = true,
+    .bdrv_prepare_multiqueue = raw_prepare_multiqueue,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
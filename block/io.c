@@ -1354,6 +1354,7 @@ static int coroutine_fn bdrv_aligned_preadv(BdrvChild *child,
     if (!(flags & BDRV_REQ_NO_SERIALISING)) {
         wait_serialising_requests(req);
     }
+    block_node_latency_dispatch(&req->latency);
 
     if (flags & BDRV_REQ_COPY_ON_READ) {
         int64_t pnum;
@@ -1476,9 +1477,11 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
     }
 
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    block_node_latency_start(&req.latency, BLOCK_NODE_LATENCY_OP_READ);
     ret = bdrv_aligned_preadv(child, &req, offset, bytes, align,
                               use_local_qiov ? &local_qiov : qiov,
                               flags);
+    block_node_latency_done(&bs->latency, &req.latency);
     tracked_request_end(&req);
     bdrv_dec_in_flight(bs);
 
@@ -1719,6 +1722,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BdrvChild *child,
                                    align);
 
     ret = bdrv_co_write_req_prepare(child, offset, bytes, req, flags);
+    block_node_latency_dispatch(&req->latency);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
         !(flags & BDRV_REQ_ZERO_WRITE) && drv->bdrv_co_pwrite_zeroes &&
@@ -1893,6 +1897,9 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
      * only for bdrv_aligned_pwritev, but also for the reads of the RMW cycle.
      */
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
+    block_node_latency_start(&req.latency, (flags & BDRV_REQ_ZERO_WRITE) ?
+                             BLOCK_NODE_LATENCY_OP_ZERO :
+                             BLOCK_NODE_LATENCY_OP_WRITE);
 
     if (flags & BDRV_REQ_ZERO_WRITE) {
         ret = bdrv_co_do_zero_pwritev(child, offset, bytes, flags, &req);
@@ -1977,6 +1984,7 @@ fail:
     qemu_vfree(head_buf);
     qemu_vfree(tail_buf);
 out:
+    block_node_latency_done(&bs->latency, &req.latency);
     tracked_request_end(&req);
     bdrv_dec_in_flight(bs);
     return ret;
@@ -2578,6 +2586,7 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
 
 int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 {
+    BlockNodeLatencyCookie latency;
     int current_gen;
     int ret = 0;
 
@@ -2588,6 +2597,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
         goto early_exit;
     }
 
+    block_node_latency_start(&latency, BLOCK_NODE_LATENCY_OP_FLUSH);
     qemu_co_mutex_lock(&bs->reqs_lock);
     current_gen = atomic_read(&bs->write_gen);
 
@@ -2599,6 +2609,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
     /* Flushes reach this point in nondecreasing current_gen order.  */
     bs->active_flush_req = true;
     qemu_co_mutex_unlock(&bs->reqs_lock);
+    block_node_latency_dispatch(&latency);
 
     /* Write back all layers by calling one driver function */
     if (bs->drv->bdrv_co_flush) {
@@ -2682,6 +2693,7 @@ out:
     /* Return value is ignored - it's ok if wait queue is empty */
     qemu_co_queue_next(&bs->flush_queue);
     qemu_co_mutex_unlock(&bs->reqs_lock);
+    block_node_latency_done(&bs->latency, &latency);
 
 early_exit:
     bdrv_dec_in_flight(bs);
@@ -2763,8 +2775,10 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
 
     bdrv_inc_in_flight(bs);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_DISCARD);
+    block_node_latency_start(&req.latency, BLOCK_NODE_LATENCY_OP_DISCARD);
 
     ret = bdrv_co_write_req_prepare(child, offset, bytes, &req, 0);
+    block_node_latency_dispatch(&req.latency);
     if (ret < 0) {
         goto out;
     }
@@ -2831,6 +2845,7 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
     ret = 0;
 out:
     bdrv_co_write_req_finish(child, req.offset, req.bytes, &req, ret);
+    block_node_latency_done(&bs->latency, &req.latency);
     tracked_request_end(&req);
     bdrv_dec_in_flight(bs);
     return ret;
@@ -2955,11 +2970,13 @@ void bdrv_io_plug(BlockDriverState *bs)
         bdrv_io_plug(child->bs);
     }
 
-    if (atomic_fetch_inc(&bs->io_plugged) == 0) {
-        BlockDriver *drv = bs->drv;
-        if (drv && drv->bdrv_io_plug) {
-            drv->bdrv_io_plug(bs);
-        }
+    /*
+     * Always call the driver, which may be plugged from several AioContexts
+     * at once (see blk_set_multiqueue()) and tracks nesting itself.
+     */
+    atomic_inc(&bs->io_plugged);
+    if (bs->drv && bs->drv->bdrv_io_plug) {
+        bs->drv->bdrv_io_plug(bs);
     }
 }
 
@@ -2968,11 +2985,9 @@ void bdrv_io_unplug(BlockDriverState *bs)
     BdrvChild *child;
 
     assert(bs->io_plugged);
-    if (atomic_fetch_dec(&bs->io_plugged) == 1) {
-        BlockDriver *drv = bs->drv;
-        if (drv && drv->bdrv_io_unplug) {
-            drv->bdrv_io_unplug(bs);
-        }
+    atomic_dec(&bs->io_plugged);
+    if (bs->drv && bs->drv->bdrv_io_unplug) {
+        bs->drv->bdrv_io_unplug(bs);
     }
 
     QLIST_FOREACH(child, &bs->children, next) {
@@ -0,0 +1,196 @@
+/*
+ * Request sizing and hot region deferral for the mirror block job
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "trace.h"
+#include "block/mirror-policy.h"
+
+void mirror_io_sizer_init(MirrorIOSizer *z, int64_t io_bytes,
+                          int64_t cap_io_bytes, int64_t granularity,
+                          int64_t now)
+{
+    *z = (MirrorIOSizer) {
+        .io_bytes       = io_bytes,
+        .min_io_bytes   = QEMU_ALIGN_UP(MIRROR_MIN_IO_BYTES, granularity),
+        .cap_io_bytes   = MAX(QEMU_ALIGN_DOWN(cap_io_bytes, granularity),
+                              io_bytes),
+        .granularity    = granularity,
+        .dir            = 1,
+        .start_ns       = now,
+    };
+}
+
+/*
+ * Pick the request size for background copies by hill climbing on the
+ * throughput of the target: keep growing (or shrinking) the size while that
+ * helps, step back and hold when it makes things worse, and probe upwards
+ * again from time to time.  Requests that take longer than
+ * MIRROR_LATENCY_TARGET_NS are always made smaller, because they delay
+ * guest writes that conflict with them.
+ *
+ * Called for every completed background copy of @bytes that took
+ * @latency_ns.  The size always stays between z->min_io_bytes and
+ * z->cap_io_bytes.
+ */
+void mirror_io_sizer_complete(MirrorIOSizer *z, uint64_t bytes,
+                              int64_t latency_ns, int64_t now)
+{
+    int64_t elapsed, io_bytes;
+    uint64_t bps, latency;
+    int step = 0;
+
+    z->bytes += bytes;
+    z->latency_ns += latency_ns;
+    z->ops++;
+
+    elapsed = now - z->start_ns;
+    if (elapsed < MIRROR_ADAPT_INTERVAL_NS) {
+        return;
+    }
+
+    /*
+     * Too few requests say nothing about the target.  Large requests may
+     * take a while, so extend the interval until there are enough of them,
+     * unless the job was idle for long.
+     */
+    if (z->ops < MIRROR_ADAPT_MIN_OPS &&
+        elapsed < MIRROR_ADAPT_PROBE_INTERVALS * MIRROR_ADAPT_INTERVAL_NS) {
+        return;
+    }
+
+    if (z->ops >= MIRROR_ADAPT_MIN_OPS) {
+        bps = z->bytes * NANOSECONDS_PER_SECOND / elapsed;
+        latency = z->latency_ns / z->ops;
+
+        if (latency > MIRROR_LATENCY_TARGET_NS) {
+            step = -1;
+            z->dir = 0;
+        } else if (z->dir && bps < z->last_bps - z->last_bps / 8) {
+            step = -z->dir;
+            z->dir = 0;
+        } else if (z->dir) {
+            step = z->dir;
+        } else if (++z->hold >= MIRROR_ADAPT_PROBE_INTERVALS) {
+            step = z->dir = 1;
+        }
+        if (step) {
+            z->hold = 0;
+        }
+
+        io_bytes = step > 0 ? z->io_bytes * 2 :
+                   step < 0 ? z->io_bytes / 2 : z->io_bytes;
+        io_bytes = QEMU_ALIGN_DOWN(io_bytes, z->granularity);
+        io_bytes = MAX(MIN(io_bytes, z->cap_io_bytes), z->min_io_bytes);
+        if (io_bytes == z->io_bytes) {
+            z->dir = 0;
+        }
+
+        trace_mirror_adapt_io_bytes(z, bps, latency, z->io_bytes, io_bytes);
+        z->io_bytes = io_bytes;
+        z->last_bps = bps;
+    }
+
+    z->start_ns = now;
+    z->bytes = 0;
+    z->latency_ns = 0;
+    z->ops = 0;
+}
+
+void mirror_heat_map_init(MirrorHeatMap *h, int64_t length, int64_t now)
+{
+    *h = (MirrorHeatMap) {
+        .nb_regions = DIV_ROUND_UP(length, MIRROR_HEAT_REGION_SIZE),
+        .decay_ns   = now,
+    };
+    /* Without a heat map, nothing is ever hot and nothing deferred */
+    h->heat = g_try_new0(uint8_t, h->nb_regions);
+}
+
+void mirror_heat_map_cleanup(MirrorHeatMap *h)
+{
+    g_free(h->heat);
+    h->heat = NULL;
+}
+
+void mirror_heat_map_note_write(MirrorHeatMap *h, uint64_t offset,
+                                uint64_t bytes)
+{
+    int64_t i, end;
+
+    if (!h->heat || !bytes) {
+        return;
+    }
+
+    end = MIN(DIV_ROUND_UP(offset + bytes, MIRROR_HEAT_REGION_SIZE),
+              h->nb_regions);
+    for (i = offset / MIRROR_HEAT_REGION_SIZE; i < end; i++) {
+        if (h->heat[i] < UINT8_MAX) {
+            h->heat[i]++;
+        }
+    }
+}
+
+bool mirror_heat_map_is_hot(MirrorHeatMap *h, int64_t offset)
+{
+    return h->heat &&
+           h->heat[offset / MIRROR_HEAT_REGION_SIZE] >= MIRROR_HEAT_HOT;
+}
+
+/*
+ * Called whenever the iterator wraps around.  Lets old writes cool down, at
+ * most once per MIRROR_HEAT_DECAY_NS, and alternates between passes that
+ * skip hot regions and passes that copy everything.
+ */
+void mirror_heat_map_new_pass(MirrorHeatMap *h, int64_t now)
+{
+    int64_t i;
+
+    if (h->heat && now - h->decay_ns >= MIRROR_HEAT_DECAY_NS) {
+        for (i = 0; i < h->nb_regions; i++) {
+            h->heat[i] /= 2;
+        }
+        h->decay_ns = now;
+    }
+    h->copy_hot = !h->copy_hot;
+}
+
+/*
+ * Find the next dirty offset to copy.  Passes over the dirty bitmap that skip
+ * the regions the guest has recently been rewriting alternate with passes
+ * that copy everything, so hot data does not eat up the bandwidth for the
+ * rest of the disk, but still converges once the guest leaves it alone.
+ *
+ * Returns -1 when the end of the bitmap is reached; the caller then restarts
+ * @dbi and calls mirror_heat_map_new_pass().  Called with the dirty bitmap
+ * locked.
+ */
+int64_t mirror_heat_next_dirty(MirrorHeatMap *h, BdrvDirtyBitmapIter *dbi,
+                               int64_t length)
+{
+    int64_t offset, region_end;
+    int skips;
+
+    for (skips = 0; ; skips++) {
+        offset = bdrv_dirty_iter_next(dbi);
+        if (offset < 0) {
+            return -1;
+        }
+
+        if (h->copy_hot || skips == MIRROR_HEAT_MAX_SKIPS ||
+            !mirror_heat_map_is_hot(h, offset)) {
+            return offset;
+        }
+
+        trace_mirror_skip_hot(h, offset);
+        region_end = QEMU_ALIGN_UP(offset + 1, MIRROR_HEAT_REGION_SIZE);
+        if (region_end >= length) {
+            return -1;
+        }
+        bdrv_set_dirty_iter(dbi, region_end);
+    }
+}
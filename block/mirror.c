@@ -18,6 +18,7 @@
 #include "trace.h"
 #include "block/blockjob_int.h"
 #include "block/block_int.h"
+#include "block/mirror-policy.h"
 #include "sysemu/block-backend.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
@@ -83,6 +84,9 @@ typedef struct MirrorBlockJob {
     int in_active_write_counter;
     bool prepared;
     bool in_drain;
+
+    MirrorIOSizer io_sizer;
+    MirrorHeatMap heat_map;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -102,6 +106,8 @@ struct MirrorOp {
 
     bool is_pseudo_op;
     bool is_active_write;
+    /* When the read of a background copy was issued, or 0 */
+    int64_t start_ns;
     CoQueue waiting_requests;
 
     QTAILQ_ENTRY(MirrorOp) next;
@@ -189,6 +195,12 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         if (s->cow_bitmap) {
             bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
         }
+        if (op->start_ns) {
+            int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+            mirror_io_sizer_complete(&s->io_sizer, op->bytes,
+                                     now - op->start_ns, now);
+        }
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
         }
@@ -368,6 +380,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->bytes_in_flight += op->bytes;
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
                          &op->qiov, 0);
     mirror_read_complete(op, ret);
@@ -445,6 +458,35 @@ static unsigned mirror_perform(MirrorBlockJob *s, int64_t offset,
     return bytes_handled;
 }
 
+/* Called with the dirty bitmap locked */
+static int64_t mirror_restart_iter(MirrorBlockJob *s)
+{
+    int64_t offset;
+
+    bdrv_set_dirty_iter(s->dbi, 0);
+    offset = bdrv_dirty_iter_next(s->dbi);
+    trace_mirror_restart_iter(s, bdrv_get_dirty_count(s->dirty_bitmap));
+    assert(offset >= 0);
+
+    mirror_heat_map_new_pass(&s->heat_map,
+                             qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+
+    return offset;
+}
+
+/* Called with the dirty bitmap locked */
+static int64_t mirror_next_dirty(MirrorBlockJob *s)
+{
+    int64_t offset;
+
+    offset = mirror_heat_next_dirty(&s->heat_map, s->dbi, s->bdev_length);
+    if (offset < 0) {
+        offset = mirror_restart_iter(s);
+    }
+
+    return offset;
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->mirror_top_bs->backing->bs;
@@ -454,16 +496,10 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->io_sizer.io_bytes;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    offset = bdrv_dirty_iter_next(s->dbi);
-    if (offset < 0) {
-        bdrv_set_dirty_iter(s->dbi, 0);
-        offset = bdrv_dirty_iter_next(s->dbi);
-        trace_mirror_restart_iter(s, bdrv_get_dirty_count(s->dirty_bitmap));
-        assert(offset >= 0);
-    }
+    offset = mirror_next_dirty(s);
     bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
 
     mirror_wait_on_conflicts(NULL, s, offset, 1);
@@ -849,6 +885,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     BlockDriverState *target_bs = blk_bs(s->target);
     bool need_drain = true;
     int64_t length;
+    int64_t now;
     BlockDriverInfo bdi;
     char backing_filename[2]; /* we only need 2 characters because we are only
                                  checking for a NULL string */
@@ -917,6 +954,12 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     }
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
 
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    mirror_io_sizer_init(&s->io_sizer,
+                         MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES),
+                         s->buf_size / 4, s->granularity, now);
+    mirror_heat_map_init(&s->heat_map, s->bdev_length, now);
+
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
         ret = -ENOMEM;
@@ -1064,6 +1107,7 @@ immediate_exit:
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
+    mirror_heat_map_cleanup(&s->heat_map);
     bdrv_dirty_iter_free(s->dbi);
 
     if (need_drain) {
@@ -1358,6 +1402,8 @@ static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
         op = active_write_prepare(s->job, offset, bytes);
     }
 
+    mirror_heat_map_note_write(&s->job->heat_map, offset, bytes);
+
     switch (method) {
     case MIRROR_METHOD_COPY:
         ret = bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
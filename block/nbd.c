@@ -44,9 +44,10 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ (uint64_t)(intptr_t)(conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ (uint64_t)(intptr_t)(conn))
 
 typedef struct {
     Coroutine *coroutine;
@@ -59,23 +60,38 @@ typedef enum NBDClientState {
     NBD_CLIENT_QUIT
 } NBDClientState;
 
-typedef struct BDRVNBDState {
+typedef struct NBDConnection {
+    struct BDRVNBDState *s;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    NBDExportInfo info;
+    uint32_t context_id; /* block status context negotiated on this channel */
 
     CoMutex send_mutex;
     CoQueue free_sema;
     Coroutine *connection_co;
     int in_flight;
-    NBDClientState state;
 
     NBDClientRequest requests[MAX_NBD_REQUESTS];
     NBDReply reply;
+} NBDConnection;
+
+typedef struct BDRVNBDState {
+    /*
+     * Requests are spread over several connections only if the server
+     * advertises NBD_FLAG_CAN_MULTI_CONN.  The server then guarantees that a
+     * flush on any connection covers the writes completed on all of them.
+     */
+    NBDConnection conns[MAX_NBD_CONNECTIONS];
+    int nb_conns;
+    int next_conn;
+
+    NBDExportInfo info; /* as negotiated on the first connection */
+    NBDClientState state;
     BlockDriverState *bs;
 
     /* Connection parameters */
     uint32_t reconnect_delay;
+    uint32_t connections;
     SocketAddress *saddr;
     char *export, *tlscredsid;
     QCryptoTLSCreds *tlscreds;
@@ -89,12 +105,12 @@ static void nbd_channel_error(BDRVNBDState *s, int ret)
     s->state = NBD_CLIENT_QUIT;
 }
 
-static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
+static void nbd_recv_coroutines_wake_all(NBDConnection *conn)
 {
     int i;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        NBDClientRequest *req = &s->requests[i];
+        NBDClientRequest *req = &conn->requests[i];
 
         if (req->coroutine && req->receiving) {
             aio_co_wake(req->coroutine);
@@ -102,25 +118,65 @@ static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
     }
 }
 
+/* Pick the connection with the fewest requests in flight */
+static NBDConnection *nbd_get_connection(BDRVNBDState *s)
+{
+    NBDConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[(s->next_conn + i) % s->nb_conns];
+
+        if (!best || conn->in_flight < best->in_flight) {
+            best = conn;
+        }
+    }
+    s->next_conn = (best - s->conns + 1) % s->nb_conns;
+
+    return best;
+}
+
+static bool nbd_connection_co_running(BDRVNBDState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].connection_co) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+    for (i = 0; i < s->nb_conns; i++) {
+        qio_channel_detach_aio_context(QIO_CHANNEL(s->conns[i].ioc));
+    }
 }
 
 static void nbd_client_attach_aio_context_bh(void *opaque)
 {
     BlockDriverState *bs = opaque;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
     /*
-     * The node is still drained, so we know the coroutine has yielded in
-     * nbd_read_eof(), the only place where bs->in_flight can reach 0, or it is
-     * entered for the first time. Both places are safe for entering the
-     * coroutine.
+     * The node is still drained, so we know the coroutines have yielded in
+     * nbd_read_eof(), the only place where bs->in_flight can reach 0, or they
+     * are entered for the first time. Both places are safe for entering the
+     * coroutines.
      */
-    qemu_aio_coroutine_enter(bs->aio_context, s->connection_co);
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].connection_co) {
+            qemu_aio_coroutine_enter(bs->aio_context,
+                                     s->conns[i].connection_co);
+        }
+    }
     bdrv_dec_in_flight(bs);
 }
 
@@ -128,8 +184,12 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
                                           AioContext *new_context)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
+    for (i = 0; i < s->nb_conns; i++) {
+        qio_channel_attach_aio_context(QIO_CHANNEL(s->conns[i].ioc),
+                                       new_context);
+    }
 
     bdrv_inc_in_flight(bs);
 
@@ -144,25 +204,31 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
 static void nbd_teardown_connection(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-
-    assert(s->ioc);
+    int i;
 
     /* finish any pending coroutines */
-    qio_channel_shutdown(s->ioc,
-                         QIO_CHANNEL_SHUTDOWN_BOTH,
-                         NULL);
-    BDRV_POLL_WHILE(bs, s->connection_co);
+    for (i = 0; i < s->nb_conns; i++) {
+        assert(s->conns[i].ioc);
+        qio_channel_shutdown(s->conns[i].ioc,
+                             QIO_CHANNEL_SHUTDOWN_BOTH,
+                             NULL);
+    }
+    BDRV_POLL_WHILE(bs, nbd_connection_co_running(s));
 
     nbd_client_detach_aio_context(bs);
-    object_unref(OBJECT(s->sioc));
-    s->sioc = NULL;
-    object_unref(OBJECT(s->ioc));
-    s->ioc = NULL;
+    for (i = 0; i < s->nb_conns; i++) {
+        object_unref(OBJECT(s->conns[i].sioc));
+        s->conns[i].sioc = NULL;
+        object_unref(OBJECT(s->conns[i].ioc));
+        s->conns[i].ioc = NULL;
+    }
+    s->nb_conns = 0;
 }
 
 static coroutine_fn void nbd_connection_entry(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
+    BDRVNBDState *s = conn->s;
     uint64_t i;
     int ret = 0;
     Error *local_err = NULL;
@@ -177,8 +243,8 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          * Therefore we keep an additional in_flight reference all the time and
          * only drop it temporarily here.
          */
-        assert(s->reply.handle == 0);
-        ret = nbd_receive_reply(s->bs, s->ioc, &s->reply, &local_err);
+        assert(conn->reply.handle == 0);
+        ret = nbd_receive_reply(s->bs, conn->ioc, &conn->reply, &local_err);
 
         if (local_err) {
             trace_nbd_read_reply_entry_fail(ret, error_get_pretty(local_err));
@@ -194,11 +260,12 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          * handler acts as a synchronization point and ensures that only
          * one coroutine is called until the reply finishes.
          */
-        i = HANDLE_TO_INDEX(s, s->reply.handle);
+        i = HANDLE_TO_INDEX(conn, conn->reply.handle);
         if (i >= MAX_NBD_REQUESTS ||
-            !s->requests[i].coroutine ||
-            !s->requests[i].receiving ||
-            (nbd_reply_is_structured(&s->reply) && !s->info.structured_reply))
+            !conn->requests[i].coroutine ||
+            !conn->requests[i].receiving ||
+            (nbd_reply_is_structured(&conn->reply) &&
+             !s->info.structured_reply))
         {
             nbd_channel_error(s, -EINVAL);
             break;
@@ -216,27 +283,27 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          *   connection_co happens through a bottom half, which can only
          *   run after we yield.
          */
-        aio_co_wake(s->requests[i].coroutine);
+        aio_co_wake(conn->requests[i].coroutine);
         qemu_coroutine_yield();
     }
 
-    nbd_recv_coroutines_wake_all(s);
+    nbd_recv_coroutines_wake_all(conn);
     bdrv_dec_in_flight(s->bs);
 
-    s->connection_co = NULL;
+    conn->connection_co = NULL;
     aio_wait_kick();
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDConnection *conn,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = conn->s;
     int rc, i = -1;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    while (s->in_flight == MAX_NBD_REQUESTS) {
-        qemu_co_queue_wait(&s->free_sema, &s->send_mutex);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    while (conn->in_flight == MAX_NBD_REQUESTS) {
+        qemu_co_queue_wait(&conn->free_sema, &conn->send_mutex);
     }
 
     if (s->state != NBD_CLIENT_CONNECTED) {
@@ -244,10 +311,10 @@ static int nbd_co_send_request(BlockDriverState *bs,
         goto err;
     }
 
-    s->in_flight++;
+    conn->in_flight++;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->requests[i].coroutine == NULL) {
+        if (conn->requests[i].coroutine == NULL) {
             break;
         }
     }
@@ -255,40 +322,40 @@ static int nbd_co_send_request(BlockDriverState *bs,
     g_assert(qemu_in_coroutine());
     assert(i < MAX_NBD_REQUESTS);
 
-    s->requests[i].coroutine = qemu_coroutine_self();
-    s->requests[i].offset = request->from;
-    s->requests[i].receiving = false;
+    conn->requests[i].coroutine = qemu_coroutine_self();
+    conn->requests[i].offset = request->from;
+    conn->requests[i].receiving = false;
 
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(conn, i);
 
-    assert(s->ioc);
+    assert(conn->ioc);
 
     if (qiov) {
-        qio_channel_set_cork(s->ioc, true);
-        rc = nbd_send_request(s->ioc, request);
+        qio_channel_set_cork(conn->ioc, true);
+        rc = nbd_send_request(conn->ioc, request);
         if (rc >= 0 && s->state == NBD_CLIENT_CONNECTED) {
-            if (qio_channel_writev_all(s->ioc, qiov->iov, qiov->niov,
+            if (qio_channel_writev_all(conn->ioc, qiov->iov, qiov->niov,
                                        NULL) < 0) {
                 rc = -EIO;
             }
         } else if (rc >= 0) {
             rc = -EIO;
         }
-        qio_channel_set_cork(s->ioc, false);
+        qio_channel_set_cork(conn->ioc, false);
     } else {
-        rc = nbd_send_request(s->ioc, request);
+        rc = nbd_send_request(conn->ioc, request);
     }
 
 err:
     if (rc < 0) {
         nbd_channel_error(s, rc);
         if (i != -1) {
-            s->requests[i].coroutine = NULL;
-            s->in_flight--;
+            conn->requests[i].coroutine = NULL;
+            conn->in_flight--;
         }
-        qemu_co_queue_next(&s->free_sema);
+        qemu_co_queue_next(&conn->free_sema);
     }
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_unlock(&conn->send_mutex);
     return rc;
 }
 
@@ -348,11 +415,12 @@ static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
  * Based on our request, we expect only one extent in reply, for the
  * base:allocation context.
  */
-static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
+static int nbd_parse_blockstatus_payload(NBDConnection *conn,
                                          NBDStructuredReplyChunk *chunk,
                                          uint8_t *payload, uint64_t orig_length,
                                          NBDExtent *extent, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     uint32_t context_id;
 
     /* The server succeeded, so it must have sent [at least] one extent */
@@ -363,11 +431,11 @@ static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
     }
 
     context_id = payload_advance32(&payload);
-    if (s->info.context_id != context_id) {
+    if (conn->context_id != context_id) {
         error_setg(errp, "Protocol error: unexpected context id %d for "
                          "NBD_REPLY_TYPE_BLOCK_STATUS, when negotiated context "
                          "id is %d", context_id,
-                         s->info.context_id);
+                         conn->context_id);
         return -EINVAL;
     }
 
@@ -465,17 +533,18 @@ static int nbd_parse_error_payload(NBDStructuredReplyChunk *chunk,
     return 0;
 }
 
-static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
+static int nbd_co_receive_offset_data_payload(NBDConnection *conn,
                                               uint64_t orig_offset,
                                               QEMUIOVector *qiov, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     QEMUIOVector sub_qiov;
     uint64_t offset;
     size_t data_size;
     int ret;
-    NBDStructuredReplyChunk *chunk = &s->reply.structured;
+    NBDStructuredReplyChunk *chunk = &conn->reply.structured;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&conn->reply));
 
     /* The NBD spec requires at least one byte of payload */
     if (chunk->length <= sizeof(offset)) {
@@ -484,7 +553,7 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
         return -EINVAL;
     }
 
-    if (nbd_read64(s->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
+    if (nbd_read64(conn->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
         return -EIO;
     }
 
@@ -502,7 +571,7 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
 
     qemu_iovec_init(&sub_qiov, qiov->niov);
     qemu_iovec_concat(&sub_qiov, qiov, offset - orig_offset, data_size);
-    ret = qio_channel_readv_all(s->ioc, sub_qiov.iov, sub_qiov.niov, errp);
+    ret = qio_channel_readv_all(conn->ioc, sub_qiov.iov, sub_qiov.niov, errp);
     qemu_iovec_destroy(&sub_qiov);
 
     return ret < 0 ? -EIO : 0;
@@ -510,14 +579,14 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
 
 #define NBD_MAX_MALLOC_PAYLOAD 1000
 static coroutine_fn int nbd_co_receive_structured_payload(
-        BDRVNBDState *s, void **payload, Error **errp)
+        NBDConnection *conn, void **payload, Error **errp)
 {
     int ret;
     uint32_t len;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&conn->reply));
 
-    len = s->reply.structured.length;
+    len = conn->reply.structured.length;
 
     if (len == 0) {
         return 0;
@@ -534,7 +603,7 @@ static coroutine_fn int nbd_co_receive_structured_payload(
     }
 
     *payload = g_new(char, len);
-    ret = nbd_read(s->ioc, *payload, len, "structured payload", errp);
+    ret = nbd_read(conn->ioc, *payload, len, "structured payload", errp);
     if (ret < 0) {
         g_free(*payload);
         *payload = NULL;
@@ -560,11 +629,12 @@ static coroutine_fn int nbd_co_receive_structured_payload(
  * corresponding to the server's error reply), and errp is unchanged.
  */
 static coroutine_fn int nbd_co_do_receive_one_chunk(
-        BDRVNBDState *s, uint64_t handle, bool only_structured,
+        NBDConnection *conn, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, void **payload, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     int ret;
-    int i = HANDLE_TO_INDEX(s, handle);
+    int i = HANDLE_TO_INDEX(conn, handle);
     void *local_payload = NULL;
     NBDStructuredReplyChunk *chunk;
 
@@ -574,36 +644,36 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
     *request_ret = 0;
 
     /* Wait until we're woken up by nbd_connection_entry.  */
-    s->requests[i].receiving = true;
+    conn->requests[i].receiving = true;
     qemu_coroutine_yield();
-    s->requests[i].receiving = false;
+    conn->requests[i].receiving = false;
     if (s->state != NBD_CLIENT_CONNECTED) {
         error_setg(errp, "Connection closed");
         return -EIO;
     }
-    assert(s->ioc);
+    assert(conn->ioc);
 
-    assert(s->reply.handle == handle);
+    assert(conn->reply.handle == handle);
 
-    if (nbd_reply_is_simple(&s->reply)) {
+    if (nbd_reply_is_simple(&conn->reply)) {
         if (only_structured) {
             error_setg(errp, "Protocol error: simple reply when structured "
                              "reply chunk was expected");
             return -EINVAL;
         }
 
-        *request_ret = -nbd_errno_to_system_errno(s->reply.simple.error);
+        *request_ret = -nbd_errno_to_system_errno(conn->reply.simple.error);
         if (*request_ret < 0 || !qiov) {
             return 0;
         }
 
-        return qio_channel_readv_all(s->ioc, qiov->iov, qiov->niov,
+        return qio_channel_readv_all(conn->ioc, qiov->iov, qiov->niov,
                                      errp) < 0 ? -EIO : 0;
     }
 
     /* handle structured reply chunk */
     assert(s->info.structured_reply);
-    chunk = &s->reply.structured;
+    chunk = &conn->reply.structured;
 
     if (chunk->type == NBD_REPLY_TYPE_NONE) {
         if (!(chunk->flags & NBD_REPLY_FLAG_DONE)) {
@@ -625,7 +695,8 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
             return -EINVAL;
         }
 
-        return nbd_co_receive_offset_data_payload(s, s->requests[i].offset,
+        return nbd_co_receive_offset_data_payload(conn,
+                                                  conn->requests[i].offset,
                                                   qiov, errp);
     }
 
@@ -633,7 +704,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
         payload = &local_payload;
     }
 
-    ret = nbd_co_receive_structured_payload(s, payload, errp);
+    ret = nbd_co_receive_structured_payload(conn, payload, errp);
     if (ret < 0) {
         return ret;
     }
@@ -653,24 +724,24 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
  * Return value is a fatal error code or normal nbd reply error code
  */
 static coroutine_fn int nbd_co_receive_one_chunk(
-        BDRVNBDState *s, uint64_t handle, bool only_structured,
+        NBDConnection *conn, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, NBDReply *reply, void **payload,
         Error **errp)
 {
-    int ret = nbd_co_do_receive_one_chunk(s, handle, only_structured,
+    int ret = nbd_co_do_receive_one_chunk(conn, handle, only_structured,
                                           request_ret, qiov, payload, errp);
 
     if (ret < 0) {
         memset(reply, 0, sizeof(*reply));
-        nbd_channel_error(s, ret);
+        nbd_channel_error(conn->s, ret);
     } else {
         /* For assert at loop start in nbd_connection_entry */
-        *reply = s->reply;
-        s->reply.handle = 0;
+        *reply = conn->reply;
+        conn->reply.handle = 0;
     }
 
-    if (s->connection_co) {
-        aio_co_wake(s->connection_co);
+    if (conn->connection_co) {
+        aio_co_wake(conn->connection_co);
     }
 
     return ret;
@@ -711,21 +782,23 @@ static void nbd_iter_request_error(NBDReplyChunkIter *iter, int ret)
  * NBD_FOREACH_REPLY_CHUNK
  * The pointer stored in @payload requires g_free() to free it.
  */
-#define NBD_FOREACH_REPLY_CHUNK(s, iter, handle, structured, \
+#define NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, structured, \
                                 qiov, reply, payload) \
     for (iter = (NBDReplyChunkIter) { .only_structured = structured }; \
-         nbd_reply_chunk_iter_receive(s, &iter, handle, qiov, reply, payload);)
+         nbd_reply_chunk_iter_receive(conn, &iter, handle, qiov, reply, \
+                                      payload);)
 
 /*
  * nbd_reply_chunk_iter_receive
  * The pointer stored in @payload requires g_free() to free it.
  */
-static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
+static bool nbd_reply_chunk_iter_receive(NBDConnection *conn,
                                          NBDReplyChunkIter *iter,
                                          uint64_t handle,
                                          QEMUIOVector *qiov, NBDReply *reply,
                                          void **payload)
 {
+    BDRVNBDState *s = conn->s;
     int ret, request_ret;
     NBDReply local_reply;
     NBDStructuredReplyChunk *chunk;
@@ -745,7 +818,7 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
         reply = &local_reply;
     }
 
-    ret = nbd_co_receive_one_chunk(s, handle, iter->only_structured,
+    ret = nbd_co_receive_one_chunk(conn, handle, iter->only_structured,
                                    &request_ret, qiov, reply, payload,
                                    &local_err);
     if (ret < 0) {
@@ -777,22 +850,22 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
     return true;
 
 break_loop:
-    s->requests[HANDLE_TO_INDEX(s, handle)].coroutine = NULL;
+    conn->requests[HANDLE_TO_INDEX(conn, handle)].coroutine = NULL;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->in_flight--;
-    qemu_co_queue_next(&s->free_sema);
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    conn->in_flight--;
+    qemu_co_queue_next(&conn->free_sema);
+    qemu_co_mutex_unlock(&conn->send_mutex);
 
     return false;
 }
 
-static int nbd_co_receive_return_code(BDRVNBDState *s, uint64_t handle,
+static int nbd_co_receive_return_code(NBDConnection *conn, uint64_t handle,
                                       int *request_ret, Error **errp)
 {
     NBDReplyChunkIter iter;
 
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, NULL, NULL) {
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, false, NULL, NULL, NULL) {
         /* nbd_reply_chunk_iter_receive does all the work */
     }
 
@@ -801,16 +874,17 @@ static int nbd_co_receive_return_code(BDRVNBDState *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
+static int nbd_co_receive_cmdread_reply(NBDConnection *conn, uint64_t handle,
                                         uint64_t offset, QEMUIOVector *qiov,
                                         int *request_ret, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     NBDReplyChunkIter iter;
     NBDReply reply;
     void *payload = NULL;
     Error *local_err = NULL;
 
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, s->info.structured_reply,
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, s->info.structured_reply,
                             qiov, &reply, &payload)
     {
         int ret;
@@ -853,11 +927,12 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
+static int nbd_co_receive_blockstatus_reply(NBDConnection *conn,
                                             uint64_t handle, uint64_t length,
                                             NBDExtent *extent,
                                             int *request_ret, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     NBDReplyChunkIter iter;
     NBDReply reply;
     void *payload = NULL;
@@ -865,7 +940,7 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
     bool received = false;
 
     assert(!extent->length);
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, &reply, &payload) {
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, false, NULL, &reply, &payload) {
         int ret;
         NBDStructuredReplyChunk *chunk = &reply.structured;
 
@@ -880,7 +955,7 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
             }
             received = true;
 
-            ret = nbd_parse_blockstatus_payload(s, &reply.structured,
+            ret = nbd_parse_blockstatus_payload(conn, &reply.structured,
                                                 payload, length, extent,
                                                 &local_err);
             if (ret < 0) {
@@ -919,6 +994,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *conn = nbd_get_connection(s);
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -927,12 +1003,12 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
+    ret = nbd_co_send_request(conn, request, write_qiov);
     if (ret < 0) {
         return ret;
     }
 
-    ret = nbd_co_receive_return_code(s, request->handle,
+    ret = nbd_co_receive_return_code(conn, request->handle,
                                      &request_ret, &local_err);
     if (local_err) {
         trace_nbd_co_request_fail(request->from, request->len, request->handle,
@@ -950,6 +1026,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *conn;
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -981,12 +1058,13 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
         request.len -= slop;
     }
 
-    ret = nbd_co_send_request(bs, &request, NULL);
+    conn = nbd_get_connection(s);
+    ret = nbd_co_send_request(conn, &request, NULL);
     if (ret < 0) {
         return ret;
     }
 
-    ret = nbd_co_receive_cmdread_reply(s, request.handle, offset, qiov,
+    ret = nbd_co_receive_cmdread_reply(conn, request.handle, offset, qiov,
                                        &request_ret, &local_err);
     if (local_err) {
         trace_nbd_co_request_fail(request.from, request.len, request.handle,
@@ -1091,6 +1169,7 @@ static int coroutine_fn nbd_client_co_block_status(
     int ret, request_ret;
     NBDExtent extent = { 0 };
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *conn;
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -1127,12 +1206,13 @@ static int coroutine_fn nbd_client_co_block_status(
     if (s->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
-    ret = nbd_co_send_request(bs, &request, NULL);
+    conn = nbd_get_connection(s);
+    ret = nbd_co_send_request(conn, &request, NULL);
     if (ret < 0) {
         return ret;
     }
 
-    ret = nbd_co_receive_blockstatus_reply(s, request.handle, bytes,
+    ret = nbd_co_receive_blockstatus_reply(conn, request.handle, bytes,
                                            &extent, &request_ret, &local_err);
     if (local_err) {
         trace_nbd_co_request_fail(request.from, request.len, request.handle,
@@ -1158,10 +1238,12 @@ static void nbd_client_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    assert(s->ioc);
-
-    nbd_send_request(s->ioc, &request);
+    for (i = 0; i < s->nb_conns; i++) {
+        assert(s->conns[i].ioc);
+        nbd_send_request(s->conns[i].ioc, &request);
+    }
 
     nbd_teardown_connection(bs);
 }
@@ -1187,7 +1269,11 @@ static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
     return sioc;
 }
 
-static int nbd_client_connect(BlockDriverState *bs, Error **errp)
+/*
+ * Connect to the server and negotiate the export for @conn, filling in @info.
+ */
+static int nbd_client_connect_one(BlockDriverState *bs, NBDConnection *conn,
+                                  NBDExportInfo *info, Error **errp)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     AioContext *aio_context = bdrv_get_aio_context(bs);
@@ -1208,19 +1294,63 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     qio_channel_attach_aio_context(QIO_CHANNEL(sioc), aio_context);
 
-    s->info.request_sizes = true;
-    s->info.structured_reply = true;
-    s->info.base_allocation = true;
-    s->info.x_dirty_bitmap = g_strdup(s->x_dirty_bitmap);
-    s->info.name = g_strdup(s->export ?: "");
+    info->request_sizes = true;
+    info->structured_reply = true;
+    info->base_allocation = true;
+    info->x_dirty_bitmap = g_strdup(s->x_dirty_bitmap);
+    info->name = g_strdup(s->export ?: "");
     ret = nbd_receive_negotiate(aio_context, QIO_CHANNEL(sioc), s->tlscreds,
-                                s->hostname, &s->ioc, &s->info, errp);
-    g_free(s->info.x_dirty_bitmap);
-    g_free(s->info.name);
+                                s->hostname, &conn->ioc, info, errp);
+    g_free(info->x_dirty_bitmap);
+    g_free(info->name);
+    info->x_dirty_bitmap = NULL;
+    info->name = NULL;
     if (ret < 0) {
         object_unref(OBJECT(sioc));
         return ret;
     }
+
+    conn->s = s;
+    conn->sioc = sioc;
+    conn->context_id = info->context_id;
+    qemu_co_mutex_init(&conn->send_mutex);
+    qemu_co_queue_init(&conn->free_sema);
+
+    if (!conn->ioc) {
+        conn->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(conn->ioc));
+    }
+
+    return 0;
+}
+
+/*
+ * Undo nbd_client_connect_one() for a connection that has no connection_co
+ * yet.  Send NBD_CMD_DISC as a courtesy to the server.
+ */
+static void nbd_client_disconnect_one(NBDConnection *conn)
+{
+    NBDRequest request = { .type = NBD_CMD_DISC };
+
+    nbd_send_request(conn->ioc, &request);
+
+    object_unref(OBJECT(conn->sioc));
+    conn->sioc = NULL;
+    object_unref(OBJECT(conn->ioc));
+    conn->ioc = NULL;
+}
+
+static int nbd_client_connect(BlockDriverState *bs, Error **errp)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i, ret;
+
+    ret = nbd_client_connect_one(bs, &s->conns[0], &s->info, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    s->nb_conns = 1;
+
     if (s->x_dirty_bitmap && !s->info.base_allocation) {
         error_setg(errp, "requested x-dirty-bitmap %s not found",
                    s->x_dirty_bitmap);
@@ -1241,31 +1371,47 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
         bs->supported_zero_flags |= BDRV_REQ_MAY_UNMAP;
     }
 
-    s->sioc = sioc;
+    /*
+     * Without NBD_FLAG_CAN_MULTI_CONN, a flush on one connection need not
+     * cover writes made on another one, so stay with a single connection.
+     */
+    if (s->connections > 1 && !(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        trace_nbd_client_multi_conn_unsupported(s->export);
+    } else {
+        for (i = 1; i < s->connections; i++) {
+            NBDExportInfo info = { 0 };
 
-    if (!s->ioc) {
-        s->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(s->ioc));
+            ret = nbd_client_connect_one(bs, &s->conns[i], &info, errp);
+            if (ret < 0) {
+                goto fail;
+            }
+            s->nb_conns++;
+
+            if (info.size != s->info.size || info.flags != s->info.flags ||
+                info.structured_reply != s->info.structured_reply ||
+                info.base_allocation != s->info.base_allocation ||
+                info.min_block != s->info.min_block ||
+                info.max_block != s->info.max_block) {
+                error_setg(errp, "NBD server changed the export parameters "
+                           "for connection %d", i);
+                ret = -EINVAL;
+                goto fail;
+            }
+        }
     }
 
-    trace_nbd_client_connect_success(s->export);
+    trace_nbd_client_connect_success(s->export, s->nb_conns);
 
     return 0;
 
  fail:
-    /*
-     * We have connected, but must fail for other reasons.
-     * Send NBD_CMD_DISC as a courtesy to the server.
-     */
-    {
-        NBDRequest request = { .type = NBD_CMD_DISC };
-
-        nbd_send_request(s->ioc ?: QIO_CHANNEL(sioc), &request);
-
-        object_unref(OBJECT(sioc));
-
-        return ret;
+    /* We have connected, but must fail for other reasons. */
+    for (i = 0; i < s->nb_conns; i++) {
+        nbd_client_disconnect_one(&s->conns[i]);
     }
+    s->nb_conns = 0;
+
+    return ret;
 }
 
 /*
@@ -1575,6 +1721,12 @@ static QemuOptsList nbd_runtime_opts = {
             .help = "experimental: expose named dirty bitmap in place of "
                     "block status",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the server, used only if the "
+                    "server allows multiple connections. Default 1",
+        },
         {
             .name = "reconnect-delay",
             .type = QEMU_OPT_NUMBER,
@@ -1636,6 +1788,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     s->x_dirty_bitmap = g_strdup(qemu_opt_get(opts, "x-dirty-bitmap"));
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    s->connections = qemu_opt_get_number(opts, "connections", 1);
+    if (s->connections < 1 || s->connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -1652,7 +1811,7 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
-    int ret;
+    int i, ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     ret = nbd_process_options(bs, options, errp);
@@ -1661,8 +1820,6 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     s->bs = bs;
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_queue_init(&s->free_sema);
 
     ret = nbd_client_connect(bs, errp);
     if (ret < 0) {
@@ -1671,9 +1828,14 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     /* successfully connected */
     s->state = NBD_CLIENT_CONNECTED;
 
-    s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
-    bdrv_inc_in_flight(bs);
-    aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[i];
+
+        conn->connection_co = qemu_coroutine_create(nbd_connection_entry,
+                                                    conn);
+        bdrv_inc_in_flight(bs);
+        aio_co_schedule(bdrv_get_aio_context(bs), conn->connection_co);
+    }
 
     return 0;
 }
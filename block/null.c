@@ -283,6 +283,8 @@ static BlockDriver bdrv_null_co = {
 
     .bdrv_co_block_status   = null_co_block_status,
 
+    .supports_multiqueue    = true,
+
     .bdrv_refresh_filename  = null_refresh_filename,
     .strong_runtime_opts    = null_strong_runtime_opts,
 };
@@ -31,6 +31,7 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+#define NVME_MAX_IO_QUEUES 64
 
 typedef struct {
     int32_t  head, tail;
@@ -49,13 +50,23 @@ typedef struct {
     bool busy;
 } NVMeRequest;
 
+typedef struct BDRVNVMeState BDRVNVMeState;
+
 typedef struct {
     CoQueue     free_req_queue;
     QemuMutex   lock;
 
     /* Fields protected by BQL */
+    BDRVNVMeState *s;
     int         index;
     uint8_t     *prp_list_pages;
+    /* Signalled by the interrupt vector of this queue pair */
+    EventNotifier irq_notifier;
+
+    /* The AioContext that polls this I/O queue pair, see nvme_get_io_queue().
+     * Set once under BDRVNVMeState.bind_lock, cleared with the BQL while the
+     * node is drained. */
+    AioContext  *aio_context;
 
     /* Fields protected by @lock */
     NVMeQueue   sq, cq;
@@ -64,6 +75,7 @@ typedef struct {
     bool        busy;
     int         need_kick;
     int         inflight;
+    unsigned    plugged;        /* nesting depth of bdrv_io_plug() */
 } NVMeQueuePair;
 
 /* Memory mapped registers */
@@ -88,7 +100,7 @@ typedef volatile struct {
 
 QEMU_BUILD_BUG_ON(offsetof(NVMeRegs, doorbells) != 0x1000);
 
-typedef struct {
+struct BDRVNVMeState {
     AioContext *aio_context;
     QEMUVFIOState *vfio;
     NVMeRegs *regs;
@@ -102,14 +114,20 @@ typedef struct {
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
     bool write_cache_supported;
-    EventNotifier irq_notifier;
+    bool write_zeroes_supported;
+    bool discard_supported;
+
+    /* The device has a single interrupt vector, which the admin queue and
+     * the only I/O queue share.  Both are then polled by @aio_context. */
+    bool shared_irq;
+    QemuMutex bind_lock;
+    unsigned next_shared_queue; /* protected by @bind_lock */
 
     uint64_t nsze; /* Namespace size reported by identify command */
     int nsid;      /* The namespace id to read/write data. */
     int blkshift;
 
     uint64_t max_transfer;
-    bool plugged;
 
     CoMutex dma_map_lock;
     CoQueue dma_flush_queue;
@@ -119,10 +137,11 @@ typedef struct {
 
     /* PCI address (required for nvme_refresh_filename()) */
     char *device;
-} BDRVNVMeState;
+};
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_NUM_QUEUES "num-queues"
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -138,6 +157,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_NUM_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs",
+        },
         { /* end of list */ }
     },
 };
@@ -169,6 +193,7 @@ static void nvme_free_queue_pair(BlockDriverState *bs, NVMeQueuePair *q)
     qemu_vfree(q->sq.queue);
     qemu_vfree(q->cq.queue);
     qemu_mutex_destroy(&q->lock);
+    event_notifier_cleanup(&q->irq_notifier);
     g_free(q);
 }
 
@@ -193,7 +218,13 @@ static NVMeQueuePair *nvme_create_queue_pair(BlockDriverState *bs,
     NVMeQueuePair *q = g_new0(NVMeQueuePair, 1);
     uint64_t prp_list_iova;
 
+    if (event_notifier_init(&q->irq_notifier, 0)) {
+        error_setg(errp, "Failed to init event notifier");
+        g_free(q);
+        return NULL;
+    }
     qemu_mutex_init(&q->lock);
+    q->s = s;
     q->index = idx;
     qemu_co_queue_init(&q->free_req_queue);
     q->prp_list_pages = qemu_blockalign0(bs, s->page_size * NVME_QUEUE_SIZE);
@@ -201,6 +232,7 @@ static NVMeQueuePair *nvme_create_queue_pair(BlockDriverState *bs,
                           s->page_size * NVME_QUEUE_SIZE,
                           false, &prp_list_iova);
     if (r) {
+        error_setg(errp, "Cannot map buffer for DMA");
         goto fail;
     }
     for (i = 0; i < NVME_QUEUE_SIZE; i++) {
@@ -232,7 +264,7 @@ fail:
 /* With q->lock */
 static void nvme_kick(BDRVNVMeState *s, NVMeQueuePair *q)
 {
-    if (s->plugged || !q->need_kick) {
+    if (q->plugged || !q->need_kick) {
         return;
     }
     trace_nvme_kick(s, q->index);
@@ -310,7 +342,7 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
     NvmeCqe *c;
 
     trace_nvme_process_completion(s, q->index, q->inflight);
-    if (q->busy || s->plugged) {
+    if (q->busy || q->plugged) {
         trace_nvme_process_completion_queue_busy(s, q->index);
         return false;
     }
@@ -351,7 +383,8 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         smp_mb_release();
         *q->cq.doorbell = cpu_to_le32(q->cq.head);
         if (!qemu_co_queue_empty(&q->free_req_queue)) {
-            aio_bh_schedule_oneshot(s->aio_context, nvme_free_req_queue_cb, q);
+            aio_bh_schedule_oneshot(q->aio_context ?: s->aio_context,
+                                    nvme_free_req_queue_cb, q);
         }
     }
     q->busy = false;
@@ -452,6 +485,9 @@ static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
         goto out;
     }
     s->write_cache_supported = le32_to_cpu(idctrl->vwc) & 0x1;
+    s->write_zeroes_supported = le16_to_cpu(idctrl->oncs) &
+                                NVME_ONCS_WRITE_ZEROS;
+    s->discard_supported = le16_to_cpu(idctrl->oncs) & NVME_ONCS_DSM;
     s->max_transfer = (idctrl->mdts ? 1 << idctrl->mdts : 0) * s->page_size;
     /* For now the page list buffer per command is one page, to hold at most
      * s->page_size / sizeof(uint64_t) entries. */
@@ -489,53 +525,68 @@ out:
     qemu_vfree(resp);
 }
 
-static bool nvme_poll_queues(BDRVNVMeState *s)
+static bool nvme_poll_queue(BDRVNVMeState *s, NVMeQueuePair *q)
 {
     bool progress = false;
-    int i;
 
-    for (i = 0; i < s->nr_queues; i++) {
-        NVMeQueuePair *q = s->queues[i];
-        qemu_mutex_lock(&q->lock);
-        while (nvme_process_completion(s, q)) {
-            /* Keep polling */
-            progress = true;
-        }
-        qemu_mutex_unlock(&q->lock);
+    qemu_mutex_lock(&q->lock);
+    while (nvme_process_completion(s, q)) {
+        /* Keep polling */
+        progress = true;
+    }
+    qemu_mutex_unlock(&q->lock);
+    return progress;
+}
+
+/* Poll the queue pairs that are signalled by the interrupt vector of @q */
+static bool nvme_poll_queues(NVMeQueuePair *q)
+{
+    BDRVNVMeState *s = q->s;
+    bool progress;
+
+    progress = nvme_poll_queue(s, q);
+    if (q->index == 0 && s->shared_irq) {
+        progress |= nvme_poll_queue(s, s->queues[1]);
     }
     return progress;
 }
 
 static void nvme_handle_event(EventNotifier *n)
 {
-    BDRVNVMeState *s = container_of(n, BDRVNVMeState, irq_notifier);
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, irq_notifier);
 
-    trace_nvme_handle_event(s);
+    trace_nvme_handle_event(q->s, q->index);
     event_notifier_test_and_clear(n);
-    nvme_poll_queues(s);
+    nvme_poll_queues(q);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+static bool nvme_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, irq_notifier);
+
+    trace_nvme_poll_cb(q->s, q->index);
+    return nvme_poll_queues(q);
+}
+
+/* Create the completion and submission queues of @q on the device */
+static bool nvme_add_io_queue(BlockDriverState *bs, NVMeQueuePair *q,
+                              Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
-    int n = s->nr_queues;
-    NVMeQueuePair *q;
+    int n = q->index;
+    int vector = s->shared_irq ? 0 : n;
     NvmeCmd cmd;
     int queue_size = NVME_QUEUE_SIZE;
 
-    q = nvme_create_queue_pair(bs, n, queue_size, errp);
-    if (!q) {
-        return false;
-    }
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | (n & 0xFFFF)),
-        .cdw11 = cpu_to_le32(0x3),
+        .cdw11 = cpu_to_le32(0x3 | (vector << 16)),
     };
     if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
-        nvme_free_queue_pair(bs, q);
         return false;
     }
     cmd = (NvmeCmd) {
@@ -546,46 +597,106 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     };
     if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
-        nvme_free_queue_pair(bs, q);
+        /* Don't leave the CQ behind, its memory is freed by the caller */
+        cmd = (NvmeCmd) {
+            .opcode = NVME_ADM_CMD_DELETE_CQ,
+            .cdw10 = cpu_to_le32(n & 0xFFFF),
+        };
+        nvme_cmd_sync(bs, s->queues[0], &cmd);
         return false;
     }
-    s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
-    s->queues[n] = q;
-    s->nr_queues++;
     return true;
 }
 
-static bool nvme_poll_cb(void *opaque)
+/* Called with s->bind_lock, from the thread that runs @ctx */
+static void nvme_bind_io_queue(BDRVNVMeState *s, NVMeQueuePair *q,
+                               AioContext *ctx)
 {
-    EventNotifier *e = opaque;
-    BDRVNVMeState *s = container_of(e, BDRVNVMeState, irq_notifier);
-    bool progress = false;
+    trace_nvme_bind_io_queue(s, q->index, ctx);
+    aio_context_ref(ctx);
+    aio_set_event_notifier(ctx, &q->irq_notifier,
+                           false, nvme_handle_event, nvme_poll_cb);
+    atomic_mb_set(&q->aio_context, ctx);
+}
 
-    trace_nvme_poll_cb(s);
-    progress = nvme_poll_queues(s);
-    return progress;
+/* Called with the BQL while no requests are in flight */
+static void nvme_unbind_io_queues(BDRVNVMeState *s)
+{
+    int i;
+
+    for (i = 1; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+
+        if (!q->aio_context) {
+            continue;
+        }
+        aio_set_event_notifier(q->aio_context, &q->irq_notifier,
+                               false, NULL, NULL);
+        aio_context_unref(q->aio_context);
+        q->aio_context = NULL;
+    }
+    s->next_shared_queue = 0;
+}
+
+/* Return the I/O queue pair for requests from the current AioContext.
+ *
+ * Each AioContext that submits requests gets a queue pair of its own the
+ * first time it does so, and from then on polls its completions itself, so
+ * a queue pair is never touched by more than one thread.  AioContexts that
+ * come after all queue pairs are taken share them in round-robin order;
+ * their requests complete in the thread that owns the queue pair and are
+ * handed back through a bottom half. */
+static NVMeQueuePair *nvme_get_io_queue(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    NVMeQueuePair *q;
+    int i;
+
+    assert(s->nr_queues > 1);
+    if (s->shared_irq) {
+        return s->queues[1];
+    }
+    for (i = 1; i < s->nr_queues; i++) {
+        q = s->queues[i];
+        if (atomic_read(&q->aio_context) == ctx) {
+            return q;
+        }
+    }
+
+    qemu_mutex_lock(&s->bind_lock);
+    for (i = 1; i < s->nr_queues; i++) {
+        q = s->queues[i];
+        if (!q->aio_context) {
+            nvme_bind_io_queue(s, q, ctx);
+            goto out;
+        }
+    }
+    q = s->queues[1 + s->next_shared_queue++ % (s->nr_queues - 1)];
+    trace_nvme_share_io_queue(s, q->index, ctx);
+out:
+    qemu_mutex_unlock(&s->bind_lock);
+    return q;
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     int num_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     int ret;
+    int i, nr_irqs;
     uint64_t cap;
     uint64_t timeout_ms;
     uint64_t deadline, now;
+    EventNotifier **irq_notifiers;
     Error *local_err = NULL;
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_mutex_init(&s->bind_lock);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
-    ret = event_notifier_init(&s->irq_notifier, 0);
-    if (ret) {
-        error_setg(errp, "Failed to init event notifier");
-        return ret;
-    }
 
     s->vfio = qemu_vfio_open_pci(device, errp);
     if (!s->vfio) {
@@ -628,8 +739,13 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
+    /* Every I/O queue pair needs a doorbell in the mapped part of the BAR */
+    num_queues = MIN(num_queues,
+                     (NVME_BAR_SIZE - offsetof(NVMeRegs, doorbells)) /
+                     (2 * s->doorbell_scale * sizeof(uint32_t)) - 1);
+
     /* Set up admin queue. */
-    s->queues = g_new(NVMeQueuePair *, 1);
+    s->queues = g_new0(NVMeQueuePair *, num_queues + 1);
     s->queues[0] = nvme_create_queue_pair(bs, 0, NVME_QUEUE_SIZE, errp);
     if (!s->queues[0]) {
         ret = -EINVAL;
@@ -658,12 +774,44 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
-    ret = qemu_vfio_pci_init_irq(s->vfio, &s->irq_notifier,
-                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    /* Each I/O queue pair gets an interrupt vector of its own, so that it
+     * can be polled by the AioContext that submits to it.  With a single
+     * vector, fall back to one I/O queue pair served like the admin queue. */
+    nr_irqs = qemu_vfio_pci_get_irq_count(s->vfio, VFIO_PCI_MSIX_IRQ_INDEX,
+                                          errp);
+    if (nr_irqs < 0) {
+        ret = nr_irqs;
+        goto out;
+    }
+    s->shared_irq = nr_irqs < 2;
+    if (s->shared_irq) {
+        num_queues = 1;
+        nr_irqs = 1;
+    } else {
+        num_queues = MIN(num_queues, nr_irqs - 1);
+        nr_irqs = num_queues + 1;
+    }
+
+    for (i = 1; i <= num_queues; i++) {
+        s->queues[i] = nvme_create_queue_pair(bs, i, NVME_QUEUE_SIZE, errp);
+        if (!s->queues[i]) {
+            ret = -EINVAL;
+            goto out;
+        }
+        s->nr_queues++;
+    }
+
+    irq_notifiers = g_new(EventNotifier *, nr_irqs);
+    for (i = 0; i < nr_irqs; i++) {
+        irq_notifiers[i] = &s->queues[i]->irq_notifier;
+    }
+    ret = qemu_vfio_pci_init_irqs(s->vfio, irq_notifiers, nr_irqs,
+                                  VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    g_free(irq_notifiers);
     if (ret) {
         goto out;
     }
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
+    aio_set_event_notifier(s->aio_context, &s->queues[0]->irq_notifier,
                            false, nvme_handle_event, nvme_poll_cb);
 
     nvme_identify(bs, namespace, &local_err);
@@ -673,9 +821,24 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
-    /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    /* Set up command queues.  The controller may grant fewer I/O queues
+     * than we asked for; make do with those it did create. */
+    for (i = 1; i <= num_queues; i++) {
+        if (!nvme_add_io_queue(bs, s->queues[i], &local_err)) {
+            break;
+        }
+    }
+    if (i == 1) {
+        error_propagate(errp, local_err);
         ret = -EIO;
+        goto out;
+    }
+    if (local_err) {
+        trace_nvme_add_io_queue_failed(s, i, error_get_pretty(local_err));
+        error_free(local_err);
+        while (s->nr_queues > i) {
+            nvme_free_queue_pair(bs, s->queues[--s->nr_queues]);
+        }
     }
 out:
     /* Cleaning up is done in nvme_file_open() upon error. */
@@ -742,13 +905,17 @@ static void nvme_close(BlockDriverState *bs)
     int i;
     BDRVNVMeState *s = bs->opaque;
 
+    nvme_unbind_io_queues(s);
+    if (s->nr_queues) {
+        aio_set_event_notifier(bdrv_get_aio_context(bs),
+                               &s->queues[0]->irq_notifier,
+                               false, NULL, NULL);
+    }
     for (i = 0; i < s->nr_queues; ++i) {
         nvme_free_queue_pair(bs, s->queues[i]);
     }
     g_free(s->queues);
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
-                           false, NULL, NULL);
-    event_notifier_cleanup(&s->irq_notifier);
+    qemu_mutex_destroy(&s->bind_lock);
     qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->regs, 0, NVME_BAR_SIZE);
     qemu_vfio_close(s->vfio);
 
@@ -761,6 +928,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    int64_t num_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -774,7 +942,14 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    num_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NUM_QUEUES, 1);
+    if (num_queues < 1 || num_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_NUM_QUEUES "' must be between 1 "
+                   "and %d", NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, num_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -793,6 +968,9 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
     bs->supported_write_flags = BDRV_REQ_FUA;
+    if (s->write_zeroes_supported) {
+        bs->supported_zero_flags = BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP;
+    }
     return 0;
 fail:
     nvme_close(bs);
@@ -921,21 +1099,47 @@ typedef struct {
     AioContext *ctx;
 } NVMeCoData;
 
-static void nvme_rw_cb_bh(void *opaque)
+/*
+ * Completions are processed by whoever polls the queue: the submitting
+ * coroutine itself from nvme_submit_command(), a handler in its own
+ * AioContext, or, with a shared interrupt vector, another thread.
+ */
+static void nvme_rw_cb(void *opaque, int ret)
 {
     NVMeCoData *data = opaque;
-    qemu_coroutine_enter(data->co);
+
+    atomic_set(&data->ret, ret);
+    /* Pairs with the coroutine reading data->ret once it is woken up */
+    smp_wmb();
+
+    if (qemu_coroutine_self() == data->co) {
+        /* Completed during submission, wake up after the yield */
+        aio_co_schedule(data->ctx, data->co);
+    } else {
+        aio_co_wake(data->co);
+    }
 }
 
-static void nvme_rw_cb(void *opaque, int ret)
+/*
+ * Submit @cmd on @ioq and wait for its completion.  The coroutine yields
+ * exactly once, and nvme_rw_cb() wakes it exactly once.
+ */
+static coroutine_fn int nvme_co_submit_wait(BDRVNVMeState *s,
+                                            NVMeQueuePair *ioq,
+                                            NVMeRequest *req, NvmeCmd *cmd)
 {
-    NVMeCoData *data = opaque;
-    data->ret = ret;
-    if (!data->co) {
-        /* The rw coroutine hasn't yielded, don't try to enter. */
-        return;
-    }
-    aio_bh_schedule_oneshot(data->ctx, nvme_rw_cb_bh, data);
+    NVMeCoData data = {
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
+        .ret = -EINPROGRESS,
+    };
+
+    nvme_submit_command(s, ioq, req, cmd, nvme_rw_cb, &data);
+    qemu_coroutine_yield();
+
+    /* Pairs with smp_wmb() in nvme_rw_cb() */
+    smp_rmb();
+    return atomic_read(&data.ret);
 }
 
 static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
@@ -946,7 +1150,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -958,13 +1162,9 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw11 = cpu_to_le32(((offset >> s->blkshift) >> 32) & 0xFFFFFFFF),
         .cdw12 = cpu_to_le32(cdw12),
     };
-    NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
-        .ret = -EINPROGRESS,
-    };
+    int ret;
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->nr_queues > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -975,12 +1175,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         req->busy = false;
         return r;
     }
-    nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    ret = nvme_co_submit_wait(s, ioq, req, &cmd);
 
     qemu_co_mutex_lock(&s->dma_map_lock);
     r = nvme_cmd_unmap_qiov(bs, qiov);
@@ -989,8 +1184,8 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         return r;
     }
 
-    trace_nvme_rw_done(s, is_write, offset, bytes, data.ret);
-    return data.ret;
+    trace_nvme_rw_done(s, is_write, offset, bytes, ret);
+    return ret;
 }
 
 static inline bool nvme_qiov_aligned(BlockDriverState *bs,
@@ -1058,33 +1253,124 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
     return nvme_co_prw(bs, offset, bytes, qiov, true, flags);
 }
 
-static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
+/* Submit a command that transfers no data and wait for it to complete */
+static coroutine_fn int nvme_co_cmd(BlockDriverState *bs, NvmeCmd *cmd)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
+
+    req = nvme_get_free_req(ioq);
+    assert(req);
+
+    return nvme_co_submit_wait(s, ioq, req, cmd);
+}
+
+static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
-    NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
-        .ret = -EINPROGRESS,
+
+    return nvme_co_cmd(bs, &cmd);
+}
+
+static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
+                                              int64_t offset, int bytes,
+                                              BdrvRequestFlags flags)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_WRITE_ZEROS,
+        .nsid = cpu_to_le32(s->nsid),
+        .cdw10 = cpu_to_le32((offset >> s->blkshift) & 0xFFFFFFFF),
+        .cdw11 = cpu_to_le32(((offset >> s->blkshift) >> 32) & 0xFFFFFFFF),
     };
+    int ret;
 
-    assert(s->nr_queues > 1);
+    if (!s->write_zeroes_supported) {
+        return -ENOTSUP;
+    }
+
+    /* Deallocate (DEAC) lets the device unmap the blocks; they still read
+     * back as zeroes. */
+    if (flags & BDRV_REQ_MAY_UNMAP) {
+        cdw12 |= 1 << 25;
+    }
+    if (flags & BDRV_REQ_FUA) {
+        cdw12 |= 1 << 30;
+    }
+    cmd.cdw12 = cpu_to_le32(cdw12);
+
+    trace_nvme_write_zeroes(s, offset, bytes, flags);
+    assert(bytes >> s->blkshift <= 0x10000);
+    ret = nvme_co_cmd(bs, &cmd);
+    trace_nvme_write_zeroes_done(s, offset, bytes, ret);
+    return ret;
+}
+
+static coroutine_fn int nvme_co_pdiscard(BlockDriverState *bs,
+                                         int64_t offset, int bytes)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *ioq;
+    NVMeRequest *req;
+    NvmeDsmRange *range;
+    QEMUIOVector local_qiov;
+    int ret, cmd_ret;
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_DSM,
+        .nsid = cpu_to_le32(s->nsid),
+        .cdw10 = cpu_to_le32(0), /* number of ranges - 1 */
+        .cdw11 = cpu_to_le32(NVME_DSMGMT_AD),
+    };
+
+    if (!s->discard_supported) {
+        return -ENOTSUP;
+    }
+
+    /* The range list is read by the device, so it has to be DMA mapped like
+     * any other data buffer. */
+    range = qemu_try_blockalign0(bs, s->page_size);
+    if (!range) {
+        return -ENOMEM;
+    }
+    range->nlb = cpu_to_le32(bytes >> s->blkshift);
+    range->slba = cpu_to_le64(offset >> s->blkshift);
+    qemu_iovec_init(&local_qiov, 1);
+    qemu_iovec_add(&local_qiov, range, s->page_size);
+
+    trace_nvme_dsm(s, offset, bytes);
+    ioq = nvme_get_io_queue(bs);
     req = nvme_get_free_req(ioq);
     assert(req);
-    nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
 
-    data.co = qemu_coroutine_self();
-    if (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
+    qemu_co_mutex_lock(&s->dma_map_lock);
+    ret = nvme_cmd_map_qiov(bs, &cmd, req, &local_qiov);
+    qemu_co_mutex_unlock(&s->dma_map_lock);
+    if (ret) {
+        req->busy = false;
+        goto out;
     }
+    cmd_ret = nvme_co_submit_wait(s, ioq, req, &cmd);
 
-    return data.ret;
-}
+    qemu_co_mutex_lock(&s->dma_map_lock);
+    ret = nvme_cmd_unmap_qiov(bs, &local_qiov);
+    qemu_co_mutex_unlock(&s->dma_map_lock);
+    if (ret) {
+        goto out;
+    }
 
+    ret = cmd_ret;
+    trace_nvme_dsm_done(s, offset, bytes, ret);
+out:
+    qemu_iovec_destroy(&local_qiov);
+    qemu_vfree(range);
+    return ret;
+}
 
 static int nvme_reopen_prepare(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp)
@@ -1107,13 +1393,25 @@ static void nvme_refresh_limits(BlockDriverState *bs, Error **errp)
     bs->bl.opt_mem_alignment = s->page_size;
     bs->bl.request_alignment = s->page_size;
     bs->bl.max_transfer = s->max_transfer;
+
+    /* Write Zeroes takes a 16-bit block count, Dataset Management a 32-bit
+     * one per range */
+    if (s->write_zeroes_supported) {
+        bs->bl.max_pwrite_zeroes = 0x10000 << s->blkshift;
+    }
+    if (s->discard_supported) {
+        bs->bl.max_pdiscard = QEMU_ALIGN_DOWN(INT_MAX, s->page_size);
+    }
 }
 
 static void nvme_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
 
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
+    /* I/O queue pairs are bound again by the AioContexts that use them next */
+    nvme_unbind_io_queues(s);
+    aio_set_event_notifier(bdrv_get_aio_context(bs),
+                           &s->queues[0]->irq_notifier,
                            false, NULL, NULL);
 }
 
@@ -1123,30 +1421,51 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     BDRVNVMeState *s = bs->opaque;
 
     s->aio_context = new_context;
-    aio_set_event_notifier(new_context, &s->irq_notifier,
+    aio_set_event_notifier(new_context, &s->queues[0]->irq_notifier,
                            false, nvme_handle_event, nvme_poll_cb);
 }
 
-static void nvme_aio_plug(BlockDriverState *bs)
+/* Plugging is per queue pair, so that a batch submitted by one AioContext
+ * does not hold back the others.  AioContexts that share another one's
+ * queue pair submit unbatched. */
+static NVMeQueuePair *nvme_get_plug_queue(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    assert(!s->plugged);
-    s->plugged = true;
+    NVMeQueuePair *q = nvme_get_io_queue(bs);
+
+    if (!s->shared_irq && q->aio_context != qemu_get_current_aio_context()) {
+        return NULL;
+    }
+    return q;
+}
+
+static void nvme_aio_plug(BlockDriverState *bs)
+{
+    NVMeQueuePair *q = nvme_get_plug_queue(bs);
+
+    if (!q) {
+        return;
+    }
+    qemu_mutex_lock(&q->lock);
+    q->plugged++;
+    qemu_mutex_unlock(&q->lock);
 }
 
 static void nvme_aio_unplug(BlockDriverState *bs)
 {
-    int i;
     BDRVNVMeState *s = bs->opaque;
-    assert(s->plugged);
-    s->plugged = false;
-    for (i = 1; i < s->nr_queues; i++) {
-        NVMeQueuePair *q = s->queues[i];
-        qemu_mutex_lock(&q->lock);
+    NVMeQueuePair *q = nvme_get_plug_queue(bs);
+
+    if (!q) {
+        return;
+    }
+    qemu_mutex_lock(&q->lock);
+    assert(q->plugged);
+    if (!--q->plugged) {
         nvme_kick(s, q);
         nvme_process_completion(s, q);
-        qemu_mutex_unlock(&q->lock);
     }
+    qemu_mutex_unlock(&q->lock);
 }
 
 static void nvme_register_buf(BlockDriverState *bs, void *host, size_t size)
@@ -1173,6 +1492,7 @@ static void nvme_unregister_buf(BlockDriverState *bs, void *host)
 static const char *const nvme_strong_runtime_opts[] = {
     NVME_BLOCK_OPT_DEVICE,
     NVME_BLOCK_OPT_NAMESPACE,
+    NVME_BLOCK_OPT_NUM_QUEUES,
 
     NULL
 };
@@ -1191,6 +1511,8 @@ static BlockDriver bdrv_nvme = {
     .bdrv_co_preadv           = nvme_co_preadv,
     .bdrv_co_pwritev          = nvme_co_pwritev,
     .bdrv_co_flush_to_disk    = nvme_co_flush,
+    .bdrv_co_pwrite_zeroes    = nvme_co_pwrite_zeroes,
+    .bdrv_co_pdiscard         = nvme_co_pdiscard,
     .bdrv_reopen_prepare      = nvme_reopen_prepare,
 
     .bdrv_refresh_filename    = nvme_refresh_filename,
@@ -1199,6 +1521,7 @@ static BlockDriver bdrv_nvme = {
 
     .bdrv_detach_aio_context  = nvme_detach_aio_context,
     .bdrv_attach_aio_context  = nvme_attach_aio_context,
+    .supports_multiqueue      = true,
 
     .bdrv_io_plug             = nvme_aio_plug,
     .bdrv_io_unplug           = nvme_aio_unplug,
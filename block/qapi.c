@@ -140,6 +140,9 @@ BlockDeviceInfo *bdrv_block_device_info(BlockBackend *blk,
         info->has_group = true;
         info->group =
             g_strdup(throttle_group_get_name(&blkp->throttle_group_member));
+        info->has_group_weight = true;
+        info->group_weight =
+            throttle_group_get_weight(&blkp->throttle_group_member);
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -510,6 +513,45 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
                                  &ds->flush_latency_histogram);
 }
 
+static BlockLatencyPercentiles *bdrv_latency_percentiles(BlockLatencyHdr *hdr)
+{
+    BlockLatencyPercentiles *p = g_new0(BlockLatencyPercentiles, 1);
+
+    p->count = block_latency_hdr_count(hdr);
+    p->p50 = block_latency_hdr_percentile(hdr, p->count, 0.5);
+    p->p99 = block_latency_hdr_percentile(hdr, p->count, 0.99);
+    p->p999 = block_latency_hdr_percentile(hdr, p->count, 0.999);
+    p->max = stat64_get(&hdr->max);
+
+    return p;
+}
+
+static BlockNodeLatencyList *bdrv_query_node_latency(BlockDriverState *bs)
+{
+    BlockNodeLatencyList *head = NULL;
+    int op;
+
+    /* Build the list backwards so that it is sorted by operation */
+    for (op = BLOCK_NODE_LATENCY_OP__MAX - 1; op >= 0; op--) {
+        BlockNodeLatencyOpStats *ops = atomic_rcu_read(&bs->latency.ops[op]);
+        BlockNodeLatencyList *entry;
+
+        if (!ops) {
+            continue;
+        }
+
+        entry = g_new0(BlockNodeLatencyList, 1);
+        entry->value = g_new0(BlockNodeLatency, 1);
+        entry->value->op = op;
+        entry->value->queue = bdrv_latency_percentiles(&ops->queue);
+        entry->value->driver = bdrv_latency_percentiles(&ops->driver);
+        entry->next = head;
+        head = entry;
+    }
+
+    return head;
+}
+
 static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
                                         bool blk_level)
 {
@@ -537,6 +579,9 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    s->latency = bdrv_query_node_latency(bs);
+    s->has_latency = s->latency != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, blk_level);
@@ -1061,6 +1061,92 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocating writes take their data clusters from a pool of clusters whose
+ * refcount was already incremented.  The pool is refilled with one refcount
+ * update for s->alloc_pool_size clusters at a time.
+ *
+ * Like all cluster allocations, this is called with s->lock held, so
+ * allocating writes remain serialised against each other.  The pool does not
+ * change that; it only keeps refcount block updates (and the I/O they may
+ * cause) out of the critical section for most of the allocations.
+ *
+ * Pooled clusters are not referenced by any L2 table.  They are freed again
+ * when the pool is released (on close, before check, shrink, amend and
+ * make_empty), and are merely leaked if QEMU crashes, which leaves the image
+ * consistent.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t offset;
+
+    if (!s->alloc_pool_size) {
+        return qcow2_alloc_clusters(bs, nb_clusters << s->cluster_bits);
+    }
+
+    if (s->alloc_pool_clusters < nb_clusters) {
+        uint64_t refill = MAX(nb_clusters, s->alloc_pool_size);
+
+        qcow2_alloc_pool_release(bs);
+
+        offset = qcow2_alloc_clusters(bs, refill << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        trace_qcow2_alloc_pool_refill(bs, offset, refill);
+
+        s->alloc_pool_offset = offset;
+        s->alloc_pool_clusters = refill;
+    }
+
+    offset = s->alloc_pool_offset;
+    s->alloc_pool_offset += nb_clusters << s->cluster_bits;
+    s->alloc_pool_clusters -= nb_clusters;
+
+    return offset;
+}
+
+/*
+ * Like qcow2_alloc_clusters_at(), but continues an allocation from the pool
+ * if @offset is where the pool starts.
+ */
+int64_t qcow2_alloc_data_clusters_at(BlockDriverState *bs, uint64_t offset,
+                                     int64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->alloc_pool_clusters && offset == s->alloc_pool_offset) {
+        nb_clusters = MIN(nb_clusters, s->alloc_pool_clusters);
+        s->alloc_pool_offset += nb_clusters << s->cluster_bits;
+        s->alloc_pool_clusters -= nb_clusters;
+        return nb_clusters;
+    }
+
+    return qcow2_alloc_clusters_at(bs, offset, nb_clusters);
+}
+
+/*
+ * Free the clusters left in the pool.  Called with s->lock held or while no
+ * other requests run.
+ */
+void qcow2_alloc_pool_release(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->alloc_pool_clusters) {
+        return;
+    }
+
+    trace_qcow2_alloc_pool_release(bs, s->alloc_pool_offset,
+                                   s->alloc_pool_clusters);
+    qcow2_free_clusters(bs, s->alloc_pool_offset,
+                        s->alloc_pool_clusters << s->cluster_bits,
+                        QCOW2_DISCARD_NEVER);
+    s->alloc_pool_offset = 0;
+    s->alloc_pool_clusters = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
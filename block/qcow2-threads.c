@@ -28,9 +28,15 @@
 #define ZLIB_CONST
 #include <zlib.h>
 
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
 #include "qcow2.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
+#include "qemu/thread.h"
 
 static int coroutine_fn
 qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
@@ -62,36 +68,40 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
  */
 
 typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size);
+                                     const void *src, size_t src_size,
+                                     int level);
 typedef struct Qcow2CompressData {
     void *dest;
     size_t dest_size;
     const void *src;
     size_t src_size;
+    int level;
     ssize_t ret;
 
     Qcow2CompressFunc func;
 } Qcow2CompressData;
 
 /*
- * qcow2_compress()
+ * qcow2_zlib_compress()
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @level - zlib compression level, 0 for the default
  *
  * Returns: compressed size on success
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
-static ssize_t qcow2_compress(void *dest, size_t dest_size,
-                              const void *src, size_t src_size)
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size,
+                                   int level)
 {
     ssize_t ret;
     z_stream strm;
 
-    /* best compression, small window, no zlib header */
+    /* small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+    ret = deflateInit2(&strm, level ?: Z_DEFAULT_COMPRESSION, Z_DEFLATED,
                        -12, 9, Z_DEFAULT_STRATEGY);
     if (ret != Z_OK) {
         return -EIO;
@@ -119,19 +129,21 @@ static ssize_t qcow2_compress(void *dest, size_t dest_size,
 }
 
 /*
- * qcow2_decompress()
+ * qcow2_zlib_decompress()
  *
  * Decompress some data (not more than @src_size bytes) to produce exactly
  * @dest_size bytes.
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @level - unused
  *
  * Returns: 0 on success
  *          -1 on fail
  */
-static ssize_t qcow2_decompress(void *dest, size_t dest_size,
-                                const void *src, size_t src_size)
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size,
+                                     int level)
 {
     int ret = 0;
     z_stream strm;
@@ -162,12 +174,163 @@ static ssize_t qcow2_decompress(void *dest, size_t dest_size,
     return ret;
 }
 
+#ifdef CONFIG_ZSTD
+
+/*
+ * Compression runs in the thread pool, one cluster at a time.  Keep the zstd
+ * contexts around for the lifetime of the worker thread instead of setting
+ * up several hundred kilobytes of state for every cluster.
+ */
+static __thread ZSTD_CCtx *zstd_cctx;
+static __thread ZSTD_DStream *zstd_dstream;
+static __thread Notifier zstd_cleanup_notifier;
+
+static void qcow2_zstd_cleanup(Notifier *n, void *value)
+{
+    ZSTD_freeCCtx(zstd_cctx);
+    ZSTD_freeDStream(zstd_dstream);
+    zstd_cctx = NULL;
+    zstd_dstream = NULL;
+}
+
+static void qcow2_zstd_init_cleanup(void)
+{
+    if (!zstd_cleanup_notifier.notify) {
+        zstd_cleanup_notifier.notify = qcow2_zstd_cleanup;
+        qemu_thread_atexit_add(&zstd_cleanup_notifier);
+    }
+}
+
+/*
+ * qcow2_zstd_compress()
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ * @level - zstd compression level, 0 for the default
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ *          -EIO    on any other error
+ */
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size,
+                                   int level)
+{
+    size_t zstd_ret;
+
+    if (!zstd_cctx) {
+        qcow2_zstd_init_cleanup();
+        zstd_cctx = ZSTD_createCCtx();
+        if (!zstd_cctx) {
+            return -EIO;
+        }
+    }
+
+    /* zstd picks its default level for 0 */
+    zstd_ret = ZSTD_compressCCtx(zstd_cctx, dest, dest_size, src, src_size,
+                                 level);
+
+    if (ZSTD_isError(zstd_ret)) {
+        return ZSTD_getErrorCode(zstd_ret) == ZSTD_error_dstSize_tooSmall ?
+               -ENOMEM : -EIO;
+    }
+
+    return zstd_ret;
+}
+
+/*
+ * qcow2_zstd_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes.
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ * @level - unused
+ *
+ * Returns: 0 on success
+ *          -EIO on fail
+ */
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size,
+                                     int level)
+{
+    ZSTD_outBuffer output = {
+        .dst = dest,
+        .size = dest_size,
+        .pos = 0,
+    };
+    ZSTD_inBuffer input = {
+        .src = src,
+        .size = src_size,
+        .pos = 0,
+    };
+    ssize_t ret = 0;
+
+    if (!zstd_dstream) {
+        qcow2_zstd_init_cleanup();
+        zstd_dstream = ZSTD_createDStream();
+        if (!zstd_dstream) {
+            return -EIO;
+        }
+    }
+    /* Drop whatever state an earlier, failed call may have left behind */
+    ZSTD_initDStream(zstd_dstream);
+
+    /*
+     * The compressed size is only known with a precision of one sector, so
+     * @src may contain garbage after the zstd frame.  Stop as soon as @dest
+     * is filled instead of consuming all of the input.
+     */
+    while (output.pos < output.size) {
+        size_t last_in_pos = input.pos;
+        size_t last_out_pos = output.pos;
+        size_t zstd_ret = ZSTD_decompressStream(zstd_dstream, &output,
+                                                &input);
+
+        if (ZSTD_isError(zstd_ret)) {
+            ret = -EIO;
+            break;
+        }
+
+        /* The frame ended early, or there is no more input to make progress */
+        if ((zstd_ret == 0 && output.pos < output.size) ||
+            (input.pos == last_in_pos && output.pos == last_out_pos)) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+#endif /* CONFIG_ZSTD */
+
+/*
+ * qcow2_compression_max_level()
+ *
+ * Returns: the highest compression level accepted for @type
+ */
+int qcow2_compression_max_level(Qcow2CompressionType type)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return Z_BEST_COMPRESSION;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return ZSTD_maxCLevel();
+#endif
+    default:
+        abort();
+    }
+}
+
 static int qcow2_compress_pool_func(void *opaque)
 {
     Qcow2CompressData *data = opaque;
 
     data->ret = data->func(data->dest, data->dest_size,
-                           data->src, data->src_size);
+                           data->src, data->src_size, data->level);
 
     return 0;
 }
@@ -176,11 +339,13 @@ static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
+    BDRVQcow2State *s = bs->opaque;
     Qcow2CompressData arg = {
         .dest = dest,
         .dest_size = dest_size,
         .src = src,
         .src_size = src_size,
+        .level = s->compression_level,
         .func = func,
     };
 
@@ -189,20 +354,69 @@ qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
     return arg.ret;
 }
 
+/*
+ * qcow2_co_compress()
+ *
+ * Compress @src_size bytes of data using the compression method and level
+ * configured for the image, in a worker thread.
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ *          -EIO    on any other error
+ */
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size)
 {
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
-                                qcow2_compress);
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_zlib_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_compress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
 }
 
+/*
+ * qcow2_co_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes, in a worker thread.
+ *
+ * Returns: 0 on success
+ *          a negative value on failure
+ */
 ssize_t coroutine_fn
 qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size)
 {
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
-                                qcow2_decompress);
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_zlib_decompress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_decompress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
 }
 
 
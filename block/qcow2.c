@@ -70,6 +70,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_COMPRESSION_LEVEL 0x434c564c
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -172,6 +173,26 @@ static ssize_t qcow2_crypto_hdr_write_func(QCryptoBlock *block, size_t offset,
 }
 
 
+static int qcow2_validate_compression(int type, int64_t level, Error **errp)
+{
+    int max_level;
+
+    if (type < 0 || type >= QCOW2_COMPRESSION_TYPE__MAX) {
+        error_setg(errp, "Compression type %d is not supported", type);
+        return -ENOTSUP;
+    }
+
+    max_level = qcow2_compression_max_level(type);
+    if (level < 0 || level > max_level) {
+        error_setg(errp, "Compression level must be between 0 and %d for "
+                   "compression type '%s'", max_level,
+                   Qcow2CompressionType_str(type));
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 /* 
  * read qcow2 extension and fill bs
  * start reading from start_offset
@@ -409,6 +430,35 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_COMPRESSION_LEVEL:
+        {
+            Qcow2CompressionLevelHeaderExt level_ext;
+
+            if (ext.len != sizeof(level_ext)) {
+                error_setg(errp, "compression_level_ext: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &level_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: compression_level_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            /* The compression type comes from the header */
+            ret = qcow2_validate_compression(s->compression_type,
+                                             level_ext.compression_level,
+                                             errp);
+            if (ret < 0) {
+                return ret;
+            }
+
+            s->compression_level = level_ext.compression_level;
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -572,7 +622,12 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
                                               BdrvCheckResult *result,
                                               BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    /* Pooled clusters are not referenced and would be reported as leaks */
+    qcow2_alloc_pool_release(bs);
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
@@ -644,6 +699,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_ALLOC_POOL_SIZE,
     NULL
 };
 
@@ -755,6 +811,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_POOL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Number of bytes to preallocate for data clusters at once "
+                    "(0 = disabled)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -910,6 +972,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t alloc_pool_size;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -969,6 +1032,23 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->alloc_pool_size = qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_POOL_SIZE, 0);
+    if (r->alloc_pool_size % s->cluster_size) {
+        error_setg(errp, QCOW2_OPT_ALLOC_POOL_SIZE " must be a multiple of "
+                   "the cluster size (%d)", s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (r->alloc_pool_size > QCOW2_MAX_ALLOC_POOL_SIZE) {
+        error_setg(errp, QCOW2_OPT_ALLOC_POOL_SIZE " must not exceed %"
+                   PRIu64 " bytes", (uint64_t) QCOW2_MAX_ALLOC_POOL_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Give unused pool clusters back before the refcounts are flushed */
+    qcow2_alloc_pool_release(bs);
+
     /* alloc new L2 table/refcount block cache, flush old one */
     if (s->l2_table_cache) {
         ret = qcow2_cache_flush(bs, s->l2_table_cache);
@@ -1166,6 +1246,8 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    s->alloc_pool_size = r->alloc_pool_size >> s->cluster_bits;
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1278,6 +1360,17 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         }
     }
 
+    /* Additional fields are zero (the default) if they are not present */
+    if (header.header_length > offsetof(QCowHeader, compression_type)) {
+        s->compression_type = header.compression_type;
+    } else {
+        s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+    ret = qcow2_validate_compression(s->compression_type, 0, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     if (header.header_length > s->cluster_size) {
         error_setg(errp, "qcow2 header exceeds cluster size");
         ret = -EINVAL;
@@ -1487,6 +1580,15 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
+    /* Only compression types other than zlib need the incompatible bit */
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) !=
+        (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB)) {
+        error_setg(errp, "Compression type incompatible feature bit must%s "
+                   "be set", s->compression_type ? "" : " not");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* Open external data file */
     s->data_file = bdrv_open_child(NULL, options, "data-file", bs, &child_file,
                                    true, &local_err);
@@ -2357,6 +2459,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_alloc_pool_release(bs);
+
     qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2539,6 +2643,7 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
+        .compression_type       = s->compression_type,
     };
 
     /* For older versions, write a shorter header */
@@ -2597,6 +2702,22 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression level header extension */
+    if (s->compression_level != 0) {
+        Qcow2CompressionLevelHeaderExt level_ext = {
+            .compression_level  = s->compression_level,
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION_LEVEL,
+                             &level_ext, sizeof(level_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Full disk encryption header pointer extension */
     if (s->crypto_header.offset != 0) {
         s->crypto_header.offset = cpu_to_be64(s->crypto_header.offset);
@@ -2631,6 +2752,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_DATA_FILE_BITNR,
                 .name = "external data file",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3148,6 +3274,27 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     }
     refcount_order = ctz32(qcow2_opts->refcount_bits);
 
+    if (!qcow2_opts->has_compression_type) {
+        qcow2_opts->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+    if (!qcow2_opts->has_compression_level) {
+        qcow2_opts->compression_level = 0;
+    }
+    if (version < 3 &&
+        qcow2_opts->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB)
+    {
+        error_setg(errp, "Compression types other than zlib require "
+                   "compatibility level 1.1 or above (use version=v3 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto out;
+    }
+    ret = qcow2_validate_compression(qcow2_opts->compression_type,
+                                     qcow2_opts->compression_level, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
     if (qcow2_opts->data_file_raw && !qcow2_opts->data_file) {
         error_setg(errp, "data-file-raw requires data-file");
         ret = -EINVAL;
@@ -3280,6 +3427,18 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         s->image_data_file = g_strdup(data_bs->filename);
     }
 
+    /* Set the compression method if necessary */
+    if (qcow2_opts->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB ||
+        qcow2_opts->compression_level != 0)
+    {
+        BDRVQcow2State *s = blk_bs(blk)->opaque;
+        s->compression_type = qcow2_opts->compression_type;
+        s->compression_level = qcow2_opts->compression_level;
+        if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+            s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION;
+        }
+    }
+
     /* Create a full header (including things like feature table) */
     ret = qcow2_update_header(blk_bs(blk));
     if (ret < 0) {
@@ -3403,6 +3562,8 @@ static int coroutine_fn qcow2_co_create_opts(const char *filename, QemuOpts *opt
         { BLOCK_OPT_ENCRYPT,            BLOCK_OPT_ENCRYPT_FORMAT },
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
+        { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
+        { BLOCK_OPT_COMPRESSION_LEVEL,  "compression-level" },
         { NULL, NULL },
     };
 
@@ -3784,6 +3945,9 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
             goto fail;
         }
 
+        /* The pool may lie beyond the new end of the image file */
+        qcow2_alloc_pool_release(bs);
+
         ret = qcow2_cluster_discard(bs, ROUND_UP(offset, s->cluster_size),
                                     old_length - ROUND_UP(offset,
                                                           s->cluster_size),
@@ -4297,6 +4461,8 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
+    qcow2_alloc_pool_release(bs);
+
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
@@ -4593,6 +4759,11 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
+            .has_compression_type = s->compression_type !=
+                                    QCOW2_COMPRESSION_TYPE_ZLIB,
+            .compression_type   = s->compression_type,
+            .has_compression_level = s->compression_level != 0,
+            .compression_level  = s->compression_level,
             .has_bitmaps        = !!bitmaps,
             .bitmaps            = bitmaps,
             .has_data_file      = !!s->image_data_file,
@@ -4836,10 +5007,13 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     bool encrypt;
     int encformat;
     int refcount_bits = s->refcount_bits;
+    int64_t compression_level = s->compression_level;
     int ret;
     QemuOptDesc *desc = opts->list->desc;
     Qcow2AmendHelperCBInfo helper_cb_info;
 
+    qcow2_alloc_pool_release(bs);
+
     while (desc && desc->name) {
         if (!qemu_opt_find(opts, desc->name)) {
             /* only change explicitly defined options */
@@ -4926,6 +5100,23 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "images");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *type = qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+            if (type &&
+                strcmp(type, Qcow2CompressionType_str(s->compression_type))) {
+                error_setg(errp, "Changing the compression type is not "
+                           "supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_LEVEL)) {
+            compression_level = qemu_opt_get_number(opts,
+                                                    BLOCK_OPT_COMPRESSION_LEVEL,
+                                                    compression_level);
+            ret = qcow2_validate_compression(s->compression_type,
+                                             compression_level, errp);
+            if (ret < 0) {
+                return ret;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -4984,6 +5175,8 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         s->image_data_file = *data_file ? g_strdup(data_file) : NULL;
     }
 
+    s->compression_level = compression_level;
+
     ret = qcow2_update_header(bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to update the image header");
@@ -5191,6 +5384,17 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method used for image cluster compression",
+        },
+        {
+            .name = BLOCK_OPT_COMPRESSION_LEVEL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Compression level, 0 for the default of the "
+                    "compression type",
+        },
         { /* end of list */ }
     }
 };
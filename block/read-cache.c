@@ -0,0 +1,961 @@
+/*
+ * Persistent read cache block filter
+ *
+ * Caches blocks read from a (typically remote) node in a local file, so that
+ * repeated reads of the same data, for example many guests booting from the
+ * same base image, do not go to the storage network again.  The cache
+ * contents survive a restart of QEMU if the cache was closed cleanly.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+/*
+ * Layout of the cache file:
+ *
+ *   [0, 4k)                    header
+ *   [4k, data_offset)          one ReadCacheDiskEntry per slot
+ *   [data_offset, end)         nb_slots slots of block_size bytes each
+ *
+ * The slot table is only written when the cache is closed or inactivated.
+ * While the cache is in use, the header is marked dirty and a cache file that
+ * was not closed cleanly is discarded on the next open.  All fields are
+ * little-endian.
+ *
+ * A clean cache is only used again if the source did not change in the
+ * meantime.  For a local file, this is checked with its modification time;
+ * other sources must be opened read-only for the cache to be reused.
+ */
+
+#define READ_CACHE_MAGIC            0x0045484341434452ULL /* "RDCACHE\0" */
+#define READ_CACHE_VERSION          1
+#define READ_CACHE_HEADER_SIZE      4096
+#define READ_CACHE_SOURCE_LEN       1024
+
+#define READ_CACHE_DIRTY            (1 << 0)
+
+#define READ_CACHE_DEFAULT_BLOCK_SIZE (64 * KiB)
+#define READ_CACHE_MAX_BLOCK_SIZE     (2 * MiB)
+
+/* Maximum number of blocks read from the source for a single miss */
+#define READ_CACHE_MAX_MISS_BLOCKS  16
+
+#define READ_CACHE_OPT_SIZE         "cache-size"
+#define READ_CACHE_OPT_BLOCK_SIZE   "block-size"
+#define READ_CACHE_OPT_CACHE_WRITES "cache-writes"
+
+typedef struct ReadCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t block_size;
+    uint64_t nb_slots;
+    uint64_t data_offset;
+    uint64_t source_length;
+    uint64_t source_mtime;  /* nanoseconds, 0 if not a local file */
+    char source[READ_CACHE_SOURCE_LEN]; /* filename of the cached node */
+} QEMU_PACKED ReadCacheHeader;
+
+typedef struct ReadCacheDiskEntry {
+    uint64_t block;     /* cached block number + 1, 0 if the slot is free */
+    uint64_t last_used; /* LRU position, higher is more recent */
+} QEMU_PACKED ReadCacheDiskEntry;
+
+typedef struct ReadCacheEntry {
+    uint64_t block;
+    uint64_t slot;
+    uint64_t last_used;
+
+    /*
+     * Number of requests using the slot.  An entry that is in use is not on
+     * the LRU list and therefore cannot be evicted.
+     */
+    int users;
+    bool filling;   /* slot is being written, contents not valid yet */
+    bool stale;     /* invalidated while in use, free once unused */
+
+    QTAILQ_ENTRY(ReadCacheEntry) lru_next;
+} ReadCacheEntry;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache;
+    uint64_t block_size;
+    uint64_t nb_slots;
+    uint64_t data_offset;
+    bool cache_writes;
+
+    /* True while the metadata is loaded and the cache file is marked dirty */
+    bool active;
+
+    ReadCacheEntry *entries;    /* indexed by slot */
+    GHashTable *map;            /* block number -> ReadCacheEntry */
+    QTAILQ_HEAD(, ReadCacheEntry) lru;  /* unused valid entries, LRU first */
+    uint64_t *free_slots;
+    uint64_t nb_free_slots;
+    uint64_t lru_clock;
+} BDRVReadCacheState;
+
+static QemuOptsList read_cache_runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(read_cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cached data in the cache file",
+        },
+        {
+            .name = READ_CACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the cache",
+        },
+        {
+            .name = READ_CACHE_OPT_CACHE_WRITES,
+            .type = QEMU_OPT_BOOL,
+            .help = "Store written data in the cache (write-through)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static uint64_t read_cache_slot_offset(BDRVReadCacheState *s, uint64_t slot)
+{
+    return s->data_offset + slot * s->block_size;
+}
+
+static ReadCacheEntry *read_cache_lookup(BDRVReadCacheState *s,
+                                         uint64_t block)
+{
+    return g_hash_table_lookup(s->map, &block);
+}
+
+static void read_cache_free_slot(BDRVReadCacheState *s, ReadCacheEntry *e)
+{
+    e->filling = false;
+    e->stale = false;
+    s->free_slots[s->nb_free_slots++] = e->slot;
+}
+
+static void read_cache_ref(BDRVReadCacheState *s, ReadCacheEntry *e)
+{
+    if (e->users++ == 0) {
+        QTAILQ_REMOVE(&s->lru, e, lru_next);
+    }
+}
+
+static void read_cache_unref(BDRVReadCacheState *s, ReadCacheEntry *e)
+{
+    assert(e->users > 0);
+    if (--e->users > 0) {
+        return;
+    }
+
+    if (e->stale) {
+        read_cache_free_slot(s, e);
+    } else {
+        assert(!e->filling);
+        e->last_used = ++s->lru_clock;
+        QTAILQ_INSERT_TAIL(&s->lru, e, lru_next);
+    }
+}
+
+static void read_cache_invalidate_entry(BDRVReadCacheState *s,
+                                        ReadCacheEntry *e)
+{
+    if (e->stale) {
+        return;     /* already removed from the map */
+    }
+
+    g_hash_table_remove(s->map, &e->block);
+    if (e->users) {
+        e->stale = true;
+    } else {
+        QTAILQ_REMOVE(&s->lru, e, lru_next);
+        read_cache_free_slot(s, e);
+    }
+}
+
+static void read_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t block, end;
+
+    if (!s->active || !bytes) {
+        return;
+    }
+
+    end = DIV_ROUND_UP(offset + bytes, s->block_size);
+    for (block = offset / s->block_size; block < end; block++) {
+        ReadCacheEntry *e = read_cache_lookup(s, block);
+        if (e) {
+            trace_read_cache_invalidate(bs, block);
+            read_cache_invalidate_entry(s, e);
+        }
+    }
+}
+
+/*
+ * Take a slot for @block, evicting the least recently used block if there is
+ * no free slot.  The new entry is in use and filling.  Returns NULL if all
+ * slots are in use.
+ */
+static ReadCacheEntry *read_cache_alloc(BlockDriverState *bs, uint64_t block)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheEntry *e;
+
+    if (s->nb_free_slots) {
+        e = &s->entries[s->free_slots[--s->nb_free_slots]];
+    } else if (!QTAILQ_EMPTY(&s->lru)) {
+        e = QTAILQ_FIRST(&s->lru);
+        trace_read_cache_evict(bs, e->block, e->slot);
+        g_hash_table_remove(s->map, &e->block);
+        QTAILQ_REMOVE(&s->lru, e, lru_next);
+    } else {
+        return NULL;
+    }
+
+    e->block = block;
+    e->users = 1;
+    e->filling = true;
+    e->stale = false;
+    g_hash_table_insert(s->map, &e->block, e);
+
+    return e;
+}
+
+/* Write @buf to the slot of a filling entry and make it valid */
+static void coroutine_fn read_cache_co_fill(BlockDriverState *bs,
+                                            ReadCacheEntry *e, void *buf)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_pwrite(s->cache, read_cache_slot_offset(s, e->slot),
+                         s->block_size, buf, 0);
+    e->filling = false;
+    if (ret < 0) {
+        read_cache_invalidate_entry(s, e);
+    }
+    read_cache_unref(s, e);
+}
+
+static int coroutine_fn read_cache_co_read_slot(BlockDriverState *bs,
+                                                ReadCacheEntry *e,
+                                                uint64_t offset, uint64_t bytes,
+                                                QEMUIOVector *qiov,
+                                                size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QEMUIOVector local_qiov;
+    int ret;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+
+    read_cache_ref(s, e);
+    ret = bdrv_co_preadv(s->cache,
+                         read_cache_slot_offset(s, e->slot) +
+                         offset % s->block_size,
+                         bytes, &local_qiov, 0);
+    read_cache_unref(s, e);
+
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_read_source(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset,
+                                                  int flags)
+{
+    QEMUIOVector local_qiov;
+    int ret;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+    ret = bdrv_co_preadv(bs->file, offset, bytes, &local_qiov, flags);
+    qemu_iovec_destroy(&local_qiov);
+
+    return ret;
+}
+
+/*
+ * Read the @nb_blocks uncached blocks starting at @block from the source,
+ * copy the requested part to @qiov and store the blocks in the cache.
+ */
+static int coroutine_fn read_cache_co_miss(BlockDriverState *bs,
+                                           uint64_t block, int nb_blocks,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov,
+                                           size_t qiov_offset, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheEntry *entries[READ_CACHE_MAX_MISS_BLOCKS];
+    uint64_t start = block * s->block_size;
+    uint64_t len = nb_blocks * s->block_size;
+    int64_t source_length = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t read_len;
+    uint8_t *buf;
+    int i, ret;
+
+    trace_read_cache_miss(bs, block, nb_blocks);
+
+    for (i = 0; i < nb_blocks; i++) {
+        entries[i] = read_cache_alloc(bs, block + i);
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, len);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* The last block of the source may be partial */
+    read_len = MIN(len, source_length - start);
+    memset(buf + read_len, 0, len - read_len);
+
+    ret = bdrv_co_pread(bs->file, start, read_len, buf, flags);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - start), bytes);
+
+    for (i = 0; i < nb_blocks; i++) {
+        if (entries[i]) {
+            read_cache_co_fill(bs, entries[i], buf + i * s->block_size);
+            entries[i] = NULL;
+        }
+    }
+
+out:
+    for (i = 0; i < nb_blocks; i++) {
+        if (entries[i]) {
+            entries[i]->filling = false;
+            read_cache_invalidate_entry(s, entries[i]);
+            read_cache_unref(s, entries[i]);
+        }
+    }
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn read_cache_co_preadv(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    size_t qiov_offset = 0;
+    int ret;
+
+    if (!s->active) {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+
+    while (bytes) {
+        uint64_t block = offset / s->block_size;
+        uint64_t len = MIN(bytes, s->block_size - offset % s->block_size);
+        ReadCacheEntry *e = read_cache_lookup(s, block);
+
+        if (e && !e->filling) {
+            trace_read_cache_hit(bs, block);
+            ret = read_cache_co_read_slot(bs, e, offset, len, qiov,
+                                          qiov_offset);
+        } else if (e) {
+            /* Another request is filling this block, bypass the cache */
+            ret = read_cache_co_read_source(bs, offset, len, qiov,
+                                            qiov_offset, flags);
+        } else {
+            int nb_blocks = 1;
+
+            /* Read consecutive missing blocks with a single request */
+            while (nb_blocks < READ_CACHE_MAX_MISS_BLOCKS &&
+                   len < bytes &&
+                   !read_cache_lookup(s, block + nb_blocks)) {
+                len = MIN(bytes,
+                          (block + nb_blocks + 1) * s->block_size - offset);
+                nb_blocks++;
+            }
+            ret = read_cache_co_miss(bs, block, nb_blocks, offset, len, qiov,
+                                     qiov_offset, flags);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += len;
+        bytes -= len;
+        qiov_offset += len;
+    }
+
+    return 0;
+}
+
+/* Store the blocks that a successful write covers completely */
+static void coroutine_fn read_cache_co_write_through(BlockDriverState *bs,
+                                                     uint64_t offset,
+                                                     uint64_t bytes,
+                                                     QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t block = DIV_ROUND_UP(offset, s->block_size);
+    uint64_t end = (offset + bytes) / s->block_size;
+    uint8_t *buf;
+
+    if (block >= end) {
+        return;
+    }
+
+    buf = qemu_try_blockalign(s->cache->bs, s->block_size);
+    if (!buf) {
+        return;
+    }
+
+    for (; block < end; block++) {
+        ReadCacheEntry *e;
+
+        /* A read may have cached the new data while we filled other slots */
+        if (read_cache_lookup(s, block)) {
+            continue;
+        }
+
+        e = read_cache_alloc(bs, block);
+        if (!e) {
+            break;
+        }
+        qemu_iovec_to_buf(qiov, block * s->block_size - offset, buf,
+                          s->block_size);
+        read_cache_co_fill(bs, e, buf);
+    }
+
+    qemu_vfree(buf);
+}
+
+/*
+ * Requests that modify the source invalidate the cached blocks they touch
+ * after they complete.  This also catches blocks that a concurrent read
+ * started to fill with the old data while the request was in flight.
+ */
+
+static int coroutine_fn read_cache_co_pwritev(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    read_cache_invalidate(bs, offset, bytes);
+
+    if (ret >= 0 && s->active && s->cache_writes) {
+        read_cache_co_write_through(bs, offset, bytes, qiov);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_invalidate(bs, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    int ret;
+
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_invalidate(bs, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_truncate(BlockDriverState *bs,
+                                               int64_t offset,
+                                               PreallocMode prealloc,
+                                               Error **errp)
+{
+    int64_t old_length = bdrv_getlength(bs->file->bs);
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, prealloc, errp);
+    if (old_length >= 0) {
+        int64_t start = QEMU_ALIGN_DOWN(MIN(old_length, offset),
+                                        BDRV_SECTOR_SIZE);
+        read_cache_invalidate(bs, start, MAX(old_length, offset) - start);
+    }
+
+    return ret;
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int read_cache_compare_last_used(const void *a, const void *b)
+{
+    const ReadCacheEntry *ea = *(ReadCacheEntry * const *)a;
+    const ReadCacheEntry *eb = *(ReadCacheEntry * const *)b;
+
+    return ea->last_used < eb->last_used ? -1 : ea->last_used > eb->last_used;
+}
+
+static void read_cache_reset(BDRVReadCacheState *s)
+{
+    uint64_t i;
+
+    g_hash_table_remove_all(s->map);
+    QTAILQ_INIT(&s->lru);
+    s->nb_free_slots = 0;
+    s->lru_clock = 0;
+    for (i = s->nb_slots; i > 0; i--) {
+        s->entries[i - 1] = (ReadCacheEntry) { .slot = i - 1 };
+        s->free_slots[s->nb_free_slots++] = i - 1;
+    }
+}
+
+/*
+ * Modification time in nanoseconds of the local file that holds the data of
+ * @bs, or 0 if there is none
+ */
+static uint64_t read_cache_source_mtime(BlockDriverState *bs)
+{
+    struct stat st;
+
+    while (bs && bs->drv && !bs->drv->protocol_name) {
+        bs = bs->file ? bs->file->bs : NULL;
+    }
+    if (!bs || !bs->drv || strcmp(bs->drv->format_name, "file") ||
+        stat(bs->filename, &st) < 0) {
+        return 0;
+    }
+
+#ifdef CONFIG_LINUX
+    return st.st_mtim.tv_sec * NANOSECONDS_PER_SECOND + st.st_mtim.tv_nsec;
+#else
+    return st.st_mtime * NANOSECONDS_PER_SECOND;
+#endif
+}
+
+static void read_cache_fill_header(BlockDriverState *bs, ReadCacheHeader *h,
+                                   uint32_t flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    memset(h, 0, sizeof(*h));
+    h->magic = cpu_to_le64(READ_CACHE_MAGIC);
+    h->version = cpu_to_le32(READ_CACHE_VERSION);
+    h->flags = cpu_to_le32(flags);
+    h->block_size = cpu_to_le64(s->block_size);
+    h->nb_slots = cpu_to_le64(s->nb_slots);
+    h->data_offset = cpu_to_le64(s->data_offset);
+    h->source_length = cpu_to_le64(bdrv_getlength(bs->file->bs));
+    h->source_mtime = cpu_to_le64(read_cache_source_mtime(bs->file->bs));
+    pstrcpy(h->source, sizeof(h->source), bs->file->bs->filename);
+}
+
+/*
+ * Load the slot table if the cache file belongs to the same, unchanged source
+ * and was closed cleanly, then mark the cache file dirty.
+ */
+static int read_cache_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader expected, header;
+    ReadCacheDiskEntry *table = NULL;
+    ReadCacheEntry **valid = NULL;
+    uint64_t i, nb_valid = 0;
+    int64_t file_length;
+    int ret;
+
+    read_cache_reset(s);
+
+    file_length = bdrv_getlength(s->cache->bs);
+    if (file_length < 0) {
+        error_setg_errno(errp, -file_length,
+                         "Could not get the length of the cache file");
+        return file_length;
+    }
+    if (file_length < read_cache_slot_offset(s, s->nb_slots)) {
+        ret = bdrv_truncate(s->cache, read_cache_slot_offset(s, s->nb_slots),
+                            PREALLOC_MODE_OFF, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    read_cache_fill_header(bs, &expected, 0);
+    ret = bdrv_pread(s->cache, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache header");
+        return ret;
+    }
+
+    if (memcmp(&header, &expected, sizeof(header)) ||
+        (!expected.source_mtime && !bdrv_is_read_only(bs->file->bs))) {
+        trace_read_cache_discard(bs, le32_to_cpu(header.flags) &
+                                     READ_CACHE_DIRTY);
+    } else {
+        table = g_try_new(ReadCacheDiskEntry, s->nb_slots);
+        valid = g_try_new(ReadCacheEntry *, s->nb_slots);
+        if (!table || !valid) {
+            error_setg(errp, "Could not allocate the cache slot table");
+            ret = -ENOMEM;
+            goto out;
+        }
+
+        ret = bdrv_pread(s->cache, READ_CACHE_HEADER_SIZE, table,
+                         s->nb_slots * sizeof(*table));
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the cache slot table");
+            goto out;
+        }
+
+        s->nb_free_slots = 0;
+        for (i = 0; i < s->nb_slots; i++) {
+            ReadCacheEntry *e = &s->entries[i];
+            uint64_t block = le64_to_cpu(table[i].block);
+
+            if (!block || read_cache_lookup(s, block - 1)) {
+                s->free_slots[s->nb_free_slots++] = i;
+                continue;
+            }
+
+            e->block = block - 1;
+            e->last_used = le64_to_cpu(table[i].last_used);
+            s->lru_clock = MAX(s->lru_clock, e->last_used);
+            g_hash_table_insert(s->map, &e->block, e);
+            valid[nb_valid++] = e;
+        }
+
+        qsort(valid, nb_valid, sizeof(*valid), read_cache_compare_last_used);
+        for (i = 0; i < nb_valid; i++) {
+            QTAILQ_INSERT_TAIL(&s->lru, valid[i], lru_next);
+        }
+    }
+
+    read_cache_fill_header(bs, &header, READ_CACHE_DIRTY);
+    ret = bdrv_pwrite(s->cache, 0, &header, sizeof(header));
+    if (ret >= 0) {
+        ret = bdrv_flush(s->cache->bs);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the cache header");
+        goto out;
+    }
+
+    trace_read_cache_load(bs, nb_valid);
+    s->active = true;
+    ret = 0;
+
+out:
+    if (ret < 0) {
+        read_cache_reset(s);
+    }
+    g_free(table);
+    g_free(valid);
+    return ret;
+}
+
+/* Write the slot table and mark the cache file clean */
+static int read_cache_save(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheDiskEntry *table;
+    ReadCacheHeader header;
+    uint64_t i;
+    int ret;
+
+    if (!s->active) {
+        return 0;
+    }
+    s->active = false;
+
+    table = g_try_new0(ReadCacheDiskEntry, s->nb_slots);
+    if (!table) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        ReadCacheEntry *e = &s->entries[i];
+
+        if (read_cache_lookup(s, e->block) == e && !e->filling) {
+            table[i].block = cpu_to_le64(e->block + 1);
+            table[i].last_used = cpu_to_le64(e->last_used);
+        }
+    }
+
+    ret = bdrv_pwrite(s->cache, READ_CACHE_HEADER_SIZE, table,
+                      s->nb_slots * sizeof(*table));
+    g_free(table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The table must be on disk before the header says it is valid */
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    read_cache_fill_header(bs, &header, 0);
+    ret = bdrv_pwrite(s->cache, 0, &header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    trace_read_cache_save(bs, g_hash_table_size(s->map));
+    return 0;
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t cache_size;
+    int ret;
+
+    opts = qemu_opts_create(&read_cache_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->block_size = qemu_opt_get_size(opts, READ_CACHE_OPT_BLOCK_SIZE,
+                                      READ_CACHE_DEFAULT_BLOCK_SIZE);
+    if (s->block_size < BDRV_SECTOR_SIZE ||
+        s->block_size > READ_CACHE_MAX_BLOCK_SIZE ||
+        !is_power_of_2(s->block_size)) {
+        error_setg(errp, READ_CACHE_OPT_BLOCK_SIZE " must be a power of two "
+                   "between %" PRId64 " and %" PRId64,
+                   (int64_t)BDRV_SECTOR_SIZE, READ_CACHE_MAX_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cache_size = qemu_opt_get_size(opts, READ_CACHE_OPT_SIZE, 0);
+    s->nb_slots = cache_size / s->block_size;
+    if (!s->nb_slots) {
+        error_setg(errp, READ_CACHE_OPT_SIZE " must be at least "
+                   READ_CACHE_OPT_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->nb_slots > SIZE_MAX / sizeof(ReadCacheEntry) ||
+        s->nb_slots > (INT_MAX - READ_CACHE_HEADER_SIZE) /
+                      sizeof(ReadCacheDiskEntry)) {
+        error_setg(errp, "Too many cache blocks, increase "
+                   READ_CACHE_OPT_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->data_offset = ROUND_UP(READ_CACHE_HEADER_SIZE +
+                              s->nb_slots * sizeof(ReadCacheDiskEntry),
+                              s->block_size);
+
+    s->cache_writes = qemu_opt_get_bool(opts, READ_CACHE_OPT_CACHE_WRITES,
+                                        false);
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               errp);
+    if (!bs->file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /*
+     * The cache is written even when the cached node is read-only, e.g. when
+     * it is the backing file of an overlay.
+     */
+    if (!qdict_haskey(options, "cache-file")) {
+        qdict_set_default_str(options, "cache-file." BDRV_OPT_READ_ONLY,
+                              "off");
+    }
+    s->cache = bdrv_open_child(NULL, options, "cache-file", bs, &child_file,
+                               false, errp);
+    if (!s->cache) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    s->entries = g_try_new0(ReadCacheEntry, s->nb_slots);
+    s->free_slots = g_try_new(uint64_t, s->nb_slots);
+    if (!s->entries || !s->free_slots) {
+        error_setg(errp, "Could not allocate cache metadata");
+        ret = -ENOMEM;
+        goto fail;
+    }
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+
+    /* An incoming migration loads the cache in bdrv_co_invalidate_cache() */
+    if (!(flags & BDRV_O_INACTIVE)) {
+        ret = read_cache_load(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    } else {
+        read_cache_reset(s);
+    }
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        if (s->map) {
+            g_hash_table_destroy(s->map);
+            s->map = NULL;
+        }
+        g_free(s->entries);
+        g_free(s->free_slots);
+        bdrv_unref_child(bs, s->cache);
+        s->cache = NULL;
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = read_cache_save(bs);
+    if (ret < 0) {
+        warn_report("read-cache: could not save the cache metadata: %s",
+                    strerror(-ret));
+    }
+
+    g_hash_table_destroy(s->map);
+    g_free(s->entries);
+    g_free(s->free_slots);
+
+    bdrv_unref_child(bs, s->cache);
+    s->cache = NULL;
+}
+
+static int read_cache_inactivate(BlockDriverState *bs)
+{
+    return read_cache_save(bs);
+}
+
+static void coroutine_fn read_cache_co_invalidate_cache(BlockDriverState *bs,
+                                                        Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (!s->active) {
+        read_cache_load(bs, errp);
+    }
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  const BdrvChildRole *role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    if (!c || strcmp(c->name, "cache-file")) {
+        bdrv_filter_default_perms(bs, c, role, reopen_queue, perm, shared,
+                                  nperm, nshared);
+        return;
+    }
+
+    /*
+     * Nobody else may write to the cache file or resize it while we use it,
+     * not even another read-cache node: the slot table only lives in memory
+     * until the cache is closed.
+     */
+    *nperm = BLK_PERM_CONSISTENT_READ;
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        *nperm |= BLK_PERM_WRITE | BLK_PERM_RESIZE;
+    }
+    *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_GRAPH_MOD;
+}
+
+static bool read_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                   BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    READ_CACHE_OPT_SIZE,
+    READ_CACHE_OPT_BLOCK_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        = "read-cache",
+    .instance_size                      = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                          = read_cache_open,
+    .bdrv_close                         = read_cache_close,
+    .bdrv_inactivate                    = read_cache_inactivate,
+    .bdrv_co_invalidate_cache           = read_cache_co_invalidate_cache,
+    .bdrv_child_perm                    = read_cache_child_perm,
+
+    .bdrv_getlength                     = read_cache_getlength,
+    .bdrv_co_truncate                   = read_cache_co_truncate,
+
+    .bdrv_co_preadv                     = read_cache_co_preadv,
+    .bdrv_co_pwritev                    = read_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = read_cache_co_pdiscard,
+
+    .bdrv_co_block_status               = bdrv_co_block_status_from_file,
+
+    .bdrv_recurse_is_first_non_filter = read_cache_recurse_is_first_non_filter,
+
+    .has_variable_length                = true,
+    .is_filter                          = true,
+    .strong_runtime_opts                = read_cache_strong_runtime_opts,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
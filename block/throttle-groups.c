@@ -62,7 +62,34 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * To keep the lock off the fast path when many members in different
+ * AioContexts share a group, each AioContext gets a ThrottleGroupShare: a
+ * credit of operations and bytes that was already accounted in the group's
+ * ThrottleState and that members can consume with atomic operations.  A
+ * share is refilled with a slice of the group's limits, divided by the
+ * number of shares, whenever a request passes through the group without
+ * having to wait.  Credit that is not used within a slice is given back.
+ *
+ * When the group is saturated, queued requests are granted by weighted
+ * fair queuing: the member with pending requests that has the smallest
+ * weighted virtual time goes next.
  */
+#define THROTTLE_GROUP_SHARE_SLICE_NS   (10 * SCALE_MS)
+#define THROTTLE_GROUP_MAX_CREDIT       (INT_MAX / 2)
+#define THROTTLE_GROUP_VTIME_SCALE      1000000
+
+struct ThrottleGroupShare {
+    AioContext *ctx;
+    unsigned int refcnt;
+    int64_t refill_time[2];
+    QLIST_ENTRY(ThrottleGroupShare) list;
+
+    /* Accessed with atomic operations */
+    int ops[2];
+    int bytes[2];
+};
+
 typedef struct ThrottleGroup {
     Object parent_obj;
 
@@ -70,12 +97,19 @@ typedef struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
     QEMUClockType clock_type;
+    QLIST_HEAD(, ThrottleGroupShare) shares;
+    unsigned int nr_shares;
+    unsigned int nr_pending[2];
+    uint64_t vtime[2];  /* virtual time of the last granted request */
+
+    /* Whether shares may be used, accessed with atomic operations */
+    bool shares_enabled;
 
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
@@ -206,8 +240,8 @@ static inline bool tgm_has_pending_reqs(ThrottleGroupMember *tgm,
     return tgm->pending_reqs[is_write];
 }
 
-/* Return the next ThrottleGroupMember in the round-robin sequence with pending
- * I/O requests.
+/* Return the ThrottleGroupMember with pending I/O requests that has the
+ * smallest weighted virtual time, i.e. that got the least of its share.
  *
  * This assumes that tg->lock is held.
  *
@@ -221,37 +255,263 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
 {
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
-    ThrottleGroupMember *token, *start;
+    ThrottleGroupMember *iter, *token = NULL;
 
     /* If this member has its I/O limits disabled then it means that
-     * it's being drained. Skip the round-robin search and return tgm
-     * immediately if it has pending requests. Otherwise we could be
-     * forcing it to wait for other member's throttled requests. */
+     * it's being drained. Skip the search and return tgm immediately
+     * if it has pending requests. Otherwise we could be forcing it to
+     * wait for other member's throttled requests. */
     if (tgm_has_pending_reqs(tgm, is_write) &&
         atomic_read(&tgm->io_limits_disabled)) {
         return tgm;
     }
 
-    start = token = tg->tokens[is_write];
-
-    /* get next bs round in round robin style */
-    token = throttle_group_next_tgm(token);
-    while (token != start && !tgm_has_pending_reqs(token, is_write)) {
-        token = throttle_group_next_tgm(token);
+    QLIST_FOREACH(iter, &tg->head, round_robin) {
+        if (tgm_has_pending_reqs(iter, is_write) &&
+            (!token || iter->vtime[is_write] < token->vtime[is_write])) {
+            token = iter;
+        }
     }
 
-    /* If no IO are queued for scheduling on the next round robin token
-     * then decide the token is the current tgm because chances are
-     * the current tgm got the current request queued.
+    /* If no IO are queued then decide the token is the current tgm
+     * because chances are the current tgm got the current request queued.
      */
-    if (token == start && !tgm_has_pending_reqs(token, is_write)) {
-        token = tgm;
+    return token ?: tgm;
+}
+
+/* Don't let a member that was idle catch up on the share it did not use.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_vtime_start(ThrottleGroupMember *tgm,
+                                       bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    tgm->vtime[is_write] = MAX(tgm->vtime[is_write], tg->vtime[is_write]);
+}
+
+/* Charge a granted request to the virtual time of its member.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_vtime_charge(ThrottleGroupMember *tgm,
+                                        unsigned int bytes, bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    uint64_t op_size = tg->ts.cfg.op_size;
+    uint64_t units = 1;
+
+    if (op_size && bytes > op_size) {
+        units = bytes / op_size;
+    }
+
+    tg->vtime[is_write] = tgm->vtime[is_write];
+    tgm->vtime[is_write] += units * THROTTLE_GROUP_VTIME_SCALE / tgm->weight;
+}
+
+/* Smallest average limit of two buckets, or 0 if neither is limited */
+static uint64_t throttle_group_min_avg(ThrottleState *ts, BucketType total,
+                                       BucketType single)
+{
+    uint64_t a = ts->cfg.buckets[total].avg;
+    uint64_t b = ts->cfg.buckets[single].avg;
+
+    return a && b ? MIN(a, b) : MAX(a, b);
+}
+
+/* Give the unused credit of @share back to the group.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_share_drop(ThrottleGroup *tg,
+                                      ThrottleGroupShare *share, bool is_write)
+{
+    int ops = MAX(atomic_xchg(&share->ops[is_write], 0), 0);
+    int bytes = MAX(atomic_xchg(&share->bytes[is_write], 0), 0);
+
+    /* Credit for unlimited buckets was never accounted */
+    if (!throttle_group_min_avg(&tg->ts, THROTTLE_OPS_TOTAL,
+                                is_write ? THROTTLE_OPS_WRITE :
+                                THROTTLE_OPS_READ)) {
+        ops = 0;
+    }
+    if (!throttle_group_min_avg(&tg->ts, THROTTLE_BPS_TOTAL,
+                                is_write ? THROTTLE_BPS_WRITE :
+                                THROTTLE_BPS_READ)) {
+        bytes = 0;
+    }
+
+    throttle_account_units(&tg->ts, is_write, -ops, -bytes);
+}
+
+/* Add @credit to a share counter, or make it unlimited if @credit is
+ * negative.  Returns the credit that was added.
+ */
+static int throttle_group_share_add(int *counter, int64_t credit)
+{
+    int cur = atomic_read(counter);
+
+    if (credit < 0) {
+        atomic_set(counter, THROTTLE_GROUP_MAX_CREDIT);
+        return 0;
+    }
+
+    credit = MIN(credit, MAX(THROTTLE_GROUP_MAX_CREDIT - cur, 0));
+    atomic_add(counter, credit);
+    return credit;
+}
+
+/* Account a request that did not have to wait together with a slice of the
+ * group's limits, and give the slice to the AioContext of @tgm so that the
+ * following requests can skip the group lock.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @ret: false if the request still has to be accounted
+ */
+static bool throttle_group_share_refill(ThrottleGroupMember *tgm,
+                                        unsigned int bytes, bool is_write)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    ThrottleGroupShare *share = tgm->share, *iter;
+    uint64_t avg_ops, avg_bps;
+    int64_t now, ops, size;
+
+    if (!share || !tg->shares_enabled || tg->nr_pending[is_write] ||
+        bytes > THROTTLE_GROUP_MAX_CREDIT ||
+        atomic_read(&tgm->io_limits_disabled)) {
+        return false;
+    }
+
+    /* Rebalance: take back what other AioContexts did not use in time */
+    now = qemu_clock_get_ns(tg->clock_type);
+    QLIST_FOREACH(iter, &tg->shares, list) {
+        int64_t age = now - iter->refill_time[is_write];
+
+        if (age >= THROTTLE_GROUP_SHARE_SLICE_NS) {
+            throttle_group_share_drop(tg, iter, is_write);
+        }
+    }
+
+    avg_ops = throttle_group_min_avg(ts, THROTTLE_OPS_TOTAL,
+                                     is_write ? THROTTLE_OPS_WRITE :
+                                     THROTTLE_OPS_READ);
+    avg_bps = throttle_group_min_avg(ts, THROTTLE_BPS_TOTAL,
+                                     is_write ? THROTTLE_BPS_WRITE :
+                                     THROTTLE_BPS_READ);
+
+    ops = -1;
+    if (avg_ops) {
+        ops = muldiv64(avg_ops, THROTTLE_GROUP_SHARE_SLICE_NS,
+                       NANOSECONDS_PER_SECOND) / tg->nr_shares;
+        ops = MAX(ops - 1, 0);
+    }
+    size = -1;
+    if (avg_bps) {
+        size = muldiv64(avg_bps, THROTTLE_GROUP_SHARE_SLICE_NS,
+                        NANOSECONDS_PER_SECOND) / tg->nr_shares;
+        size = MAX(size - (int64_t)bytes, 0);
+    }
+
+    ops = throttle_group_share_add(&share->ops[is_write], ops);
+    size = throttle_group_share_add(&share->bytes[is_write], size);
+    share->refill_time[is_write] = now;
+
+    throttle_account_units(ts, is_write, 1 + ops, (double)bytes + size);
+    return true;
+}
+
+/* Try to run a request on the credit of the member's AioContext, without
+ * taking the group lock.
+ */
+static bool throttle_group_share_take(ThrottleGroupMember *tgm,
+                                      unsigned int bytes, bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleGroupShare *share = tgm->share;
+
+    if (!share || !atomic_read(&tg->shares_enabled) ||
+        bytes > THROTTLE_GROUP_MAX_CREDIT ||
+        atomic_read(&tgm->pending_reqs[is_write])) {
+        return false;
+    }
+
+    if (atomic_fetch_sub(&share->ops[is_write], 1) < 1) {
+        atomic_inc(&share->ops[is_write]);
+        return false;
+    }
+    if (atomic_fetch_sub(&share->bytes[is_write], (int)bytes) < (int)bytes) {
+        atomic_add(&share->bytes[is_write], (int)bytes);
+        atomic_inc(&share->ops[is_write]);
+        return false;
+    }
+
+    return true;
+}
+
+/* Return the share of @ctx, creating it if necessary.
+ *
+ * This assumes that tg->lock is held.
+ */
+static ThrottleGroupShare *throttle_group_share_get(ThrottleGroup *tg,
+                                                   AioContext *ctx)
+{
+    ThrottleGroupShare *share;
+
+    QLIST_FOREACH(share, &tg->shares, list) {
+        if (share->ctx == ctx) {
+            share->refcnt++;
+            return share;
+        }
     }
 
-    /* Either we return the original TGM, or one with pending requests */
-    assert(token == tgm || tgm_has_pending_reqs(token, is_write));
+    share = g_new0(ThrottleGroupShare, 1);
+    share->ctx = ctx;
+    share->refcnt = 1;
+    QLIST_INSERT_HEAD(&tg->shares, share, list);
+    tg->nr_shares++;
+    return share;
+}
+
+/* This assumes that tg->lock is held. */
+static void throttle_group_share_put(ThrottleGroup *tg,
+                                     ThrottleGroupShare *share)
+{
+    if (--share->refcnt) {
+        return;
+    }
+
+    throttle_group_share_drop(tg, share, false);
+    throttle_group_share_drop(tg, share, true);
+    QLIST_REMOVE(share, list);
+    tg->nr_shares--;
+    g_free(share);
+}
+
+/* Apply a new configuration.  This resets the bucket levels, so the
+ * credit of the shares is dropped as well.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_do_config(ThrottleGroup *tg, ThrottleConfig *cfg)
+{
+    ThrottleGroupShare *share;
+    int i;
+
+    throttle_config(&tg->ts, tg->clock_type, cfg);
+
+    QLIST_FOREACH(share, &tg->shares, list) {
+        for (i = 0; i < 2; i++) {
+            atomic_set(&share->ops[i], 0);
+            atomic_set(&share->bytes[i], 0);
+            share->refill_time[i] = 0;
+        }
+    }
 
-    return token;
+    /* Credit is counted in whole operations */
+    atomic_set(&tg->shares_enabled, !tg->ts.cfg.op_size);
 }
 
 /* Check if the next I/O request for a ThrottleGroupMember needs to be
@@ -335,11 +595,9 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current tgm */
-        if (qemu_in_coroutine() &&
-            throttle_group_co_restart_queue(tgm, is_write)) {
-            token = tgm;
-        } else {
+        /* Run it from here if it is ours, else wake up its owner now */
+        if (token != tgm || !qemu_in_coroutine() ||
+            !throttle_group_co_restart_queue(tgm, is_write)) {
             ThrottleTimers *tt = &token->throttle_timers;
             int64_t now = qemu_clock_get_ns(tg->clock_type);
             timer_mod(tt->timers[is_write], now);
@@ -350,8 +608,8 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
 }
 
 /* Check if an I/O request needs to be throttled, wait and set a timer
- * if necessary, and schedule the next request using a round robin
- * algorithm.
+ * if necessary, and schedule the next request using weighted fair
+ * queuing.
  *
  * @tgm:       the current ThrottleGroupMember
  * @bytes:     the number of bytes for this I/O
@@ -362,8 +620,15 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
                                                         bool is_write)
 {
     bool must_wait;
+    bool accounted = false;
     ThrottleGroupMember *token;
     ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    /* Fast path: the I/O was already accounted as part of the share */
+    if (throttle_group_share_take(tgm, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -372,7 +637,11 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
+        if (!tgm->pending_reqs[is_write]) {
+            throttle_group_vtime_start(tgm, is_write);
+        }
         tgm->pending_reqs[is_write]++;
+        tg->nr_pending[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[is_write],
@@ -380,10 +649,17 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[is_write]--;
+        tg->nr_pending[is_write]--;
+    } else {
+        throttle_group_vtime_start(tgm, is_write);
+        accounted = throttle_group_share_refill(tgm, bytes, is_write);
     }
 
     /* The I/O will be executed, so do the accounting */
-    throttle_account(tgm->throttle_state, is_write, bytes);
+    throttle_group_vtime_charge(tgm, bytes, is_write);
+    if (!accounted) {
+        throttle_account(tgm->throttle_state, is_write, bytes);
+    }
 
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
@@ -471,7 +747,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
-    throttle_config(ts, tg->clock_type, cfg);
+    throttle_group_do_config(tg, cfg);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -493,6 +769,35 @@ void throttle_group_get_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Set the weight of a ThrottleGroupMember.  When the group is saturated,
+ * members get a share of its limits that is proportional to their weight.
+ * The default weight is THROTTLE_GROUP_DEFAULT_WEIGHT.
+ *
+ * @tgm:    a ThrottleGroupMember, not necessarily registered yet
+ * @weight: the new weight, between 1 and THROTTLE_GROUP_MAX_WEIGHT
+ */
+void throttle_group_set_weight(ThrottleGroupMember *tgm, unsigned int weight)
+{
+    ThrottleGroup *tg;
+
+    assert(weight > 0 && weight <= THROTTLE_GROUP_MAX_WEIGHT);
+
+    if (!tgm->throttle_state) {
+        tgm->weight = weight;
+        return;
+    }
+
+    tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    qemu_mutex_lock(&tg->lock);
+    tgm->weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+unsigned int throttle_group_get_weight(ThrottleGroupMember *tgm)
+{
+    return tgm->weight ?: THROTTLE_GROUP_DEFAULT_WEIGHT;
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -545,8 +850,14 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     tgm->throttle_state = ts;
     tgm->aio_context = ctx;
     atomic_set(&tgm->restart_pending, 0);
+    if (!tgm->weight) {
+        tgm->weight = THROTTLE_GROUP_DEFAULT_WEIGHT;
+    }
 
     qemu_mutex_lock(&tg->lock);
+    tgm->vtime[0] = tgm->vtime[1] = 0;
+    tgm->share = throttle_group_share_get(tg, ctx);
+
     /* If the ThrottleGroup is new set this ThrottleGroupMember as the token */
     for (i = 0; i < 2; i++) {
         if (!tg->tokens[i]) {
@@ -612,6 +923,10 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
     /* remove the current tgm from the list */
     QLIST_REMOVE(tgm, round_robin);
     throttle_timers_destroy(&tgm->throttle_timers);
+    if (tgm->share) {
+        throttle_group_share_put(tg, tgm->share);
+        tgm->share = NULL;
+    }
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_unref(&tg->ts);
@@ -621,9 +936,14 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 void throttle_group_attach_aio_context(ThrottleGroupMember *tgm,
                                        AioContext *new_context)
 {
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
     ThrottleTimers *tt = &tgm->throttle_timers;
     throttle_timers_attach_aio_context(tt, new_context);
     tgm->aio_context = new_context;
+
+    qemu_mutex_lock(&tg->lock);
+    tgm->share = throttle_group_share_get(tg, new_context);
+    qemu_mutex_unlock(&tg->lock);
 }
 
 void throttle_group_detach_aio_context(ThrottleGroupMember *tgm)
@@ -645,6 +965,8 @@ void throttle_group_detach_aio_context(ThrottleGroupMember *tgm)
             schedule_next_request(tgm, i);
         }
     }
+    throttle_group_share_put(tg, tgm->share);
+    tgm->share = NULL;
     qemu_mutex_unlock(&tg->lock);
 
     throttle_timers_detach_aio_context(tt);
@@ -760,6 +1082,7 @@ static void throttle_group_obj_init(Object *obj)
     qemu_mutex_init(&tg->lock);
     throttle_init(&tg->ts);
     QLIST_INIT(&tg->head);
+    QLIST_INIT(&tg->shares);
 }
 
 /* This function edits throttle_groups and must be called under the global
@@ -787,7 +1110,7 @@ static void throttle_group_obj_complete(UserCreatable *obj, Error **errp)
     if (!throttle_is_valid(&cfg, errp)) {
         return;
     }
-    throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_do_config(tg, &cfg);
     QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
     tg->is_initialized = true;
 }
@@ -907,7 +1230,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
     if (local_err) {
         goto unlock;
     }
-    throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_do_config(tg, &cfg);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
@@ -18,6 +18,7 @@
 #include "block/nbd.h"
 #include "io/channel-socket.h"
 #include "io/net-listener.h"
+#include "sysemu/iothread.h"
 
 typedef struct NBDServerData {
     QIONetListener *listener;
@@ -145,11 +146,15 @@ void qmp_nbd_server_start(SocketAddressLegacy *addr,
 
 void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
                         bool has_writable, bool writable,
-                        bool has_bitmap, const char *bitmap, Error **errp)
+                        bool has_bitmap, const char *bitmap,
+                        bool has_iothreads, strList *iothreads, Error **errp)
 {
     BlockDriverState *bs = NULL;
     BlockBackend *on_eject_blk;
     NBDExport *exp;
+    AioContext **client_ctx = NULL;
+    int nb_client_ctx = 0;
+    strList *e;
     int64_t len;
 
     if (!nbd_server) {
@@ -187,17 +192,38 @@ void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
         writable = false;
     }
 
+    for (e = iothreads; e; e = e->next) {
+        IOThread *iothread = iothread_by_id(e->value);
+
+        if (!iothread) {
+            error_setg(errp, "Cannot find iothread %s", e->value);
+            goto out;
+        }
+        client_ctx = g_renew(AioContext *, client_ctx, nb_client_ctx + 1);
+        client_ctx[nb_client_ctx++] = iothread_get_aio_context(iothread);
+    }
+
+    /*
+     * The number of clients is not limited and they all share the export's
+     * BlockBackend, so multiple connections from one client are safe.
+     */
     exp = nbd_export_new(bs, 0, len, name, NULL, bitmap,
-                         writable ? 0 : NBD_FLAG_READ_ONLY,
+                         (writable ? 0 : NBD_FLAG_READ_ONLY) |
+                         NBD_FLAG_CAN_MULTI_CONN,
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
-        return;
+        goto out;
     }
 
+    nbd_export_set_client_contexts(exp, client_ctx, nb_client_ctx);
+
     /* The list of named exports has a strong reference to this export now and
      * our only way of accessing it is through nbd_export_find(), so we can drop
      * the strong reference that is @exp. */
     nbd_export_put(exp);
+
+out:
+    g_free(client_ctx);
 }
 
 void qmp_nbd_server_remove(const char *name,
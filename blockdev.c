@@ -385,13 +385,9 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         }
 
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
-            if (!strcmp(aio, "native")) {
-                *bdrv_flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(aio, "threads")) {
-                /* this is the default */
-            } else {
-               error_setg(errp, "invalid aio option");
-               return;
+            if (bdrv_parse_aio(aio, bdrv_flags) < 0) {
+                error_setg(errp, "invalid aio option");
+                return;
             }
         }
     }
@@ -484,6 +480,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockdevDetectZeroesOptions detect_zeroes =
         BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
     const char *throttling_group = NULL;
+    uint64_t throttling_weight;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -530,6 +527,15 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    throttling_weight = qemu_opt_get_number(opts, "throttling.group-weight",
+                                            THROTTLE_GROUP_DEFAULT_WEIGHT);
+    if (throttling_weight < 1 ||
+        throttling_weight > THROTTLE_GROUP_MAX_WEIGHT) {
+        error_setg(errp, "throttling.group-weight must be between 1 and %d",
+                   THROTTLE_GROUP_MAX_WEIGHT);
+        goto early_err;
+    }
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
         if (is_help_option(buf)) {
             qemu_printf("Supported formats:");
@@ -624,6 +630,8 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
             throttling_group = id;
         }
         blk_io_limits_enable(blk, throttling_group);
+        throttle_group_set_weight(&blk_get_public(blk)->throttle_group_member,
+                                  throttling_weight);
         blk_set_io_limits(blk, &cfg);
     }
 
@@ -2833,6 +2841,14 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         goto out;
     }
 
+    if (arg->has_group_weight &&
+        (arg->group_weight < 1 ||
+         arg->group_weight > THROTTLE_GROUP_MAX_WEIGHT)) {
+        error_setg(errp, "group-weight must be between 1 and %d",
+                   THROTTLE_GROUP_MAX_WEIGHT);
+        goto out;
+    }
+
     if (throttle_enabled(&cfg)) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
@@ -2844,6 +2860,11 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         } else if (arg->has_group) {
             blk_io_limits_update_group(blk, arg->group);
         }
+        if (arg->has_group_weight) {
+            throttle_group_set_weight(
+                &blk_get_public(blk)->throttle_group_member,
+                arg->group_weight);
+        }
         /* Set the new throttling configuration */
         blk_set_io_limits(blk, &cfg);
     } else if (blk_get_public(blk)->throttle_group_member.throttle_state) {
@@ -3499,6 +3520,7 @@ static BlockJob *do_backup_common(BackupCommon *backup,
 {
     BlockJob *job = NULL;
     BdrvDirtyBitmap *bmap = NULL;
+    BlockDriverState *cbw_buffer_bs = NULL;
     int job_flags = JOB_DEFAULT;
     int ret;
 
@@ -3523,12 +3545,30 @@ static BlockJob *do_backup_common(BackupCommon *backup,
     if (!backup->has_compress) {
         backup->compress = false;
     }
+    if (!backup->has_cbw_buffer_size) {
+        backup->cbw_buffer_size = 0;
+    }
+    if (!backup->has_cbw_workers) {
+        backup->cbw_workers = 4;
+    }
 
     ret = bdrv_try_set_aio_context(target_bs, aio_context, errp);
     if (ret < 0) {
         return NULL;
     }
 
+    if (backup->has_cbw_buffer_node) {
+        cbw_buffer_bs = bdrv_lookup_bs(backup->cbw_buffer_node,
+                                       backup->cbw_buffer_node, errp);
+        if (!cbw_buffer_bs) {
+            return NULL;
+        }
+        ret = bdrv_try_set_aio_context(cbw_buffer_bs, aio_context, errp);
+        if (ret < 0) {
+            return NULL;
+        }
+    }
+
     if ((backup->sync == MIRROR_SYNC_MODE_BITMAP) ||
         (backup->sync == MIRROR_SYNC_MODE_INCREMENTAL)) {
         /* done before desugaring 'incremental' to print the right message */
@@ -3600,7 +3640,8 @@ static BlockJob *do_backup_common(BackupCommon *backup,
 
     job = backup_job_create(backup->job_id, bs, target_bs, backup->speed,
                             backup->sync, bmap, backup->bitmap_mode,
-                            backup->compress,
+                            backup->compress, backup->cbw_buffer_size,
+                            backup->cbw_workers, cbw_buffer_bs,
                             backup->on_source_error,
                             backup->on_target_error,
                             job_flags, NULL, NULL, txn, errp);
@@ -4690,6 +4731,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.group",
             .type = QEMU_OPT_STRING,
             .help = "name of the block throttling group",
+        },{
+            .name = "throttling.group-weight",
+            .type = QEMU_OPT_NUMBER,
+            .help = "weight of the drive within its throttling group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -217,6 +217,11 @@ int block_job_add_bdrv(BlockJob *job, const char *name, BlockDriverState *bs,
     BdrvChild *c;
 
     bdrv_ref(bs);
+    /*
+     * Multiqueue BlockBackends above @bs check for the job at the end of the
+     * drained section, see bdrv_prepare_multiqueue()
+     */
+    bdrv_drained_begin(bs);
     if (job->job.aio_context != qemu_get_aio_context()) {
         aio_context_release(job->job.aio_context);
     }
@@ -225,6 +230,7 @@ int block_job_add_bdrv(BlockJob *job, const char *name, BlockDriverState *bs,
     if (job->job.aio_context != qemu_get_aio_context()) {
         aio_context_acquire(job->job.aio_context);
     }
+    bdrv_drained_end(bs);
     if (c == NULL) {
         return -EPERM;
     }
@@ -781,15 +781,22 @@ static const VMStateDescription vmstate_timers = {
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
     double pct;
+    double max_pct;
     double throttle_ratio;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    pct = (double)atomic_read(&cpu->throttle_percentage) / 100;
+    max_pct = (double)cpu_throttle_get_percentage() / 100;
+    if (!pct || !max_pct) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
+    /*
+     * The timer period is based on the highest throttle percentage, so
+     * sleep for @pct of that period.
+     */
+    throttle_ratio = pct / (1 - max_pct);
     sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
 
     qemu_mutex_unlock_iothread();
@@ -808,6 +815,9 @@ static void cpu_throttle_timer_tick(void *opaque)
         return;
     }
     CPU_FOREACH(cpu) {
+        if (!atomic_read(&cpu->throttle_percentage)) {
+            continue;
+        }
         if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
                              RUN_ON_CPU_NULL);
@@ -821,19 +831,58 @@ static void cpu_throttle_timer_tick(void *opaque)
 
 void cpu_throttle_set(int new_throttle_pct)
 {
+    CPUState *cpu;
+
     /* Ensure throttle percentage is within valid range */
     new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
     new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
 
+    rcu_read_lock();
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+    }
+    rcu_read_unlock();
     atomic_set(&throttle_percentage, new_throttle_pct);
 
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    CPUState *other;
+    int max_pct = 0;
+
+    /* Ensure throttle percentage is within valid range */
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, 0);
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    rcu_read_lock();
+    CPU_FOREACH(other) {
+        max_pct = MAX(max_pct, atomic_read(&other->throttle_percentage));
+    }
+    rcu_read_unlock();
+
+    if (max_pct && !cpu_throttle_active()) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+    atomic_set(&throttle_percentage, max_pct);
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+
+    rcu_read_lock();
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
+    rcu_read_unlock();
 }
 
 bool cpu_throttle_active(void)
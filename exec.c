@@ -2747,6 +2747,11 @@ void memory_notdirty_write_prepare(NotDirtyInfo *ndi,
     ndi->pages = NULL;
 
     assert(tcg_enabled());
+    /* Let migration know which vcpus dirty memory the fastest */
+    if (cpu && global_dirty_log &&
+        !cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION)) {
+        atomic_inc(&cpu->dirty_pages);
+    }
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
         ndi->pages = page_collection_lock(ram_addr, ram_addr + size);
         tb_invalidate_phys_page_fast(ndi->pages, ram_addr, size);
@@ -41,10 +41,42 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    IOThread *iothread;
-    AioContext *ctx;
+    IOThread **iothreads;
+    unsigned num_iothreads;
+    AioContext *ctx;                /* AioContext of the BlockBackend */
+
+    /*
+     * With more than one iothread, virtqueue i is processed in the
+     * AioContext of iothread i % num_iothreads and the BlockBackend accepts
+     * requests from all of them.  If the BlockBackend cannot do that, all
+     * virtqueues are processed in ctx, see dataplane_vq_ctx().
+     */
+    bool multiqueue;
+    AioContext **vq_ctx;
+    bool external_disabled;         /* see virtio_blk_data_plane_drained_begin */
 };
 
+/* Is @ctx already used by a virtqueue before @n? */
+static bool vq_ctx_seen(VirtIOBlockDataPlane *s, unsigned n, AioContext *ctx)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (s->vq_ctx[i] == ctx) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The AioContext that processes virtqueue @n while dataplane runs */
+static AioContext *dataplane_vq_ctx(VirtIOBlockDataPlane *s, unsigned n)
+{
+    VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+
+    return vblk->vq_aio_context ? s->vq_ctx[n] : s->ctx;
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
@@ -88,10 +120,21 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->num_iothreads) {
+        error_setg(errp, "iothread and iothreads are mutually exclusive");
+        return false;
+    }
+    if (conf->num_iothreads > conf->num_queues) {
+        error_setg(errp, "iothreads must not have more elements than "
+                   "num-queues (%" PRIu16 ")", conf->num_queues);
+        return false;
+    }
+
+    if (conf->iothread || conf->num_iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -120,13 +163,41 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
-    } else {
-        s->ctx = qemu_get_aio_context();
+    if (conf->num_iothreads) {
+        s->iothreads = g_new0(IOThread *, conf->num_iothreads);
+        for (i = 0; i < conf->num_iothreads; i++) {
+            IOThread *iothread = iothread_by_id(conf->iothread_ids[i]);
+
+            if (!iothread) {
+                error_setg(errp, "iothread '%s' not found",
+                           conf->iothread_ids[i]);
+                virtio_blk_data_plane_destroy(s);
+                return false;
+            }
+            object_ref(OBJECT(iothread));
+            s->iothreads[s->num_iothreads++] = iothread;
+        }
+    } else if (conf->iothread) {
+        s->iothreads = g_new0(IOThread *, 1);
+        s->iothreads[0] = conf->iothread;
+        s->num_iothreads = 1;
+        object_ref(OBJECT(conf->iothread));
+    }
+
+    s->vq_ctx = g_new(AioContext *, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        if (s->num_iothreads) {
+            IOThread *iothread = s->iothreads[i % s->num_iothreads];
+            s->vq_ctx[i] = iothread_get_aio_context(iothread);
+        } else {
+            s->vq_ctx[i] = qemu_get_aio_context();
+        }
+        if (s->vq_ctx[i] != s->vq_ctx[0]) {
+            s->multiqueue = true;
+        }
     }
+    s->ctx = s->vq_ctx[0];
+
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
@@ -139,6 +210,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -147,10 +219,14 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
+    if (s->bh) {
+        qemu_bh_delete(s->bh);
     }
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    g_free(s->vq_ctx);
     g_free(s);
 }
 
@@ -183,12 +259,6 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
     s->starting = true;
 
-    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        s->batch_notifications = true;
-    } else {
-        s->batch_notifications = false;
-    }
-
     /* Set up guest notifier (irq) */
     r = k->set_guest_notifiers(qbus->parent, nvqs, true);
     if (r != 0) {
@@ -220,6 +290,25 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
         goto fail_guest_notifiers;
     }
 
+    if (s->multiqueue) {
+        if (blk_set_multiqueue(s->conf->conf.blk, s->vq_ctx, nvqs,
+                               &local_err) < 0) {
+            warn_reportf_err(local_err, "virtio-blk: processing all "
+                             "virtqueues in one iothread: ");
+            local_err = NULL;
+        } else {
+            vblk->vq_aio_context = s->vq_ctx;
+        }
+    }
+
+    /* The notification BH only runs in one AioContext */
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX) &&
+        !vblk->vq_aio_context) {
+        s->batch_notifications = true;
+    } else {
+        s->batch_notifications = false;
+    }
+
     /* Kick right away to begin processing requests already in vring */
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
@@ -228,14 +317,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = dataplane_vq_ctx(s, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -245,19 +335,23 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     return -ENOSYS;
 }
 
-/* Stop notifications for new requests from guest.
+/* Stop notifications for new requests from guest on the virtqueues that
+ * are processed in the current AioContext.
  *
  * Context: BH in IOThread
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (dataplane_vq_ctx(s, i) == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
     }
 }
 
@@ -284,6 +378,17 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    /* The other iothreads first, their completions take their own lock */
+    for (i = 0; vblk->vq_aio_context && i < nvqs; i++) {
+        AioContext *ctx = s->vq_ctx[i];
+
+        if (ctx != s->ctx && !vq_ctx_seen(s, i, ctx)) {
+            aio_context_acquire(ctx);
+            aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+            aio_context_release(ctx);
+        }
+    }
+
     aio_context_acquire(s->ctx);
     aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
@@ -291,6 +396,11 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
      * keep the BlockBackend in the iothread, that's ok */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context(), NULL);
 
+    if (s->multiqueue) {
+        blk_set_multiqueue(s->conf->conf.blk, NULL, 0, &error_abort);
+        vblk->vq_aio_context = NULL;
+    }
+
     aio_context_release(s->ctx);
 
     for (i = 0; i < nvqs; i++) {
@@ -304,3 +414,46 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     vblk->dataplane_started = false;
     s->stopping = false;
 }
+
+/* Stop processing the virtqueues that do not run in the AioContext of the
+ * BlockBackend, bdrv_drained_begin() takes care of that one.
+ *
+ * Context: QEMU global mutex held
+ */
+void virtio_blk_data_plane_drained_begin(VirtIOBlockDataPlane *s)
+{
+    VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    unsigned i;
+
+    if (!vblk->vq_aio_context || s->external_disabled) {
+        return;
+    }
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        AioContext *ctx = s->vq_ctx[i];
+
+        if (ctx != s->ctx && !vq_ctx_seen(s, i, ctx)) {
+            aio_disable_external(ctx);
+        }
+    }
+    s->external_disabled = true;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_blk_data_plane_drained_end(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->external_disabled) {
+        return;
+    }
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        AioContext *ctx = s->vq_ctx[i];
+
+        if (ctx != s->ctx && !vq_ctx_seen(s, i, ctx)) {
+            aio_enable_external(ctx);
+        }
+    }
+    s->external_disabled = false;
+}
@@ -19,10 +19,16 @@
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>, \
  *              cmb_size_mb=<cmb_size_mb[optional]>, \
- *              num_queues=<N[optional]>
+ *              num_queues=<N[optional]>, \
+ *              len-iothreads=<M[optional]>,iothreads[0]=<iothread_id>,...
  *
  * Note cmb_size_mb denotes size of CMB in MB. CMB is assumed to be at
  * offset 0 in BAR2 and supports only WDS, RDS and SQS for now.
+ *
+ * With iothreads, I/O completion queue i and its submission queues are
+ * processed in iothread (i - 1) % M; the admin queues stay in the main loop.
+ * Submission queue doorbells of such queues become ioeventfds once the
+ * driver has set up shadow doorbells with Doorbell Buffer Config.
  */
 
 #include "qemu/osdep.h"
@@ -36,8 +42,10 @@
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "block/aio-wait.h"
 
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/cutils.h"
 #include "trace.h"
@@ -52,6 +60,47 @@
 
 static void nvme_process_sq(void *opaque);
 
+/* The AioContext that processes completion queue @cqid and its SQs */
+static AioContext *nvme_queue_ctx(NvmeCtrl *n, uint16_t cqid)
+{
+    if (!cqid || !n->num_iothreads) {
+        return qemu_get_aio_context();
+    }
+    return iothread_get_aio_context(n->iothreads[(cqid - 1) %
+                                                 n->num_iothreads]);
+}
+
+static bool nvme_queue_in_iothread(AioContext *ctx)
+{
+    return ctx != qemu_get_aio_context();
+}
+
+static QEMUTimer *nvme_timer_new(AioContext *ctx, QEMUTimerCB *cb,
+                                 void *opaque)
+{
+    if (!nvme_queue_in_iothread(ctx)) {
+        return timer_new_ns(QEMU_CLOCK_VIRTUAL, cb, opaque);
+    }
+    return aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS, cb, opaque);
+}
+
+/*
+ * Run @fn in @ctx and wait for it to finish.  Used to stop timers and
+ * handlers of a queue from the thread that runs them.
+ *
+ * Context: QEMU global mutex held, @ctx not acquired
+ */
+static void nvme_queue_ctx_call(AioContext *ctx, QEMUBHFunc *fn, void *opaque)
+{
+    if (!nvme_queue_in_iothread(ctx)) {
+        fn(opaque);
+        return;
+    }
+    aio_context_acquire(ctx);
+    aio_wait_bh_oneshot(ctx, fn, opaque);
+    aio_context_release(ctx);
+}
+
 static void nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
 {
     if (n->cmbsz && addr >= n->ctrl_mem.addr &&
@@ -125,6 +174,90 @@ static void nvme_irq_assert(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+/* Context: QEMU global mutex held */
+static void nvme_cq_irq_notifier_read(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, irq_notifier);
+    bool pending;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    /* The driver may have consumed everything in the meantime */
+    aio_context_acquire(cq->ctx);
+    pending = cq->tail != cq->head;
+    aio_context_release(cq->ctx);
+    if (pending) {
+        nvme_irq_assert(cq->ctrl, cq);
+    }
+}
+
+/*
+ * MSI-X and INTx need the global mutex, queues processed in an iothread
+ * have the main loop raise their interrupt.
+ */
+static void nvme_cq_raise_irq(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (nvme_queue_in_iothread(cq->ctx)) {
+        event_notifier_set(&cq->irq_notifier);
+    } else {
+        nvme_irq_assert(n, cq);
+    }
+}
+
+static bool nvme_cq_coalescing(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t ic = atomic_read(&n->int_coalescing);
+
+    /* Interrupt coalescing does not apply to the admin completion queue */
+    return cq->cqid && cq->irq_enabled && NVME_INTC_TIME(ic) &&
+           !atomic_read(&n->int_coalescing_disabled[cq->vector]);
+}
+
+/*
+ * Signal @posted new completion queue entries.  With interrupt coalescing
+ * the interrupt is held back until more than the aggregation threshold
+ * entries are pending or the aggregation time has passed.
+ *
+ * Called with cq->ctx acquired.
+ */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, unsigned posted)
+{
+    if (nvme_cq_coalescing(n, cq) && !nvme_cq_full(cq)) {
+        uint32_t ic = atomic_read(&n->int_coalescing);
+
+        if (!posted) {
+            return;
+        }
+        cq->coalesced += posted;
+        if (cq->coalesced <= NVME_INTC_THR(ic)) {
+            if (!timer_pending(cq->coalesce_timer)) {
+                timer_mod(cq->coalesce_timer,
+                          qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                          NVME_INTC_TIME(ic) * 100 * SCALE_US);
+            }
+            return;
+        }
+    }
+
+    cq->coalesced = 0;
+    timer_del(cq->coalesce_timer);
+    nvme_cq_raise_irq(n, cq);
+}
+
+static void nvme_cq_coalesce_timer_cb(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    aio_context_acquire(cq->ctx);
+    cq->coalesced = 0;
+    if (cq->tail != cq->head) {
+        nvme_cq_raise_irq(cq->ctrl, cq);
+    }
+    aio_context_release(cq->ctx);
+}
+
 static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
@@ -273,36 +406,130 @@ static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     return status;
 }
 
+/*
+ * Shadow doorbells.  With Doorbell Buffer Config the driver writes the SQ
+ * tail and CQ head doorbell values to host memory and only rings the MMIO
+ * doorbell when the value passes the EventIdx that the controller publishes
+ * next to it.
+ */
+static uint32_t nvme_dbbuf_read(NvmeCtrl *n, uint64_t addr)
+{
+    uint32_t v;
+
+    pci_dma_read(&n->parent_obj, addr, &v, sizeof(v));
+    return le32_to_cpu(v);
+}
+
+static void nvme_dbbuf_write(NvmeCtrl *n, uint64_t addr, uint32_t v)
+{
+    v = cpu_to_le32(v);
+    pci_dma_write(&n->parent_obj, addr, &v, sizeof(v));
+}
+
+static void nvme_sq_update_tail(NvmeSQueue *sq)
+{
+    uint32_t tail = nvme_dbbuf_read(sq->ctrl, sq->db_addr);
+
+    /* Ignore garbage just like an invalid MMIO doorbell write */
+    if (likely(tail < sq->size)) {
+        sq->tail = tail;
+    }
+}
+
+/*
+ * Ask for a doorbell write on the next submission, unless the queue is being
+ * polled: an EventIdx one behind the tail suppresses doorbell writes until
+ * the driver has gone around the whole queue.
+ */
+static void nvme_sq_update_eventidx(NvmeSQueue *sq)
+{
+    uint32_t ei = sq->tail;
+
+    if (sq->polling) {
+        ei = (sq->tail + sq->size - 1) % sq->size;
+    }
+    nvme_dbbuf_write(sq->ctrl, sq->ei_addr, ei);
+}
+
+static void nvme_cq_update_head(NvmeCQueue *cq)
+{
+    uint32_t head = nvme_dbbuf_read(cq->ctrl, cq->db_addr);
+
+    if (likely(head < cq->size)) {
+        cq->head = head;
+    }
+}
+
+/*
+ * The CQ head is read from the shadow doorbell whenever entries are posted,
+ * so head doorbell writes are only needed to restart a full queue.  INTx
+ * deassertion relies on them too.
+ */
+static void nvme_cq_update_eventidx(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t ei = cq->head;
+
+    if (msix_enabled(&n->parent_obj) &&
+        !(nvme_cq_full(cq) && !QTAILQ_EMPTY(&cq->req_list))) {
+        ei = (cq->head + cq->size - 1) % cq->size;
+    }
+    nvme_dbbuf_write(n, cq->ei_addr, ei);
+}
+
 static void nvme_post_cqes(void *opaque)
 {
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    unsigned posted = 0;
 
-    QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
-        NvmeSQueue *sq;
-        hwaddr addr;
+    aio_context_acquire(cq->ctx);
+    if (cq->db_addr) {
+        nvme_cq_update_head(cq);
+    }
+
+    for (;;) {
+        QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
+            NvmeSQueue *sq;
+            hwaddr addr;
+
+            if (nvme_cq_full(cq)) {
+                break;
+            }
+
+            QTAILQ_REMOVE(&cq->req_list, req, entry);
+            sq = req->sq;
+            req->cqe.status = cpu_to_le16((req->status << 1) | cq->phase);
+            req->cqe.sq_id = cpu_to_le16(sq->sqid);
+            req->cqe.sq_head = cpu_to_le16(sq->head);
+            addr = cq->dma_addr + cq->tail * n->cqe_size;
+            nvme_inc_cq_tail(cq);
+            pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
+                sizeof(req->cqe));
+            QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+            posted++;
+        }
 
-        if (nvme_cq_full(cq)) {
+        if (!cq->db_addr) {
             break;
         }
 
-        QTAILQ_REMOVE(&cq->req_list, req, entry);
-        sq = req->sq;
-        req->cqe.status = cpu_to_le16((req->status << 1) | cq->phase);
-        req->cqe.sq_id = cpu_to_le16(sq->sqid);
-        req->cqe.sq_head = cpu_to_le16(sq->head);
-        addr = cq->dma_addr + cq->tail * n->cqe_size;
-        nvme_inc_cq_tail(cq);
-        pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
-            sizeof(req->cqe));
-        QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        nvme_cq_update_eventidx(n, cq);
+        /* Pairs with the driver's barrier after its shadow doorbell write */
+        smp_mb();
+        nvme_cq_update_head(cq);
+        if (nvme_cq_full(cq) || QTAILQ_EMPTY(&cq->req_list)) {
+            break;
+        }
     }
+
     if (cq->tail != cq->head) {
-        nvme_irq_assert(n, cq);
+        nvme_cq_notify(n, cq, posted);
     }
+    aio_context_release(cq->ctx);
 }
 
+/* Called with req->sq->ctx acquired */
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
 {
     assert(cq->cqid == req->sq->cqid);
@@ -318,6 +545,7 @@ static void nvme_rw_cb(void *opaque, int ret)
     NvmeCtrl *n = sq->ctrl;
     NvmeCQueue *cq = n->cq[sq->cqid];
 
+    aio_context_acquire(sq->ctx);
     if (!ret) {
         block_acct_done(blk_get_stats(n->conf.blk), &req->acct);
         req->status = NVME_SUCCESS;
@@ -329,6 +557,10 @@ static void nvme_rw_cb(void *opaque, int ret)
         qemu_sglist_destroy(&req->qsg);
     }
     nvme_enqueue_req_completion(cq, req);
+    aio_context_release(sq->ctx);
+
+    /* nvme_sq_drain() may be waiting for this request */
+    aio_wait_kick();
 }
 
 static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
@@ -366,6 +598,24 @@ static uint16_t nvme_write_zeros(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     return NVME_NO_COMPLETE;
 }
 
+static BlockAIOCB *nvme_dma_readv(int64_t offset, QEMUIOVector *iov,
+                                  BlockCompletionFunc *cb, void *cb_opaque,
+                                  void *opaque)
+{
+    NvmeCtrl *n = opaque;
+
+    return blk_aio_preadv(n->conf.blk, offset, iov, 0, cb, cb_opaque);
+}
+
+static BlockAIOCB *nvme_dma_writev(int64_t offset, QEMUIOVector *iov,
+                                   BlockCompletionFunc *cb, void *cb_opaque,
+                                   void *opaque)
+{
+    NvmeCtrl *n = opaque;
+
+    return blk_aio_pwritev(n->conf.blk, offset, iov, 0, cb, cb_opaque);
+}
+
 static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
@@ -398,11 +648,14 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     dma_acct_start(n->conf.blk, &req->acct, &req->qsg, acct);
     if (req->qsg.nsg > 0) {
         req->has_sg = true;
+        /* Complete in the queue's AioContext, not in the BlockBackend's */
         req->aiocb = is_write ?
-            dma_blk_write(n->conf.blk, &req->qsg, data_offset, BDRV_SECTOR_SIZE,
-                          nvme_rw_cb, req) :
-            dma_blk_read(n->conf.blk, &req->qsg, data_offset, BDRV_SECTOR_SIZE,
-                         nvme_rw_cb, req);
+            dma_blk_io(req->sq->ctx, &req->qsg, data_offset, BDRV_SECTOR_SIZE,
+                       nvme_dma_writev, n, nvme_rw_cb, req,
+                       DMA_DIRECTION_TO_DEVICE) :
+            dma_blk_io(req->sq->ctx, &req->qsg, data_offset, BDRV_SECTOR_SIZE,
+                       nvme_dma_readv, n, nvme_rw_cb, req,
+                       DMA_DIRECTION_FROM_DEVICE);
     } else {
         req->has_sg = false;
         req->aiocb = is_write ?
@@ -440,10 +693,132 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
+static void nvme_sq_notifier_read(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+static bool nvme_do_process_sq(NvmeSQueue *sq);
+
+static bool nvme_sq_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+    bool progress;
+
+    aio_context_acquire(sq->ctx);
+    progress = nvme_do_process_sq(sq);
+    aio_context_release(sq->ctx);
+    return progress;
+}
+
+static void nvme_sq_poll_begin(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    aio_context_acquire(sq->ctx);
+    sq->polling = true;
+    nvme_sq_update_eventidx(sq);
+    aio_context_release(sq->ctx);
+}
+
+static void nvme_sq_poll_end(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    aio_context_acquire(sq->ctx);
+    sq->polling = false;
+    /* Publishes the EventIdx and catches submissions that raced with it */
+    nvme_do_process_sq(sq);
+    aio_context_release(sq->ctx);
+}
+
+static hwaddr nvme_sq_db_offset(NvmeSQueue *sq)
+{
+    return 0x1000 + (sq->sqid << 3);
+}
+
+/*
+ * An ioeventfd does not carry the value written to the doorbell, so only
+ * queues with a shadow doorbell can use one.  They must also be processed
+ * in an iothread, or there is nothing to gain.  Without KVM, the memory
+ * core signals the ioeventfd itself.
+ *
+ * Context: QEMU global mutex held
+ */
+static void nvme_sq_start_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (sq->ioeventfd || !sq->db_addr || !nvme_queue_in_iothread(sq->ctx)) {
+        return;
+    }
+    if (event_notifier_init(&sq->notifier, 0) < 0) {
+        /* Keep using the MMIO doorbell */
+        return;
+    }
+
+    trace_nvme_sq_ioeventfd(sq->sqid, true);
+    memory_region_add_eventfd(&n->iomem, nvme_sq_db_offset(sq), 4, false, 0,
+                              &sq->notifier);
+    aio_context_acquire(sq->ctx);
+    aio_set_event_notifier(sq->ctx, &sq->notifier, true,
+                           nvme_sq_notifier_read, nvme_sq_poll);
+    aio_set_event_notifier_poll(sq->ctx, &sq->notifier,
+                                nvme_sq_poll_begin, nvme_sq_poll_end);
+    aio_context_release(sq->ctx);
+    sq->ioeventfd = true;
+
+    /* Pick up whatever was submitted before the ioeventfd was in place */
+    event_notifier_set(&sq->notifier);
+}
+
+/* Context: BH in sq->ctx */
+static void nvme_sq_stop_bh(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+
+    if (sq->ioeventfd) {
+        aio_set_event_notifier(sq->ctx, &sq->notifier, true, NULL, NULL);
+    }
+    timer_del(sq->timer);
+}
+
+/*
+ * Stop fetching commands from @sq.  Once the MMIO doorbell, which needs the
+ * global mutex, is the only way left to kick the queue, nothing restarts it.
+ *
+ * Context: QEMU global mutex held
+ */
+static void nvme_sq_stop(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (sq->ioeventfd) {
+        trace_nvme_sq_ioeventfd(sq->sqid, false);
+        memory_region_del_eventfd(&n->iomem, nvme_sq_db_offset(sq), 4, false,
+                                  0, &sq->notifier);
+    }
+    nvme_queue_ctx_call(sq->ctx, nvme_sq_stop_bh, sq);
+    if (sq->ioeventfd) {
+        event_notifier_cleanup(&sq->notifier);
+        sq->ioeventfd = false;
+    }
+}
+
+/*
+ * Wait for the commands in flight on a stopped queue of an iothread.  The
+ * AioContext of the queue must be acquired exactly once.
+ */
+static void nvme_sq_drain(NvmeSQueue *sq)
+{
+    AIO_WAIT_WHILE(sq->ctx, !QTAILQ_EMPTY(&sq->out_req_list));
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
+    /* Deleted in sq->ctx by nvme_sq_stop() */
     timer_free(sq->timer);
     g_free(sq->io_req);
     if (sq->sqid) {
@@ -467,10 +842,17 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
     trace_nvme_del_sq(qid);
 
     sq = n->sq[qid];
-    while (!QTAILQ_EMPTY(&sq->out_req_list)) {
-        req = QTAILQ_FIRST(&sq->out_req_list);
-        assert(req->aiocb);
-        blk_aio_cancel(req->aiocb);
+    nvme_sq_stop(n, sq);
+    aio_context_acquire(sq->ctx);
+    if (nvme_queue_in_iothread(sq->ctx)) {
+        /* Cancelling would have to happen in the iothread, just wait */
+        nvme_sq_drain(sq);
+    } else {
+        while (!QTAILQ_EMPTY(&sq->out_req_list)) {
+            req = QTAILQ_FIRST(&sq->out_req_list);
+            assert(req->aiocb);
+            blk_aio_cancel(req->aiocb);
+        }
     }
     if (!nvme_check_cqid(n, sq->cqid)) {
         cq = n->cq[sq->cqid];
@@ -484,22 +866,40 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
             }
         }
     }
+    aio_context_release(sq->ctx);
 
     nvme_free_sq(sq, n);
     return NVME_SUCCESS;
 }
 
+static void nvme_sq_enable_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    aio_context_acquire(sq->ctx);
+    /* Submission queue tail doorbell y is at 2y * doorbell stride */
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    nvme_dbbuf_write(n, sq->db_addr, sq->tail);
+    nvme_dbbuf_write(n, sq->ei_addr, sq->tail);
+    aio_context_release(sq->ctx);
+
+    nvme_sq_start_ioeventfd(n, sq);
+}
+
 static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     uint16_t sqid, uint16_t cqid, uint16_t size)
 {
     int i;
     NvmeCQueue *cq;
 
+    assert(n->cq[cqid]);
+    cq = n->cq[cqid];
+
     sq->ctrl = n;
     sq->dma_addr = dma_addr;
     sq->sqid = sqid;
     sq->size = size;
     sq->cqid = cqid;
+    sq->ctx = cq->ctx;
     sq->head = sq->tail = 0;
     sq->io_req = g_new(NvmeRequest, sq->size);
 
@@ -509,12 +909,15 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->timer = nvme_timer_new(sq->ctx, nvme_process_sq, sq);
 
-    assert(n->cq[cqid]);
-    cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    /* The admin queues keep using MMIO doorbells */
+    if (sqid && n->dbbuf_enabled) {
+        nvme_sq_enable_dbbuf(n, sq);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -555,17 +958,43 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
+/* Context: BH in cq->ctx */
+static void nvme_cq_stop_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    timer_del(cq->timer);
+    timer_del(cq->coalesce_timer);
+}
+
+/* All submission queues of @cq must have been stopped */
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
+    nvme_queue_ctx_call(cq->ctx, nvme_cq_stop_bh, cq);
     timer_free(cq->timer);
+    timer_free(cq->coalesce_timer);
+    if (nvme_queue_in_iothread(cq->ctx)) {
+        event_notifier_set_handler(&cq->irq_notifier, NULL);
+        event_notifier_cleanup(&cq->irq_notifier);
+    }
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
     }
 }
 
+static void nvme_cq_enable_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    aio_context_acquire(cq->ctx);
+    /* Completion queue head doorbell y is at (2y + 1) * doorbell stride */
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    nvme_dbbuf_write(n, cq->db_addr, cq->head);
+    nvme_dbbuf_write(n, cq->ei_addr, cq->head);
+    aio_context_release(cq->ctx);
+}
+
 static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeCmd *cmd)
 {
     NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
@@ -592,6 +1021,7 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     uint16_t cqid, uint16_t vector, uint16_t size, uint16_t irq_enabled)
 {
     cq->ctrl = n;
+    cq->ctx = nvme_queue_ctx(n, cqid);
     cq->cqid = cqid;
     cq->size = size;
     cq->dma_addr = dma_addr;
@@ -602,8 +1032,19 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
+    if (nvme_queue_in_iothread(cq->ctx)) {
+        event_notifier_init(&cq->irq_notifier, 0);
+        event_notifier_set_handler(&cq->irq_notifier,
+                                   nvme_cq_irq_notifier_read);
+    }
+    cq->timer = nvme_timer_new(cq->ctx, nvme_post_cqes, cq);
+    cq->coalesce_timer = nvme_timer_new(cq->ctx, nvme_cq_coalesce_timer_cb,
+                                        cq);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+
+    if (cqid && n->dbbuf_enabled) {
+        nvme_cq_enable_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -789,6 +1230,25 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     case NVME_TIMESTAMP:
         return nvme_get_feature_timestamp(n, cmd);
         break;
+    case NVME_INTERRUPT_COALESCING:
+        result = cpu_to_le32(atomic_read(&n->int_coalescing));
+        trace_nvme_getfeat_int_coalescing(result);
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF: {
+        uint32_t iv = NVME_INTVC_IV(le32_to_cpu(cmd->cdw11));
+
+        if (unlikely(iv > n->num_queues)) {
+            trace_nvme_err_invalid_int_vector(iv);
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        result = iv;
+        if (atomic_read(&n->int_coalescing_disabled[iv])) {
+            result |= 1 << 16;
+        }
+        result = cpu_to_le32(result);
+        trace_nvme_getfeat_int_vector_conf(result);
+        break;
+    }
     default:
         trace_nvme_err_invalid_getfeat(dw10);
         return NVME_INVALID_FIELD | NVME_DNR;
@@ -837,6 +1297,23 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature_timestamp(n, cmd);
         break;
 
+    case NVME_INTERRUPT_COALESCING:
+        trace_nvme_setfeat_int_coalescing(NVME_INTC_THR(dw11),
+                                          NVME_INTC_TIME(dw11));
+        atomic_set(&n->int_coalescing, dw11 & 0xffff);
+        break;
+
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if (unlikely(NVME_INTVC_IV(dw11) > n->num_queues)) {
+            trace_nvme_err_invalid_int_vector(NVME_INTVC_IV(dw11));
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        trace_nvme_setfeat_int_vector_conf(NVME_INTVC_IV(dw11),
+                                           NVME_INTVC_CD(dw11));
+        atomic_set(&n->int_coalescing_disabled[NVME_INTVC_IV(dw11)],
+                   NVME_INTVC_CD(dw11));
+        break;
+
     default:
         trace_nvme_err_invalid_setfeat(dw10);
         return NVME_INVALID_FIELD | NVME_DNR;
@@ -844,6 +1321,35 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (unlikely(!dbs_addr || dbs_addr & (n->page_size - 1) ||
+                 !eis_addr || eis_addr & (n->page_size - 1))) {
+        trace_nvme_err_invalid_dbbuf_config(dbs_addr, eis_addr);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    trace_nvme_dbbuf_config(dbs_addr, eis_addr);
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /* Like Linux, leave the admin queues on MMIO doorbells */
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->cq[i]) {
+            nvme_cq_enable_dbbuf(n, n->cq[i]);
+        }
+        if (n->sq[i]) {
+            nvme_sq_enable_dbbuf(n, n->sq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -861,51 +1367,100 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         trace_nvme_err_invalid_admin_opc(cmd->opcode);
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
 }
 
-static void nvme_process_sq(void *opaque)
+/*
+ * Fetch and start commands until the queue is empty.  Called with sq->ctx
+ * acquired, returns true if any command was fetched.
+ */
+static bool nvme_do_process_sq(NvmeSQueue *sq)
 {
-    NvmeSQueue *sq = opaque;
     NvmeCtrl *n = sq->ctrl;
     NvmeCQueue *cq = n->cq[sq->cqid];
+    bool progress = false;
 
     uint16_t status;
     hwaddr addr;
     NvmeCmd cmd;
     NvmeRequest *req;
 
-    while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
-        addr = sq->dma_addr + sq->head * n->sqe_size;
-        nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
-        nvme_inc_sq_head(sq);
-
-        req = QTAILQ_FIRST(&sq->req_list);
-        QTAILQ_REMOVE(&sq->req_list, req, entry);
-        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
-        memset(&req->cqe, 0, sizeof(req->cqe));
-        req->cqe.cid = cmd.cid;
-
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
-        if (status != NVME_NO_COMPLETE) {
-            req->status = status;
-            nvme_enqueue_req_completion(cq, req);
+    if (sq->db_addr) {
+        nvme_sq_update_tail(sq);
+    }
+
+    for (;;) {
+        while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
+            addr = sq->dma_addr + sq->head * n->sqe_size;
+            nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
+            nvme_inc_sq_head(sq);
+
+            req = QTAILQ_FIRST(&sq->req_list);
+            QTAILQ_REMOVE(&sq->req_list, req, entry);
+            QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+            memset(&req->cqe, 0, sizeof(req->cqe));
+            req->cqe.cid = cmd.cid;
+
+            status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
+                nvme_admin_cmd(n, &cmd, req);
+            if (status != NVME_NO_COMPLETE) {
+                req->status = status;
+                nvme_enqueue_req_completion(cq, req);
+            }
+            progress = true;
+        }
+
+        if (!sq->db_addr) {
+            break;
+        }
+
+        nvme_sq_update_eventidx(sq);
+        /* Pairs with the driver's barrier after its shadow doorbell write */
+        smp_mb();
+        nvme_sq_update_tail(sq);
+        if (nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list)) {
+            break;
         }
     }
+    return progress;
+}
+
+static void nvme_process_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+
+    aio_context_acquire(sq->ctx);
+    nvme_do_process_sq(sq);
+    aio_context_release(sq->ctx);
 }
 
 static void nvme_clear_ctrl(NvmeCtrl *n)
 {
+    AioContext *ctx = blk_get_aio_context(n->conf.blk);
     int i;
 
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->sq[i] != NULL) {
+            nvme_sq_stop(n, n->sq[i]);
+        }
+    }
+
+    aio_context_acquire(ctx);
     blk_drain(n->conf.blk);
+    aio_context_release(ctx);
 
     for (i = 0; i < n->num_queues; i++) {
         if (n->sq[i] != NULL) {
+            if (nvme_queue_in_iothread(n->sq[i]->ctx)) {
+                aio_context_acquire(n->sq[i]->ctx);
+                nvme_sq_drain(n->sq[i]);
+                aio_context_release(n->sq[i]->ctx);
+            }
             nvme_free_sq(n->sq[i], n);
         }
     }
@@ -915,7 +1470,16 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
         }
     }
 
+    n->dbbuf_enabled = false;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+    atomic_set(&n->int_coalescing, 0);
+    for (i = 0; i <= n->num_queues; i++) {
+        atomic_set(&n->int_coalescing_disabled[i], false);
+    }
+
+    aio_context_acquire(ctx);
     blk_flush(n->conf.blk);
+    aio_context_release(ctx);
     n->bar.cc = 0;
 }
 
@@ -1216,6 +1780,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
+        aio_context_acquire(cq->ctx);
         start_sqs = nvme_cq_full(cq) ? 1 : 0;
         cq->head = new_head;
         if (start_sqs) {
@@ -1229,6 +1794,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         if (cq->tail == cq->head) {
             nvme_irq_deassert(n, cq);
         }
+        aio_context_release(cq->ctx);
     } else {
         /* Submission queue doorbell write */
 
@@ -1254,8 +1820,10 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
+        aio_context_acquire(sq->ctx);
         sq->tail = new_tail;
         timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        aio_context_release(sq->ctx);
     }
 }
 
@@ -1303,6 +1871,122 @@ static const MemoryRegionOps nvme_cmb_ops = {
     },
 };
 
+/*
+ * Stop the submission queues that are not processed in the AioContext of the
+ * BlockBackend, bdrv_drained_begin() takes care of that one.
+ *
+ * Context: QEMU global mutex held
+ */
+static void nvme_drained_begin(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    AioContext *ctx = blk_get_aio_context(n->conf.blk);
+    int i;
+
+    for (i = 0; i < n->num_iothreads; i++) {
+        AioContext *iothread_ctx = iothread_get_aio_context(n->iothreads[i]);
+
+        if (iothread_ctx != ctx) {
+            aio_disable_external(iothread_ctx);
+        }
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void nvme_drained_end(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    AioContext *ctx = blk_get_aio_context(n->conf.blk);
+    int i;
+
+    for (i = 0; i < n->num_iothreads; i++) {
+        AioContext *iothread_ctx = iothread_get_aio_context(n->iothreads[i]);
+
+        if (iothread_ctx != ctx) {
+            aio_enable_external(iothread_ctx);
+        }
+    }
+}
+
+static const BlockDevOps nvme_block_ops = {
+    .drained_begin = nvme_drained_begin,
+    .drained_end = nvme_drained_end,
+};
+
+static void nvme_put_iothreads(NvmeCtrl *n)
+{
+    int i;
+
+    for (i = 0; i < n->num_iothreads; i++) {
+        if (n->iothreads[i]) {
+            object_unref(OBJECT(n->iothreads[i]));
+        }
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
+}
+
+static bool nvme_init_iothreads(NvmeCtrl *n, Error **errp)
+{
+    AioContext *old_ctx = blk_get_aio_context(n->conf.blk);
+    AioContext *ctx, **ctxs;
+    int i, ret;
+
+    if (!n->num_iothreads) {
+        return true;
+    }
+    if (n->num_iothreads > n->num_queues - 1) {
+        error_setg(errp, "iothreads must not have more elements than "
+                   "there are I/O queues (%u)", n->num_queues - 1);
+        return false;
+    }
+
+    n->iothreads = g_new0(IOThread *, n->num_iothreads);
+    for (i = 0; i < n->num_iothreads; i++) {
+        IOThread *iothread = iothread_by_id(n->iothread_ids[i]);
+
+        if (!iothread) {
+            error_setg(errp, "iothread '%s' not found", n->iothread_ids[i]);
+            nvme_put_iothreads(n);
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+        n->iothreads[i] = iothread;
+    }
+
+    /*
+     * The BlockBackend lives in the first iothread and accepts requests
+     * from all of them.
+     */
+    aio_context_acquire(old_ctx);
+    if (blk_set_aio_context(n->conf.blk,
+                            iothread_get_aio_context(n->iothreads[0]),
+                            errp) < 0) {
+        aio_context_release(old_ctx);
+        nvme_put_iothreads(n);
+        return false;
+    }
+    aio_context_release(old_ctx);
+
+    ctxs = g_new(AioContext *, n->num_iothreads);
+    for (i = 0; i < n->num_iothreads; i++) {
+        ctxs[i] = iothread_get_aio_context(n->iothreads[i]);
+    }
+    ret = blk_set_multiqueue(n->conf.blk, ctxs, n->num_iothreads, errp);
+    g_free(ctxs);
+    if (ret < 0) {
+        ctx = blk_get_aio_context(n->conf.blk);
+        aio_context_acquire(ctx);
+        blk_set_aio_context(n->conf.blk, old_ctx, NULL);
+        aio_context_release(ctx);
+        nvme_put_iothreads(n);
+        return false;
+    }
+
+    blk_set_dev_ops(n->conf.blk, &nvme_block_ops, n);
+    return true;
+}
+
 static void nvme_realize(PCIDevice *pci_dev, Error **errp)
 {
     NvmeCtrl *n = NVME(pci_dev);
@@ -1337,6 +2021,9 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
                                        false, errp)) {
         return;
     }
+    if (!nvme_init_iothreads(n, errp)) {
+        return;
+    }
 
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
@@ -1351,6 +2038,8 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
     n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
+    /* Create I/O Completion Queue accepts vectors up to num_queues */
+    n->int_coalescing_disabled = g_new0(bool, n->num_queues + 1);
 
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
@@ -1368,7 +2057,7 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -1441,6 +2130,18 @@ static void nvme_exit(PCIDevice *pci_dev)
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
+    g_free(n->int_coalescing_disabled);
+
+    if (n->num_iothreads) {
+        AioContext *ctx = blk_get_aio_context(n->conf.blk);
+
+        blk_set_dev_ops(n->conf.blk, NULL, NULL);
+        aio_context_acquire(ctx);
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context(), NULL);
+        blk_set_multiqueue(n->conf.blk, NULL, 0, &error_abort);
+        aio_context_release(ctx);
+        nvme_put_iothreads(n);
+    }
 
     if (n->cmb_size_mb) {
         g_free(n->cmbuf);
@@ -1453,6 +2154,8 @@ static Property nvme_props[] = {
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
     DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, cmb_size_mb, 0),
     DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_ARRAY("iothreads", NvmeCtrl, num_iothreads, iothread_ids,
+                      qdev_prop_string, char *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1,6 +1,7 @@
 #ifndef HW_NVME_H
 #define HW_NVME_H
 #include "block/nvme.h"
+#include "sysemu/iothread.h"
 
 typedef struct NvmeAsyncEvent {
     QSIMPLEQ_ENTRY(NvmeAsyncEvent) entry;
@@ -32,6 +33,16 @@ typedef struct NvmeSQueue {
     QTAILQ_HEAD(, NvmeRequest) req_list;
     QTAILQ_HEAD(, NvmeRequest) out_req_list;
     QTAILQ_ENTRY(NvmeSQueue) entry;
+
+    /* The AioContext of the completion queue, see nvme_queue_ctx() */
+    AioContext  *ctx;
+    /* Shadow doorbell and EventIdx entries, 0 until Doorbell Buffer Config */
+    uint64_t    db_addr;
+    uint64_t    ei_addr;
+    /* Doorbell ioeventfd, see nvme_sq_start_ioeventfd() */
+    EventNotifier notifier;
+    bool        ioeventfd;
+    bool        polling;        /* doorbell writes suppressed while polling */
 } NvmeSQueue;
 
 typedef struct NvmeCQueue {
@@ -47,6 +58,15 @@ typedef struct NvmeCQueue {
     QEMUTimer   *timer;
     QTAILQ_HEAD(, NvmeSQueue) sq_list;
     QTAILQ_HEAD(, NvmeRequest) req_list;
+
+    AioContext  *ctx;
+    uint64_t    db_addr;
+    uint64_t    ei_addr;
+    /* Interrupts of queues served by an iothread are raised in the main loop */
+    EventNotifier irq_notifier;
+    /* Interrupt coalescing, see nvme_cq_notify() */
+    uint32_t    coalesced;
+    QEMUTimer   *coalesce_timer;
 } NvmeCQueue;
 
 typedef struct NvmeNamespace {
@@ -82,6 +102,19 @@ typedef struct NvmeCtrl {
     uint64_t    host_timestamp;                 /* Timestamp sent by the host */
     uint64_t    timestamp_set_qemu_clock_ms;    /* QEMU clock time */
 
+    /* Doorbell Buffer Config */
+    uint64_t    dbbuf_dbs;
+    uint64_t    dbbuf_eis;
+    bool        dbbuf_enabled;
+
+    uint32_t    int_coalescing;                 /* Interrupt Coalescing */
+    bool        *int_coalescing_disabled;       /* per vector, CD bit */
+
+    /* I/O completion queue i is served by iothread (i - 1) % num_iothreads */
+    uint32_t    num_iothreads;
+    char        **iothread_ids;
+    IOThread    **iothreads;
+
     char            *serial;
     NvmeNamespace   *namespaces;
     NvmeSQueue      **sq;
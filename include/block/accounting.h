@@ -27,7 +27,9 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-builtin-types.h"
+#include "qapi/qapi-types-block-core.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 typedef struct BlockAcctStats BlockAcctStats;
@@ -97,6 +99,42 @@ typedef struct BlockAcctCookie {
     enum BlockAcctType type;
 } BlockAcctCookie;
 
+/*
+ * HDR-style latency histogram with BLOCK_LATENCY_HDR_SUB_COUNT linear
+ * buckets per power of two nanoseconds, so that any recorded latency is
+ * known to within 1/BLOCK_LATENCY_HDR_SUB_COUNT of its value.  Latencies of
+ * 2^BLOCK_LATENCY_HDR_MAX_BITS ns (about 69 seconds) and more share the
+ * last bucket.  Recording is lock-free.
+ */
+#define BLOCK_LATENCY_HDR_SUB_BITS      4
+#define BLOCK_LATENCY_HDR_SUB_COUNT     (1 << BLOCK_LATENCY_HDR_SUB_BITS)
+#define BLOCK_LATENCY_HDR_MAX_BITS      36
+#define BLOCK_LATENCY_HDR_BUCKETS \
+    ((BLOCK_LATENCY_HDR_MAX_BITS - BLOCK_LATENCY_HDR_SUB_BITS + 1) * \
+     BLOCK_LATENCY_HDR_SUB_COUNT)
+
+typedef struct BlockLatencyHdr {
+    Stat64 max;
+    Stat64 buckets[BLOCK_LATENCY_HDR_BUCKETS];
+} BlockLatencyHdr;
+
+typedef struct BlockNodeLatencyOpStats {
+    BlockLatencyHdr queue;      /* until the node starts processing */
+    BlockLatencyHdr driver;     /* from then until completion */
+} BlockNodeLatencyOpStats;
+
+/* Always-on latency statistics of a BlockDriverState */
+typedef struct BlockNodeLatencyStats {
+    /* Allocated when the first request of a type completes */
+    BlockNodeLatencyOpStats *ops[BLOCK_NODE_LATENCY_OP__MAX];
+} BlockNodeLatencyStats;
+
+typedef struct BlockNodeLatencyCookie {
+    BlockNodeLatencyOp op;
+    int64_t start_time_ns;
+    int64_t dispatch_time_ns;
+} BlockNodeLatencyCookie;
+
 void block_acct_init(BlockAcctStats *stats);
 void block_acct_setup(BlockAcctStats *stats, bool account_invalid,
                      bool account_failed);
@@ -118,4 +156,14 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
 
+void block_node_latency_start(BlockNodeLatencyCookie *cookie,
+                              BlockNodeLatencyOp op);
+void block_node_latency_dispatch(BlockNodeLatencyCookie *cookie);
+void block_node_latency_done(BlockNodeLatencyStats *lat,
+                             BlockNodeLatencyCookie *cookie);
+void block_node_latency_cleanup(BlockNodeLatencyStats *lat);
+uint64_t block_latency_hdr_count(BlockLatencyHdr *hdr);
+uint64_t block_latency_hdr_percentile(BlockLatencyHdr *hdr, uint64_t count,
+                                      double fraction);
+
 #endif
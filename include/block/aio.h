@@ -46,9 +46,28 @@ typedef void QEMUBHFunc(void *opaque);
 typedef bool AioPollFn(void *opaque);
 typedef void IOHandler(void *opaque);
 
+/*
+ * Wake-to-event latency histogram of a poll handler.  Bin i counts latencies
+ * below AIO_POLL_HISTOGRAM_MIN_NS << i, the last bin counts everything else.
+ */
+#define AIO_POLL_HISTOGRAM_BINS     16
+#define AIO_POLL_HISTOGRAM_MIN_NS   1024
+
+/* Adaptive polling statistics of an AioHandler with an io_poll() callback */
+typedef struct AioPollHandlerStats {
+    int fd;
+    int64_t poll_ns;        /* current polling window in nanoseconds */
+    uint64_t events;        /* number of events seen by aio_poll() */
+    uint64_t poll_hits;     /* number of events found by busy polling */
+    uint64_t histogram[AIO_POLL_HISTOGRAM_BINS];
+} AioPollHandlerStats;
+
 struct Coroutine;
 struct ThreadPool;
 struct LinuxAioState;
+struct LuringState;
+struct FDMonOps;
+struct FDMonIoUring;
 
 struct AioContext {
     GSource source;
@@ -122,6 +141,13 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
      * locking.
@@ -134,10 +160,12 @@ struct AioContext {
     int poll_disable_cnt;
 
     /* Polling mode parameters */
-    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_ns;        /* current polling time in nanoseconds, this is
+                             * the largest window of the poll handlers */
     int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
+    uint64_t poll_time_ns;  /* total time spent busy polling */
 
     /* Are we in polling mode or monitoring file descriptors? */
     bool poll_started;
@@ -146,6 +174,14 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* File descriptor monitoring implementation, see util/aio-posix.h */
+    const struct FDMonOps *fdmon_ops;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring(7) state used by util/fdmon-io_uring.c */
+    struct FDMonIoUring *fdmon_io_uring;
+#endif
 };
 
 /**
@@ -386,6 +422,12 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Setup the LuringState bound to this AioContext */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+
+/* Return the LuringState bound to this AioContext */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -549,6 +591,15 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_co_schedule(AioContext *ctx, struct Coroutine *co);
 
+/**
+ * aio_co_reschedule_self:
+ * @new_ctx: the new context
+ *
+ * Move the currently running coroutine to new_ctx. If the coroutine is already
+ * running in new_ctx, do nothing.
+ */
+void coroutine_fn aio_co_reschedule_self(AioContext *new_ctx);
+
 /**
  * aio_co_wake:
  * @co: the coroutine
@@ -609,6 +660,25 @@ void aio_context_setup(AioContext *ctx);
  */
 void aio_context_destroy(AioContext *ctx);
 
+/**
+ * aio_context_disable_io_uring:
+ * @ctx: the aio context
+ *
+ * Monitor file descriptors with epoll(7) or ppoll(2) even if io_uring(7) is
+ * available.  Must be called before @ctx is used by another thread.
+ */
+void aio_context_disable_io_uring(AioContext *ctx);
+
+/**
+ * aio_context_use_g_source:
+ * @ctx: the aio context
+ *
+ * Used by the glib main loop to notify the AioContext that it is dispatched
+ * through its GSource.  File descriptor monitoring implementations that only
+ * work with aio_poll() are disabled.
+ */
+void aio_context_use_g_source(AioContext *ctx);
+
 /**
  * aio_context_set_poll_params:
  * @ctx: the aio context
@@ -622,4 +692,18 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_get_poll_stats:
+ * @ctx: the aio context
+ * @stats: filled with a newly allocated array, free with g_free()
+ *
+ * Collect the adaptive polling statistics of the handlers that support
+ * polling.  The statistics are updated without atomics, so this must be
+ * called from the thread that runs @ctx, for example from a BH scheduled
+ * with aio_wait_bh_oneshot().
+ *
+ * Returns: the number of elements in @stats
+ */
+int aio_context_get_poll_stats(AioContext *ctx, AioPollHandlerStats **stats);
+
 #endif
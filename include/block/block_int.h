@@ -57,6 +57,8 @@
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_COMPRESSION_LEVEL "compression_level"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -82,6 +84,8 @@ typedef struct BdrvTrackedRequest {
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
+
+    BlockNodeLatencyCookie latency;
 } BdrvTrackedRequest;
 
 struct BlockDriver {
@@ -119,6 +123,14 @@ struct BlockDriver {
     /* Set if a driver can support backing files */
     bool supports_backing;
 
+    /*
+     * Set if the driver can process requests from several AioContexts at
+     * the same time without holding the AioContext lock of the node, see
+     * blk_set_multiqueue().  Every node below a multiqueue BlockBackend must
+     * set it.
+     */
+    bool supports_multiqueue;
+
     /* For handling image reopen for split or non-split files */
     int (*bdrv_reopen_prepare)(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp);
@@ -442,7 +454,19 @@ struct BlockDriver {
     void (*bdrv_attach_aio_context)(BlockDriverState *bs,
                                     AioContext *new_context);
 
-    /* io queue for linux-aio */
+    /*
+     * Prepare to process requests submitted from @ctx, in addition to the
+     * AioContext of @bs.  Only called for drivers that set
+     * supports_multiqueue.
+     */
+    int (*bdrv_prepare_multiqueue)(BlockDriverState *bs, AioContext *ctx,
+                                   Error **errp);
+
+    /*
+     * io queue for linux-aio.  Calls can be nested, and with a multiqueue
+     * BlockBackend they are made from the AioContext that submits the
+     * requests, which need not be the one of @bs.
+     */
     void (*bdrv_io_plug)(BlockDriverState *bs);
     void (*bdrv_io_unplug)(BlockDriverState *bs);
 
@@ -882,7 +906,8 @@ struct BlockDriverState {
     unsigned int in_flight;
     unsigned int serialising_in_flight;
 
-    /* counter for nested bdrv_io_plug.
+    /* counter for nested bdrv_io_plug, the driver callbacks count their
+     * own nesting per AioContext.
      * Accessed with atomic ops.
     */
     unsigned io_plugged;
@@ -907,6 +932,9 @@ struct BlockDriverState {
 
     /* BdrvChild links to this node may never be frozen */
     bool never_freeze;
+
+    /* Per-operation latency distributions, reported by query-blockstats */
+    BlockNodeLatencyStats latency;
 };
 
 struct BlockBackendRootState {
@@ -1158,6 +1186,11 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is 'bitmap' or 'incremental'
  * @bitmap_mode: The bitmap synchronization policy to use.
+ * @compress: Whether to write compressed data to @target.
+ * @cbw_buffer_size: How much old data guest writes may leave to be copied to
+ *                   @target in the background, or 0 to copy it synchronously.
+ * @cbw_workers: Number of coroutines writing that data to @target.
+ * @cbw_buffer: Node to keep that data in instead of memory (may be NULL).
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @creation_flags: Flags that control the behavior of the Job lifetime.
@@ -1175,6 +1208,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                             BdrvDirtyBitmap *sync_bitmap,
                             BitmapSyncMode bitmap_mode,
                             bool compress,
+                            int64_t cbw_buffer_size, int cbw_workers,
+                            BlockDriverState *cbw_buffer,
                             BlockdevOnError on_source_error,
                             BlockdevOnError on_target_error,
                             int creation_flags,
@@ -0,0 +1,68 @@
+/*
+ * Request sizing and hot region deferral for the mirror block job
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef BLOCK_MIRROR_POLICY_H
+#define BLOCK_MIRROR_POLICY_H
+
+#include "qemu/timer.h"
+#include "block/dirty-bitmap.h"
+
+/* Request size adaptation, see mirror_io_sizer_complete() */
+#define MIRROR_MIN_IO_BYTES (1 << 16)
+#define MIRROR_ADAPT_INTERVAL_NS (100 * SCALE_MS)
+#define MIRROR_ADAPT_MIN_OPS 8
+#define MIRROR_ADAPT_PROBE_INTERVALS 10
+#define MIRROR_LATENCY_TARGET_NS (100 * SCALE_MS)
+
+/* Deferral of hot regions, see mirror_heat_next_dirty() */
+#define MIRROR_HEAT_REGION_SIZE (1 << 20)
+#define MIRROR_HEAT_HOT 4
+#define MIRROR_HEAT_MAX_SKIPS 16
+#define MIRROR_HEAT_DECAY_NS NANOSECONDS_PER_SECOND
+
+typedef struct MirrorIOSizer {
+    /* Current request size limit, adapted to the target's performance */
+    int64_t io_bytes;
+    int64_t min_io_bytes;
+    int64_t cap_io_bytes;
+    int64_t granularity;
+
+    int dir;                    /* 1 growing, -1 shrinking, 0 holding */
+    int hold;                   /* intervals since the last probe */
+    int64_t start_ns;
+    uint64_t bytes;
+    uint64_t latency_ns;
+    int ops;
+    uint64_t last_bps;
+} MirrorIOSizer;
+
+typedef struct MirrorHeatMap {
+    /* Number of guest writes per MIRROR_HEAT_REGION_SIZE region, decaying */
+    uint8_t *heat;
+    int64_t nb_regions;
+    int64_t decay_ns;
+    /* Whether the current pass over the dirty bitmap copies hot regions */
+    bool copy_hot;
+} MirrorHeatMap;
+
+void mirror_io_sizer_init(MirrorIOSizer *z, int64_t io_bytes,
+                          int64_t cap_io_bytes, int64_t granularity,
+                          int64_t now);
+void mirror_io_sizer_complete(MirrorIOSizer *z, uint64_t bytes,
+                              int64_t latency_ns, int64_t now);
+
+void mirror_heat_map_init(MirrorHeatMap *h, int64_t length, int64_t now);
+void mirror_heat_map_cleanup(MirrorHeatMap *h);
+void mirror_heat_map_note_write(MirrorHeatMap *h, uint64_t offset,
+                                uint64_t bytes);
+bool mirror_heat_map_is_hot(MirrorHeatMap *h, int64_t offset);
+void mirror_heat_map_new_pass(MirrorHeatMap *h, int64_t now);
+int64_t mirror_heat_next_dirty(MirrorHeatMap *h, BdrvDirtyBitmapIter *dbi,
+                               int64_t length);
+
+#endif
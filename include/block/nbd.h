@@ -329,6 +329,8 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
                           const char *bitmap, uint16_t nbdflags,
                           void (*close)(NBDExport *), bool writethrough,
                           BlockBackend *on_eject_blk, Error **errp);
+void nbd_export_set_client_contexts(NBDExport *exp, AioContext **ctx,
+                                    int nb_ctx);
 void nbd_export_close(NBDExport *exp);
 void nbd_export_remove(NBDExport *exp, NbdServerRemoveMode mode, Error **errp);
 void nbd_export_get(NBDExport *exp);
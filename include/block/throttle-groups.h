@@ -28,6 +28,11 @@
 #include "qemu/throttle.h"
 #include "block/block_int.h"
 
+#define THROTTLE_GROUP_DEFAULT_WEIGHT   100
+#define THROTTLE_GROUP_MAX_WEIGHT       10000
+
+typedef struct ThrottleGroupShare ThrottleGroupShare;
+
 /* The ThrottleGroupMember structure indicates membership in a ThrottleGroup
  * and holds related data.
  */
@@ -56,6 +61,15 @@ typedef struct ThrottleGroupMember {
     unsigned       pending_reqs[2];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /* Proportional share of the group, see throttle_group_set_weight().
+     * vtime is the weighted amount of I/O that the member was granted.
+     */
+    unsigned int   weight;
+    uint64_t       vtime[2];
+
+    /* Credit of the member's AioContext, only changes while drained */
+    ThrottleGroupShare *share;
+
 } ThrottleGroupMember;
 
 #define TYPE_THROTTLE_GROUP "throttle-group"
@@ -68,6 +82,8 @@ void throttle_group_unref(ThrottleState *ts);
 
 void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg);
 void throttle_group_get_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg);
+void throttle_group_set_weight(ThrottleGroupMember *tgm, unsigned int weight);
+unsigned int throttle_group_get_weight(ThrottleGroupMember *tgm);
 
 void throttle_group_register_tgm(ThrottleGroupMember *tgm,
                                 const char *groupname,
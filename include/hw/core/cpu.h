@@ -443,6 +443,13 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle percentage of this vcpu, 0 if it is not throttled */
+    int throttle_percentage;
+    /*
+     * Pages that this vcpu dirtied since migration last looked, only
+     * counted by TCG
+     */
+    uint32_t dirty_pages;
 
     bool ignore_memory_transaction_failures;
 
@@ -829,6 +836,16 @@ CPUState *cpu_by_arch_id(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vCPU to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 0 to 99.
+ *
+ * Like cpu_throttle_set, but only for @cpu; the other vcpus keep their
+ * throttle percentage.  0 lets @cpu run freely.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
 /**
  * cpu_throttle_stop:
  *
@@ -847,6 +864,8 @@ bool cpu_throttle_active(void);
  * cpu_throttle_get_percentage:
  *
  * Returns the vcpu throttle percentage. See cpu_throttle_set for details.
+ * When the vcpus are throttled by different amounts, this is the highest
+ * of their throttle percentages.
  *
  * Returns: The throttle percentage in range 1 to 99.
  */
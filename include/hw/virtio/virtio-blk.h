@@ -34,6 +34,8 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    uint32_t num_iothreads;
+    char **iothread_ids;    /* virtqueue i is served by iothread i % n */
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -49,6 +51,7 @@ typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
     void *rq;
+    QemuMutex rq_lock;      /* protects rq while requests are in flight */
     QEMUBH *bh;
     VirtIOBlkConf conf;
     unsigned short sector_mask;
@@ -57,6 +60,7 @@ typedef struct VirtIOBlock {
     bool dataplane_disabled;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+    AioContext **vq_aio_context; /* per virtqueue, set by multiqueue dataplane */
     uint64_t host_features;
     size_t config_size;
 } VirtIOBlock;
@@ -386,5 +386,13 @@ static inline size_t hbitmap_iter_next_word(HBitmapIter *hbi, unsigned long *p_c
     return hbi->pos;
 }
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Disable the currently selected accelerated kernels and switch to the
+ * next best ones.  Returns false once the generic kernels are in use.
+ * Only for use by unit tests.
+ */
+bool test_hbitmap_next_accel(void);
 
 #endif
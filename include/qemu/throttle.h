@@ -151,6 +151,8 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              bool is_write);
 
+void throttle_account_units(ThrottleState *ts, bool is_write, double units,
+                            double size);
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
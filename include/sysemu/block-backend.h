@@ -105,6 +105,10 @@ void blk_get_perm(BlockBackend *blk, uint64_t *perm, uint64_t *shared_perm);
 void blk_set_allow_write_beyond_eof(BlockBackend *blk, bool allow);
 void blk_set_allow_aio_context_change(BlockBackend *blk, bool allow);
 void blk_set_disable_request_queuing(BlockBackend *blk, bool disable);
+int blk_set_multiqueue(BlockBackend *blk, AioContext *const *ctxs, int n,
+                       Error **errp);
+bool blk_get_multiqueue(BlockBackend *blk);
+void blk_set_request_merging(BlockBackend *blk, bool enable, int64_t window_ns);
 void blk_iostatus_enable(BlockBackend *blk);
 bool blk_iostatus_is_enabled(const BlockBackend *blk);
 BlockDeviceIoStatus blk_iostatus(const BlockBackend *blk);
@@ -37,6 +37,8 @@ typedef struct {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    bool io_uring;              /* monitor fds with io_uring if available */
 } IOThread;
 
 #define IOTHREAD(obj) \
@@ -16,6 +16,7 @@
 #include "qom/object_interfaces.h"
 #include "qemu/module.h"
 #include "block/aio.h"
+#include "block/aio-wait.h"
 #include "block/block.h"
 #include "sysemu/iothread.h"
 #include "qapi/error.h"
@@ -79,6 +80,7 @@ static void *iothread_run(void *opaque)
          * changed in previous aio_poll()
          */
         if (iothread->running && atomic_read(&iothread->run_gcontext)) {
+            aio_context_use_g_source(iothread->ctx);
             g_main_loop_run(iothread->main_loop);
         }
     }
@@ -115,6 +117,7 @@ static void iothread_instance_init(Object *obj)
     IOThread *iothread = IOTHREAD(obj);
 
     iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->io_uring = true;
     iothread->thread_id = -1;
     qemu_sem_init(&iothread->init_done_sem, 0);
     /* By default, we don't run gcontext */
@@ -175,6 +178,10 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    if (!iothread->io_uring) {
+        aio_context_disable_io_uring(iothread->ctx);
+    }
+
     /*
      * Init one GMainContext for the iothread unconditionally, even if
      * it's not used
@@ -268,6 +275,26 @@ out:
     error_propagate(errp, local_err);
 }
 
+static bool iothread_get_io_uring(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return iothread->io_uring;
+}
+
+static void iothread_set_io_uring(Object *obj, bool value, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->ctx) {
+        error_setg(errp, "io-uring cannot be changed once the iothread is "
+                   "running");
+        return;
+    }
+
+    iothread->io_uring = value;
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -285,6 +312,9 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add_bool(klass, "io-uring",
+                                   iothread_get_io_uring,
+                                   iothread_set_io_uring, &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -317,24 +347,93 @@ AioContext *iothread_get_aio_context(IOThread *iothread)
     return iothread->ctx;
 }
 
+/*
+ * The polling statistics are updated by the IOThread without atomics, so
+ * take a snapshot from its own thread.
+ */
+typedef struct {
+    AioContext *ctx;
+    int64_t poll_ns;
+    uint64_t poll_time_ns;
+    AioPollHandlerStats *stats;
+    int n;
+} IOThreadPollSnapshot;
+
+static void iothread_poll_snapshot_bh(void *opaque)
+{
+    IOThreadPollSnapshot *snap = opaque;
+
+    snap->poll_ns = snap->ctx->poll_ns;
+    snap->poll_time_ns = snap->ctx->poll_time_ns;
+    snap->n = aio_context_get_poll_stats(snap->ctx, &snap->stats);
+}
+
+static IOThreadPollHandlerInfoList *
+query_poll_handlers(AioPollHandlerStats *stats, int n)
+{
+    IOThreadPollHandlerInfoList *head = NULL, **prev = &head;
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        IOThreadPollHandlerInfo *info = g_new0(IOThreadPollHandlerInfo, 1);
+        IOThreadPollHandlerInfoList *elem;
+        uint64List **boundary = &info->boundaries;
+        uint64List **bin = &info->bins;
+
+        info->fd = stats[i].fd;
+        info->poll_ns = stats[i].poll_ns;
+        info->events = stats[i].events;
+        info->poll_hits = stats[i].poll_hits;
+
+        for (j = 0; j < AIO_POLL_HISTOGRAM_BINS; j++) {
+            if (j < AIO_POLL_HISTOGRAM_BINS - 1) {
+                *boundary = g_new0(uint64List, 1);
+                (*boundary)->value = (uint64_t)AIO_POLL_HISTOGRAM_MIN_NS << j;
+                boundary = &(*boundary)->next;
+            }
+
+            *bin = g_new0(uint64List, 1);
+            (*bin)->value = stats[i].histogram[j];
+            bin = &(*bin)->next;
+        }
+
+        elem = g_new0(IOThreadPollHandlerInfoList, 1);
+        elem->value = info;
+        *prev = elem;
+        prev = &elem->next;
+    }
+
+    return head;
+}
+
 static int query_one_iothread(Object *object, void *opaque)
 {
     IOThreadInfoList ***prev = opaque;
     IOThreadInfoList *elem;
     IOThreadInfo *info;
     IOThread *iothread;
+    IOThreadPollSnapshot snap = {};
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
         return 0;
     }
 
+    snap.ctx = iothread->ctx;
+    aio_context_acquire(iothread->ctx);
+    aio_wait_bh_oneshot(iothread->ctx, iothread_poll_snapshot_bh, &snap);
+    aio_context_release(iothread->ctx);
+
     info = g_new0(IOThreadInfo, 1);
     info->id = iothread_get_id(iothread);
     info->thread_id = iothread->thread_id;
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->poll_ns = snap.poll_ns;
+    info->poll_time_ns = snap.poll_time_ns;
+    info->poll_handlers = query_poll_handlers(snap.stats, snap.n);
+    g_free(snap.stats);
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
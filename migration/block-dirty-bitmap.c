@@ -53,6 +53,17 @@
  * [ be64: buffer size  ] \ ! (flags & ZEROES)
  * [ n bytes: buffer    ] /
  *
+ * # Data chunk of bitmap migration as dirty extents (flags & EXTENTS), only
+ * # sent with the dirty-bitmaps-extents capability
+ * header
+ * be64: start sector
+ * be32: number of sectors
+ * be32: number of extents
+ * n times:
+ *   be64: offset of a dirty area in bytes
+ *   be64: length of the dirty area in bytes
+ * All bits in the chunk outside of these areas are clean.
+ *
  * The last chunk in stream should contain flags & EOS. The chunk may skip
  * device and/or bitmap names, assuming them to be the same with the previous
  * chunk.
@@ -95,6 +106,12 @@
 
 #define DIRTY_BITMAP_MIG_EXTRA_FLAGS        0x80
 
+/* Flags in the second byte */
+#define DIRTY_BITMAP_MIG_FLAG_EXTENTS       0x0100
+
+/* Limit for the size of an extents chunk, like CHUNK_SIZE for raw bits */
+#define MAX_EXTENTS_PER_CHUNK (1 << 10)
+
 #define DIRTY_BITMAP_MIG_START_FLAG_ENABLED          0x01
 #define DIRTY_BITMAP_MIG_START_FLAG_PERSISTENT       0x02
 /* 0x04 was "AUTOLOAD" flags on elder versions, no it is ignored */
@@ -151,11 +168,13 @@ void init_dirty_bitmap_incoming_migration(void)
 
 static uint32_t qemu_get_bitmap_flags(QEMUFile *f)
 {
-    uint8_t flags = qemu_get_byte(f);
+    uint32_t flags = qemu_get_byte(f);
     if (flags & DIRTY_BITMAP_MIG_EXTRA_FLAGS) {
-        flags = flags << 8 | qemu_get_byte(f);
+        flags = (flags & ~DIRTY_BITMAP_MIG_EXTRA_FLAGS) << 8 |
+                qemu_get_byte(f);
         if (flags & DIRTY_BITMAP_MIG_EXTRA_FLAGS) {
-            flags = flags << 16 | qemu_get_be16(f);
+            flags = (flags & ~DIRTY_BITMAP_MIG_EXTRA_FLAGS) << 16 |
+                    qemu_get_be16(f);
         }
     }
 
@@ -164,9 +183,12 @@ static uint32_t qemu_get_bitmap_flags(QEMUFile *f)
 
 static void qemu_put_bitmap_flags(QEMUFile *f, uint32_t flags)
 {
-    /* The code currently do not send flags more than one byte */
-    assert(!(flags & (0xffffff00 | DIRTY_BITMAP_MIG_EXTRA_FLAGS)));
+    /* The code currently do not send flags more than two bytes */
+    assert(!(flags & (0xffff8000 | DIRTY_BITMAP_MIG_EXTRA_FLAGS)));
 
+    if (flags & 0xff00) {
+        qemu_put_byte(f, (flags >> 8) | DIRTY_BITMAP_MIG_EXTRA_FLAGS);
+    }
     qemu_put_byte(f, flags);
 }
 
@@ -254,6 +276,79 @@ static void send_bitmap_bits(QEMUFile *f, DirtyBitmapMigBitmapState *dbms,
     g_free(buf);
 }
 
+/*
+ * Send the dirty areas from dbms->cur_sector on as a list of extents.  The
+ * search uses the upper HBitmap levels, so clean areas cost nothing, and
+ * one chunk can cover up to 2 TiB.  Where the bitmap is fragmented enough
+ * that the raw bits are smaller, one chunk of raw bits is sent instead.
+ *
+ * Returns the number of sectors covered.
+ */
+static uint64_t send_bitmap_extents(QEMUFile *f,
+                                    DirtyBitmapMigBitmapState *dbms)
+{
+    BdrvDirtyBitmap *bitmap = dbms->bitmap;
+    uint64_t align = bdrv_dirty_bitmap_serialization_align(bitmap);
+    uint64_t start = dbms->cur_sector << BDRV_SECTOR_BITS;
+    uint64_t end = MIN(dbms->total_sectors << BDRV_SECTOR_BITS,
+                       start + QEMU_ALIGN_DOWN((uint64_t)UINT32_MAX <<
+                                               BDRV_SECTOR_BITS, align));
+    uint64_t *extents = g_new(uint64_t, 2 * MAX_EXTENTS_PER_CHUNK);
+    uint64_t offset = start, bytes;
+    uint32_t nb_extents = 0, i;
+
+    assert(QEMU_IS_ALIGNED(start, align));
+
+    while (nb_extents < MAX_EXTENTS_PER_CHUNK && offset < end) {
+        bytes = end - offset;
+        if (!bdrv_dirty_bitmap_next_dirty_area(bitmap, &offset, &bytes)) {
+            break;
+        }
+        extents[2 * nb_extents] = offset;
+        extents[2 * nb_extents + 1] = bytes;
+        nb_extents++;
+        offset += bytes;
+    }
+
+    if (nb_extents == MAX_EXTENTS_PER_CHUNK && offset < end) {
+        /* There is more; end the chunk where the receiver can continue */
+        end = QEMU_ALIGN_DOWN(offset, align);
+        assert(end > start);
+        while (nb_extents && extents[2 * (nb_extents - 1)] >= end) {
+            nb_extents--;
+        }
+        if (nb_extents) {
+            i = nb_extents - 1;
+            extents[2 * i + 1] = MIN(extents[2 * i + 1], end - extents[2 * i]);
+        }
+    }
+
+    if (nb_extents * 2 * sizeof(uint64_t) >
+        bdrv_dirty_bitmap_serialization_size(bitmap, start, end - start)) {
+        uint32_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
+                                  dbms->sectors_per_chunk);
+
+        g_free(extents);
+        send_bitmap_bits(f, dbms, dbms->cur_sector, nr_sectors);
+        return nr_sectors;
+    }
+
+    trace_send_bitmap_extents(dbms->cur_sector,
+                              (end - start) >> BDRV_SECTOR_BITS, nb_extents);
+
+    send_bitmap_header(f, dbms, DIRTY_BITMAP_MIG_FLAG_EXTENTS);
+    qemu_put_be64(f, dbms->cur_sector);
+    qemu_put_be32(f, (end - start) >> BDRV_SECTOR_BITS);
+    qemu_put_be32(f, nb_extents);
+    for (i = 0; i < nb_extents; i++) {
+        qemu_put_be64(f, extents[2 * i]);
+        qemu_put_be64(f, extents[2 * i + 1]);
+    }
+
+    g_free(extents);
+    return (end - start) >> BDRV_SECTOR_BITS;
+}
+
 /* Called with iothread lock taken.  */
 static void dirty_bitmap_mig_cleanup(void)
 {
@@ -344,10 +439,15 @@ fail:
 /* Called with no lock taken.  */
 static void bulk_phase_send_chunk(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
 {
-    uint32_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
-                             dbms->sectors_per_chunk);
+    uint64_t nr_sectors;
 
-    send_bitmap_bits(f, dbms, dbms->cur_sector, nr_sectors);
+    if (migrate_dirty_bitmaps_extents()) {
+        nr_sectors = send_bitmap_extents(f, dbms);
+    } else {
+        nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
+                         dbms->sectors_per_chunk);
+        send_bitmap_bits(f, dbms, dbms->cur_sector, nr_sectors);
+    }
 
     dbms->cur_sector += nr_sectors;
     if (dbms->cur_sector >= dbms->total_sectors) {
@@ -601,6 +701,46 @@ static int dirty_bitmap_load_bits(QEMUFile *f, DirtyBitmapLoadState *s)
     return 0;
 }
 
+static int dirty_bitmap_load_extents(QEMUFile *f, DirtyBitmapLoadState *s)
+{
+    uint64_t first_byte = qemu_get_be64(f) << BDRV_SECTOR_BITS;
+    uint64_t nr_bytes = (uint64_t)qemu_get_be32(f) << BDRV_SECTOR_BITS;
+    uint32_t nb_extents = qemu_get_be32(f);
+    uint64_t size = bdrv_dirty_bitmap_size(s->bitmap);
+    uint64_t align = bdrv_dirty_bitmap_serialization_align(s->bitmap);
+    uint32_t i;
+
+    trace_dirty_bitmap_load_extents(first_byte >> BDRV_SECTOR_BITS,
+                                    nr_bytes >> BDRV_SECTOR_BITS, nb_extents);
+
+    if (!QEMU_IS_ALIGNED(first_byte, align) || first_byte >= size ||
+        nr_bytes > size - first_byte ||
+        (!QEMU_IS_ALIGNED(nr_bytes, align) && first_byte + nr_bytes != size) ||
+        nb_extents > MAX_EXTENTS_PER_CHUNK) {
+        error_report("Invalid extents chunk for dirty bitmap '%s'",
+                     bdrv_dirty_bitmap_name(s->bitmap));
+        return -EINVAL;
+    }
+
+    bdrv_dirty_bitmap_deserialize_zeroes(s->bitmap, first_byte, nr_bytes,
+                                         false);
+
+    for (i = 0; i < nb_extents; i++) {
+        uint64_t offset = qemu_get_be64(f);
+        uint64_t bytes = qemu_get_be64(f);
+
+        if (offset < first_byte || offset >= first_byte + nr_bytes ||
+            !bytes || bytes > first_byte + nr_bytes - offset) {
+            error_report("Dirty extent out of range for dirty bitmap '%s'",
+                         bdrv_dirty_bitmap_name(s->bitmap));
+            return -EINVAL;
+        }
+        bdrv_set_dirty_bitmap(s->bitmap, offset, bytes);
+    }
+
+    return 0;
+}
+
 static int dirty_bitmap_load_header(QEMUFile *f, DirtyBitmapLoadState *s)
 {
     Error *local_err = NULL;
@@ -671,6 +811,8 @@ static int dirty_bitmap_load(QEMUFile *f, void *opaque, int version_id)
             dirty_bitmap_load_complete(f, &s);
         } else if (s.flags & DIRTY_BITMAP_MIG_FLAG_BITS) {
             ret = dirty_bitmap_load_bits(f, &s);
+        } else if (s.flags & DIRTY_BITMAP_MIG_FLAG_EXTENTS) {
+            ret = dirty_bitmap_load_extents(f, &s);
         }
 
         if (!ret) {
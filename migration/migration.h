@@ -289,12 +289,19 @@ bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
+bool migrate_dirty_bitmaps_extents(void);
 bool migrate_ignore_shared(void);
 
 bool migrate_auto_converge(void);
+bool migrate_per_vcpu_throttle(void);
 bool migrate_use_multifd(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
+MultiFDCompression migrate_multifd_compression(void);
+int migrate_multifd_zlib_level(void);
+int migrate_multifd_zstd_level(void);
+ZeroPageDetection migrate_zero_page_detection(void);
+int migrate_dirty_sync_threads(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -35,8 +35,10 @@
 #include "qemu/main-loop.h"
 #include "qemu/pmem.h"
 #include "xbzrle.h"
+#include "vcpu-throttle.h"
 #include "ram.h"
 #include "migration.h"
+#include "multifd.h"
 #include "socket.h"
 #include "migration/register.h"
 #include "migration/misc.h"
@@ -578,129 +580,68 @@ exit:
 
 /* Multiple fd's */
 
-#define MULTIFD_MAGIC 0x11223344U
-#define MULTIFD_VERSION 1
+/* Multifd without compression */
 
-#define MULTIFD_FLAG_SYNC (1 << 0)
+static int nocomp_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    return 0;
+}
 
-/* This value needs to be a multiple of qemu_target_page_size() */
-#define MULTIFD_PACKET_SIZE (512 * 1024)
+static void nocomp_send_cleanup(MultiFDSendParams *p)
+{
+}
 
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    unsigned char uuid[16]; /* QemuUUID */
-    uint8_t id;
-    uint8_t unused1[7];     /* Reserved for future use */
-    uint64_t unused2[4];    /* Reserved for future use */
-} __attribute__((packed)) MultiFDInit_t;
+static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    p->next_packet_size = used * qemu_target_page_size();
+    return 0;
+}
 
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t flags;
-    /* maximum number of allocated pages */
-    uint32_t pages_alloc;
-    uint32_t pages_used;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
-    char ramblock[256];
-    uint64_t offset[];
-} __attribute__((packed)) MultiFDPacket_t;
+static int nocomp_send_write(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+}
 
-typedef struct {
-    /* number of used pages */
-    uint32_t used;
-    /* number of allocated pages */
-    uint32_t allocated;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* offset of each page */
-    ram_addr_t *offset;
-    /* pointer to each page */
-    struct iovec *iov;
-    RAMBlock *block;
-} MultiFDPages_t;
+static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    return 0;
+}
 
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* sem where to wait for more work */
-    QemuSemaphore sem;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* should this thread finish */
-    bool quit;
-    /* thread has work to do */
-    int pending_job;
-    /* array of pages to sent */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-    /* syncs main thread and channels */
-    QemuSemaphore sem_sync;
-}  MultiFDSendParams;
+static void nocomp_recv_cleanup(MultiFDRecvParams *p)
+{
+}
 
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* should this thread finish */
-    bool quit;
-    /* array of pages to receive */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-    /* syncs main thread and channels */
-    QemuSemaphore sem_sync;
-} MultiFDRecvParams;
+static int nocomp_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                             Error **errp)
+{
+    if (p->next_packet_size != used * qemu_target_page_size()) {
+        error_setg(errp, "multifd %d: received packet size %u "
+                   "and expected %zu", p->id, p->next_packet_size,
+                   used * qemu_target_page_size());
+        return -1;
+    }
+    return qio_channel_readv_all(p->c, p->pages->iov, used, errp);
+}
+
+static MultiFDMethods multifd_nocomp_ops = {
+    .send_setup = nocomp_send_setup,
+    .send_cleanup = nocomp_send_cleanup,
+    .send_prepare = nocomp_send_prepare,
+    .send_write = nocomp_send_write,
+    .recv_setup = nocomp_recv_setup,
+    .recv_cleanup = nocomp_recv_cleanup,
+    .recv_pages = nocomp_recv_pages,
+};
+
+static MultiFDMethods *multifd_ops[MULTIFD_COMPRESSION__MAX] = {
+    [MULTIFD_COMPRESSION_NONE] = &multifd_nocomp_ops,
+    [MULTIFD_COMPRESSION_ZLIB] = &multifd_zlib_ops,
+#ifdef CONFIG_ZSTD
+    [MULTIFD_COMPRESSION_ZSTD] = &multifd_zstd_ops,
+#endif
+};
 
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
@@ -788,7 +729,19 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     g_free(pages);
 }
 
-static void multifd_send_fill_packet(MultiFDSendParams *p)
+/*
+ * multifd_send_fill_packet: fill the header of the next packet
+ *
+ * Runs in the channel thread without the channel mutex, so the flags
+ * and the packet number come from the snapshot taken under the mutex.
+ *
+ * @p: channel that sends the packet
+ * @flags: multifd flags of the packet
+ * @packet_num: global number of the packet
+ * @used: number of pages in p->pages, zero pages included
+ */
+static void multifd_send_fill_packet(MultiFDSendParams *p, uint32_t flags,
+                                     uint64_t packet_num, uint32_t used)
 {
     MultiFDPacket_t *packet = p->packet;
     uint32_t page_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
@@ -796,17 +749,19 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
     packet->magic = cpu_to_be32(MULTIFD_MAGIC);
     packet->version = cpu_to_be32(MULTIFD_VERSION);
-    packet->flags = cpu_to_be32(p->flags);
+    packet->flags = cpu_to_be32(flags | (migrate_multifd_compression() <<
+                                         MULTIFD_FLAG_COMPRESSION_SHIFT));
     packet->pages_alloc = cpu_to_be32(page_max);
-    packet->pages_used = cpu_to_be32(p->pages->used);
+    packet->pages_used = cpu_to_be32(p->normal_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
-    packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->packet_num = cpu_to_be64(packet_num);
+    packet->zero_pages = cpu_to_be32(used - p->normal_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < used; i++) {
         packet->offset[i] = cpu_to_be64(p->pages->offset[i]);
     }
 }
@@ -815,7 +770,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
 {
     MultiFDPacket_t *packet = p->packet;
     uint32_t pages_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
-    RAMBlock *block;
+    RAMBlock *block = NULL;
     int i;
 
     packet->magic = be32_to_cpu(packet->magic);
@@ -835,6 +790,15 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     p->flags = be32_to_cpu(packet->flags);
+    if ((p->flags & MULTIFD_FLAG_COMPRESSION_MASK) >>
+        MULTIFD_FLAG_COMPRESSION_SHIFT != migrate_multifd_compression()) {
+        error_setg(errp, "multifd: received packet "
+                   "compressed with method %d and expected method %d",
+                   (p->flags & MULTIFD_FLAG_COMPRESSION_MASK) >>
+                   MULTIFD_FLAG_COMPRESSION_SHIFT,
+                   migrate_multifd_compression());
+        return -1;
+    }
 
     packet->pages_alloc = be32_to_cpu(packet->pages_alloc);
     /*
@@ -856,13 +820,23 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->pages = multifd_pages_init(packet->pages_alloc);
     }
 
-    p->pages->used = be32_to_cpu(packet->pages_used);
-    if (p->pages->used > packet->pages_alloc) {
+    p->normal_num = be32_to_cpu(packet->pages_used);
+    packet->zero_pages = be32_to_cpu(packet->zero_pages);
+    if ((uint64_t)p->normal_num + packet->zero_pages > packet->pages_alloc) {
         error_setg(errp, "multifd: received packet "
-                   "with %d pages and expected maximum pages are %d",
-                   p->pages->used, packet->pages_alloc) ;
+                   "with %d pages and %d zero pages and expected maximum "
+                   "pages are %d", p->normal_num, packet->zero_pages,
+                   packet->pages_alloc);
+        return -1;
+    }
+    if (packet->zero_pages &&
+        migrate_zero_page_detection() != ZERO_PAGE_DETECTION_MULTIFD) {
+        error_setg(errp, "multifd: received packet with %d zero pages "
+                   "but zero-page-detection is not multifd",
+                   packet->zero_pages);
         return -1;
     }
+    p->pages->used = p->normal_num + packet->zero_pages;
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
@@ -878,6 +852,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         }
     }
 
+    p->pages->block = block;
     for (i = 0; i < p->pages->used; i++) {
         ram_addr_t offset = be64_to_cpu(packet->offset[i]);
 
@@ -887,6 +862,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
+        p->pages->offset[i] = offset;
         p->pages->iov[i].iov_base = block->host + offset;
         p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
     }
@@ -898,6 +874,10 @@ struct {
     MultiFDSendParams *params;
     /* array of pages to sent */
     MultiFDPages_t *pages;
+    /* compression methods */
+    MultiFDMethods *ops;
+    /* whether the channels look for zero pages */
+    bool zero_page;
     /* global number of generated multifd packets */
     uint64_t packet_num;
     /* send channels ready */
@@ -922,13 +902,34 @@ struct {
  * false.
  */
 
+/*
+ * multifd_send_collect_savings: account for data the channel did not send
+ *
+ * Pages are accounted as normal pages of full size when they are queued.
+ * Collect the zero pages and the bytes that the channel saved since the
+ * last call, and return the number of bytes to take back from the
+ * transfer accounting.  Called with p->mutex held.
+ *
+ * @p: channel to look at
+ */
+static int64_t multifd_send_collect_savings(MultiFDSendParams *p)
+{
+    int64_t saved = p->bytes_saved;
+
+    ram_counters.duplicate += p->zero_pages_found;
+    ram_counters.normal -= p->zero_pages_found;
+    p->zero_pages_found = 0;
+    p->bytes_saved = 0;
+    return saved;
+}
+
 static int multifd_send_pages(RAMState *rs)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
+    int64_t transferred;
 
     qemu_sem_wait(&multifd_send_state->channels_ready);
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
@@ -953,7 +954,13 @@ static int multifd_send_pages(RAMState *rs)
     p->pages->block = NULL;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
+    /*
+     * Rate limiting needs the size before the channel thread gets to
+     * compress the pages and skip the zero ones; take back what it saved
+     * on the previous packet of this channel.
+     */
     transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
+    transferred -= multifd_send_collect_savings(p);
     qemu_file_update_transfer(rs->f, transferred);
     ram_counters.multifd_bytes += transferred;
     ram_counters.transferred += transferred;;
@@ -1037,6 +1044,7 @@ void multifd_save_cleanup(void)
         }
         socket_send_channel_destroy(p->c);
         p->c = NULL;
+        multifd_send_state->ops->send_cleanup(p);
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
         qemu_sem_destroy(&p->sem_sync);
@@ -1059,6 +1067,7 @@ void multifd_save_cleanup(void)
 
 static void multifd_send_sync_main(RAMState *rs)
 {
+    int64_t transferred;
     int i;
 
     if (!migrate_use_multifd()) {
@@ -1086,9 +1095,10 @@ static void multifd_send_sync_main(RAMState *rs)
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
         p->pending_job++;
-        qemu_file_update_transfer(rs->f, p->packet_len);
-        ram_counters.multifd_bytes += p->packet_len;
-        ram_counters.transferred += p->packet_len;
+        transferred = p->packet_len - multifd_send_collect_savings(p);
+        qemu_file_update_transfer(rs->f, transferred);
+        ram_counters.multifd_bytes += transferred;
+        ram_counters.transferred += transferred;
         qemu_mutex_unlock(&p->mutex);
         qemu_sem_post(&p->sem);
     }
@@ -1101,6 +1111,47 @@ static void multifd_send_sync_main(RAMState *rs)
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/*
+ * multifd_send_zero_page_detect: move the zero pages to the end
+ *
+ * Reorder the first @used pages of the channel so that the pages that
+ * have to be sent come first, followed by the zero pages that are only
+ * listed in the packet, and set p->normal_num.
+ *
+ * @p: channel that sends the pages
+ * @used: number of pages in p->pages
+ */
+static void multifd_send_zero_page_detect(MultiFDSendParams *p, uint32_t used)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i = 0;
+    uint32_t j = used;
+
+    if (!multifd_send_state->zero_page) {
+        p->normal_num = used;
+        return;
+    }
+
+    while (i < j) {
+        ram_addr_t offset;
+        struct iovec iov;
+
+        if (!buffer_is_zero(pages->iov[i].iov_base, pages->iov[i].iov_len)) {
+            i++;
+            continue;
+        }
+
+        j--;
+        offset = pages->offset[i];
+        pages->offset[i] = pages->offset[j];
+        pages->offset[j] = offset;
+        iov = pages->iov[i];
+        pages->iov[i] = pages->iov[j];
+        pages->iov[j] = iov;
+    }
+    p->normal_num = i;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -1126,15 +1177,30 @@ static void *multifd_send_thread(void *opaque)
             uint64_t packet_num = p->packet_num;
             flags = p->flags;
 
-            p->next_packet_size = used * qemu_target_page_size();
-            multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
             p->pages->used = 0;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
+            /*
+             * The pages belong to this channel until pending_job goes
+             * back to zero, so they can be scanned and compressed without
+             * the lock while the migration thread fills the other channels.
+             */
+            multifd_send_zero_page_detect(p, used);
+            p->next_packet_size = 0;
+            if (p->normal_num) {
+                ret = multifd_send_state->ops->send_prepare(p, p->normal_num,
+                                                            &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
+            multifd_send_fill_packet(p, flags, packet_num, used);
+
+            trace_multifd_send(p->id, packet_num, p->normal_num,
+                               used - p->normal_num, flags,
                                p->next_packet_size);
 
             ret = qio_channel_write_all(p->c, (void *)p->packet,
@@ -1143,15 +1209,18 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
-            if (used) {
-                ret = qio_channel_writev_all(p->c, p->pages->iov,
-                                             used, &local_err);
+            if (p->normal_num) {
+                ret = multifd_send_state->ops->send_write(p, p->normal_num,
+                                                          &local_err);
                 if (ret != 0) {
                     break;
                 }
             }
 
             qemu_mutex_lock(&p->mutex);
+            p->bytes_saved += (int64_t)used * qemu_target_page_size() -
+                              p->next_packet_size;
+            p->zero_pages_found += used - p->normal_num;
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
 
@@ -1228,6 +1297,9 @@ int multifd_save_setup(void)
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_send_state->zero_page =
+        migrate_zero_page_detection() == ZERO_PAGE_DETECTION_MULTIFD;
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1243,6 +1315,26 @@ int multifd_save_setup(void)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdsend_%d", i);
+    }
+
+    /*
+     * Set up compression for all channels before connecting any of them:
+     * if it fails, multifd_save_cleanup() frees the params, and no
+     * connection may still be in flight at that point.
+     */
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        Error *local_err = NULL;
+
+        if (multifd_send_state->ops->send_setup(p, &local_err) < 0) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
     return 0;
@@ -1252,6 +1344,10 @@ struct {
     MultiFDRecvParams *params;
     /* number of created threads */
     int count;
+    /* compression methods */
+    MultiFDMethods *ops;
+    /* whether the packets can list zero pages */
+    bool zero_page;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
@@ -1311,6 +1407,7 @@ int multifd_load_cleanup(Error **errp)
         }
         object_unref(OBJECT(p->c));
         p->c = NULL;
+        multifd_recv_state->ops->recv_cleanup(p);
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem_sync);
         g_free(p->name);
@@ -1357,6 +1454,36 @@ static void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/*
+ * multifd_recv_zero_pages: handle the zero pages of a packet
+ *
+ * Pages that were never received are still zero from the allocation of
+ * guest RAM; leave them alone so that they are not faulted in.  Pages
+ * that were received before are only cleared if they are not zero yet.
+ *
+ * @p: channel that received the packet
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i;
+
+    for (i = 0; i < p->normal_num; i++) {
+        ramblock_recv_bitmap_set(pages->block, pages->iov[i].iov_base);
+    }
+
+    for (i = p->normal_num; i < pages->used; i++) {
+        void *page = pages->iov[i].iov_base;
+
+        if (!ramblock_recv_bitmap_test_byte_offset(pages->block,
+                                                   pages->offset[i])) {
+            ramblock_recv_bitmap_set(pages->block, page);
+        } else if (!buffer_is_zero(page, TARGET_PAGE_SIZE)) {
+            memset(page, 0, TARGET_PAGE_SIZE);
+        }
+    }
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1392,19 +1519,23 @@ static void *multifd_recv_thread(void *opaque)
 
         used = p->pages->used;
         flags = p->flags;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, p->normal_num,
+                           used - p->normal_num, flags,
                            p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
         qemu_mutex_unlock(&p->mutex);
 
-        if (used) {
-            ret = qio_channel_readv_all(p->c, p->pages->iov,
-                                        used, &local_err);
+        if (p->normal_num) {
+            ret = multifd_recv_state->ops->recv_pages(p, p->normal_num,
+                                                      &local_err);
             if (ret != 0) {
                 break;
             }
         }
+        if (multifd_recv_state->zero_page) {
+            multifd_recv_zero_pages(p);
+        }
 
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
@@ -1439,9 +1570,13 @@ int multifd_load_setup(void)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     atomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_recv_state->zero_page =
+        migrate_zero_page_detection() == ZERO_PAGE_DETECTION_MULTIFD;
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
+        Error *local_err = NULL;
 
         qemu_mutex_init(&p->mutex);
         qemu_sem_init(&p->sem_sync, 0);
@@ -1452,6 +1587,10 @@ int multifd_load_setup(void)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
+        if (multifd_recv_state->ops->recv_setup(p, &local_err) < 0) {
+            error_report_err(local_err);
+            return -1;
+        }
     }
     return 0;
 }
@@ -1544,6 +1683,73 @@ static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
     return size;
 }
 
+/**
+ * mig_throttle_vcpus: throttle down the vcpus that dirty memory fastest
+ *
+ * Split the dirty rate between the vcpus according to the pages each of
+ * them dirtied, and throttle down the fastest ones as computed by
+ * vcpu_throttle_compute().
+ *
+ * Returns false, without changing anything, if the accelerator does not
+ * count the pages dirtied by each vcpu.
+ *
+ * @dirty_bytes: bytes dirtied in the last period
+ * @target_bytes: bytes the guest may dirty in a period
+ */
+static bool mig_throttle_vcpus(uint64_t dirty_bytes, uint64_t target_bytes)
+{
+    MigrationState *s = migrate_get_current();
+    CPUState **cpus;
+    double *rates;
+    int *pcts;
+    uint64_t total_pages = 0;
+    CPUState *cpu;
+    int nr_vcpus = 0;
+    int i;
+
+    CPU_FOREACH(cpu) {
+        nr_vcpus++;
+    }
+    cpus = g_new(CPUState *, nr_vcpus);
+    rates = g_new(double, nr_vcpus);
+
+    i = 0;
+    CPU_FOREACH(cpu) {
+        uint32_t pages = atomic_xchg(&cpu->dirty_pages, 0);
+
+        cpus[i] = cpu;
+        rates[i] = pages;
+        total_pages += pages;
+        i++;
+    }
+    if (!total_pages) {
+        g_free(cpus);
+        g_free(rates);
+        return false;
+    }
+
+    /* What each vcpu would have dirtied if it had not been throttled */
+    for (i = 0; i < nr_vcpus; i++) {
+        double pct = atomic_read(&cpus[i]->throttle_percentage) / 100.0;
+
+        rates[i] = rates[i] * dirty_bytes / total_pages / (1 - pct);
+    }
+
+    pcts = g_new(int, nr_vcpus);
+    vcpu_throttle_compute(rates, pcts, nr_vcpus, target_bytes,
+                          s->parameters.max_cpu_throttle);
+    for (i = 0; i < nr_vcpus; i++) {
+        trace_migration_throttle_vcpu(cpus[i]->cpu_index, (uint64_t)rates[i],
+                                      pcts[i]);
+        cpu_throttle_set_vcpu(cpus[i], pcts[i]);
+    }
+
+    g_free(cpus);
+    g_free(rates);
+    g_free(pcts);
+    return true;
+}
+
 /**
  * mig_throttle_guest_down: throotle down the guest
  *
@@ -1552,14 +1758,23 @@ static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
  * which we can transfer pages to the destination then we should be
  * able to complete migration. Some workloads dirty memory way too
  * fast and will not effectively converge, even with auto-converge.
+ *
+ * @dirty_bytes: bytes dirtied in the last period
+ * @target_bytes: bytes the guest may dirty in a period
  */
-static void mig_throttle_guest_down(void)
+static void mig_throttle_guest_down(uint64_t dirty_bytes,
+                                    uint64_t target_bytes)
 {
     MigrationState *s = migrate_get_current();
     uint64_t pct_initial = s->parameters.cpu_throttle_initial;
     uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
     int pct_max = s->parameters.max_cpu_throttle;
 
+    if (migrate_per_vcpu_throttle() &&
+        mig_throttle_vcpus(dirty_bytes, target_bytes)) {
+        return;
+    }
+
     /* We have not started throttling yet. Let's start it. */
     if (!cpu_throttle_active()) {
         cpu_throttle_set(pct_initial);
@@ -1766,6 +1981,223 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
                                               &rs->num_dirty_pages_period);
 }
 
+/*
+ * Dirty bitmap synchronization threads
+ *
+ * With dirty-sync-threads > 1 the RAM blocks are cut into shards that
+ * the migration thread and the sync threads take in turn.  A shard
+ * always starts on a word of the migration bitmap and on a chunk of the
+ * clear bitmap, so two threads never update the same word.
+ */
+
+/* Bytes of guest RAM in a shard, unless the clear bitmap needs more */
+#define BITMAP_SYNC_SHARD_SIZE (1ULL << 30)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncShard;
+
+static struct {
+    /* sync threads, the migration thread is not included */
+    QemuThread *threads;
+    int count;
+    QemuMutex mutex;
+    /* signalled when a new generation of shards is ready, or on quit */
+    QemuCond work_cond;
+    /* signalled when the last sync thread is done with a generation */
+    QemuCond done_cond;
+    bool quit;
+    unsigned generation;
+    /* sync threads still working on the current generation */
+    int busy;
+    BitmapSyncShard *shards;
+    unsigned nr_shards;
+    unsigned allocated;
+    /* next shard to take, updated atomically */
+    unsigned next;
+    /* what the sync threads found in the current generation */
+    uint64_t dirty_pages;
+    uint64_t real_dirty_pages;
+} *bitmap_sync_state;
+
+/*
+ * bitmap_sync_run_shards: synchronize shards until none is left
+ *
+ * Called within an RCU critical section, by the migration thread and
+ * the sync threads.
+ *
+ * @dirty_pages: incremented by the number of newly dirty pages
+ * @real_dirty_pages: incremented by the number of pages dirtied since the
+ *                    last synchronization
+ */
+static void bitmap_sync_run_shards(uint64_t *dirty_pages,
+                                   uint64_t *real_dirty_pages)
+{
+    unsigned i;
+
+    while ((i = atomic_fetch_inc(&bitmap_sync_state->next)) <
+           bitmap_sync_state->nr_shards) {
+        BitmapSyncShard *shard = &bitmap_sync_state->shards[i];
+
+        *dirty_pages +=
+            cpu_physical_memory_sync_dirty_bitmap(shard->block, shard->start,
+                                                  shard->length,
+                                                  real_dirty_pages);
+    }
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    unsigned generation = 0;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&bitmap_sync_state->mutex);
+    while (true) {
+        uint64_t dirty_pages = 0;
+        uint64_t real_dirty_pages = 0;
+
+        while (!bitmap_sync_state->quit &&
+               generation == bitmap_sync_state->generation) {
+            qemu_cond_wait(&bitmap_sync_state->work_cond,
+                           &bitmap_sync_state->mutex);
+        }
+        if (bitmap_sync_state->quit) {
+            break;
+        }
+        generation = bitmap_sync_state->generation;
+        qemu_mutex_unlock(&bitmap_sync_state->mutex);
+
+        rcu_read_lock();
+        bitmap_sync_run_shards(&dirty_pages, &real_dirty_pages);
+        rcu_read_unlock();
+
+        qemu_mutex_lock(&bitmap_sync_state->mutex);
+        bitmap_sync_state->dirty_pages += dirty_pages;
+        bitmap_sync_state->real_dirty_pages += real_dirty_pages;
+        if (--bitmap_sync_state->busy == 0) {
+            qemu_cond_signal(&bitmap_sync_state->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&bitmap_sync_state->mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void bitmap_sync_threads_cleanup(void)
+{
+    int i;
+
+    if (!bitmap_sync_state) {
+        return;
+    }
+
+    qemu_mutex_lock(&bitmap_sync_state->mutex);
+    bitmap_sync_state->quit = true;
+    qemu_cond_broadcast(&bitmap_sync_state->work_cond);
+    qemu_mutex_unlock(&bitmap_sync_state->mutex);
+
+    for (i = 0; i < bitmap_sync_state->count; i++) {
+        qemu_thread_join(bitmap_sync_state->threads + i);
+    }
+    qemu_mutex_destroy(&bitmap_sync_state->mutex);
+    qemu_cond_destroy(&bitmap_sync_state->work_cond);
+    qemu_cond_destroy(&bitmap_sync_state->done_cond);
+    g_free(bitmap_sync_state->threads);
+    g_free(bitmap_sync_state->shards);
+    g_free(bitmap_sync_state);
+    bitmap_sync_state = NULL;
+}
+
+static void bitmap_sync_threads_setup(void)
+{
+    int i;
+
+    if (bitmap_sync_state || migrate_dirty_sync_threads() <= 1) {
+        return;
+    }
+
+    bitmap_sync_state = g_malloc0(sizeof(*bitmap_sync_state));
+    bitmap_sync_state->count = migrate_dirty_sync_threads() - 1;
+    bitmap_sync_state->threads = g_new0(QemuThread, bitmap_sync_state->count);
+    qemu_mutex_init(&bitmap_sync_state->mutex);
+    qemu_cond_init(&bitmap_sync_state->work_cond);
+    qemu_cond_init(&bitmap_sync_state->done_cond);
+    for (i = 0; i < bitmap_sync_state->count; i++) {
+        qemu_thread_create(bitmap_sync_state->threads + i, "dirtysync",
+                           bitmap_sync_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+}
+
+/*
+ * migration_bitmap_sync_shards: synchronize the dirty bitmap of all
+ * RAM blocks with the help of the sync threads
+ *
+ * Called within an RCU critical section, with rs->bitmap_mutex held.
+ */
+static void migration_bitmap_sync_shards(RAMState *rs)
+{
+    uint64_t dirty_pages = 0;
+    uint64_t real_dirty_pages = 0;
+    unsigned nr_shards = 0;
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t shard_size = BITMAP_SYNC_SHARD_SIZE;
+        ram_addr_t start;
+
+        if (block->clear_bmap) {
+            shard_size = MAX(shard_size, (ram_addr_t)TARGET_PAGE_SIZE <<
+                                         block->clear_bmap_shift);
+        }
+
+        for (start = 0; start < block->used_length; start += shard_size) {
+            BitmapSyncShard *shard;
+
+            if (nr_shards == bitmap_sync_state->allocated) {
+                bitmap_sync_state->allocated =
+                    MAX(16, bitmap_sync_state->allocated * 2);
+                bitmap_sync_state->shards =
+                    g_renew(BitmapSyncShard, bitmap_sync_state->shards,
+                            bitmap_sync_state->allocated);
+            }
+            shard = &bitmap_sync_state->shards[nr_shards++];
+            shard->block = block;
+            shard->start = start;
+            shard->length = MIN(shard_size, block->used_length - start);
+        }
+    }
+    trace_migration_bitmap_sync_shards(nr_shards,
+                                       bitmap_sync_state->count + 1);
+
+    qemu_mutex_lock(&bitmap_sync_state->mutex);
+    bitmap_sync_state->nr_shards = nr_shards;
+    atomic_set(&bitmap_sync_state->next, 0);
+    bitmap_sync_state->dirty_pages = 0;
+    bitmap_sync_state->real_dirty_pages = 0;
+    bitmap_sync_state->busy = bitmap_sync_state->count;
+    bitmap_sync_state->generation++;
+    qemu_cond_broadcast(&bitmap_sync_state->work_cond);
+    qemu_mutex_unlock(&bitmap_sync_state->mutex);
+
+    bitmap_sync_run_shards(&dirty_pages, &real_dirty_pages);
+
+    qemu_mutex_lock(&bitmap_sync_state->mutex);
+    while (bitmap_sync_state->busy) {
+        qemu_cond_wait(&bitmap_sync_state->done_cond,
+                       &bitmap_sync_state->mutex);
+    }
+    dirty_pages += bitmap_sync_state->dirty_pages;
+    real_dirty_pages += bitmap_sync_state->real_dirty_pages;
+    qemu_mutex_unlock(&bitmap_sync_state->mutex);
+
+    rs->migration_dirty_pages += dirty_pages;
+    rs->num_dirty_pages_period += real_dirty_pages;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1850,8 +2282,12 @@ static void migration_bitmap_sync(RAMState *rs)
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        ramblock_sync_dirty_bitmap(rs, block);
+    if (bitmap_sync_state) {
+        migration_bitmap_sync_shards(rs);
+    } else {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
     }
     ram_counters.remaining = ram_bytes_remaining();
     rcu_read_unlock();
@@ -1870,18 +2306,23 @@ static void migration_bitmap_sync(RAMState *rs)
          * that ram migration makes no progress. Avoid this by disabling the
          * throttling logic during the bulk phase of block migration. */
         if (migrate_auto_converge() && !blk_mig_bulk_active()) {
+            uint64_t bytes_dirty_period =
+                rs->num_dirty_pages_period * TARGET_PAGE_SIZE;
+            uint64_t bytes_target_period =
+                (bytes_xfer_now - rs->bytes_xfer_prev) / 2;
+
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
                were in this routine. If that happens twice, start or increase
                throttling */
 
-            if ((rs->num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - rs->bytes_xfer_prev) / 2) &&
+            if ((bytes_dirty_period > bytes_target_period) &&
                 (++rs->dirty_rate_high_cnt >= 2)) {
                     trace_migration_throttle();
                     rs->dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    mig_throttle_guest_down(bytes_dirty_period,
+                                            bytes_target_period);
             }
         }
 
@@ -2542,6 +2983,8 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+    ZeroPageDetection zero_page = migrate_zero_page_detection();
+    bool use_multifd;
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
@@ -2552,25 +2995,32 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
-    res = save_zero_page(rs, block, offset);
-    if (res > 0) {
-        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
-         * page would be stale
-         */
-        if (!save_page_use_compression(rs)) {
-            XBZRLE_cache_lock();
-            xbzrle_cache_zero_page(rs, block->offset + offset);
-            XBZRLE_cache_unlock();
-        }
-        ram_release_pages(block->idstr, offset, res);
-        return res;
-    }
-
     /*
      * do not use multifd for compression as the first page in the new
      * block should be posted out before sending the compressed page
      */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()) {
+    use_multifd = !save_page_use_compression(rs) && migrate_use_multifd();
+
+    /* With multifd detection the send channels look for zero pages */
+    if (zero_page == ZERO_PAGE_DETECTION_LEGACY ||
+        (zero_page == ZERO_PAGE_DETECTION_MULTIFD && !use_multifd)) {
+        res = save_zero_page(rs, block, offset);
+        if (res > 0) {
+            /*
+             * Must let xbzrle know, otherwise a previous (now 0'd) cached
+             * page would be stale
+             */
+            if (!save_page_use_compression(rs)) {
+                XBZRLE_cache_lock();
+                xbzrle_cache_zero_page(rs, block->offset + offset);
+                XBZRLE_cache_unlock();
+            }
+            ram_release_pages(block->idstr, offset, res);
+            return res;
+        }
+    }
+
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -2783,6 +3233,7 @@ static void ram_save_cleanup(void *opaque)
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    bitmap_sync_threads_cleanup();
     ram_state_cleanup(rsp);
 }
 
@@ -3428,11 +3879,13 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     if (compress_threads_save_setup()) {
         return -1;
     }
+    bitmap_sync_threads_setup();
 
     /* migration has already setup the bitmap, reuse it. */
     if (!migration_in_colo_state()) {
         if (ram_init_all(rsp) != 0) {
             compress_threads_save_cleanup();
+            bitmap_sync_threads_cleanup();
             return -1;
         }
     }
@@ -269,6 +269,7 @@ static bool should_validate_capability(int capability)
     /* Validate only new capabilities to keep compatibility. */
     switch (capability) {
     case MIGRATION_CAPABILITY_X_IGNORE_SHARED:
+    case MIGRATION_CAPABILITY_DIRTY_BITMAPS_EXTENTS:
         return true;
     default:
         return false;
@@ -0,0 +1,65 @@
+/*
+ * Per-vCPU throttling for auto-converge
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "vcpu-throttle.h"
+
+static int rate_cmp(const void *a, const void *b)
+{
+    const double *ra = a;
+    const double *rb = b;
+
+    return *ra < *rb ? -1 : *ra > *rb;
+}
+
+/**
+ * vcpu_throttle_compute: pick the throttle of each vcpu
+ *
+ * Look for the highest rate that the vcpus can keep while dirtying no
+ * more than @target bytes in total, by giving each vcpu, slowest first,
+ * an equal part of what the slower ones left.  The vcpus above that rate
+ * are throttled down to it, but by no more than @pct_max percent; the
+ * others run freely.
+ *
+ * Returns the rate, or -1 if the vcpus need no throttling at all.
+ *
+ * @rates: bytes each vcpu would dirty in a period if it was not throttled
+ * @pcts: filled with the throttle percentage of each vcpu
+ * @nr_vcpus: number of entries in @rates and @pcts
+ * @target: bytes the guest may dirty in a period
+ * @pct_max: the highest throttle percentage
+ */
+double vcpu_throttle_compute(const double *rates, int *pcts, int nr_vcpus,
+                             double target, int pct_max)
+{
+    double *sorted = g_memdup(rates, nr_vcpus * sizeof(*rates));
+    double remaining = target;
+    double cap = -1;
+    int i;
+
+    qsort(sorted, nr_vcpus, sizeof(*sorted), rate_cmp);
+    for (i = 0; i < nr_vcpus; i++) {
+        int left = nr_vcpus - i;
+
+        if (sorted[i] * left > remaining) {
+            cap = remaining / left;
+            break;
+        }
+        remaining -= sorted[i];
+    }
+    g_free(sorted);
+
+    for (i = 0; i < nr_vcpus; i++) {
+        pcts[i] = 0;
+        if (cap >= 0 && rates[i] > cap) {
+            pcts[i] = MIN(100 - (int)(100 * cap / rates[i]), pct_max);
+        }
+    }
+
+    return cap;
+}
@@ -0,0 +1,15 @@
+/*
+ * Per-vCPU throttling for auto-converge
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_VCPU_THROTTLE_H
+#define QEMU_MIGRATION_VCPU_THROTTLE_H
+
+double vcpu_throttle_compute(const double *rates, int *pcts, int nr_vcpus,
+                             double target, int pct_max);
+
+#endif
@@ -12,8 +12,265 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
+/*
+ * Run scanning
+ *
+ * The encoder alternates between looking for the end of a run of
+ * unchanged bytes and the end of a run of changed bytes.  Both searches
+ * have a plain C version working a long at a time and vectorized
+ * versions that are chosen at startup depending on the host CPU.
+ */
+
+/* Returns the offset of the first byte from @i on that differs */
+static int find_changed_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+    return i;
+}
+
+/* Returns the offset of the first byte from @i on that is unchanged */
+static int find_unchanged_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+    return i;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/*
+ * Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/*
+ * The vectorized versions compare 16 or 32 bytes at a time, and leave
+ * the tail of the page to the plain C versions.
+ */
+
+static int find_changed_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t same = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (same != 0xffff) {
+            return i + ctz32(~same);
+        }
+        i += 16;
+    }
+    return find_changed_int(old_buf, new_buf, i, slen);
+}
+
+static int find_unchanged_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t same = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (same) {
+            return i + ctz32(same);
+        }
+        i += 16;
+    }
+    return find_unchanged_int(old_buf, new_buf, i, slen);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int find_changed_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (same != 0xffffffff) {
+            return i + ctz32(~same);
+        }
+        i += 32;
+    }
+    return find_changed_int(old_buf, new_buf, i, slen);
+}
+
+static int find_unchanged_avx2(const uint8_t *old_buf,
+                               const uint8_t *new_buf, int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (same) {
+            return i + ctz32(same);
+        }
+        i += 32;
+    }
+    return find_unchanged_int(old_buf, new_buf, i, slen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/*
+ * Note that for test_xbzrle_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_CHANGED find_changed_int
+# define INIT_UNCHANGED find_unchanged_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_CHANGED find_changed_sse2
+# define INIT_UNCHANGED find_unchanged_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static int (*find_changed)(const uint8_t *, const uint8_t *, int, int) =
+    INIT_CHANGED;
+static int (*find_unchanged)(const uint8_t *, const uint8_t *, int, int) =
+    INIT_UNCHANGED;
+
+static void init_accel(unsigned cache)
+{
+    find_changed = find_changed_int;
+    find_unchanged = find_unchanged_int;
+    if (cache & CACHE_SSE2) {
+        find_changed = find_changed_sse2;
+        find_unchanged = find_unchanged_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        find_changed = find_changed_avx2;
+        find_unchanged = find_unchanged_avx2;
+    }
+#endif
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_xbzrle_next_accel(void)
+{
+    /*
+     * If no bits set, we just tested the plain C version, and there
+     * are no more acceleration options to test.
+     */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define find_changed find_changed_int
+#define find_unchanged find_unchanged_int
+bool test_xbzrle_next_accel(void)
+{
+    return false;
+}
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -27,10 +284,9 @@
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
+    uint32_t zrun_len, nzrun_len;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    uint8_t *nzrun_start;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,28 +297,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun_len = find_changed(old_buf, new_buf, i, slen) - i;
+        i += zrun_len;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,42 +312,15 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        nzrun_len = find_unchanged(old_buf, new_buf, i, slen) - i;
+        i += nzrun_len;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -120,7 +329,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
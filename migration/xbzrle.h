@@ -18,4 +18,11 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/*
+ * Switch the encoder to the next less preferred implementation of the
+ * run scanning; returns false once the plain C version is in use.  For
+ * unit tests only.
+ */
+bool test_xbzrle_next_accel(void);
 #endif
@@ -20,6 +20,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qemu/queue.h"
+#include "qemu/main-loop.h"
 #include "trace.h"
 #include "nbd-internal.h"
 #include "qemu/units.h"
@@ -89,6 +90,18 @@ struct NBDExport {
 
     AioContext *ctx;
 
+    /*
+     * AioContexts that serve the connections to this export, assigned
+     * round robin; see nbd_export_set_client_contexts().  quiesce_lock
+     * protects @ctx for clients that use them, and the quiesce state.
+     */
+    AioContext **client_ctx;
+    int nb_client_ctx;
+    int next_client_ctx;
+    QemuMutex quiesce_lock;
+    bool quiesced;
+    CoQueue quiesce_queue;
+
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
 
@@ -110,7 +123,7 @@ typedef struct NBDExportMetaContexts {
 } NBDExportMetaContexts;
 
 struct NBDClient {
-    int refcount;
+    int refcount; /* atomic, clients in iothreads take references too */
     void (*close_fn)(NBDClient *client, bool negotiated);
 
     NBDExport *exp;
@@ -118,6 +131,7 @@ struct NBDClient {
     char *tlsauthz;
     QIOChannelSocket *sioc; /* The underlying data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
+    AioContext *ctx; /* Serves network I/O; if NULL, exp->ctx does it all */
 
     Coroutine *recv_coroutine;
 
@@ -1345,40 +1359,78 @@ static int nbd_receive_request(QIOChannel *ioc, NBDRequest *request,
 
 void nbd_client_get(NBDClient *client)
 {
-    client->refcount++;
+    atomic_inc(&client->refcount);
 }
 
-void nbd_client_put(NBDClient *client)
+/*
+ * The export's client list, the export itself and the users of close_fn
+ * all live in the main loop, while clients served by an iothread drop
+ * their references and disconnect there.  Anything that touches them
+ * happens in the main loop.
+ */
+static bool nbd_in_main_loop(void)
 {
-    if (--client->refcount == 0) {
-        /* The last reference should be dropped by client->close,
-         * which is called by client_close.
-         */
-        assert(client->closing);
+    return qemu_get_current_aio_context() == qemu_get_aio_context();
+}
 
-        qio_channel_detach_aio_context(client->ioc);
-        object_unref(OBJECT(client->sioc));
-        object_unref(OBJECT(client->ioc));
-        if (client->tlscreds) {
-            object_unref(OBJECT(client->tlscreds));
-        }
-        g_free(client->tlsauthz);
-        if (client->exp) {
-            QTAILQ_REMOVE(&client->exp->clients, client, next);
-            nbd_export_put(client->exp);
+static void nbd_client_free(void *opaque)
+{
+    NBDClient *client = opaque;
+
+    /*
+     * The last reference should be dropped by client->close,
+     * which is called by client_close.
+     */
+    assert(atomic_read(&client->closing));
+
+    qio_channel_detach_aio_context(client->ioc);
+    object_unref(OBJECT(client->sioc));
+    object_unref(OBJECT(client->ioc));
+    if (client->tlscreds) {
+        object_unref(OBJECT(client->tlscreds));
+    }
+    g_free(client->tlsauthz);
+    if (client->exp) {
+        QTAILQ_REMOVE(&client->exp->clients, client, next);
+        nbd_export_put(client->exp);
+    }
+    g_free(client);
+}
+
+void nbd_client_put(NBDClient *client)
+{
+    if (atomic_fetch_dec(&client->refcount) == 1) {
+        if (nbd_in_main_loop()) {
+            nbd_client_free(client);
+        } else {
+            aio_bh_schedule_oneshot(qemu_get_aio_context(), nbd_client_free,
+                                    client);
         }
-        g_free(client);
     }
 }
 
+typedef struct NBDClientCloseData {
+    NBDClient *client;
+    bool negotiated;
+} NBDClientCloseData;
+
+static void nbd_client_close_fn_bh(void *opaque)
+{
+    NBDClientCloseData *data = opaque;
+
+    data->client->close_fn(data->client, data->negotiated);
+    nbd_client_put(data->client);
+    g_free(data);
+}
+
 static void client_close(NBDClient *client, bool negotiated)
 {
-    if (client->closing) {
+    NBDClientCloseData *data;
+
+    if (atomic_xchg(&client->closing, true)) {
         return;
     }
 
-    client->closing = true;
-
     /* Force requests to finish.  They will drop their own references,
      * then we'll close the socket and free the NBDClient.
      */
@@ -1386,9 +1438,23 @@ static void client_close(NBDClient *client, bool negotiated)
                          NULL);
 
     /* Also tell the client, so that they release their reference.  */
-    if (client->close_fn) {
+    if (!client->close_fn) {
+        return;
+    }
+    if (nbd_in_main_loop()) {
         client->close_fn(client, negotiated);
+        return;
     }
+
+    /* Disconnecting from an iothread; keep the client alive for the BH */
+    nbd_client_get(client);
+    data = g_new(NBDClientCloseData, 1);
+    *data = (NBDClientCloseData) {
+        .client     = client,
+        .negotiated = negotiated,
+    };
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), nbd_client_close_fn_bh,
+                            data);
 }
 
 static NBDRequestData *nbd_request_get(NBDClient *client)
@@ -1426,9 +1492,14 @@ static void blk_aio_attached(AioContext *ctx, void *opaque)
 
     trace_nbd_blk_aio_attached(exp->name, ctx);
 
+    qemu_mutex_lock(&exp->quiesce_lock);
     exp->ctx = ctx;
+    qemu_mutex_unlock(&exp->quiesce_lock);
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
+        if (client->ctx) {
+            continue;
+        }
         qio_channel_attach_aio_context(client->ioc, ctx);
         if (client->recv_coroutine) {
             aio_co_schedule(ctx, client->recv_coroutine);
@@ -1447,10 +1518,128 @@ static void blk_aio_detach(void *opaque)
     trace_nbd_blk_aio_detach(exp->name, exp->ctx);
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
-        qio_channel_detach_aio_context(client->ioc);
+        if (!client->ctx) {
+            qio_channel_detach_aio_context(client->ioc);
+        }
     }
 
+    qemu_mutex_lock(&exp->quiesce_lock);
     exp->ctx = NULL;
+    qemu_mutex_unlock(&exp->quiesce_lock);
+}
+
+static void nbd_export_drained_begin(void *opaque)
+{
+    NBDExport *exp = opaque;
+
+    qemu_mutex_lock(&exp->quiesce_lock);
+    exp->quiesced = true;
+    qemu_mutex_unlock(&exp->quiesce_lock);
+}
+
+static void nbd_export_drained_end(void *opaque)
+{
+    NBDExport *exp = opaque;
+
+    /*
+     * This may run outside coroutine context, in the AioContext of a waiting
+     * client, which is then entered right away: drop the lock around that.
+     */
+    qemu_mutex_lock(&exp->quiesce_lock);
+    exp->quiesced = false;
+    while (!exp->quiesced &&
+           qemu_co_enter_next(&exp->quiesce_queue, &exp->quiesce_lock)) {
+        /* Wake up all waiting requests */
+    }
+    qemu_mutex_unlock(&exp->quiesce_lock);
+}
+
+static const BlockDevOps nbd_export_dev_ops = {
+    .drained_begin = nbd_export_drained_begin,
+    .drained_end   = nbd_export_drained_end,
+};
+
+/*
+ * Serve the network side of the connections to @exp in the AioContexts
+ * @ctx instead of the export's AioContext.  Each new connection is
+ * assigned one of them in turn; its requests are received and replied to
+ * there, and only move to the export's AioContext to access the block
+ * device.  Must be called before any client connects.
+ */
+void nbd_export_set_client_contexts(NBDExport *exp, AioContext **ctx,
+                                    int nb_ctx)
+{
+    int i;
+
+    assert(QTAILQ_EMPTY(&exp->clients) && !exp->nb_client_ctx);
+    if (!nb_ctx) {
+        return;
+    }
+
+    exp->client_ctx = g_new(AioContext *, nb_ctx);
+    for (i = 0; i < nb_ctx; i++) {
+        aio_context_ref(ctx[i]);
+        exp->client_ctx[i] = ctx[i];
+    }
+    exp->nb_client_ctx = nb_ctx;
+
+    /* Requests coming from other AioContexts must respect drained sections */
+    blk_set_dev_ops(exp->blk, &nbd_export_dev_ops, exp);
+}
+
+/*
+ * Move the current request of @client to the export's AioContext before
+ * it accesses the block device.  Until nbd_client_leave_export() the
+ * request counts as in flight on the BlockBackend, so drained sections
+ * wait for it; new requests wait while the export is quiesced.
+ */
+static void coroutine_fn nbd_client_enter_export(NBDClient *client)
+{
+    NBDExport *exp = client->exp;
+    AioContext *cur = qemu_get_current_aio_context();
+    AioContext *ctx;
+
+    if (!client->ctx) {
+        return;
+    }
+
+    qemu_mutex_lock(&exp->quiesce_lock);
+    if (cur == exp->ctx) {
+        /* Already there */
+        qemu_mutex_unlock(&exp->quiesce_lock);
+        return;
+    }
+    while (exp->quiesced) {
+        qemu_co_queue_wait(&exp->quiesce_queue, &exp->quiesce_lock);
+    }
+    ctx = exp->ctx;
+    if (ctx == cur) {
+        /* The export moved to the client's AioContext while we waited */
+        qemu_mutex_unlock(&exp->quiesce_lock);
+        return;
+    }
+    blk_inc_in_flight(exp->blk);
+    qemu_mutex_unlock(&exp->quiesce_lock);
+
+    aio_co_reschedule_self(ctx);
+}
+
+/*
+ * Move the current request of @client back to the client's AioContext,
+ * after it is done with the block device or before it sends a reply.
+ */
+static void coroutine_fn nbd_client_leave_export(NBDClient *client)
+{
+    if (!client->ctx || qemu_get_current_aio_context() == client->ctx) {
+        return;
+    }
+
+    /*
+     * Still in the export's AioContext, so that a drain polling it sees
+     * the request go away.
+     */
+    blk_dec_in_flight(client->exp->blk);
+    aio_co_reschedule_self(client->ctx);
 }
 
 static void nbd_eject_notifier(Notifier *n, void *data)
@@ -1546,6 +1735,8 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
 
     exp->close = close;
     exp->ctx = blk_get_aio_context(blk);
+    qemu_mutex_init(&exp->quiesce_lock);
+    qemu_co_queue_init(&exp->quiesce_queue);
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
 
     if (on_eject_blk) {
@@ -1625,6 +1816,8 @@ void nbd_export_get(NBDExport *exp)
 
 void nbd_export_put(NBDExport *exp)
 {
+    int i;
+
     assert(exp->refcount > 0);
     if (exp->refcount == 1) {
         nbd_export_close(exp);
@@ -1660,6 +1853,11 @@ void nbd_export_put(NBDExport *exp)
             g_free(exp->export_bitmap_context);
         }
 
+        for (i = 0; i < exp->nb_client_ctx; i++) {
+            aio_context_unref(exp->client_ctx[i]);
+        }
+        g_free(exp->client_ctx);
+        qemu_mutex_destroy(&exp->quiesce_lock);
         g_free(exp);
     }
 }
@@ -1684,6 +1882,10 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     int ret;
 
     g_assert(qemu_in_coroutine());
+
+    /* Replies are sent from the client's AioContext */
+    nbd_client_leave_export(client);
+
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
 
@@ -1814,12 +2016,15 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
 
     while (progress < size) {
         int64_t pnum;
-        int status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
-                                             offset + progress,
-                                             size - progress, &pnum, NULL,
-                                             NULL);
+        int status;
         bool final;
 
+        /* Sending the previous chunk left the export's AioContext */
+        nbd_client_enter_export(client);
+        status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
+                                         offset + progress, size - progress,
+                                         &pnum, NULL, NULL);
+
         if (status < 0) {
             char *msg = g_strdup_printf("unable to check for holes: %s",
                                         strerror(-status));
@@ -1968,6 +2173,7 @@ static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
     NBDExtent *extents = g_new(NBDExtent, nb_extents);
     uint64_t final_length = length;
 
+    nbd_client_enter_export(client);
     ret = blockstatus_to_extents(bs, offset, &final_length, extents,
                                  &nb_extents);
     if (ret < 0) {
@@ -2053,6 +2259,7 @@ static int nbd_co_send_bitmap(NBDClient *client, uint64_t handle,
     NBDExtent *extents = g_new(NBDExtent, nb_extents);
     uint64_t final_length = length;
 
+    nbd_client_enter_export(client);
     nb_extents = bitmap_to_extents(bitmap, offset, &final_length, extents,
                                    nb_extents, dont_fragment);
 
@@ -2271,6 +2478,8 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
     NBDExport *exp = client->exp;
     char *msg;
 
+    nbd_client_enter_export(client);
+
     switch (request->type) {
     case NBD_CMD_CACHE:
         return nbd_do_cmd_cache(client, request, errp);
@@ -2380,7 +2589,7 @@ static coroutine_fn void nbd_trip(void *opaque)
     Error *local_err = NULL;
 
     trace_nbd_trip();
-    if (client->closing) {
+    if (atomic_read(&client->closing)) {
         nbd_client_put(client);
         return;
     }
@@ -2389,7 +2598,7 @@ static coroutine_fn void nbd_trip(void *opaque)
     ret = nbd_co_receive_request(req, &request, &local_err);
     client->recv_coroutine = NULL;
 
-    if (client->closing) {
+    if (atomic_read(&client->closing)) {
         /*
          * The client may be closed when we are blocked in
          * nbd_co_receive_request()
@@ -2413,6 +2622,7 @@ static coroutine_fn void nbd_trip(void *opaque)
         error_free(export_err);
     } else {
         ret = nbd_handle_request(client, &request, req->data, &local_err);
+        nbd_client_leave_export(client);
     }
     if (ret < 0) {
         error_prepend(&local_err, "Failed to send reply: ");
@@ -2446,13 +2656,15 @@ static void nbd_client_receive_next_request(NBDClient *client)
     if (!client->recv_coroutine && client->nb_requests < MAX_NBD_REQUESTS) {
         nbd_client_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, client);
-        aio_co_schedule(client->exp->ctx, client->recv_coroutine);
+        aio_co_schedule(client->ctx ?: client->exp->ctx,
+                        client->recv_coroutine);
     }
 }
 
 static coroutine_fn void nbd_co_client_start(void *opaque)
 {
     NBDClient *client = opaque;
+    NBDExport *exp;
     Error *local_err = NULL;
 
     qemu_co_mutex_init(&client->send_lock);
@@ -2465,6 +2677,13 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
         return;
     }
 
+    exp = client->exp;
+    if (exp->nb_client_ctx) {
+        client->ctx = exp->client_ctx[exp->next_client_ctx++ %
+                                      exp->nb_client_ctx];
+        qio_channel_attach_aio_context(client->ioc, client->ctx);
+    }
+
     nbd_client_receive_next_request(client);
 }
 
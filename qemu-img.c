@@ -70,6 +70,7 @@ enum {
     OPTION_PREALLOCATION = 265,
     OPTION_SHRINK = 266,
     OPTION_SALVAGE = 267,
+    OPTION_REORDER_WINDOW = 268,
 };
 
 typedef enum OutputFormat {
@@ -178,6 +179,8 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--reorder-window' allows writes to start up to 'size' bytes ahead of\n"
+           "       the oldest unfinished write when writing in order (defaults to 0)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1563,6 +1566,13 @@ enum ImgConvertBlockStatus {
 
 #define MAX_COROUTINES 16
 
+/*
+ * Give up on copy offloading after this many requests in a row could not be
+ * offloaded; a single request that fails (e.g. because it covers compressed
+ * qcow2 clusters) falls back to a normal copy.
+ */
+#define MAX_COPY_RANGE_FAILURES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1571,7 +1581,6 @@ typedef struct ImgConvertState {
     int64_t allocated_sectors;
     int64_t allocated_done;
     int64_t sector_num;
-    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
@@ -1582,7 +1591,9 @@ typedef struct ImgConvertState {
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
     bool wr_in_order;
+    int64_t wr_window;
     bool copy_range;
+    int copy_range_failures;
     bool salvage;
     bool quiet;
     int min_sparse;
@@ -1592,7 +1603,9 @@ typedef struct ImgConvertState {
     long num_coroutines;
     int running_coroutines;
     Coroutine *co[MAX_COROUTINES];
-    int64_t wait_sector_num[MAX_COROUTINES];
+    /* first sector of the request each coroutine has not written yet, or -1 */
+    int64_t req_sector_num[MAX_COROUTINES];
+    bool wr_waiting[MAX_COROUTINES];
     CoMutex lock;
     int ret;
 } ImgConvertState;
@@ -1851,6 +1864,43 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * With in-order writes, a request may be written once it starts no more than
+ * s->wr_window sectors after the oldest request that has been handed out but
+ * not written yet.  A window of 0 keeps writes strictly sequential.
+ */
+static bool convert_may_write(ImgConvertState *s, int64_t sector_num)
+{
+    int64_t oldest = s->sector_num;
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->req_sector_num[i] >= 0) {
+            oldest = MIN(oldest, s->req_sector_num[i]);
+        }
+    }
+
+    return sector_num - oldest <= s->wr_window;
+}
+
+static void convert_wake_writers(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        /*
+         * A -> B -> A cannot occur because A has s->wr_waiting[i] == false
+         * while it runs.  Therefore B will never enter A during this time
+         * window.
+         */
+        if (s->co[i] && s->wr_waiting[i] &&
+            (s->ret != -EINPROGRESS ||
+             convert_may_write(s, s->req_sector_num[i]))) {
+            qemu_coroutine_enter(s->co[i]);
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1895,6 +1945,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         /* increment global sector counter so that other coroutines can
          * already continue reading beyond this request */
         s->sector_num += n;
+        s->req_sector_num[index] = sector_num;
         qemu_co_mutex_unlock(&s->lock);
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
@@ -1903,8 +1954,8 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
                                         s->allocated_sectors, 0);
         }
 
+        copy_range = s->copy_range && status == BLK_DATA;
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -1918,21 +1969,27 @@ retry:
         }
 
         if (s->wr_in_order) {
-            /* keep writes in order */
-            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
-                s->wait_sector_num[index] = sector_num;
+            /* keep writes in order, within the reorder window */
+            while (!convert_may_write(s, sector_num) &&
+                   s->ret == -EINPROGRESS) {
+                s->wr_waiting[index] = true;
                 qemu_coroutine_yield();
+                s->wr_waiting[index] = false;
             }
-            s->wait_sector_num[index] = -1;
         }
 
         if (s->ret == -EINPROGRESS) {
             if (copy_range) {
                 ret = convert_co_copy_range(s, sector_num, n);
                 if (ret) {
-                    s->copy_range = false;
+                    /* copy this request through the buffer instead */
+                    if (++s->copy_range_failures >= MAX_COPY_RANGE_FAILURES) {
+                        s->copy_range = false;
+                    }
+                    copy_range = false;
                     goto retry;
                 }
+                s->copy_range_failures = 0;
             } else {
                 ret = convert_co_write(s, sector_num, n, buf, status);
             }
@@ -1943,21 +2000,11 @@ retry:
             }
         }
 
+        s->req_sector_num[index] = -1;
         if (s->wr_in_order) {
-            /* reenter the coroutine that might have waited
+            /* reenter the coroutines that might have waited
              * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_wake_writers(s);
         }
     }
 
@@ -2018,9 +2065,12 @@ static int convert_do_copy(ImgConvertState *s)
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->req_sector_num[i] = -1;
+        s->wr_waiting[i] = false;
+    }
     for (i = 0; i < s->num_coroutines; i++) {
         s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
-        s->wait_sector_num[i] = -1;
         qemu_coroutine_enter(s->co[i]);
     }
 
@@ -2078,6 +2128,7 @@ static int img_convert(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {"target-image-opts", no_argument, 0, OPTION_TARGET_IMAGE_OPTS},
             {"salvage", no_argument, 0, OPTION_SALVAGE},
+            {"reorder-window", required_argument, 0, OPTION_REORDER_WINDOW},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WU",
@@ -2198,6 +2249,20 @@ static int img_convert(int argc, char **argv)
         case OPTION_SALVAGE:
             s.salvage = true;
             break;
+        case OPTION_REORDER_WINDOW:
+        {
+            int64_t sval;
+
+            sval = cvtnum(optarg);
+            if (sval < 0 || sval & (BDRV_SECTOR_SIZE - 1)) {
+                error_report("Invalid reorder window specified. Valid sizes "
+                             "are multiples of %llu.", BDRV_SECTOR_SIZE);
+                goto fail_getopt;
+            }
+
+            s.wr_window = sval / BDRV_SECTOR_SIZE;
+            break;
+        }
         case OPTION_TARGET_IMAGE_OPTS:
             tgt_image_opts = true;
             break;
@@ -2229,6 +2294,11 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (s.wr_window && !s.wr_in_order) {
+        error_report("--reorder-window cannot be used with -W");
+        goto fail_getopt;
+    }
+
     if (tgt_image_opts && !skip_create) {
         error_report("--target-image-opts requires use of -n flag");
         goto fail_getopt;
@@ -4202,7 +4272,8 @@ static int img_bench(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hc:d:f:no:qs:S:t:wU", long_options, NULL);
+        c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
+                        NULL);
         if (c == -1) {
             break;
         }
@@ -4245,6 +4316,12 @@ static int img_bench(int argc, char **argv)
         case 'n':
             flags |= BDRV_O_NATIVE_AIO;
             break;
+        case 'i':
+            if (bdrv_parse_aio(optarg, &flags) < 0) {
+                error_report("Invalid aio option: %s", optarg);
+                return 1;
+            }
+            break;
         case 'o':
         {
             offset = cvtnum(optarg);
@@ -0,0 +1,93 @@
+/*
+ * Hierarchical bitmap speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/hbitmap.h"
+
+/* 1 TiB disk tracked with 64 KiB granularity */
+#define BENCH_BITS      (16 * MiB)
+
+typedef struct HBitmapBench {
+    const char *name;
+    void (*fn)(HBitmap *a, HBitmap *b);
+} HBitmapBench;
+
+/* Merge and recount the dirty bits */
+static void bench_merge(HBitmap *a, HBitmap *b)
+{
+    hbitmap_merge(a, b, a);
+}
+
+static void bench_set_reset(HBitmap *a, HBitmap *b)
+{
+    hbitmap_set(a, 1, BENCH_BITS - 2);
+    hbitmap_reset(a, 1, BENCH_BITS - 2);
+}
+
+static void bench_next_zero(HBitmap *a, HBitmap *b)
+{
+    g_assert_cmpint(hbitmap_next_zero(b, 0, UINT64_MAX), ==, BENCH_BITS - 1);
+}
+
+static const HBitmapBench benches[] = {
+    { "merge", bench_merge },
+    { "set-reset", bench_set_reset },
+    { "next-zero", bench_next_zero },
+};
+
+static void bench_hbitmap(int pass, const HBitmapBench *bench)
+{
+    HBitmap *a = hbitmap_alloc(BENCH_BITS, 0);
+    HBitmap *b = hbitmap_alloc(BENCH_BITS, 0);
+    double total = 0.0;
+    uint64_t i;
+
+    /* Sparse but spread over the whole bitmap, so that no level is empty */
+    for (i = 0; i < BENCH_BITS; i += 4099) {
+        hbitmap_set(a, i, 1);
+    }
+    hbitmap_set(b, 0, BENCH_BITS - 1);
+
+    g_test_timer_start();
+    do {
+        bench->fn(a, b);
+        total += BENCH_BITS / 8;
+    } while (g_test_timer_elapsed() < 5.0);
+
+    total /= MiB;
+    g_print("%s: ", bench->name);
+    g_print("pass %d ", pass);
+    g_print("done: %.2f MB in %.2f secs: ", total, g_test_timer_last());
+    g_print("%.2f MB/sec\n", total / g_test_timer_last());
+
+    hbitmap_free(a);
+    hbitmap_free(b);
+}
+
+/* Each pass disables the best remaining kernels, so the last pass
+ * measures the generic code.
+ */
+static void test_hbitmap_speed(void)
+{
+    int pass = 0;
+    size_t i;
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(benches); i++) {
+            bench_hbitmap(pass, &benches[i]);
+        }
+        pass++;
+    } while (test_hbitmap_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/hbitmap/speed", test_hbitmap_speed);
+
+    return g_test_run();
+}
@@ -240,6 +240,18 @@ static int64_t read_ram_property_int(QTestState *who, const char *property)
     return result;
 }
 
+static int64_t read_migrate_property_int(QTestState *who,
+                                         const char *property)
+{
+    QDict *rsp_return;
+    int64_t result;
+
+    rsp_return = migrate_query(who);
+    result = qdict_get_try_int(rsp_return, property, 0);
+    qobject_unref(rsp_return);
+    return result;
+}
+
 static uint64_t get_migration_pass(QTestState *who)
 {
     return read_ram_property_int(who, "dirty-sync-count");
@@ -437,6 +449,42 @@ static void migrate_set_parameter_int(QTestState *who, const char *parameter,
     migrate_check_parameter_int(who, parameter, value);
 }
 
+static char *migrate_get_parameter_str(QTestState *who,
+                                       const char *parameter)
+{
+    QDict *rsp;
+    char *result;
+
+    rsp = wait_command(who, "{ 'execute': 'query-migrate-parameters' }");
+    result = g_strdup(qdict_get_str(rsp, parameter));
+    qobject_unref(rsp);
+    return result;
+}
+
+static void migrate_check_parameter_str(QTestState *who, const char *parameter,
+                                        const char *value)
+{
+    char *result;
+
+    result = migrate_get_parameter_str(who, parameter);
+    g_assert_cmpstr(result, ==, value);
+    g_free(result);
+}
+
+static void migrate_set_parameter_str(QTestState *who, const char *parameter,
+                                      const char *value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-parameters',"
+                    "'arguments': { %s: %s } }",
+                    parameter, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+    migrate_check_parameter_str(who, parameter, value);
+}
+
 static void migrate_pause(QTestState *who)
 {
     QDict *rsp;
@@ -510,16 +558,15 @@ static void migrate_postcopy_start(QTestState *from, QTestState *to)
     qtest_qmp_eventwait(to, "RESUME");
 }
 
-static int test_migrate_start(QTestState **from, QTestState **to,
-                               const char *uri, bool hide_stderr,
-                               bool use_shmem)
+static int test_migrate_start_accel(QTestState **from, QTestState **to,
+                                    const char *uri, bool hide_stderr,
+                                    bool use_shmem, const char *accel)
 {
     gchar *cmd_src, *cmd_dst;
     char *bootpath = NULL;
     char *extra_opts = NULL;
     char *shmem_path = NULL;
     const char *arch = qtest_get_arch();
-    const char *accel = "kvm:tcg";
 
     if (use_shmem) {
         if (!g_file_test("/dev/shm", G_FILE_TEST_IS_DIR)) {
@@ -643,6 +690,14 @@ static int test_migrate_start(QTestState **from, QTestState **to,
     return 0;
 }
 
+static int test_migrate_start(QTestState **from, QTestState **to,
+                               const char *uri, bool hide_stderr,
+                               bool use_shmem)
+{
+    return test_migrate_start_accel(from, to, uri, hide_stderr, use_shmem,
+                                    "kvm:tcg");
+}
+
 static void test_migrate_end(QTestState *from, QTestState *to, bool test_dest)
 {
     unsigned char dest_byte_a, dest_byte_b, dest_byte_c, dest_byte_d;
@@ -998,6 +1053,57 @@ static void test_xbzrle_unix(void)
     g_free(uri);
 }
 
+static void test_migrate_auto_converge_per_vcpu(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    int64_t percentage;
+
+    /* Only TCG counts the pages that each vcpu dirties */
+    if (test_migrate_start_accel(&from, &to, uri, false, false, "tcg")) {
+        return;
+    }
+
+    migrate_set_capability(from, "auto-converge", true);
+    migrate_set_capability(from, "per-vcpu-throttle", true);
+    migrate_set_parameter_int(from, "max-cpu-throttle", 50);
+
+    /* Without throttling, this can neither converge nor keep up */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 100MB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 100000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    /* The vcpu that dirties memory gets throttled, but never too much */
+    do {
+        usleep(100 * 1000);
+        g_assert(!got_stop);
+        percentage = read_migrate_property_int(from,
+                                               "cpu-throttle-percentage");
+    } while (!percentage);
+    g_assert_cmpint(percentage, <=, 50);
+
+    /* 300ms should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 static void test_precopy_tcp(void)
 {
     char *uri;
@@ -1016,6 +1122,8 @@ static void test_precopy_tcp(void)
     migrate_set_parameter_int(from, "downtime-limit", 1);
     /* 1GB/s */
     migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    /* Share the dirty bitmap synchronization between several threads */
+    migrate_set_parameter_int(from, "dirty-sync-threads", 4);
 
     /* Wait for the first serial output from the source */
     wait_for_serial("src_serial");
@@ -1125,6 +1233,94 @@ static void test_migrate_fd_proto(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_multifd_tcp(const char *method, const char *zero_page)
+{
+    char *uri;
+    QDict *rsp;
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        return;
+    }
+
+    /*
+     * We want to pick a speed slow enough that the test completes
+     * quickly, but that it doesn't complete precopy even on a slow
+     * machine, so also set the downtime.
+     */
+    /* 1 ms should make it not converge */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+
+    migrate_set_parameter_str(from, "multifd-compression", method);
+    migrate_set_parameter_str(to, "multifd-compression", method);
+
+    migrate_set_parameter_str(from, "zero-page-detection", zero_page);
+    migrate_set_parameter_str(to, "zero-page-detection", zero_page);
+
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+
+    /* Start incoming migration from the 1st socket */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300ms should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_multifd_tcp_none(void)
+{
+    test_multifd_tcp("none", "legacy");
+}
+
+static void test_multifd_tcp_zlib(void)
+{
+    test_multifd_tcp("zlib", "legacy");
+}
+
+#ifdef CONFIG_ZSTD
+static void test_multifd_tcp_zstd(void)
+{
+    test_multifd_tcp("zstd", "legacy");
+}
+#endif
+
+static void test_multifd_tcp_zero_page_multifd(void)
+{
+    test_multifd_tcp("none", "multifd");
+}
+
+static void test_multifd_tcp_zero_page_none(void)
+{
+    test_multifd_tcp("none", "none");
+}
+
 int main(int argc, char **argv)
 {
     char template[] = "/tmp/migration-test-XXXXXX";
@@ -1179,7 +1375,18 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/auto_converge/per_vcpu",
+                   test_migrate_auto_converge_per_vcpu);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
+#endif
+    qtest_add_func("/migration/multifd/tcp/zero-page/multifd",
+                   test_multifd_tcp_zero_page_multifd);
+    qtest_add_func("/migration/multifd/tcp/zero-page/none",
+                   test_multifd_tcp_zero_page_none);
 
     ret = g_test_run();
 
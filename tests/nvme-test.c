@@ -13,6 +13,20 @@
 #include "libqtest.h"
 #include "libqos/qgraph.h"
 #include "libqos/pci.h"
+#include "libqos/malloc.h"
+#include "hw/pci/pci_regs.h"
+#include "block/nvme.h"
+
+#define NVME_TEST_QUEUE_SIZE    16
+#define NVME_TEST_PAGE_SIZE     4096
+#define NVME_TEST_TIMEOUT_US    (30 * 1000 * 1000)
+#define NVME_TEST_MSIX_DATA     0x12345678
+#define NVME_TEST_MSIX_VECTORS  3
+
+/* Aggregation time in 100 microsecond units */
+#define NVME_TEST_INTC_TIME     100
+#define NVME_TEST_INTC_TIME_NS  (NVME_TEST_INTC_TIME * 100 * 1000)
+#define NVME_TEST_INTC_THR      3
 
 typedef struct QNvme QNvme;
 
@@ -66,6 +80,620 @@ static void nvmetest_oob_cmb_test(void *obj, void *data, QGuestAllocator *alloc)
     g_assert_cmpint(qpci_io_readl(pdev, bar, cmb_bar_size - 1), !=, 0x44332211);
 }
 
+/*
+ * A minimal driver: I/O submission queue i completes to I/O completion
+ * queue i, every queue has NVME_TEST_QUEUE_SIZE entries, and commands are
+ * polled for by advancing the virtual clock.
+ */
+typedef struct NvmeTestQueue {
+    uint16_t qid;
+    uint64_t sq_addr;
+    uint64_t cq_addr;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+    uint16_t next_cid;
+} NvmeTestQueue;
+
+typedef struct NvmeTest {
+    QTestState *qts;
+    QPCIDevice *pdev;
+    QPCIBar bar;
+    QGuestAllocator *alloc;
+    NvmeTestQueue adminq;
+    /* Shadow doorbells and EventIdx buffers, 0 until configured */
+    uint64_t dbbuf_dbs;
+    uint64_t dbbuf_eis;
+    /* Where MSI-X vectors write NVME_TEST_MSIX_DATA, 0 if not set up */
+    uint64_t msix_addr[NVME_TEST_MSIX_VECTORS];
+} NvmeTest;
+
+static uint32_t nvmetest_readl_le(NvmeTest *t, uint64_t addr)
+{
+    uint32_t v;
+
+    qtest_memread(t->qts, addr, &v, sizeof(v));
+    return le32_to_cpu(v);
+}
+
+static void nvmetest_writel_le(NvmeTest *t, uint64_t addr, uint32_t v)
+{
+    v = cpu_to_le32(v);
+    qtest_memwrite(t->qts, addr, &v, sizeof(v));
+}
+
+/* Address of the shadow doorbell or EventIdx entry of a queue in @buf */
+static uint64_t nvmetest_dbbuf_addr(uint64_t buf, uint16_t qid, bool cq)
+{
+    return buf + (qid << 3) + (cq ? 4 : 0);
+}
+
+static void nvmetest_queue_init(NvmeTest *t, NvmeTestQueue *q, uint16_t qid)
+{
+    size_t cq_bytes = NVME_TEST_QUEUE_SIZE * sizeof(NvmeCqe);
+
+    *q = (NvmeTestQueue) {
+        .qid = qid,
+        .sq_addr = guest_alloc(t->alloc,
+                               NVME_TEST_QUEUE_SIZE * sizeof(NvmeCmd)),
+        .cq_addr = guest_alloc(t->alloc, cq_bytes),
+        .phase = 1,
+    };
+    qtest_memset(t->qts, q->cq_addr, 0, cq_bytes);
+}
+
+static void nvmetest_start(NvmeTest *t, QNvme *nvme, QGuestAllocator *alloc)
+{
+    *t = (NvmeTest) {
+        .pdev = &nvme->dev,
+        .qts = nvme->dev.bus->qts,
+        .alloc = alloc,
+    };
+
+    qpci_device_enable(t->pdev);
+    t->bar = qpci_iomap(t->pdev, 0, NULL);
+
+    nvmetest_queue_init(t, &t->adminq, 0);
+    qpci_io_writel(t->pdev, t->bar, offsetof(NvmeBar, aqa),
+                   ((NVME_TEST_QUEUE_SIZE - 1) << 16) |
+                   (NVME_TEST_QUEUE_SIZE - 1));
+    qpci_io_writel(t->pdev, t->bar, offsetof(NvmeBar, asq),
+                   t->adminq.sq_addr);
+    qpci_io_writel(t->pdev, t->bar, offsetof(NvmeBar, asq) + 4,
+                   t->adminq.sq_addr >> 32);
+    qpci_io_writel(t->pdev, t->bar, offsetof(NvmeBar, acq),
+                   t->adminq.cq_addr);
+    qpci_io_writel(t->pdev, t->bar, offsetof(NvmeBar, acq) + 4,
+                   t->adminq.cq_addr >> 32);
+    qpci_io_writel(t->pdev, t->bar, offsetof(NvmeBar, cc),
+                   (1 << CC_EN_SHIFT) | (6 << CC_IOSQES_SHIFT) |
+                   (4 << CC_IOCQES_SHIFT));
+    g_assert(qpci_io_readl(t->pdev, t->bar, offsetof(NvmeBar, csts)) &
+             NVME_CSTS_READY);
+}
+
+/*
+ * Point MSI-X @vector to guest memory.  Returns false if the machine cannot
+ * deliver MSI-X this way.
+ */
+static bool nvmetest_msix_setup(NvmeTest *t, uint16_t vector)
+{
+    uint64_t off;
+    uint32_t control;
+
+    if (qpci_check_buggy_msi(t->pdev)) {
+        return false;
+    }
+    if (!t->pdev->msix_enabled) {
+        qpci_msix_enable(t->pdev);
+    }
+
+    t->msix_addr[vector] = guest_alloc(t->alloc, 4);
+    qtest_writel(t->qts, t->msix_addr[vector], 0);
+
+    off = t->pdev->msix_table_off + vector * PCI_MSIX_ENTRY_SIZE;
+    qpci_io_writel(t->pdev, t->pdev->msix_table_bar,
+                   off + PCI_MSIX_ENTRY_LOWER_ADDR, t->msix_addr[vector]);
+    qpci_io_writel(t->pdev, t->pdev->msix_table_bar,
+                   off + PCI_MSIX_ENTRY_UPPER_ADDR,
+                   t->msix_addr[vector] >> 32);
+    qpci_io_writel(t->pdev, t->pdev->msix_table_bar,
+                   off + PCI_MSIX_ENTRY_DATA, NVME_TEST_MSIX_DATA);
+    control = qpci_io_readl(t->pdev, t->pdev->msix_table_bar,
+                            off + PCI_MSIX_ENTRY_VECTOR_CTRL);
+    qpci_io_writel(t->pdev, t->pdev->msix_table_bar,
+                   off + PCI_MSIX_ENTRY_VECTOR_CTRL,
+                   control & ~PCI_MSIX_ENTRY_CTRL_MASKBIT);
+    return true;
+}
+
+/* Check for and acknowledge an interrupt on @vector */
+static bool nvmetest_msix_fired(NvmeTest *t, uint16_t vector)
+{
+    if (qtest_readl(t->qts, t->msix_addr[vector]) != NVME_TEST_MSIX_DATA) {
+        return false;
+    }
+    qtest_writel(t->qts, t->msix_addr[vector], 0);
+    return true;
+}
+
+static void nvmetest_wait_msix(NvmeTest *t, uint16_t vector)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (!nvmetest_msix_fired(t, vector)) {
+        qtest_clock_step(t->qts, 100);
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TEST_TIMEOUT_US);
+    }
+}
+
+static void nvmetest_ring_sq(NvmeTest *t, NvmeTestQueue *q, uint16_t tail)
+{
+    qpci_io_writel(t->pdev, t->bar, 0x1000 + (q->qid << 3), tail);
+}
+
+/* Place @cmd in the submission queue without ringing the doorbell */
+static uint16_t nvmetest_push(NvmeTest *t, NvmeTestQueue *q, NvmeCmd *cmd)
+{
+    cmd->cid = cpu_to_le16(q->next_cid++);
+    qtest_memwrite(t->qts, q->sq_addr + q->sq_tail * sizeof(*cmd), cmd,
+                   sizeof(*cmd));
+    q->sq_tail = (q->sq_tail + 1) % NVME_TEST_QUEUE_SIZE;
+    return le16_to_cpu(cmd->cid);
+}
+
+/* Publish the submission queue tail, like Linux always ring the doorbell */
+static void nvmetest_kick(NvmeTest *t, NvmeTestQueue *q)
+{
+    if (q->qid && t->dbbuf_dbs) {
+        nvmetest_writel_le(t, nvmetest_dbbuf_addr(t->dbbuf_dbs, q->qid, false),
+                           q->sq_tail);
+    }
+    nvmetest_ring_sq(t, q, q->sq_tail);
+}
+
+static uint16_t nvmetest_submit(NvmeTest *t, NvmeTestQueue *q, NvmeCmd *cmd)
+{
+    uint16_t cid = nvmetest_push(t, q, cmd);
+
+    nvmetest_kick(t, q);
+    return cid;
+}
+
+static bool nvmetest_get_cqe(NvmeTest *t, NvmeTestQueue *q, NvmeCqe *cqe)
+{
+    qtest_memread(t->qts, q->cq_addr + q->cq_head * sizeof(*cqe), cqe,
+                  sizeof(*cqe));
+    if ((le16_to_cpu(cqe->status) & 1) != q->phase) {
+        return false;
+    }
+    if (++q->cq_head == NVME_TEST_QUEUE_SIZE) {
+        q->cq_head = 0;
+        q->phase = !q->phase;
+    }
+    return true;
+}
+
+/* Wait for the next completion queue entry, leaving the head doorbell alone */
+static void nvmetest_wait_cqe(NvmeTest *t, NvmeTestQueue *q, NvmeCqe *cqe)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (!nvmetest_get_cqe(t, q, cqe)) {
+        qtest_clock_step(t->qts, 100);
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TEST_TIMEOUT_US);
+    }
+}
+
+/* Hand the consumed completion queue entries back to the controller */
+static void nvmetest_ack_cqes(NvmeTest *t, NvmeTestQueue *q)
+{
+    if (q->qid && t->dbbuf_dbs) {
+        nvmetest_writel_le(t, nvmetest_dbbuf_addr(t->dbbuf_dbs, q->qid, true),
+                           q->cq_head);
+    } else {
+        qpci_io_writel(t->pdev, t->bar, 0x1000 + (q->qid << 3) + 4,
+                       q->cq_head);
+    }
+}
+
+static uint16_t nvmetest_status(NvmeCqe *cqe)
+{
+    return le16_to_cpu(cqe->status) >> 1;
+}
+
+static uint16_t nvmetest_admin(NvmeTest *t, NvmeCmd *cmd, uint32_t *result)
+{
+    NvmeCqe cqe;
+    uint16_t cid;
+
+    cid = nvmetest_submit(t, &t->adminq, cmd);
+    nvmetest_wait_cqe(t, &t->adminq, &cqe);
+    nvmetest_ack_cqes(t, &t->adminq);
+
+    g_assert_cmpint(le16_to_cpu(cqe.cid), ==, cid);
+    if (result) {
+        *result = le32_to_cpu(cqe.result);
+    }
+    return nvmetest_status(&cqe);
+}
+
+static uint16_t nvmetest_feature(NvmeTest *t, uint8_t opcode, uint32_t fid,
+                                 uint32_t dw11, uint32_t *result)
+{
+    NvmeCmd cmd = {
+        .opcode = opcode,
+        .cdw10 = cpu_to_le32(fid),
+        .cdw11 = cpu_to_le32(dw11),
+    };
+
+    return nvmetest_admin(t, &cmd, result);
+}
+
+/* Create I/O completion and submission queue @qid */
+static void nvmetest_create_io_queue(NvmeTest *t, NvmeTestQueue *q,
+                                     uint16_t qid, uint16_t vector, bool irq)
+{
+    NvmeCmd cmd;
+
+    nvmetest_queue_init(t, q, qid);
+
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_CQ,
+        .prp1 = cpu_to_le64(q->cq_addr),
+        .cdw10 = cpu_to_le32(((NVME_TEST_QUEUE_SIZE - 1) << 16) | qid),
+        /* Bit 1 is Interrupts Enabled */
+        .cdw11 = cpu_to_le32((vector << 16) | (irq << 1) | NVME_Q_PC),
+    };
+    g_assert_cmphex(nvmetest_admin(t, &cmd, NULL), ==, NVME_SUCCESS);
+
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_SQ,
+        .prp1 = cpu_to_le64(q->sq_addr),
+        .cdw10 = cpu_to_le32(((NVME_TEST_QUEUE_SIZE - 1) << 16) | qid),
+        .cdw11 = cpu_to_le32((qid << 16) | NVME_Q_PC),
+    };
+    g_assert_cmphex(nvmetest_admin(t, &cmd, NULL), ==, NVME_SUCCESS);
+}
+
+static void nvmetest_delete_io_queue(NvmeTest *t, NvmeTestQueue *q)
+{
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_DELETE_SQ,
+        .cdw10 = cpu_to_le32(q->qid),
+    };
+
+    g_assert_cmphex(nvmetest_admin(t, &cmd, NULL), ==, NVME_SUCCESS);
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DELETE_CQ,
+        .cdw10 = cpu_to_le32(q->qid),
+    };
+    g_assert_cmphex(nvmetest_admin(t, &cmd, NULL), ==, NVME_SUCCESS);
+}
+
+static uint16_t nvmetest_dbbuf_config(NvmeTest *t, uint64_t dbs, uint64_t eis)
+{
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_DBBUF_CONFIG,
+        .prp1 = cpu_to_le64(dbs),
+        .prp2 = cpu_to_le64(eis),
+    };
+    uint16_t status;
+
+    status = nvmetest_admin(t, &cmd, NULL);
+    if (status == NVME_SUCCESS) {
+        t->dbbuf_dbs = dbs;
+        t->dbbuf_eis = eis;
+    }
+    return status;
+}
+
+/* Read the first block of namespace 1 into @buf */
+static uint16_t nvmetest_push_read(NvmeTest *t, NvmeTestQueue *q, uint64_t buf)
+{
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_READ,
+        .nsid = cpu_to_le32(1),
+        .prp1 = cpu_to_le64(buf),
+    };
+
+    return nvmetest_push(t, q, &cmd);
+}
+
+static void nvmetest_check_read(NvmeTest *t, NvmeTestQueue *q, NvmeCqe *cqe,
+                                uint64_t buf)
+{
+    uint8_t data[512], zeroes[512] = { 0 };
+
+    g_assert_cmphex(nvmetest_status(cqe), ==, NVME_SUCCESS);
+    g_assert_cmpint(le16_to_cpu(cqe->sq_id), ==, q->qid);
+    qtest_memread(t->qts, buf, data, sizeof(data));
+    g_assert(!memcmp(data, zeroes, sizeof(data)));
+}
+
+static uint64_t nvmetest_alloc_buf(NvmeTest *t, size_t size)
+{
+    uint64_t buf = guest_alloc(t->alloc, size);
+
+    qtest_memset(t->qts, buf, 0xaa, size);
+    return buf;
+}
+
+static void nvmetest_dbbuf_test(void *obj, void *data, QGuestAllocator *alloc)
+{
+    NvmeTest t;
+    NvmeTestQueue q1, q2;
+    NvmeCqe cqe;
+    NvmeCmd cmd;
+    uint64_t dbs, eis, id, buf;
+    uint16_t oacs;
+
+    nvmetest_start(&t, obj, alloc);
+
+    id = nvmetest_alloc_buf(&t, sizeof(NvmeIdCtrl));
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_IDENTIFY,
+        .prp1 = cpu_to_le64(id),
+        .cdw10 = cpu_to_le32(1),
+    };
+    g_assert_cmphex(nvmetest_admin(&t, &cmd, NULL), ==, NVME_SUCCESS);
+    qtest_memread(t.qts, id + offsetof(NvmeIdCtrl, oacs), &oacs,
+                  sizeof(oacs));
+    g_assert(le16_to_cpu(oacs) & NVME_OACS_DBBUF);
+
+    nvmetest_create_io_queue(&t, &q1, 1, 0, false);
+
+    dbs = nvmetest_alloc_buf(&t, NVME_TEST_PAGE_SIZE);
+    eis = nvmetest_alloc_buf(&t, NVME_TEST_PAGE_SIZE);
+
+    /* Both buffers must be page aligned */
+    g_assert_cmphex(nvmetest_dbbuf_config(&t, dbs + 8, eis), ==,
+                    NVME_INVALID_FIELD | NVME_DNR);
+    g_assert_cmphex(nvmetest_dbbuf_config(&t, dbs, 0), ==,
+                    NVME_INVALID_FIELD | NVME_DNR);
+    g_assert_cmphex(nvmetest_dbbuf_config(&t, dbs, eis), ==, NVME_SUCCESS);
+
+    /* Existing and new I/O queues use them, the admin queues do not */
+    nvmetest_create_io_queue(&t, &q2, 2, 0, false);
+    g_assert_cmphex(nvmetest_readl_le(&t, nvmetest_dbbuf_addr(dbs, 0, false)),
+                    ==, 0xaaaaaaaa);
+    g_assert_cmphex(nvmetest_readl_le(&t, nvmetest_dbbuf_addr(eis, 0, true)),
+                    ==, 0xaaaaaaaa);
+    g_assert_cmpint(nvmetest_readl_le(&t, nvmetest_dbbuf_addr(dbs, 1, false)),
+                    ==, 0);
+    g_assert_cmpint(nvmetest_readl_le(&t, nvmetest_dbbuf_addr(eis, 1, false)),
+                    ==, 0);
+    g_assert_cmpint(nvmetest_readl_le(&t, nvmetest_dbbuf_addr(dbs, 2, true)),
+                    ==, 0);
+    g_assert_cmpint(nvmetest_readl_le(&t, nvmetest_dbbuf_addr(eis, 2, true)),
+                    ==, 0);
+
+    /* The SQ tail comes from the shadow doorbell, not from the MMIO write */
+    buf = nvmetest_alloc_buf(&t, NVME_TEST_PAGE_SIZE);
+    nvmetest_push_read(&t, &q1, buf);
+    nvmetest_push_read(&t, &q1, buf);
+    nvmetest_writel_le(&t, nvmetest_dbbuf_addr(dbs, 1, false), 2);
+    nvmetest_ring_sq(&t, &q1, 1);
+
+    nvmetest_wait_cqe(&t, &q1, &cqe);
+    nvmetest_check_read(&t, &q1, &cqe, buf);
+    nvmetest_wait_cqe(&t, &q1, &cqe);
+    nvmetest_check_read(&t, &q1, &cqe, buf);
+    g_assert_cmpint(le16_to_cpu(cqe.sq_head), ==, 2);
+
+    /* Not being polled, the queue wants a doorbell write for the next one */
+    g_assert_cmpint(nvmetest_readl_le(&t, nvmetest_dbbuf_addr(eis, 1, false)),
+                    ==, 2);
+
+    /* The CQ head comes from the shadow doorbell, without MMIO write */
+    nvmetest_ack_cqes(&t, &q1);
+    nvmetest_push_read(&t, &q1, buf);
+    nvmetest_kick(&t, &q1);
+    nvmetest_wait_cqe(&t, &q1, &cqe);
+    nvmetest_check_read(&t, &q1, &cqe, buf);
+    g_assert_cmpint(nvmetest_readl_le(&t, nvmetest_dbbuf_addr(eis, 1, true)),
+                    ==, 2);
+    nvmetest_ack_cqes(&t, &q1);
+
+    /* The other queue works as well */
+    nvmetest_push_read(&t, &q2, buf);
+    nvmetest_kick(&t, &q2);
+    nvmetest_wait_cqe(&t, &q2, &cqe);
+    nvmetest_check_read(&t, &q2, &cqe, buf);
+    nvmetest_ack_cqes(&t, &q2);
+
+    nvmetest_delete_io_queue(&t, &q1);
+    nvmetest_delete_io_queue(&t, &q2);
+}
+
+static void nvmetest_int_coalescing_test(void *obj, void *data,
+                                         QGuestAllocator *alloc)
+{
+    const uint32_t intc = (NVME_TEST_INTC_TIME << 8) | NVME_TEST_INTC_THR;
+    NvmeTest t;
+    NvmeTestQueue q;
+    NvmeCqe cqe;
+    uint64_t buf;
+    uint32_t result;
+    int64_t start;
+    int i;
+
+    nvmetest_start(&t, obj, alloc);
+    if (!nvmetest_msix_setup(&t, 1)) {
+        return;
+    }
+    nvmetest_create_io_queue(&t, &q, 1, 1, true);
+    buf = nvmetest_alloc_buf(&t, NVME_TEST_PAGE_SIZE);
+
+    /* Without coalescing, every completion raises an interrupt */
+    nvmetest_push_read(&t, &q, buf);
+    nvmetest_kick(&t, &q);
+    nvmetest_wait_cqe(&t, &q, &cqe);
+    nvmetest_check_read(&t, &q, &cqe, buf);
+    g_assert(nvmetest_msix_fired(&t, 1));
+    nvmetest_ack_cqes(&t, &q);
+
+    g_assert_cmphex(nvmetest_feature(&t, NVME_ADM_CMD_SET_FEATURES,
+                                     NVME_INTERRUPT_COALESCING, intc, NULL),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(nvmetest_feature(&t, NVME_ADM_CMD_GET_FEATURES,
+                                     NVME_INTERRUPT_COALESCING, 0, &result),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(result, ==, intc);
+
+    /* Up to the aggregation threshold, the interrupt waits for the time */
+    nvmetest_push_read(&t, &q, buf);
+    nvmetest_kick(&t, &q);
+    nvmetest_wait_cqe(&t, &q, &cqe);
+    nvmetest_check_read(&t, &q, &cqe, buf);
+    g_assert(!nvmetest_msix_fired(&t, 1));
+    qtest_clock_step(t.qts, NVME_TEST_INTC_TIME_NS);
+    g_assert(nvmetest_msix_fired(&t, 1));
+    nvmetest_ack_cqes(&t, &q);
+
+    /* Beyond the threshold, it is raised right away */
+    start = qtest_clock_step(t.qts, 0);
+    for (i = 0; i <= NVME_TEST_INTC_THR; i++) {
+        nvmetest_push_read(&t, &q, buf);
+    }
+    nvmetest_kick(&t, &q);
+    for (i = 0; i <= NVME_TEST_INTC_THR; i++) {
+        nvmetest_wait_cqe(&t, &q, &cqe);
+        nvmetest_check_read(&t, &q, &cqe, buf);
+    }
+    g_assert_cmpint(qtest_clock_step(t.qts, 0) - start, <,
+                    NVME_TEST_INTC_TIME_NS);
+    g_assert(nvmetest_msix_fired(&t, 1));
+    nvmetest_ack_cqes(&t, &q);
+
+    /* Interrupt Vector Configuration disables coalescing per vector */
+    g_assert_cmphex(nvmetest_feature(&t, NVME_ADM_CMD_GET_FEATURES,
+                                     NVME_INTERRUPT_VECTOR_CONF, 1, &result),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(result, ==, 1);
+    g_assert_cmphex(nvmetest_feature(&t, NVME_ADM_CMD_SET_FEATURES,
+                                     NVME_INTERRUPT_VECTOR_CONF,
+                                     (1 << 16) | 1, NULL),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(nvmetest_feature(&t, NVME_ADM_CMD_GET_FEATURES,
+                                     NVME_INTERRUPT_VECTOR_CONF, 1, &result),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(result, ==, (1 << 16) | 1);
+
+    nvmetest_push_read(&t, &q, buf);
+    nvmetest_kick(&t, &q);
+    nvmetest_wait_cqe(&t, &q, &cqe);
+    nvmetest_check_read(&t, &q, &cqe, buf);
+    g_assert(nvmetest_msix_fired(&t, 1));
+    nvmetest_ack_cqes(&t, &q);
+
+    /* Only vectors that completion queues can use are accepted */
+    g_assert_cmphex(nvmetest_feature(&t, NVME_ADM_CMD_SET_FEATURES,
+                                     NVME_INTERRUPT_VECTOR_CONF, 0xffff, NULL),
+                    ==, NVME_INVALID_FIELD | NVME_DNR);
+    g_assert_cmphex(nvmetest_feature(&t, NVME_ADM_CMD_GET_FEATURES,
+                                     NVME_INTERRUPT_VECTOR_CONF, 0xffff, NULL),
+                    ==, NVME_INVALID_FIELD | NVME_DNR);
+
+    nvmetest_delete_io_queue(&t, &q);
+}
+
+/* I/O queues 1 and 2 are served by two iothreads */
+static void nvmetest_iothreads_test(void *obj, void *data,
+                                    QGuestAllocator *alloc)
+{
+    NvmeTest t;
+    NvmeTestQueue q[2];
+    NvmeCqe cqe;
+    uint64_t buf[2];
+    bool msix;
+    int i;
+
+    nvmetest_start(&t, obj, alloc);
+    msix = nvmetest_msix_setup(&t, 1) && nvmetest_msix_setup(&t, 2);
+
+    for (i = 0; i < 2; i++) {
+        nvmetest_create_io_queue(&t, &q[i], i + 1, i + 1, msix);
+        buf[i] = nvmetest_alloc_buf(&t, NVME_TEST_PAGE_SIZE);
+    }
+
+    for (i = 0; i < 2; i++) {
+        nvmetest_push_read(&t, &q[i], buf[i]);
+        nvmetest_kick(&t, &q[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        nvmetest_wait_cqe(&t, &q[i], &cqe);
+        nvmetest_check_read(&t, &q[i], &cqe, buf[i]);
+        /* The main loop raises the interrupts for the iothreads */
+        if (msix) {
+            nvmetest_wait_msix(&t, i + 1);
+        }
+        nvmetest_ack_cqes(&t, &q[i]);
+    }
+
+    /* Deleting waits for the commands in the iothread */
+    for (i = 0; i < 2; i++) {
+        nvmetest_push_read(&t, &q[i], buf[i]);
+        nvmetest_kick(&t, &q[i]);
+        nvmetest_delete_io_queue(&t, &q[i]);
+    }
+
+    /* Resetting the controller stops queues that are still busy */
+    nvmetest_create_io_queue(&t, &q[0], 1, 1, msix);
+    nvmetest_push_read(&t, &q[0], buf[0]);
+    nvmetest_kick(&t, &q[0]);
+    qpci_io_writel(t.pdev, t.bar, offsetof(NvmeBar, cc), 0);
+    g_assert(!(qpci_io_readl(t.pdev, t.bar, offsetof(NvmeBar, csts)) &
+               NVME_CSTS_READY));
+}
+
+/*
+ * With shadow doorbells, the submission queue served by an iothread gets an
+ * ioeventfd, so a doorbell write is picked up without the timer that MMIO
+ * doorbell writes arm.
+ */
+static void nvmetest_ioeventfd_test(void *obj, void *data,
+                                    QGuestAllocator *alloc)
+{
+    NvmeTest t;
+    NvmeTestQueue q;
+    NvmeCqe cqe;
+    uint64_t dbs, eis, buf;
+    uint32_t ei;
+    gint64 start_time;
+
+    nvmetest_start(&t, obj, alloc);
+    nvmetest_create_io_queue(&t, &q, 1, 0, false);
+    dbs = nvmetest_alloc_buf(&t, NVME_TEST_PAGE_SIZE);
+    eis = nvmetest_alloc_buf(&t, NVME_TEST_PAGE_SIZE);
+    g_assert_cmphex(nvmetest_dbbuf_config(&t, dbs, eis), ==, NVME_SUCCESS);
+
+    buf = nvmetest_alloc_buf(&t, NVME_TEST_PAGE_SIZE);
+    nvmetest_push_read(&t, &q, buf);
+    nvmetest_push_read(&t, &q, buf);
+    nvmetest_kick(&t, &q);
+
+    /*
+     * Without advancing the virtual clock, the iothread fetches both
+     * commands and moves the EventIdx to the tail, or one behind it while
+     * it is polling the queue.
+     */
+    start_time = g_get_monotonic_time();
+    do {
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TEST_TIMEOUT_US);
+        ei = nvmetest_readl_le(&t, nvmetest_dbbuf_addr(eis, 1, false));
+    } while (ei != 1 && ei != 2);
+
+    nvmetest_wait_cqe(&t, &q, &cqe);
+    nvmetest_check_read(&t, &q, &cqe, buf);
+    nvmetest_wait_cqe(&t, &q, &cqe);
+    nvmetest_check_read(&t, &q, &cqe, buf);
+    g_assert_cmpint(le16_to_cpu(cqe.sq_head), ==, 2);
+    nvmetest_ack_cqes(&t, &q);
+
+    nvmetest_delete_io_queue(&t, &q);
+}
+
 static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
@@ -83,6 +711,23 @@ static void nvme_register_nodes(void)
     qos_add_test("oob-cmb-access", "nvme", nvmetest_oob_cmb_test, &(QOSGraphTestOptions) {
         .edge.extra_device_opts = "cmb_size_mb=2"
     });
+    qos_add_test("dbbuf", "nvme", nvmetest_dbbuf_test, NULL);
+    qos_add_test("int-coalescing", "nvme", nvmetest_int_coalescing_test,
+                 NULL);
+    qos_add_test("iothreads", "nvme", nvmetest_iothreads_test,
+                 &(QOSGraphTestOptions) {
+        .edge.before_cmd_line = "-object iothread,id=nvme_io0 "
+                                "-object iothread,id=nvme_io1",
+        .edge.extra_device_opts = "num_queues=3,len-iothreads=2,"
+                                  "iothreads[0]=nvme_io0,"
+                                  "iothreads[1]=nvme_io1",
+    });
+    qos_add_test("ioeventfd", "nvme", nvmetest_ioeventfd_test,
+                 &(QOSGraphTestOptions) {
+        .edge.before_cmd_line = "-object iothread,id=nvme_io0",
+        .edge.extra_device_opts = "num_queues=2,len-iothreads=1,"
+                                  "iothreads[0]=nvme_io0",
+    });
 }
 
 libqos_init(nvme_register_nodes);
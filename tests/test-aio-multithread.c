@@ -15,6 +15,7 @@
 #include "qemu/coroutine.h"
 #include "qemu/thread.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 #include "iothread.h"
 
 /* AioContext management */
@@ -431,6 +432,105 @@ static void test_multi_mutex_10(void)
     test_multi_mutex(NUM_CONTEXTS, 10);
 }
 
+/* Polling statistics, collected while the iothread is busy.  */
+
+#define POLL_STATS_MAX_NS 32000
+
+static EventNotifier poll_stats_notifier;
+static bool poll_stats_pending;
+static int poll_stats_handled;
+
+static bool poll_stats_handle(void)
+{
+    if (atomic_xchg(&poll_stats_pending, false)) {
+        atomic_inc(&poll_stats_handled);
+        return true;
+    }
+    return false;
+}
+
+static void poll_stats_read(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+    poll_stats_handle();
+}
+
+static bool poll_stats_poll(void *opaque)
+{
+    return poll_stats_handle();
+}
+
+static void poll_stats_add_cb(void *opaque)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    aio_context_set_poll_params(ctx, POLL_STATS_MAX_NS, 0, 0, &error_abort);
+    aio_set_event_notifier(ctx, &poll_stats_notifier, false,
+                           poll_stats_read, poll_stats_poll);
+}
+
+static void poll_stats_del_cb(void *opaque)
+{
+    aio_set_event_notifier(qemu_get_current_aio_context(),
+                           &poll_stats_notifier, false, NULL, NULL);
+}
+
+typedef struct {
+    AioPollHandlerStats *stats;
+    int n;
+} PollStatsSnapshot;
+
+static void poll_stats_get_cb(void *opaque)
+{
+    PollStatsSnapshot *snap = opaque;
+
+    snap->n = aio_context_get_poll_stats(qemu_get_current_aio_context(),
+                                         &snap->stats);
+}
+
+static void test_multi_poll_stats(void)
+{
+    uint64_t last_events = 0;
+    int i, j;
+
+    create_aio_contexts();
+    event_notifier_init(&poll_stats_notifier, false);
+    ctx_run(0, poll_stats_add_cb, NULL);
+
+    for (i = 0; i < 1000; i++) {
+        atomic_set(&poll_stats_pending, true);
+        event_notifier_set(&poll_stats_notifier);
+
+        if (i % 50 == 49) {
+            PollStatsSnapshot snap = {};
+            uint64_t sum = 0;
+
+            ctx_run(0, poll_stats_get_cb, &snap);
+            g_assert_cmpint(snap.n, ==, 1);
+            g_assert_cmpint(snap.stats[0].fd, ==,
+                            event_notifier_get_fd(&poll_stats_notifier));
+            g_assert_cmpint(snap.stats[0].poll_ns, >=, 0);
+            g_assert_cmpint(snap.stats[0].poll_ns, <=, POLL_STATS_MAX_NS);
+            g_assert_cmpuint(snap.stats[0].poll_hits, <=,
+                             snap.stats[0].events);
+            g_assert_cmpuint(snap.stats[0].events, >=, last_events);
+            for (j = 0; j < AIO_POLL_HISTOGRAM_BINS; j++) {
+                sum += snap.stats[0].histogram[j];
+            }
+            g_assert_cmpuint(sum, ==, snap.stats[0].events);
+            last_events = snap.stats[0].events;
+            g_free(snap.stats);
+        }
+    }
+
+    g_assert_cmpuint(last_events, >, 0);
+    g_assert_cmpint(atomic_read(&poll_stats_handled), >, 0);
+
+    ctx_run(0, poll_stats_del_cb, NULL);
+    event_notifier_cleanup(&poll_stats_notifier);
+    join_aio_contexts();
+}
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -439,6 +539,7 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/aio/multi/lifecycle", test_lifecycle);
+    g_test_add_func("/aio/multi/poll-stats", test_multi_poll_stats);
     if (g_test_quick()) {
         g_test_add_func("/aio/multi/schedule", test_multi_co_schedule_1);
         g_test_add_func("/aio/multi/mutex/contended", test_multi_co_mutex_1);
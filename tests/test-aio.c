@@ -18,6 +18,7 @@
 #include "qemu/error-report.h"
 #include "qemu/coroutine.h"
 #include "qemu/main-loop.h"
+#include "iothread.h"
 
 static AioContext *ctx;
 
@@ -876,6 +877,78 @@ static void test_queue_chaining(void)
     g_assert_cmpint(data_b.i, ==, data_b.max);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Tests for io_uring file descriptor monitoring, run in an iothread.  */
+
+static QemuEvent io_uring_done;
+
+static void io_uring_handler_changes_cb(void *opaque)
+{
+    AioContext *uring_ctx = opaque;
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    EventNotifierTestData other = { .n = 0, .active = 1 };
+
+    event_notifier_init(&data.e, false);
+    event_notifier_init(&other.e, false);
+
+    /* Submit the POLL_ADD, nothing is ready yet */
+    set_event_notifier(uring_ctx, &data.e, dummy_io_handler_read);
+    aio_poll(uring_ctx, false);
+
+    /* Add a handler and modify the first one while its POLL_ADD is pending */
+    set_event_notifier(uring_ctx, &other.e, event_ready_cb);
+    set_event_notifier(uring_ctx, &data.e, event_ready_cb);
+
+    event_notifier_set(&data.e);
+    while (data.active > 0) {
+        aio_poll(uring_ctx, true);
+    }
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(other.n, ==, 0);
+
+    event_notifier_set(&other.e);
+    while (other.active > 0) {
+        aio_poll(uring_ctx, true);
+    }
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(other.n, ==, 1);
+
+    /* Submit the re-armed POLL_ADD, then remove the handler and fire it */
+    aio_poll(uring_ctx, false);
+    set_event_notifier(uring_ctx, &data.e, NULL);
+    event_notifier_set(&data.e);
+    while (aio_poll(uring_ctx, false)) {
+        /* Reap the POLL_ADD of the removed handler */
+    }
+    g_assert_cmpint(data.n, ==, 1);
+
+    set_event_notifier(uring_ctx, &other.e, NULL);
+    event_notifier_cleanup(&data.e);
+    event_notifier_cleanup(&other.e);
+
+    qemu_event_set(&io_uring_done);
+}
+
+static void test_io_uring_handler_changes(void)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *uring_ctx = iothread_get_aio_context(iothread);
+
+    if (!uring_ctx->fdmon_io_uring) {
+        iothread_join(iothread);
+        g_test_skip("io_uring is not available");
+        return;
+    }
+
+    qemu_event_init(&io_uring_done, false);
+    aio_bh_schedule_oneshot(uring_ctx, io_uring_handler_changes_cb, uring_ctx);
+    qemu_event_wait(&io_uring_done);
+    qemu_event_destroy(&io_uring_done);
+
+    iothread_join(iothread);
+}
+#endif
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -902,6 +975,10 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
+#ifdef CONFIG_LINUX_IO_URING
+    g_test_add_func("/aio/io_uring/handler-changes",
+                    test_io_uring_handler_changes);
+#endif
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
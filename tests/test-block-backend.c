@@ -24,8 +24,12 @@
 
 #include "qemu/osdep.h"
 #include "block/block.h"
+#include "block/block_int.h"
+#include "block/blockjob_int.h"
+#include "block/write-threshold.h"
 #include "sysemu/block-backend.h"
 #include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
 #include "qemu/main-loop.h"
 
 static void test_drain_aio_error_flush_cb(void *opaque, int ret)
@@ -70,6 +74,311 @@ static void test_drain_all_aio_error(void)
     blk_unref(blk);
 }
 
+typedef struct BDRVMergeTestState {
+    int num_reads;
+    int num_writes;
+    uint64_t bytes[8];
+} BDRVMergeTestState;
+
+static int coroutine_fn bdrv_merge_test_co_prwv(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                uint64_t bytes,
+                                                QEMUIOVector *qiov, int flags,
+                                                bool is_write)
+{
+    BDRVMergeTestState *s = bs->opaque;
+    int n = s->num_reads + s->num_writes;
+
+    g_assert(qiov->size == bytes);
+    if (n < ARRAY_SIZE(s->bytes)) {
+        s->bytes[n] = bytes;
+    }
+    if (is_write) {
+        s->num_writes++;
+    } else {
+        s->num_reads++;
+    }
+
+    /* Complete asynchronously like a real driver */
+    aio_co_schedule(qemu_get_current_aio_context(), qemu_coroutine_self());
+    qemu_coroutine_yield();
+    return 0;
+}
+
+static int coroutine_fn bdrv_merge_test_co_preadv(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  int flags)
+{
+    return bdrv_merge_test_co_prwv(bs, offset, bytes, qiov, flags, false);
+}
+
+static int coroutine_fn bdrv_merge_test_co_pwritev(BlockDriverState *bs,
+                                                   uint64_t offset,
+                                                   uint64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   int flags)
+{
+    return bdrv_merge_test_co_prwv(bs, offset, bytes, qiov, flags, true);
+}
+
+static int64_t bdrv_merge_test_getlength(BlockDriverState *bs)
+{
+    return 1 << 20;
+}
+
+static BlockDriver bdrv_merge_test = {
+    .format_name            = "merge-test",
+    .instance_size          = sizeof(BDRVMergeTestState),
+
+    .bdrv_co_preadv         = bdrv_merge_test_co_preadv,
+    .bdrv_co_pwritev        = bdrv_merge_test_co_pwritev,
+    .bdrv_getlength         = bdrv_merge_test_getlength,
+};
+
+static void test_merge_cb(void *opaque, int ret)
+{
+    int *completed = opaque;
+
+    g_assert(ret == 0);
+    (*completed)++;
+}
+
+static void test_merge_requests(void)
+{
+    BlockBackend *blk = blk_new(qemu_get_aio_context(),
+                                BLK_PERM_ALL, BLK_PERM_ALL);
+    BlockDriverState *bs;
+    BDRVMergeTestState *s;
+    QEMUIOVector qiov[5];
+    uint8_t buf[5][512];
+    int completed = 0;
+    int i;
+
+    bs = bdrv_new_open_driver(&bdrv_merge_test, "merge-test", BDRV_O_RDWR,
+                              &error_abort);
+    s = bs->opaque;
+    blk_insert_bs(blk, bs, &error_abort);
+    blk_set_request_merging(blk, true, 0);
+
+    for (i = 0; i < 5; i++) {
+        qemu_iovec_init_buf(&qiov[i], buf[i], sizeof(buf[i]));
+    }
+
+    /* Contiguous reads in reverse order, a write, and a read elsewhere */
+    blk_aio_preadv(blk, 1024, &qiov[0], 0, test_merge_cb, &completed);
+    blk_aio_preadv(blk, 512, &qiov[1], 0, test_merge_cb, &completed);
+    blk_aio_preadv(blk, 0, &qiov[2], 0, test_merge_cb, &completed);
+    blk_aio_pwritev(blk, 1536, &qiov[3], 0, test_merge_cb, &completed);
+    blk_aio_preadv(blk, 8192, &qiov[4], 0, test_merge_cb, &completed);
+    g_assert_cmpint(s->num_reads + s->num_writes, ==, 0);
+    g_assert_cmpint(completed, ==, 0);
+
+    while (completed < 5) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(s->num_reads, ==, 2);
+    g_assert_cmpint(s->num_writes, ==, 1);
+    g_assert_cmpint(s->bytes[0], ==, 1536);
+    g_assert_cmpint(s->bytes[1], ==, 512);
+    g_assert_cmpint(s->bytes[2], ==, 512);
+
+    /* Requests are held back until the plugged section ends */
+    s->num_reads = s->num_writes = 0;
+    completed = 0;
+    blk_io_plug(blk);
+    for (i = 0; i < 4; i++) {
+        blk_aio_pwritev(blk, i * 512, &qiov[i], 0, test_merge_cb, &completed);
+        aio_poll(qemu_get_aio_context(), false);
+    }
+    g_assert_cmpint(s->num_writes, ==, 0);
+    blk_io_unplug(blk);
+
+    /* Draining submits any requests that are still held back */
+    blk_aio_preadv(blk, 0, &qiov[4], 0, test_merge_cb, &completed);
+    blk_drain(blk);
+    g_assert_cmpint(completed, ==, 5);
+    g_assert_cmpint(s->num_writes, ==, 1);
+    g_assert_cmpint(s->num_reads, ==, 1);
+    g_assert_cmpint(s->bytes[0], ==, 2048);
+
+    blk_unref(blk);
+    bdrv_unref(bs);
+}
+
+/* A plugged section that queues more requests than can be merged at once */
+static void test_merge_queue_full(void)
+{
+    BlockBackend *blk = blk_new(qemu_get_aio_context(),
+                                BLK_PERM_ALL, BLK_PERM_ALL);
+    BlockDriverState *bs;
+    BDRVMergeTestState *s;
+    const int num_reqs = 70;
+    QEMUIOVector qiov;
+    uint8_t buf[512];
+    int completed = 0;
+    int i;
+
+    bs = bdrv_new_open_driver(&bdrv_merge_test, "merge-test", BDRV_O_RDWR,
+                              &error_abort);
+    s = bs->opaque;
+    blk_insert_bs(blk, bs, &error_abort);
+    blk_set_request_merging(blk, true, 0);
+    qemu_iovec_init_buf(&qiov, buf, sizeof(buf));
+
+    /* Every 32 requests are submitted right away, plugged or not */
+    blk_io_plug(blk);
+    for (i = 0; i < num_reqs; i++) {
+        blk_aio_pwritev(blk, i * 512, &qiov, 0, test_merge_cb, &completed);
+        g_assert_cmpint(s->num_writes, ==, (i + 1) / 32);
+    }
+    g_assert_cmpint(completed, ==, 0);
+    blk_io_unplug(blk);
+
+    while (completed < num_reqs) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(s->num_writes, ==, 3);
+    g_assert_cmpint(s->bytes[0], ==, 32 * 512);
+    g_assert_cmpint(s->bytes[1], ==, 32 * 512);
+    g_assert_cmpint(s->bytes[2], ==, (num_reqs - 64) * 512);
+
+    blk_unref(blk);
+    bdrv_unref(bs);
+}
+
+static BlockDriverState *test_multiqueue_open(const char *driver,
+                                              const char *file_driver,
+                                              const char *file)
+{
+    QDict *opts = qdict_new();
+
+    qdict_put_str(opts, "driver", driver);
+    if (file_driver) {
+        qdict_put_str(opts, "file.driver", file_driver);
+    } else if (file) {
+        qdict_put_str(opts, "file", file);
+    }
+    return bdrv_open(NULL, NULL, opts, BDRV_O_RDWR, &error_abort);
+}
+
+/* Only graphs whose nodes all support multiqueue accept it */
+static void test_multiqueue_graph(void)
+{
+    BlockBackend *blk = blk_new(qemu_get_aio_context(),
+                                BLK_PERM_ALL, BLK_PERM_ALL);
+    AioContext *ctx = aio_context_new(&error_abort);
+    BlockDriverState *bs, *unsafe_bs;
+    Error *local_err = NULL;
+
+    /* No medium yet, nothing to check */
+    g_assert_cmpint(blk_set_multiqueue(blk, &ctx, 1, &error_abort), ==, 0);
+    g_assert_cmpint(blk_set_multiqueue(blk, NULL, 0, &error_abort), ==, 0);
+
+    /* raw over null-co */
+    bs = test_multiqueue_open("raw", "null-co", NULL);
+    blk_insert_bs(blk, bs, &error_abort);
+    g_assert_cmpint(blk_set_multiqueue(blk, &ctx, 1, &error_abort), ==, 0);
+    blk_remove_bs(blk);
+    bdrv_unref(bs);
+
+    /* A node with a driver that does not declare support */
+    unsafe_bs = bdrv_new_open_driver(&bdrv_merge_test, "unsafe", BDRV_O_RDWR,
+                                     &error_abort);
+    blk_insert_bs(blk, unsafe_bs, &error_abort);
+    g_assert_cmpint(blk_set_multiqueue(blk, &ctx, 1, &local_err), <, 0);
+    g_assert(local_err);
+    g_assert(strstr(error_get_pretty(local_err), "'unsafe'"));
+    error_free(local_err);
+    local_err = NULL;
+    blk_remove_bs(blk);
+
+    /* ... also when it is not the root node */
+    bs = test_multiqueue_open("raw", NULL, "unsafe");
+    blk_insert_bs(blk, bs, &error_abort);
+    g_assert_cmpint(blk_set_multiqueue(blk, &ctx, 1, &local_err), <, 0);
+    g_assert(local_err);
+    g_assert(strstr(error_get_pretty(local_err), "'unsafe'"));
+    error_free(local_err);
+
+    /* A drained section checks the graph again */
+    blk_remove_bs(blk);
+    bdrv_unref(bs);
+    bs = test_multiqueue_open("null-co", NULL, NULL);
+    blk_insert_bs(blk, bs, &error_abort);
+    g_assert_cmpint(blk_set_multiqueue(blk, &ctx, 1, &error_abort), ==, 0);
+    blk_drain(blk);
+
+    blk_unref(blk);
+    bdrv_unref(bs);
+    bdrv_unref(unsafe_bs);
+    aio_context_unref(ctx);
+}
+
+static const BlockJobDriver test_multiqueue_job_driver = {
+    .job_driver = {
+        .instance_size = sizeof(BlockJob),
+        .free          = block_job_free,
+        .user_resume   = block_job_user_resume,
+        .drain         = block_job_drain,
+    },
+};
+
+/* Block jobs and before-write notifiers turn multiqueue off while they exist */
+static void test_multiqueue_users(void)
+{
+    BlockBackend *blk = blk_new(qemu_get_aio_context(),
+                                BLK_PERM_ALL, BLK_PERM_ALL);
+    AioContext *ctx = aio_context_new(&error_abort);
+    BlockDriverState *bs;
+    BlockJob *job;
+    Error *local_err = NULL;
+
+    bs = test_multiqueue_open("null-co", NULL, NULL);
+    blk_insert_bs(blk, bs, &error_abort);
+    g_assert_cmpint(blk_set_multiqueue(blk, &ctx, 1, &error_abort), ==, 0);
+    g_assert(blk_get_multiqueue(blk));
+
+    /* A write threshold is added in a drained section */
+    bdrv_drained_begin(bs);
+    bdrv_write_threshold_set(bs, 1024 * 1024);
+    bdrv_drained_end(bs);
+    g_assert(!blk_get_multiqueue(blk));
+
+    bdrv_drained_begin(bs);
+    bdrv_write_threshold_set(bs, 0);
+    bdrv_drained_end(bs);
+    g_assert(blk_get_multiqueue(blk));
+
+    /* Creating a block job drains the node */
+    job = block_job_create("job0", &test_multiqueue_job_driver, NULL, bs,
+                           0, BLK_PERM_ALL, 0, JOB_DEFAULT, NULL, NULL,
+                           &error_abort);
+    g_assert(!blk_get_multiqueue(blk));
+
+    /* Multiqueue comes back with the next drained section after the job */
+    job_early_fail(&job->job);
+    g_assert(!blk_get_multiqueue(blk));
+    blk_drain(blk);
+    g_assert(blk_get_multiqueue(blk));
+
+    /* Enabling it fails while the job exists */
+    job = block_job_create("job0", &test_multiqueue_job_driver, NULL, bs,
+                           0, BLK_PERM_ALL, 0, JOB_DEFAULT, NULL, NULL,
+                           &error_abort);
+    g_assert_cmpint(blk_set_multiqueue(blk, &ctx, 1, &local_err), <, 0);
+    g_assert(local_err);
+    g_assert(strstr(error_get_pretty(local_err), "block job"));
+    error_free(local_err);
+    g_assert(!blk_get_multiqueue(blk));
+    job_early_fail(&job->job);
+
+    blk_unref(blk);
+    bdrv_unref(bs);
+    aio_context_unref(ctx);
+}
+
 int main(int argc, char **argv)
 {
     bdrv_init();
@@ -80,6 +389,10 @@ int main(int argc, char **argv)
     g_test_add_func("/block-backend/drain_aio_error", test_drain_aio_error);
     g_test_add_func("/block-backend/drain_all_aio_error",
                     test_drain_all_aio_error);
+    g_test_add_func("/block-backend/merge_requests", test_merge_requests);
+    g_test_add_func("/block-backend/merge_queue_full", test_merge_queue_full);
+    g_test_add_func("/block-backend/multiqueue_graph", test_multiqueue_graph);
+    g_test_add_func("/block-backend/multiqueue_users", test_multiqueue_users);
 
     return g_test_run();
 }
@@ -994,6 +994,53 @@ static void test_hbitmap_next_zero_do(TestHBitmapData *data, int granularity)
     test_hbitmap_next_zero_check(data, 0);
 }
 
+/* Run the same random operations with each of the accelerated kernels and
+ * compare the results against the shadow bitmap.
+ */
+static void test_hbitmap_accel_do(TestHBitmapData *data)
+{
+    uint64_t size = L2 * 8 + 3;
+    HBitmap *other;
+    int i;
+
+    hbitmap_test_init(data, size, 0);
+    other = hbitmap_alloc(size, 0);
+    for (i = 0; i < 200; i++) {
+        uint64_t first = g_test_rand_int_range(0, size);
+        uint64_t max = MIN(size - first, L2 * 2);
+        uint64_t count = g_test_rand_int_range(1, max + 1);
+
+        switch (g_test_rand_int_range(0, 4)) {
+        case 0:
+        case 1:
+            hbitmap_test_set(data, first, count);
+            break;
+        case 2:
+            hbitmap_test_reset(data, first, count);
+            break;
+        case 3:
+            hbitmap_reset_all(other);
+            hbitmap_set(other, first, count);
+            g_assert(hbitmap_merge(data->hb, other, data->hb));
+            hbitmap_test_set(data, first, count);
+            break;
+        }
+
+        test_hbitmap_next_zero_check(data, 0);
+        test_hbitmap_next_zero_check(data, first);
+        test_hbitmap_next_zero_check_range(data, first, count);
+    }
+    hbitmap_free(other);
+}
+
+static void test_hbitmap_accel(TestHBitmapData *data, const void *unused)
+{
+    do {
+        test_hbitmap_accel_do(data);
+        hbitmap_test_teardown(data, NULL);
+    } while (test_hbitmap_next_accel());
+}
+
 static void test_hbitmap_next_zero_0(TestHBitmapData *data, const void *unused)
 {
     test_hbitmap_next_zero_do(data, 0);
@@ -1190,6 +1237,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_zero/next_zero_after_truncate",
                      test_hbitmap_next_zero_after_truncate);
 
+    hbitmap_test_add("/hbitmap/accel", test_hbitmap_accel);
+
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_0",
                      test_hbitmap_next_dirty_area_0);
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_1",
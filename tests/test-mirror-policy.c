@@ -0,0 +1,306 @@
+/*
+ * Mirror job request sizing and hot region deferral tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "block/block.h"
+#include "block/mirror-policy.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+
+#define TEST_GRANULARITY (64 * KiB)
+#define TEST_BUF_SIZE (16 * MiB)
+
+/*
+ * Throughput of a simulated target in bytes per second for a request size,
+ * and the latency of each request in nanoseconds
+ */
+typedef uint64_t TestThroughputFunc(int64_t io_bytes);
+
+/*
+ * Complete requests of the currently chosen size back to back until
+ * @intervals adaptation intervals have passed.  Returns how many of these
+ * intervals ran with a size of @count_bytes.
+ */
+static int run_intervals(MirrorIOSizer *z, int64_t *now, int intervals,
+                         TestThroughputFunc *tp, int64_t latency_ns,
+                         int64_t count_bytes)
+{
+    int count = 0;
+    int i;
+
+    for (i = 0; i < intervals; i++) {
+        int64_t io_bytes = z->io_bytes;
+        int64_t start = z->start_ns;
+
+        if (io_bytes == count_bytes) {
+            count++;
+        }
+
+        while (z->start_ns == start) {
+            *now += io_bytes * NANOSECONDS_PER_SECOND / tp(io_bytes);
+            mirror_io_sizer_complete(z, io_bytes, latency_ns, *now);
+
+            g_assert_cmpint(z->io_bytes, >=, z->min_io_bytes);
+            g_assert_cmpint(z->io_bytes, <=, z->cap_io_bytes);
+            g_assert_cmpint(z->io_bytes % z->granularity, ==, 0);
+        }
+    }
+
+    return count;
+}
+
+/* A target that works best with 2 MiB requests */
+static uint64_t tp_peak_2m(int64_t io_bytes)
+{
+    switch (io_bytes) {
+    case 64 * KiB:
+        return 100 * MiB;
+    case 128 * KiB:
+        return 150 * MiB;
+    case 256 * KiB:
+        return 200 * MiB;
+    case 512 * KiB:
+        return 300 * MiB;
+    case 1 * MiB:
+        return 400 * MiB;
+    case 2 * MiB:
+        return 500 * MiB;
+    default:
+        return 250 * MiB;
+    }
+}
+
+/* A target whose throughput keeps growing with the request size */
+static uint64_t tp_growing(int64_t io_bytes)
+{
+    return io_bytes * 256;
+}
+
+static void test_io_size_bounds(void)
+{
+    MirrorIOSizer z;
+    int64_t now = 0;
+
+    /* The limits are aligned to the granularity */
+    mirror_io_sizer_init(&z, 1 * MiB, TEST_BUF_SIZE / 4 + 1, TEST_GRANULARITY,
+                         now);
+    g_assert_cmpint(z.io_bytes, ==, 1 * MiB);
+    g_assert_cmpint(z.min_io_bytes, ==, MIRROR_MIN_IO_BYTES);
+    g_assert_cmpint(z.cap_io_bytes, ==, TEST_BUF_SIZE / 4);
+
+    /* A granularity larger than the minimum size raises the minimum */
+    mirror_io_sizer_init(&z, 4 * MiB, 1 * MiB, 2 * MiB, now);
+    g_assert_cmpint(z.min_io_bytes, ==, 2 * MiB);
+    g_assert_cmpint(z.cap_io_bytes, ==, 4 * MiB);
+
+    /* Growing throughput drives the size up to the cap, but not beyond */
+    mirror_io_sizer_init(&z, 1 * MiB, TEST_BUF_SIZE / 4, TEST_GRANULARITY,
+                         now);
+    run_intervals(&z, &now, 100, tp_growing, 1 * SCALE_MS, 0);
+    g_assert_cmpint(z.io_bytes, ==, z.cap_io_bytes);
+
+    /* Slow requests make it shrink down to the minimum, but not below */
+    run_intervals(&z, &now, 100, tp_growing,
+                  2 * MIRROR_LATENCY_TARGET_NS, 0);
+    g_assert_cmpint(z.io_bytes, ==, z.min_io_bytes);
+
+    /* Once requests are fast again, probing makes it grow again */
+    run_intervals(&z, &now, 100, tp_growing, 1 * SCALE_MS, 0);
+    g_assert_cmpint(z.io_bytes, ==, z.cap_io_bytes);
+}
+
+static void test_io_size_peak(void)
+{
+    MirrorIOSizer z;
+    int64_t now = 0;
+    int at_peak;
+
+    mirror_io_sizer_init(&z, 1 * MiB, TEST_BUF_SIZE / 4, TEST_GRANULARITY,
+                         now);
+    run_intervals(&z, &now, 10, tp_peak_2m, 1 * SCALE_MS, 0);
+    g_assert_cmpint(z.io_bytes, ==, 2 * MiB);
+
+    /* Probing 4 MiB now and then is fine, but most of the time is at 2 MiB */
+    at_peak = run_intervals(&z, &now, 100, tp_peak_2m, 1 * SCALE_MS, 2 * MiB);
+    g_assert_cmpint(at_peak, >=, 80);
+
+    /* Starting at the minimum finds the same size */
+    mirror_io_sizer_init(&z, 64 * KiB, TEST_BUF_SIZE / 4, TEST_GRANULARITY,
+                         now);
+    run_intervals(&z, &now, 10, tp_peak_2m, 1 * SCALE_MS, 0);
+    g_assert_cmpint(z.io_bytes, ==, 2 * MiB);
+
+    /* Too few requests per interval never change the size */
+    mirror_io_sizer_init(&z, 1 * MiB, TEST_BUF_SIZE / 4, TEST_GRANULARITY,
+                         now);
+    now += MIRROR_ADAPT_INTERVAL_NS;
+    mirror_io_sizer_complete(&z, 1 * MiB, 1 * SCALE_MS, now);
+    g_assert_cmpint(z.io_bytes, ==, 1 * MiB);
+}
+
+typedef struct TestHeatState {
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    BdrvDirtyBitmapIter *dbi;
+    MirrorHeatMap heat_map;
+    int64_t length;
+    int64_t now;
+} TestHeatState;
+
+static void test_heat_start(TestHeatState *t, int64_t length)
+{
+    QDict *opts = qdict_new();
+
+    qdict_put_str(opts, "driver", "null-co");
+    qdict_put_int(opts, "size", length);
+    t->bs = bdrv_open(NULL, NULL, opts, BDRV_O_RDWR, &error_abort);
+    t->bitmap = bdrv_create_dirty_bitmap(t->bs, TEST_GRANULARITY, NULL,
+                                         &error_abort);
+    t->dbi = bdrv_dirty_iter_new(t->bitmap);
+    t->length = length;
+    t->now = 0;
+    mirror_heat_map_init(&t->heat_map, length, t->now);
+
+    bdrv_set_dirty_bitmap(t->bitmap, 0, length);
+}
+
+static void test_heat_end(TestHeatState *t)
+{
+    mirror_heat_map_cleanup(&t->heat_map);
+    bdrv_dirty_iter_free(t->dbi);
+    bdrv_release_dirty_bitmap(t->bs, t->bitmap);
+    bdrv_unref(t->bs);
+}
+
+/* Guest write of one chunk, as seen by the mirror_top filter */
+static void test_heat_guest_write(TestHeatState *t, int64_t offset)
+{
+    bdrv_set_dirty_bitmap(t->bitmap, offset, TEST_GRANULARITY);
+    mirror_heat_map_note_write(&t->heat_map, offset, TEST_GRANULARITY);
+}
+
+/* Copy one dirty chunk the way mirror_iteration() picks it */
+static int64_t test_heat_copy(TestHeatState *t)
+{
+    int64_t offset;
+
+    t->now += 1 * SCALE_MS;
+
+    bdrv_dirty_bitmap_lock(t->bitmap);
+    offset = mirror_heat_next_dirty(&t->heat_map, t->dbi, t->length);
+    if (offset < 0) {
+        bdrv_set_dirty_iter(t->dbi, 0);
+        offset = bdrv_dirty_iter_next(t->dbi);
+        g_assert_cmpint(offset, >=, 0);
+        mirror_heat_map_new_pass(&t->heat_map, t->now);
+    }
+    bdrv_reset_dirty_bitmap_locked(t->bitmap, offset, TEST_GRANULARITY);
+    bdrv_dirty_bitmap_unlock(t->bitmap);
+
+    return offset;
+}
+
+static bool in_region(int64_t offset, int64_t region)
+{
+    return offset / MIRROR_HEAT_REGION_SIZE == region;
+}
+
+/* Hot regions are copied after the rest of the disk */
+static void test_heat_deferral(void)
+{
+    const int64_t chunks_per_region = MIRROR_HEAT_REGION_SIZE /
+                                      TEST_GRANULARITY;
+    TestHeatState t;
+    int64_t offset, hot_dirty;
+    int i;
+
+    test_heat_start(&t, 16 * MiB);
+
+    for (i = 0; i < MIRROR_HEAT_HOT; i++) {
+        test_heat_guest_write(&t, 3 * MiB);
+    }
+    g_assert(mirror_heat_map_is_hot(&t.heat_map, 3 * MiB));
+    g_assert(!mirror_heat_map_is_hot(&t.heat_map, 4 * MiB));
+
+    /* Everything else is copied first, in order */
+    for (i = 0; ; i++) {
+        offset = test_heat_copy(&t);
+        if (in_region(offset, 3)) {
+            break;
+        }
+        g_assert_cmpint(offset, ==,
+                        (i < 3 * chunks_per_region ? i : i + chunks_per_region)
+                        * TEST_GRANULARITY);
+    }
+    g_assert_cmpint(i, ==, 15 * chunks_per_region);
+
+    /* The next pass copies the hot region as well */
+    hot_dirty = bdrv_get_dirty_count(t.bitmap);
+    g_assert_cmpint(hot_dirty, ==, MIRROR_HEAT_REGION_SIZE - TEST_GRANULARITY);
+    while (bdrv_get_dirty_count(t.bitmap)) {
+        g_assert(in_region(test_heat_copy(&t), 3));
+    }
+
+    test_heat_end(&t);
+}
+
+/*
+ * A region the guest keeps rewriting is still copied while it is hot, and
+ * the job converges once the guest stops writing to it
+ */
+static void test_heat_convergence(void)
+{
+    TestHeatState t;
+    int64_t offset;
+    int hot_copies = 0;
+    int i;
+
+    test_heat_start(&t, 16 * MiB);
+
+    for (i = 0; i < 4096; i++) {
+        test_heat_guest_write(&t, 5 * MiB + (i % 16) * TEST_GRANULARITY);
+        offset = test_heat_copy(&t);
+        if (in_region(offset, 5)) {
+            hot_copies++;
+        }
+    }
+
+    /* The region was hot all the time and the rest of the disk is clean */
+    g_assert(mirror_heat_map_is_hot(&t.heat_map, 5 * MiB));
+    g_assert_cmpint(hot_copies, >, 0);
+    bdrv_dirty_bitmap_lock(t.bitmap);
+    for (offset = 0; offset < t.length; offset += TEST_GRANULARITY) {
+        g_assert(in_region(offset, 5) ||
+                 !bdrv_dirty_bitmap_get_locked(t.bitmap, offset));
+    }
+    bdrv_dirty_bitmap_unlock(t.bitmap);
+
+    /* Without new guest writes, the last dirty chunks are copied quickly */
+    for (i = 0; bdrv_get_dirty_count(t.bitmap); i++) {
+        g_assert_cmpint(i, <, 2 * MIRROR_HEAT_REGION_SIZE / TEST_GRANULARITY);
+        test_heat_copy(&t);
+    }
+
+    test_heat_end(&t);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/mirror-policy/io-size/bounds", test_io_size_bounds);
+    g_test_add_func("/mirror-policy/io-size/peak", test_io_size_peak);
+    g_test_add_func("/mirror-policy/heat/deferral", test_heat_deferral);
+    g_test_add_func("/mirror-policy/heat/convergence", test_heat_convergence);
+
+    return g_test_run();
+}
@@ -671,6 +671,33 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+/* credit given back with a negative amount never makes a bucket negative */
+static void test_account_units(void)
+{
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 100;
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = 100000;
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    throttle_account_units(&ts, true, 4, 8192);
+    throttle_get_config(&ts, &cfg);
+    g_assert(double_cmp(cfg.buckets[THROTTLE_OPS_TOTAL].level, 4));
+    g_assert(double_cmp(cfg.buckets[THROTTLE_OPS_WRITE].level, 4));
+    g_assert(double_cmp(cfg.buckets[THROTTLE_OPS_READ].level, 0));
+    g_assert(double_cmp(cfg.buckets[THROTTLE_BPS_WRITE].level, 8192));
+
+    throttle_account_units(&ts, true, -3, -4096);
+    throttle_get_config(&ts, &cfg);
+    g_assert(double_cmp(cfg.buckets[THROTTLE_OPS_TOTAL].level, 1));
+    g_assert(double_cmp(cfg.buckets[THROTTLE_BPS_WRITE].level, 4096));
+
+    throttle_account_units(&ts, true, -10, -100000);
+    throttle_get_config(&ts, &cfg);
+    g_assert(double_cmp(cfg.buckets[THROTTLE_OPS_TOTAL].level, 0));
+    g_assert(double_cmp(cfg.buckets[THROTTLE_BPS_WRITE].level, 0));
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -738,6 +765,176 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+static void test_group_weight(void)
+{
+    BlockBackend *blk1, *blk2;
+    ThrottleGroupMember *tgm1, *tgm2;
+
+    blk1 = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+    blk2 = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+    tgm1 = &blk_get_public(blk1)->throttle_group_member;
+    tgm2 = &blk_get_public(blk2)->throttle_group_member;
+
+    throttle_group_register_tgm(tgm1, "baz", blk_get_aio_context(blk1));
+    throttle_group_register_tgm(tgm2, "baz", blk_get_aio_context(blk2));
+
+    /* Members start with the default weight */
+    g_assert_cmpuint(throttle_group_get_weight(tgm1), ==,
+                     THROTTLE_GROUP_DEFAULT_WEIGHT);
+    g_assert_cmpuint(throttle_group_get_weight(tgm2), ==,
+                     THROTTLE_GROUP_DEFAULT_WEIGHT);
+
+    /* Weights are per member, not per group */
+    throttle_group_set_weight(tgm1, 300);
+    g_assert_cmpuint(throttle_group_get_weight(tgm1), ==, 300);
+    g_assert_cmpuint(throttle_group_get_weight(tgm2), ==,
+                     THROTTLE_GROUP_DEFAULT_WEIGHT);
+
+    /* Both members share the credit of the main loop */
+    g_assert(tgm1->share != NULL);
+    g_assert(tgm1->share == tgm2->share);
+
+    throttle_group_unregister_tgm(tgm1);
+    throttle_group_unregister_tgm(tgm2);
+    blk_unref(blk1);
+    blk_unref(blk2);
+}
+
+typedef struct {
+    ThrottleGroupMember *tgm;
+    int id;
+} GroupReq;
+
+#define WFQ_REQS 12
+
+/* Members of the requests of test_group_wfq(), in the order they ran */
+static int wfq_order[2 * WFQ_REQS];
+static int wfq_done;
+
+static void coroutine_fn group_wfq_entry(void *opaque)
+{
+    GroupReq *req = opaque;
+
+    throttle_group_co_io_limits_intercept(req->tgm, 512, true);
+    wfq_order[wfq_done++] = req->id;
+}
+
+/* A saturated group runs requests in proportion to the members' weights */
+static void test_group_wfq(void)
+{
+    BlockBackend *blk[2];
+    ThrottleGroupMember *tgm[2];
+    GroupReq reqs[2 * WFQ_REQS];
+    int count[2] = { 0, 0 };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        blk[i] = blk_new(ctx, 0, BLK_PERM_ALL);
+        tgm[i] = &blk_get_public(blk[i])->throttle_group_member;
+        throttle_group_register_tgm(tgm[i], "wfq", ctx);
+    }
+    throttle_group_set_weight(tgm[0], 300);
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 200;
+    throttle_group_config(tgm[0], &cfg);
+
+    /* Fill the bucket, so that every request has to wait for its turn */
+    throttle_account_units(tgm[0]->throttle_state, true, 21, 0);
+
+    wfq_done = 0;
+    for (i = 0; i < 2 * WFQ_REQS; i++) {
+        reqs[i] = (GroupReq) { .tgm = tgm[i % 2], .id = i % 2 };
+        qemu_coroutine_enter(qemu_coroutine_create(group_wfq_entry,
+                                                   &reqs[i]));
+    }
+    g_assert_cmpint(wfq_done, ==, 0);
+
+    while (wfq_done < 2 * WFQ_REQS) {
+        aio_poll(ctx, true);
+    }
+
+    /* While both members have requests queued, the first one gets 3/4 */
+    for (i = 0; i < WFQ_REQS; i++) {
+        count[wfq_order[i]]++;
+    }
+    g_assert_cmpint(count[0], >=, WFQ_REQS * 3 / 4 - 1);
+    g_assert_cmpint(count[0], <=, WFQ_REQS * 3 / 4 + 1);
+
+    for (i = 0; i < 2; i++) {
+        throttle_group_unregister_tgm(tgm[i]);
+        blk_unref(blk[i]);
+    }
+}
+
+#define CREDIT_TEST_NS (200 * SCALE_MS)
+
+typedef struct {
+    ThrottleGroupMember *tgm[2];
+    int64_t ops;
+    bool done;
+} GroupCreditTest;
+
+static void coroutine_fn group_credit_entry(void *opaque)
+{
+    GroupCreditTest *t = opaque;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    while (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start < CREDIT_TEST_NS) {
+        throttle_group_co_io_limits_intercept(t->tgm[t->ops % 2], 512, true);
+        t->ops++;
+
+        /*
+         * Stall for more than a slice now and then, so that the unused
+         * credit is given back to the group
+         */
+        if (t->ops % 64 == 0) {
+            qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, 20 * SCALE_MS);
+        }
+    }
+    t->done = true;
+}
+
+/*
+ * Requests that run on the credit of the AioContext, together with the
+ * credit that is given back, never exceed the limits of the group
+ */
+static void test_group_credit(void)
+{
+    const uint64_t avg = 1000;
+    BlockBackend *blk[2];
+    GroupCreditTest t = { 0 };
+    int64_t start, elapsed;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        blk[i] = blk_new(ctx, 0, BLK_PERM_ALL);
+        t.tgm[i] = &blk_get_public(blk[i])->throttle_group_member;
+        throttle_group_register_tgm(t.tgm[i], "credit", ctx);
+    }
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = avg;
+    throttle_group_config(t.tgm[0], &cfg);
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    qemu_coroutine_enter(qemu_coroutine_create(group_credit_entry, &t));
+    while (!t.done) {
+        aio_poll(ctx, true);
+    }
+    elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+
+    /* Burst of avg / 10 operations, plus at most one slice of credit */
+    g_assert_cmpint(t.ops, >, 0);
+    g_assert_cmpint(t.ops, <=, avg * elapsed / NANOSECONDS_PER_SECOND +
+                               avg / 10 + avg / 100 + 1);
+
+    for (i = 0; i < 2; i++) {
+        throttle_group_unregister_tgm(t.tgm[i]);
+        blk_unref(blk[i]);
+    }
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -764,7 +961,11 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/account_units",      test_account_units);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/weight",      test_group_weight);
+    g_test_add_func("/throttle/groups/wfq",         test_group_wfq);
+    g_test_add_func("/throttle/groups/credit",      test_group_credit);
     return g_test_run();
 }
 
@@ -0,0 +1,115 @@
+/*
+ * Per-vCPU throttling for auto-converge unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "../migration/vcpu-throttle.h"
+
+#define PCT_MAX 99
+
+/* Bytes dirtied in a period by vcpus with the rates and throttles given */
+static double throttled_total(const double *rates, const int *pcts, int n)
+{
+    double total = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        total += rates[i] * (100 - pcts[i]) / 100;
+    }
+    return total;
+}
+
+/* The guest dirties less than the target, nothing is throttled */
+static void test_below_target(void)
+{
+    double rates[] = { 100, 2000, 300, 0 };
+    int pcts[ARRAY_SIZE(rates)];
+    int i;
+
+    g_assert(vcpu_throttle_compute(rates, pcts, ARRAY_SIZE(rates), 2400,
+                                   PCT_MAX) < 0);
+    for (i = 0; i < ARRAY_SIZE(rates); i++) {
+        g_assert_cmpint(pcts[i], ==, 0);
+    }
+}
+
+/* Only the vcpus above the cap are throttled, each down to the cap */
+static void test_cap(void)
+{
+    double rates[] = { 100, 4000, 300, 0, 1000 };
+    int pcts[ARRAY_SIZE(rates)];
+    double cap;
+    int i;
+
+    /* 100 + 300 + 0 fit, 1000 and 4000 share the remaining 1600 */
+    cap = vcpu_throttle_compute(rates, pcts, ARRAY_SIZE(rates), 2000,
+                                PCT_MAX);
+    g_assert_cmpfloat(cap, ==, 800);
+
+    for (i = 0; i < ARRAY_SIZE(rates); i++) {
+        if (rates[i] <= cap) {
+            g_assert_cmpint(pcts[i], ==, 0);
+        } else {
+            g_assert_cmpint(pcts[i], >, 0);
+            g_assert_cmpint(pcts[i], <=, PCT_MAX);
+            g_assert_cmpfloat(rates[i] * (100 - pcts[i]) / 100, <=, cap);
+            /* ...but not much below */
+            g_assert_cmpfloat(rates[i] * (100 - pcts[i] + 1) / 100, >, cap);
+        }
+    }
+    g_assert_cmpint(pcts[1], ==, 80);
+    g_assert_cmpint(pcts[4], ==, 20);
+    g_assert_cmpfloat(throttled_total(rates, pcts, ARRAY_SIZE(rates)), <=,
+                      2000);
+}
+
+/* All vcpus dirty memory at the same rate, all get the same throttle */
+static void test_equal(void)
+{
+    double rates[] = { 1000, 1000, 1000, 1000 };
+    int pcts[ARRAY_SIZE(rates)];
+    int i;
+
+    g_assert_cmpfloat(vcpu_throttle_compute(rates, pcts, ARRAY_SIZE(rates),
+                                            1000, PCT_MAX), ==, 250);
+    for (i = 0; i < ARRAY_SIZE(rates); i++) {
+        g_assert_cmpint(pcts[i], ==, 75);
+    }
+}
+
+/* The throttle never exceeds the maximum, even if the target is missed */
+static void test_pct_max(void)
+{
+    double rates[] = { 10, 1000000, 500000 };
+    int pcts[ARRAY_SIZE(rates)];
+    int i;
+
+    vcpu_throttle_compute(rates, pcts, ARRAY_SIZE(rates), 1000, 50);
+    g_assert_cmpint(pcts[0], ==, 0);
+    g_assert_cmpint(pcts[1], ==, 50);
+    g_assert_cmpint(pcts[2], ==, 50);
+
+    /* Nothing may be dirtied at all: only idle vcpus run freely */
+    rates[0] = 0;
+    vcpu_throttle_compute(rates, pcts, ARRAY_SIZE(rates), 0, PCT_MAX);
+    g_assert_cmpint(pcts[0], ==, 0);
+    for (i = 1; i < ARRAY_SIZE(rates); i++) {
+        g_assert_cmpint(pcts[i], ==, PCT_MAX);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/vcpu-throttle/below_target", test_below_target);
+    g_test_add_func("/vcpu-throttle/cap", test_cap);
+    g_test_add_func("/vcpu-throttle/equal", test_equal);
+    g_test_add_func("/vcpu-throttle/pct_max", test_pct_max);
+
+    return g_test_run();
+}
@@ -13,7 +13,9 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qapi/error.h"
 #include "../migration/xbzrle.h"
+#include "../migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +176,49 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_decode_accel(void)
+{
+    do {
+        test_encode_decode_1_byte();
+        test_encode_decode_overflow();
+        test_encode_decode();
+    } while (test_xbzrle_next_accel());
+}
+
+static void test_page_cache_ways(void)
+{
+    /* four sets of four pages */
+    PageCache *cache = cache_init(16 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint64_t addr;
+
+    /* pages 16 apart share a set, and all fit */
+    for (addr = 0; addr < 16 * PAGE_SIZE; addr += 4 * PAGE_SIZE) {
+        page[0] = addr / PAGE_SIZE;
+        g_assert(cache_insert(cache, addr, page, 0) == 0);
+    }
+    for (addr = 0; addr < 16 * PAGE_SIZE; addr += 4 * PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr, 0));
+        g_assert(get_cached_data(cache, addr)[0] == addr / PAGE_SIZE);
+    }
+
+    /* the set is full of fresh pages */
+    g_assert(cache_insert(cache, 16 * PAGE_SIZE, page, 1) == -1);
+    g_assert(!cache_is_cached(cache, 16 * PAGE_SIZE, 1));
+
+    /* once they are old enough the least recently used one goes */
+    g_assert(cache_is_cached(cache, 0, 2));
+    page[0] = 16;
+    g_assert(cache_insert(cache, 16 * PAGE_SIZE, page, 2) == 0);
+    g_assert(cache_is_cached(cache, 0, 2));
+    g_assert(!cache_is_cached(cache, 4 * PAGE_SIZE, 2));
+    g_assert(get_cached_data(cache, 4 * PAGE_SIZE) == NULL);
+    g_assert(get_cached_data(cache, 16 * PAGE_SIZE)[0] == 16);
+
+    g_free(page);
+    cache_fini(cache);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +231,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
+    g_test_add_func("/xbzrle/page_cache_ways", test_page_cache_ways);
 
     return g_test_run();
 }
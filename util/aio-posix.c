@@ -19,24 +19,11 @@
 #include "qemu/sockets.h"
 #include "qemu/cutils.h"
 #include "trace.h"
+#include "aio-posix.h"
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
 
-struct AioHandler
-{
-    GPollFD pfd;
-    IOHandler *io_read;
-    IOHandler *io_write;
-    AioPollFn *io_poll;
-    IOHandler *io_poll_begin;
-    IOHandler *io_poll_end;
-    int deleted;
-    void *opaque;
-    bool is_external;
-    QLIST_ENTRY(AioHandler) node;
-};
-
 #ifdef CONFIG_EPOLL_CREATE1
 
 /* The fd number threshold to switch to epoll */
@@ -210,8 +197,10 @@ static bool aio_remove_fd_handler(AioContext *ctx, AioHandler *node)
         g_source_remove_poll(&ctx->source, &node->pfd);
     }
 
-    /* If a read is in progress, just mark the node as deleted */
-    if (qemu_lockcnt_count(&ctx->list_lock)) {
+    /* If a read is in progress, or the fd monitor still references the
+     * node, just mark the node as deleted.
+     */
+    if (qemu_lockcnt_count(&ctx->list_lock) || fdmon_io_uring_node_busy(node)) {
         node->deleted = 1;
         node->pfd.revents = 0;
         return false;
@@ -234,7 +223,6 @@ void aio_set_fd_handler(AioContext *ctx,
 {
     AioHandler *node;
     AioHandler *new_node = NULL;
-    bool is_new = false;
     bool deleted = false;
     int poll_disable_change;
 
@@ -254,9 +242,6 @@ void aio_set_fd_handler(AioContext *ctx,
         poll_disable_change = -!node->io_poll;
     } else {
         poll_disable_change = !io_poll - (node && !node->io_poll);
-        if (node == NULL) {
-            is_new = true;
-        }
         /* Alloc and insert if it's not already there */
         new_node = g_new0(AioHandler, 1);
 
@@ -267,10 +252,17 @@ void aio_set_fd_handler(AioContext *ctx,
         new_node->opaque = opaque;
         new_node->is_external = is_external;
 
-        if (is_new) {
+        if (node == NULL) {
             new_node->pfd.fd = fd;
         } else {
             new_node->pfd = node->pfd;
+
+            /* Keep the polling window and statistics of the fd */
+            new_node->poll_ns = node->poll_ns;
+            new_node->poll_events = node->poll_events;
+            new_node->poll_hits = node->poll_hits;
+            memcpy(new_node->poll_histogram, node->poll_histogram,
+                   sizeof(new_node->poll_histogram));
         }
         g_source_add_poll(&ctx->source, &new_node->pfd);
 
@@ -279,9 +271,6 @@ void aio_set_fd_handler(AioContext *ctx,
 
         QLIST_INSERT_HEAD_RCU(&ctx->aio_handlers, new_node, node);
     }
-    if (node) {
-        deleted = aio_remove_fd_handler(ctx, node);
-    }
 
     /* No need to order poll_disable_cnt writes against other updates;
      * the counter is only used to avoid wasting time and latency on
@@ -292,11 +281,9 @@ void aio_set_fd_handler(AioContext *ctx,
     atomic_set(&ctx->poll_disable_cnt,
                atomic_read(&ctx->poll_disable_cnt) + poll_disable_change);
 
-    if (new_node) {
-        aio_epoll_update(ctx, new_node, is_new);
-    } else if (node) {
-        /* Unregister deleted fd_handler */
-        aio_epoll_update(ctx, node, false);
+    ctx->fdmon_ops->update(ctx, node, new_node);
+    if (node) {
+        deleted = aio_remove_fd_handler(ctx, node);
     }
     qemu_lockcnt_unlock(&ctx->list_lock);
     aio_notify(ctx);
@@ -441,7 +428,7 @@ static bool aio_dispatch_handlers(AioContext *ctx)
             progress = true;
         }
 
-        if (node->deleted) {
+        if (node->deleted && !fdmon_io_uring_node_busy(node)) {
             if (qemu_lockcnt_dec_if_lock(&ctx->list_lock)) {
                 QLIST_REMOVE(node, node);
                 g_free(node);
@@ -509,15 +496,107 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
-static bool run_poll_handlers_once(AioContext *ctx, int64_t *timeout)
+static int fdmon_poll_wait_common(AioContext *ctx, int64_t timeout,
+                                  bool use_epoll)
+{
+    AioHandler *node;
+    int i;
+    int ret;
+
+    assert(npfd == 0);
+
+    /* fill pollfds */
+
+    if (!use_epoll || !aio_epoll_enabled(ctx)) {
+        QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->pfd.events
+                && aio_node_check(ctx, node->is_external)) {
+                add_pollfd(node);
+            }
+        }
+    }
+
+    /* wait until next event */
+    if (use_epoll && aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+        AioHandler epoll_handler;
+
+        epoll_handler.pfd.fd = ctx->epollfd;
+        epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
+        npfd = 0;
+        add_pollfd(&epoll_handler);
+        ret = aio_epoll(ctx, pollfds, npfd, timeout);
+    } else  {
+        ret = qemu_poll_ns(pollfds, npfd, timeout);
+        /* if we have any readable fds, dispatch event */
+        if (ret > 0) {
+            for (i = 0; i < npfd; i++) {
+                nodes[i]->pfd.revents = pollfds[i].revents;
+            }
+        }
+    }
+
+    npfd = 0;
+    return ret;
+}
+
+int fdmon_ppoll_wait(AioContext *ctx, int64_t timeout)
+{
+    return fdmon_poll_wait_common(ctx, timeout, false);
+}
+
+static int fdmon_poll_wait(AioContext *ctx, int64_t timeout)
+{
+    return fdmon_poll_wait_common(ctx, timeout, true);
+}
+
+static void fdmon_poll_update(AioContext *ctx,
+                              AioHandler *old_node,
+                              AioHandler *new_node)
+{
+    if (new_node) {
+        aio_epoll_update(ctx, new_node, !old_node);
+    } else if (old_node) {
+        /* Unregister deleted fd_handler */
+        aio_epoll_update(ctx, old_node, false);
+    }
+}
+
+static bool fdmon_poll_need_wait(AioContext *ctx)
+{
+    return atomic_read(&ctx->poll_disable_cnt);
+}
+
+const FDMonOps fdmon_poll_ops = {
+    .update = fdmon_poll_update,
+    .wait = fdmon_poll_wait,
+    .need_wait = fdmon_poll_need_wait,
+};
+
+/* run_poll_handlers_once:
+ * @ctx: the AioContext
+ * @elapsed_ns: time spent busy polling so far, in nanoseconds
+ * @timeout: timeout for blocking wait, set to zero if polling succeeds
+ *
+ * Polls each handler once.  After the first iteration (@elapsed_ns > 0),
+ * handlers whose own polling window has run out are skipped: their events
+ * are left to the blocking wait.
+ *
+ * Returns: true if progress was made, false otherwise
+ */
+static bool run_poll_handlers_once(AioContext *ctx, int64_t elapsed_ns,
+                                   int64_t *timeout)
 {
     bool progress = false;
     AioHandler *node;
 
     QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
         if (!node->deleted && node->io_poll &&
+            (elapsed_ns == 0 || elapsed_ns < node->poll_ns) &&
             aio_node_check(ctx, node->is_external) &&
             node->io_poll(node->opaque)) {
+            node->poll_hit = true;
+            node->poll_hit_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
             /*
              * Polling was successful, exit try_poll_mode immediately
              * to adjust the next polling time.
@@ -558,12 +637,15 @@ static bool run_poll_handlers(AioContext *ctx, int64_t max_ns, int64_t *timeout)
     trace_run_poll_handlers_begin(ctx, max_ns, *timeout);
 
     start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    elapsed_time = 0;
     do {
-        progress = run_poll_handlers_once(ctx, timeout);
+        progress = run_poll_handlers_once(ctx, elapsed_time, timeout);
         elapsed_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
         max_ns = qemu_soonest_timeout(*timeout, max_ns);
         assert(!(max_ns && progress));
-    } while (elapsed_time < max_ns && !atomic_read(&ctx->poll_disable_cnt));
+    } while (elapsed_time < max_ns && !ctx->fdmon_ops->need_wait(ctx));
+
+    ctx->poll_time_ns += elapsed_time;
 
     /* If time has passed with no successful polling, adjust *timeout to
      * keep the same ending time.
@@ -591,7 +673,7 @@ static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
 {
     int64_t max_ns = qemu_soonest_timeout(*timeout, ctx->poll_ns);
 
-    if (max_ns && !atomic_read(&ctx->poll_disable_cnt)) {
+    if (max_ns && !ctx->fdmon_ops->need_wait(ctx)) {
         poll_set_started(ctx, true);
 
         if (run_poll_handlers(ctx, max_ns, timeout)) {
@@ -604,13 +686,124 @@ static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
     /* Even if we don't run busy polling, try polling once in case it can make
      * progress and the caller will be able to avoid ppoll(2)/epoll_wait(2).
      */
-    return run_poll_handlers_once(ctx, timeout);
+    return run_poll_handlers_once(ctx, 0, timeout);
 }
 
-bool aio_poll(AioContext *ctx, bool blocking)
+static void aio_poll_record_latency(AioHandler *node, int64_t latency_ns)
+{
+    int bin = 0;
+
+    while (bin < AIO_POLL_HISTOGRAM_BINS - 1 &&
+           latency_ns >= (int64_t)AIO_POLL_HISTOGRAM_MIN_NS << bin) {
+        bin++;
+    }
+
+    node->poll_events++;
+    node->poll_histogram[bin]++;
+}
+
+/* Adjust the polling window of one handler, as ctx->poll_ns used to be */
+static void aio_poll_adjust_window(AioContext *ctx, AioHandler *node,
+                                   int64_t block_ns, bool event)
 {
+    int64_t old = node->poll_ns;
+
+    if (node->poll_ns > ctx->poll_max_ns) {
+        /* poll-max-ns was lowered */
+        node->poll_ns = ctx->poll_max_ns;
+    }
+
+    if (block_ns <= node->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            node->poll_ns /= ctx->poll_shrink;
+        } else {
+            node->poll_ns = 0;
+        }
+
+        trace_poll_handler_shrink(ctx, node->pfd.fd, old, node->poll_ns);
+    } else if (event && node->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow;
+
+        if (grow == 0) {
+            grow = 2;
+        }
+
+        if (node->poll_ns) {
+            node->poll_ns *= grow;
+        } else {
+            node->poll_ns = 4000; /* start polling at 4 microseconds */
+        }
+
+        if (node->poll_ns > ctx->poll_max_ns) {
+            node->poll_ns = ctx->poll_max_ns;
+        }
+
+        trace_poll_handler_grow(ctx, node->pfd.fd, old, node->poll_ns);
+    }
+}
+
+/* aio_poll_adjust_handlers:
+ * @ctx: the AioContext
+ * @start: when aio_poll() started polling
+ *
+ * Each handler with an io_poll() callback has its own polling window.  The
+ * window of a handler that had an event is adjusted based on how long the
+ * event took to arrive, so that sources which complete quickly are polled
+ * and slow ones are left to the blocking wait.  ctx->poll_ns becomes the
+ * largest window.
+ *
+ * Note that the caller must have incremented ctx->list_lock.
+ */
+static void aio_poll_adjust_handlers(AioContext *ctx, int64_t start)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t block_ns = now - start;
+    int64_t old = ctx->poll_ns;
+    int64_t poll_ns = 0;
     AioHandler *node;
-    int i;
+
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        int64_t latency_ns = block_ns;
+        bool event = false;
+
+        if (node->deleted || !node->io_poll) {
+            continue;
+        }
+
+        if (node->poll_hit) {
+            /* The hit may predate @start if polling was just enabled */
+            latency_ns = MAX(node->poll_hit_ns - start, 0);
+            node->poll_hit = false;
+            node->poll_hits++;
+            event = true;
+        } else if (node->pfd.revents & node->pfd.events) {
+            event = true;
+        }
+
+        if (event) {
+            aio_poll_record_latency(node, latency_ns);
+        }
+        aio_poll_adjust_window(ctx, node, event ? latency_ns : block_ns,
+                               event);
+
+        poll_ns = MAX(poll_ns, node->poll_ns);
+    }
+
+    ctx->poll_ns = poll_ns;
+
+    if (poll_ns < old) {
+        trace_poll_shrink(ctx, old, poll_ns);
+    } else if (poll_ns > old) {
+        trace_poll_grow(ctx, old, poll_ns);
+    }
+}
+
+bool aio_poll(AioContext *ctx, bool blocking)
+{
     int ret = 0;
     bool progress;
     int64_t timeout;
@@ -642,32 +835,8 @@ bool aio_poll(AioContext *ctx, bool blocking)
     /* If polling is allowed, non-blocking aio_poll does not need the
      * system call---a single round of run_poll_handlers_once suffices.
      */
-    if (timeout || atomic_read(&ctx->poll_disable_cnt)) {
-        assert(npfd == 0);
-
-        /* fill pollfds */
-
-        if (!aio_epoll_enabled(ctx)) {
-            QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
-                if (!node->deleted && node->pfd.events
-                    && aio_node_check(ctx, node->is_external)) {
-                    add_pollfd(node);
-                }
-            }
-        }
-
-        /* wait until next event */
-        if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
-            AioHandler epoll_handler;
-
-            epoll_handler.pfd.fd = ctx->epollfd;
-            epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
-            npfd = 0;
-            add_pollfd(&epoll_handler);
-            ret = aio_epoll(ctx, pollfds, npfd, timeout);
-        } else  {
-            ret = qemu_poll_ns(pollfds, npfd, timeout);
-        }
+    if (timeout || ctx->fdmon_ops->need_wait(ctx)) {
+        ret = ctx->fdmon_ops->wait(ctx, timeout);
     }
 
     if (blocking) {
@@ -677,54 +846,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     /* Adjust polling time */
     if (ctx->poll_max_ns) {
-        int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
-
-        if (block_ns <= ctx->poll_ns) {
-            /* This is the sweet spot, no adjustment needed */
-        } else if (block_ns > ctx->poll_max_ns) {
-            /* We'd have to poll for too long, poll less */
-            int64_t old = ctx->poll_ns;
-
-            if (ctx->poll_shrink) {
-                ctx->poll_ns /= ctx->poll_shrink;
-            } else {
-                ctx->poll_ns = 0;
-            }
-
-            trace_poll_shrink(ctx, old, ctx->poll_ns);
-        } else if (ctx->poll_ns < ctx->poll_max_ns &&
-                   block_ns < ctx->poll_max_ns) {
-            /* There is room to grow, poll longer */
-            int64_t old = ctx->poll_ns;
-            int64_t grow = ctx->poll_grow;
-
-            if (grow == 0) {
-                grow = 2;
-            }
-
-            if (ctx->poll_ns) {
-                ctx->poll_ns *= grow;
-            } else {
-                ctx->poll_ns = 4000; /* start polling at 4 microseconds */
-            }
-
-            if (ctx->poll_ns > ctx->poll_max_ns) {
-                ctx->poll_ns = ctx->poll_max_ns;
-            }
-
-            trace_poll_grow(ctx, old, ctx->poll_ns);
-        }
+        aio_poll_adjust_handlers(ctx, start);
     }
 
-    /* if we have any readable fds, dispatch event */
-    if (ret > 0) {
-        for (i = 0; i < npfd; i++) {
-            nodes[i]->pfd.revents = pollfds[i].revents;
-        }
-    }
-
-    npfd = 0;
-
     progress |= aio_bh_poll(ctx);
 
     if (ret > 0) {
@@ -738,8 +862,60 @@ bool aio_poll(AioContext *ctx, bool blocking)
     return progress;
 }
 
+int aio_context_get_poll_stats(AioContext *ctx, AioPollHandlerStats **stats)
+{
+    AioPollHandlerStats *s = NULL;
+    AioHandler *node;
+    int n = 0;
+
+    assert(in_aio_context_home_thread(ctx));
+
+    qemu_lockcnt_inc(&ctx->list_lock);
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->io_poll) {
+            continue;
+        }
+
+        s = g_renew(AioPollHandlerStats, s, n + 1);
+        s[n] = (AioPollHandlerStats) {
+            .fd = node->pfd.fd,
+            .poll_ns = node->poll_ns,
+            .events = node->poll_events,
+            .poll_hits = node->poll_hits,
+        };
+        memcpy(s[n].histogram, node->poll_histogram, sizeof(s[n].histogram));
+        n++;
+    }
+    qemu_lockcnt_dec(&ctx->list_lock);
+
+    *stats = s;
+    return n;
+}
+
+/*
+ * Free handlers that were removed while the list was being walked or while
+ * the fd monitor still referenced them.  Called with ctx->list_lock acquired.
+ */
+void aio_free_deleted_handlers(AioContext *ctx)
+{
+    AioHandler *node, *tmp;
+
+    if (qemu_lockcnt_count(&ctx->list_lock)) {
+        return; /* the list is being walked, it will be cleaned up later */
+    }
+
+    QLIST_FOREACH_SAFE(node, &ctx->aio_handlers, node, tmp) {
+        if (node->deleted && !fdmon_io_uring_node_busy(node)) {
+            QLIST_REMOVE(node, node);
+            g_free(node);
+        }
+    }
+}
+
 void aio_context_setup(AioContext *ctx)
 {
+    ctx->fdmon_ops = &fdmon_poll_ops;
+
 #ifdef CONFIG_EPOLL_CREATE1
     assert(!ctx->epollfd);
     ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
@@ -750,15 +926,36 @@ void aio_context_setup(AioContext *ctx)
         ctx->epoll_available = true;
     }
 #endif
+
+    /* Prefer io_uring when it is available, epoll/ppoll otherwise */
+    fdmon_io_uring_setup(ctx);
 }
 
 void aio_context_destroy(AioContext *ctx)
 {
+    fdmon_io_uring_destroy(ctx);
+
 #ifdef CONFIG_EPOLL_CREATE1
     aio_epoll_disable(ctx);
 #endif
 }
 
+void aio_context_disable_io_uring(AioContext *ctx)
+{
+    fdmon_io_uring_destroy(ctx);
+}
+
+void aio_context_use_g_source(AioContext *ctx)
+{
+    /*
+     * Disable io_uring when the glib main loop is used because it doesn't
+     * support mixed glib/aio_poll() usage.  It relies on aio_poll() being
+     * called regularly so that changes to the monitored file descriptors are
+     * submitted, otherwise a list of pending fd handlers builds up.
+     */
+    fdmon_io_uring_destroy(ctx);
+}
+
 void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink, Error **errp)
 {
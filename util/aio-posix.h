@@ -0,0 +1,124 @@
+/*
+ * AioContext POSIX event loop implementation internal APIs
+ *
+ * Copyright IBM, Corp. 2008
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * Contributions after 2012-01-13 are licensed under the terms of the
+ * GNU GPL, version 2 or (at your option) any later version.
+ */
+
+#ifndef AIO_POSIX_H
+#define AIO_POSIX_H
+
+#include "block/aio.h"
+
+struct AioHandler {
+    GPollFD pfd;
+    IOHandler *io_read;
+    IOHandler *io_write;
+    AioPollFn *io_poll;
+    IOHandler *io_poll_begin;
+    IOHandler *io_poll_end;
+    int deleted;
+    void *opaque;
+    bool is_external;
+    QLIST_ENTRY(AioHandler) node;
+
+    /* Adaptive polling state, see aio_poll_adjust_handlers() */
+    int64_t poll_ns;            /* polling window for this handler */
+    bool poll_hit;              /* io_poll() succeeded in this aio_poll() */
+    int64_t poll_hit_ns;        /* when io_poll() succeeded */
+    uint64_t poll_events;
+    uint64_t poll_hits;
+    uint64_t poll_histogram[AIO_POLL_HISTOGRAM_BINS];
+#ifdef CONFIG_LINUX_IO_URING
+    QSLIST_ENTRY(AioHandler) node_submitted;
+    unsigned flags; /* see fdmon-io_uring.c */
+#endif
+};
+
+/*
+ * File descriptor monitoring implementation.  The AioContext uses one of
+ * these to learn which of its AioHandlers are ready.
+ */
+typedef struct FDMonOps {
+    /*
+     * update:
+     * @ctx: the AioContext
+     * @old_node: the existing handler or NULL if this file descriptor is being
+     *            monitored for the first time
+     * @new_node: the new handler or NULL if this file descriptor is being
+     *            removed
+     *
+     * Add/remove/modify a monitored file descriptor.  There are three cases:
+     * 1. @new_node != NULL && @old_node == NULL - add a new file descriptor
+     * 2. @new_node != NULL && @old_node != NULL - modify an existing one
+     * 3. @new_node == NULL && @old_node != NULL - remove an existing one
+     *
+     * Called with ctx->list_lock acquired.
+     */
+    void (*update)(AioContext *ctx, AioHandler *old_node, AioHandler *new_node);
+
+    /*
+     * wait:
+     * @ctx: the AioContext
+     * @timeout: maximum duration to wait, in nanoseconds
+     *
+     * Wait for file descriptors to become ready and set pfd.revents on the
+     * handlers that are ready.
+     *
+     * Called with ctx->list_lock incremented but not locked.
+     *
+     * Returns: number of ready file descriptors.
+     */
+    int (*wait)(AioContext *ctx, int64_t timeout);
+
+    /*
+     * need_wait:
+     * @ctx: the AioContext
+     *
+     * Tell aio_poll() when to stop userspace polling early because ->wait()
+     * has fds ready or pending changes that must be submitted.
+     *
+     * Called with ctx->list_lock incremented but not locked.
+     *
+     * Returns: true if ->wait() should be called, false otherwise.
+     */
+    bool (*need_wait)(AioContext *ctx);
+} FDMonOps;
+
+/* ppoll(2)/epoll(7) file descriptor monitoring, the default */
+extern const FDMonOps fdmon_poll_ops;
+
+/* Plain ppoll(2) of all handlers, for fd monitors that need a fallback */
+int fdmon_ppoll_wait(AioContext *ctx, int64_t timeout);
+
+void aio_free_deleted_handlers(AioContext *ctx);
+
+#ifdef CONFIG_LINUX_IO_URING
+bool fdmon_io_uring_setup(AioContext *ctx);
+void fdmon_io_uring_destroy(AioContext *ctx);
+bool fdmon_io_uring_node_busy(AioHandler *node);
+#else
+static inline bool fdmon_io_uring_setup(AioContext *ctx)
+{
+    return false;
+}
+
+static inline void fdmon_io_uring_destroy(AioContext *ctx)
+{
+}
+
+static inline bool fdmon_io_uring_node_busy(AioHandler *node)
+{
+    return false;
+}
+#endif /* !CONFIG_LINUX_IO_URING */
+
+#endif /* AIO_POSIX_H */
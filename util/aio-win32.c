@@ -403,6 +403,20 @@ void aio_context_destroy(AioContext *ctx)
 {
 }
 
+void aio_context_disable_io_uring(AioContext *ctx)
+{
+}
+
+void aio_context_use_g_source(AioContext *ctx)
+{
+}
+
+int aio_context_get_poll_stats(AioContext *ctx, AioPollHandlerStats **stats)
+{
+    *stats = NULL;
+    return 0;
+}
+
 void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink, Error **errp)
 {
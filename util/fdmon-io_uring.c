@@ -0,0 +1,391 @@
+/*
+ * Linux io_uring file descriptor monitoring
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The Linux io_uring API supports file descriptor monitoring with a few
+ * advantages over existing APIs like poll(2) and epoll(7):
+ *
+ * 1. Userspace polling of events is possible because the completion queue (cq
+ *    ring) is shared between the kernel and userspace.  This allows
+ *    applications that rely on userspace polling to also monitor file
+ *    descriptors in the same userspace polling loop.
+ *
+ * 2. Submission and completion is batched and done together in a single system
+ *    call.  This minimizes the number of system calls.
+ *
+ * 3. File descriptor monitoring is O(1) like epoll(7) so it scales better than
+ *    poll(2).
+ *
+ * 4. Nanosecond timeouts are supported so it requires fewer syscalls than
+ *    epoll(7).
+ *
+ * This code only monitors file descriptors and does not do asynchronous disk
+ * I/O.  Implementing disk I/O efficiently has other requirements and should
+ * use a separate io_uring so it does not make sense to unify the code.
+ *
+ * File descriptor monitoring is implemented using the following operations:
+ *
+ * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.
+ * 2. IORING_OP_POLL_REMOVE - removes a file descriptor being monitored.  When
+ *    the poll mask changes for a file descriptor it is first removed and then
+ *    re-added with the new poll mask, so this operation is also used as part
+ *    of modifying an existing monitored file descriptor.
+ * 3. IORING_OP_TIMEOUT - added every time a blocking syscall is made to wait
+ *    for events.  This operation self-cancels if another event completes
+ *    before the timeout.
+ *
+ * io_uring calls the submission queue the "sq ring" and the completion queue
+ * the "cq ring".  Ring entries are called "sqe" and "cqe", respectively.
+ *
+ * The code is structured so that sq/cq rings are only modified within
+ * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
+ * the submit list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
+ * and/or IORING_OP_POLL_REMOVE sqes for them.
+ *
+ * An AioHandler that is removed while its IORING_OP_POLL_ADD is still in
+ * flight stays on ctx->aio_handlers, marked deleted, until the cqe arrives.
+ * Only then may it be freed, because the kernel hands the AioHandler pointer
+ * back to us in the cqe.
+ */
+
+#include "qemu/osdep.h"
+#include <poll.h>
+#include <liburing.h>
+#include "aio-posix.h"
+
+enum {
+    FDMON_IO_URING_ENTRIES  = 128, /* sq/cq ring size */
+
+    /* AioHandler::flags */
+    FDMON_IO_URING_PENDING  = (1 << 0), /* on the submit list */
+    FDMON_IO_URING_ADD      = (1 << 1),
+    FDMON_IO_URING_REMOVE   = (1 << 2),
+};
+
+typedef struct FDMonIoUring {
+    struct io_uring ring;
+
+    /* AioHandlers with changes that have to be submitted to the sq ring */
+    QSLIST_HEAD(, AioHandler) submit_list;
+
+    /* Read by the kernel when the IORING_OP_TIMEOUT sqe is submitted */
+    struct __kernel_timespec timeout_ts;
+} FDMonIoUring;
+
+static inline int poll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? POLLIN : 0) |
+           (pfd_events & G_IO_OUT ? POLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? POLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? POLLERR : 0);
+}
+
+static inline int pfd_events_from_poll(int poll_events)
+{
+    return (poll_events & POLLIN ? G_IO_IN : 0) |
+           (poll_events & POLLOUT ? G_IO_OUT : 0) |
+           (poll_events & POLLHUP ? G_IO_HUP : 0) |
+           (poll_events & POLLERR ? G_IO_ERR : 0);
+}
+
+/*
+ * Returns an sqe for submitting a request.  Only called within
+ * fdmon_io_uring_wait().
+ */
+static struct io_uring_sqe *get_sqe(AioContext *ctx)
+{
+    struct io_uring *ring = &ctx->fdmon_io_uring->ring;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    int ret;
+
+    if (likely(sqe)) {
+        return sqe;
+    }
+
+    /* No free sqes left, submit pending sqes first */
+    do {
+        ret = io_uring_submit(ring);
+    } while (ret == -EINTR);
+
+    assert(ret > 0);
+    sqe = io_uring_get_sqe(ring);
+    assert(sqe);
+    return sqe;
+}
+
+/* Atomically enqueue an AioHandler for sq ring submission */
+static void enqueue(FDMonIoUring *s, AioHandler *node, unsigned flags)
+{
+    unsigned old_flags;
+
+    old_flags = atomic_fetch_or(&node->flags, FDMON_IO_URING_PENDING | flags);
+    if (!(old_flags & FDMON_IO_URING_PENDING)) {
+        QSLIST_INSERT_HEAD_ATOMIC(&s->submit_list, node, node_submitted);
+    }
+}
+
+/*
+ * Dequeue an AioHandler for sq ring submission.  Called by fill_sq_ring().
+ *
+ * FDMON_IO_URING_REMOVE is not cleared.  It's sticky so it can serve two
+ * purposes: telling fill_sq_ring() to submit IORING_OP_POLL_REMOVE and
+ * telling process_cqe() that the AioHandler can be freed once its
+ * IORING_OP_POLL_ADD completes.
+ */
+static AioHandler *dequeue(AioHandler **head, unsigned *flags)
+{
+    AioHandler *node = *head;
+
+    if (!node) {
+        return NULL;
+    }
+
+    /* Doesn't need to be atomic since fill_sq_ring() moved the list */
+    *head = QSLIST_NEXT(node, node_submitted);
+
+    *flags = atomic_fetch_and(&node->flags, ~(FDMON_IO_URING_PENDING |
+                                              FDMON_IO_URING_ADD));
+    return node;
+}
+
+static void fdmon_io_uring_update(AioContext *ctx,
+                                  AioHandler *old_node,
+                                  AioHandler *new_node)
+{
+    FDMonIoUring *s = ctx->fdmon_io_uring;
+
+    if (new_node) {
+        enqueue(s, new_node, FDMON_IO_URING_ADD);
+    }
+
+    if (old_node) {
+        /*
+         * Deletion is tricky because IORING_OP_POLL_ADD and
+         * IORING_OP_POLL_REMOVE are async.  We need to wait for the original
+         * IORING_OP_POLL_ADD to complete before this handler can be freed
+         * safely.  fdmon_io_uring_node_busy() keeps aio-posix.c from freeing
+         * it in the meantime.
+         *
+         * It's possible that the file descriptor becomes ready and the
+         * IORING_OP_POLL_ADD cqe is enqueued before IORING_OP_POLL_REMOVE is
+         * submitted, too.
+         */
+        enqueue(s, old_node, FDMON_IO_URING_REMOVE);
+    }
+}
+
+static void add_poll_add_sqe(AioContext *ctx, AioHandler *node)
+{
+    struct io_uring_sqe *sqe = get_sqe(ctx);
+    int events = poll_events_from_pfd(node->pfd.events);
+
+    io_uring_prep_poll_add(sqe, node->pfd.fd, events);
+    io_uring_sqe_set_data(sqe, node);
+}
+
+static void add_poll_remove_sqe(AioContext *ctx, AioHandler *node)
+{
+    struct io_uring_sqe *sqe = get_sqe(ctx);
+
+    io_uring_prep_poll_remove(sqe, node);
+    io_uring_sqe_set_data(sqe, NULL);
+}
+
+/* Add a timeout that self-cancels when another cqe becomes ready */
+static void add_timeout_sqe(AioContext *ctx, int64_t ns)
+{
+    struct __kernel_timespec *ts = &ctx->fdmon_io_uring->timeout_ts;
+    struct io_uring_sqe *sqe;
+
+    ts->tv_sec = ns / NANOSECONDS_PER_SECOND;
+    ts->tv_nsec = ns % NANOSECONDS_PER_SECOND;
+
+    sqe = get_sqe(ctx);
+    io_uring_prep_timeout(sqe, ts, 1, 0);
+    io_uring_sqe_set_data(sqe, NULL);
+}
+
+/* Add sqes from the submit list for submission */
+static void fill_sq_ring(AioContext *ctx)
+{
+    FDMonIoUring *s = ctx->fdmon_io_uring;
+    QSLIST_HEAD(, AioHandler) submit_list;
+    AioHandler *head;
+    AioHandler *node;
+    unsigned flags;
+
+    QSLIST_MOVE_ATOMIC(&submit_list, &s->submit_list);
+    head = QSLIST_FIRST(&submit_list);
+
+    while ((node = dequeue(&head, &flags))) {
+        /* Order matters, just in case both flags were set */
+        if (flags & FDMON_IO_URING_ADD) {
+            add_poll_add_sqe(ctx, node);
+        }
+        if (flags & FDMON_IO_URING_REMOVE) {
+            add_poll_remove_sqe(ctx, node);
+        }
+    }
+}
+
+/* Returns true if a handler became ready or can now be freed */
+static bool process_cqe(AioContext *ctx, struct io_uring_cqe *cqe)
+{
+    AioHandler *node = io_uring_cqe_get_data(cqe);
+    unsigned flags;
+
+    /* poll_timeout and poll_remove have a zero user_data field */
+    if (!node) {
+        return false;
+    }
+
+    /*
+     * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
+     * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
+     * bit before IORING_OP_POLL_REMOVE is submitted.  The handler is already
+     * marked deleted and will be freed by aio_dispatch_handlers().
+     */
+    flags = atomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
+    if (flags & FDMON_IO_URING_REMOVE) {
+        return true;
+    }
+
+    node->pfd.revents |= pfd_events_from_poll(cqe->res);
+
+    /* IORING_OP_POLL_ADD is one-shot so we must re-arm it */
+    add_poll_add_sqe(ctx, node);
+    return true;
+}
+
+static int process_cq_ring(AioContext *ctx)
+{
+    struct io_uring *ring = &ctx->fdmon_io_uring->ring;
+    struct io_uring_cqe *cqe;
+    unsigned num_cqes = 0;
+    unsigned num_ready = 0;
+    unsigned head;
+
+    io_uring_for_each_cqe(ring, head, cqe) {
+        if (process_cqe(ctx, cqe)) {
+            num_ready++;
+        }
+
+        num_cqes++;
+    }
+
+    io_uring_cq_advance(ring, num_cqes);
+    return num_ready;
+}
+
+static int fdmon_io_uring_wait(AioContext *ctx, int64_t timeout)
+{
+    unsigned wait_nr = 1; /* block until at least one cqe is ready */
+    int ret;
+
+    /* Fall back while external clients are disabled */
+    if (atomic_read(&ctx->external_disable_cnt)) {
+        return fdmon_ppoll_wait(ctx, timeout);
+    }
+
+    if (timeout == 0) {
+        wait_nr = 0; /* non-blocking */
+    } else if (timeout > 0) {
+        add_timeout_sqe(ctx, timeout);
+    }
+
+    fill_sq_ring(ctx);
+
+    do {
+        ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring->ring, wait_nr);
+    } while (ret == -EINTR);
+
+    assert(ret >= 0);
+
+    return process_cq_ring(ctx);
+}
+
+static bool fdmon_io_uring_need_wait(AioContext *ctx)
+{
+    FDMonIoUring *s = ctx->fdmon_io_uring;
+
+    /* Have io_uring events completed? */
+    if (io_uring_cq_ready(&s->ring)) {
+        return true;
+    }
+
+    /* Are there pending sqes to submit? */
+    if (io_uring_sq_ready(&s->ring)) {
+        return true;
+    }
+
+    /* Do we need to process AioHandlers for io_uring changes? */
+    if (atomic_read(&s->submit_list.slh_first)) {
+        return true;
+    }
+
+    /* Are there handlers that can only be checked with a syscall? */
+    if (atomic_read(&ctx->poll_disable_cnt)) {
+        return true;
+    }
+
+    /* Are we falling back to ppoll? */
+    return atomic_read(&ctx->external_disable_cnt);
+}
+
+static const FDMonOps fdmon_io_uring_ops = {
+    .update = fdmon_io_uring_update,
+    .wait = fdmon_io_uring_wait,
+    .need_wait = fdmon_io_uring_need_wait,
+};
+
+bool fdmon_io_uring_node_busy(AioHandler *node)
+{
+    return atomic_read(&node->flags) &
+           (FDMON_IO_URING_PENDING | FDMON_IO_URING_REMOVE);
+}
+
+bool fdmon_io_uring_setup(AioContext *ctx)
+{
+    FDMonIoUring *s = g_new0(FDMonIoUring, 1);
+    int ret;
+
+    ret = io_uring_queue_init(FDMON_IO_URING_ENTRIES, &s->ring, 0);
+    if (ret != 0) {
+        g_free(s);
+        return false;
+    }
+
+    QSLIST_INIT(&s->submit_list);
+    ctx->fdmon_io_uring = s;
+    ctx->fdmon_ops = &fdmon_io_uring_ops;
+    return true;
+}
+
+void fdmon_io_uring_destroy(AioContext *ctx)
+{
+    FDMonIoUring *s = ctx->fdmon_io_uring;
+    AioHandler *node;
+
+    if (!s) {
+        return;
+    }
+
+    qemu_lockcnt_lock(&ctx->list_lock);
+
+    /* The kernel drops all its AioHandler references with the ring */
+    io_uring_queue_exit(&s->ring);
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        atomic_set(&node->flags, 0);
+        node->pfd.revents = 0;
+    }
+
+    ctx->fdmon_io_uring = NULL;
+    ctx->fdmon_ops = &fdmon_poll_ops;
+
+    aio_free_deleted_handlers(ctx);
+    qemu_lockcnt_unlock(&ctx->list_lock);
+
+    g_free(s);
+}
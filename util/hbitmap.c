@@ -101,6 +101,239 @@ struct HBitmap {
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+/* Kernels working on arrays of words of one level.  Long scans, such as
+ * counting the bits after a merge or a large set/reset, go through these;
+ * the vectorized versions are selected at startup like in bufferiszero.c.
+ */
+typedef struct HBitmapAccel {
+    /* Return the number of set bits in @n words */
+    uint64_t (*popcount)(const unsigned long *p, size_t n);
+    /* dst[i] = a[i] | b[i] for @n words; @dst may alias @a or @b */
+    void (*or)(unsigned long *dst, const unsigned long *a,
+               const unsigned long *b, size_t n);
+    /* Return the index of the first word that is not all ones, or @n */
+    size_t (*find_not_ones)(const unsigned long *p, size_t n);
+    /* Set @n words to all ones (@set) or zero.  Return true if this made
+     * any word change between zero and nonzero, i.e. the level above
+     * must be updated.
+     */
+    bool (*fill)(unsigned long *p, size_t n, bool set);
+} HBitmapAccel;
+
+static uint64_t hb_popcount_int(const unsigned long *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(p[i]);
+    }
+    return count;
+}
+
+static void hb_or_int(unsigned long *dst, const unsigned long *a,
+                      const unsigned long *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] | b[i];
+    }
+}
+
+static size_t hb_find_not_ones_int(const unsigned long *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && p[i] == ~0UL; i++) {
+        /* nothing */
+    }
+    return i;
+}
+
+static bool hb_fill_int(unsigned long *p, size_t n, bool set)
+{
+    bool changed = false;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        changed |= set ? p[i] == 0 : p[i] != 0;
+        p[i] = set ? ~0UL : 0;
+    }
+    return changed;
+}
+
+static const HBitmapAccel hb_accel_int = {
+    .popcount       = hb_popcount_int,
+    .or             = hb_or_int,
+    .find_not_ones  = hb_find_not_ones_int,
+    .fill           = hb_fill_int,
+};
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Nibble lookup table popcount, summed up per 64 bits with vpsadbw */
+static uint64_t hb_popcount_avx2(const unsigned long *p, size_t n)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    const uint8_t *buf = (const uint8_t *)p;
+    size_t len = n * sizeof(unsigned long), i;
+    __m256i acc = zero;
+    uint64_t sums[4];
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i lo = _mm256_and_si256(v, low);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                      _mm256_shuffle_epi8(lut, hi));
+
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, zero));
+    }
+    _mm256_storeu_si256((__m256i *)sums, acc);
+
+    i /= sizeof(unsigned long);
+    return sums[0] + sums[1] + sums[2] + sums[3] +
+           hb_popcount_int(p + i, n - i);
+}
+
+static void hb_or_avx2(unsigned long *dst, const unsigned long *a,
+                       const unsigned long *b, size_t n)
+{
+    size_t len = n * sizeof(unsigned long), i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)((uint8_t *)a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)((uint8_t *)b + i));
+
+        _mm256_storeu_si256((__m256i *)((uint8_t *)dst + i),
+                            _mm256_or_si256(va, vb));
+    }
+
+    i /= sizeof(unsigned long);
+    hb_or_int(dst + i, a + i, b + i, n - i);
+}
+
+static size_t hb_find_not_ones_avx2(const unsigned long *p, size_t n)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const uint8_t *buf = (const uint8_t *)p;
+    size_t len = n * sizeof(unsigned long), i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+
+        if (!_mm256_testc_si256(v, ones)) {
+            break;
+        }
+    }
+
+    /* Find the word in the block that stopped the loop, or in the tail */
+    i /= sizeof(unsigned long);
+    return i + hb_find_not_ones_int(p + i, n - i);
+}
+
+static bool hb_fill_avx2(unsigned long *p, size_t n, bool set)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i fill = set ? _mm256_set1_epi8(-1) : zero;
+    uint8_t *buf = (uint8_t *)p;
+    size_t len = n * sizeof(unsigned long), i;
+    __m256i changed = zero;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+
+        if (!set) {
+            changed = _mm256_or_si256(changed, v);
+        } else if (sizeof(unsigned long) == 8) {
+            changed = _mm256_or_si256(changed, _mm256_cmpeq_epi64(v, zero));
+        } else {
+            changed = _mm256_or_si256(changed, _mm256_cmpeq_epi32(v, zero));
+        }
+        _mm256_storeu_si256((__m256i *)(buf + i), fill);
+    }
+
+    i /= sizeof(unsigned long);
+    return hb_fill_int(p + i, n - i, set) || !_mm256_testz_si256(changed,
+                                                                 changed);
+}
+#pragma GCC pop_options
+
+static const HBitmapAccel hb_accel_avx2 = {
+    .popcount       = hb_popcount_avx2,
+    .or             = hb_or_avx2,
+    .find_not_ones  = hb_find_not_ones_avx2,
+    .fill           = hb_fill_avx2,
+};
+
+/* Note that for test_hbitmap_next_accel, the most preferred ISA must have
+ * the least significant bit.
+ */
+#define CACHE_AVX2    1
+
+#include "qemu/cpuid.h"
+
+static unsigned cpuid_cache;
+static const HBitmapAccel *hb_accel = &hb_accel_int;
+
+static void init_accel(unsigned cache)
+{
+    hb_accel = cache & CACHE_AVX2 ? &hb_accel_avx2 : &hb_accel_int;
+}
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+
+bool test_hbitmap_next_accel(void)
+{
+    /* If no bits set, we just tested the generic kernels, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+#else
+static const HBitmapAccel *hb_accel = &hb_accel_int;
+
+bool test_hbitmap_next_accel(void)
+{
+    return false;
+}
+#endif /* CONFIG_AVX2_OPT */
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -219,9 +452,8 @@ int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        pos++;
+        pos += hb_accel->find_not_ones(last_lev + pos, sz - pos);
 
         if (pos >= sz) {
             return -1;
@@ -298,31 +530,32 @@ uint64_t hbitmap_count(const HBitmap *hb)
     return hb->count << hb->granularity;
 }
 
-/* Count the number of set bits between start and end, not accounting for
- * the granularity.  Also an example of how to use hbitmap_iter_next_word.
+/* Count the number of set bits between start and last, not accounting for
+ * the granularity.  The level above is used to skip blocks of BITS_PER_LONG
+ * zero words, the others are counted in bulk.
  */
 static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
 {
-    HBitmapIter hbi;
-    uint64_t count = 0;
-    uint64_t end = last + 1;
-    unsigned long cur;
-    size_t pos;
+    const unsigned long *lev = hb->levels[HBITMAP_LEVELS - 1];
+    const unsigned long *up = hb->levels[HBITMAP_LEVELS - 2];
+    size_t pos = start >> BITS_PER_LEVEL;
+    size_t lastpos = last >> BITS_PER_LEVEL;
+    unsigned long first_mask = ~0UL << (start & (BITS_PER_LONG - 1));
+    unsigned long last_mask =
+        ~0UL >> (BITS_PER_LONG - 1 - (last & (BITS_PER_LONG - 1)));
+    uint64_t count;
+    size_t i, end;
 
-    hbitmap_iter_init(&hbi, hb, start << hb->granularity);
-    for (;;) {
-        pos = hbitmap_iter_next_word(&hbi, &cur);
-        if (pos >= (end >> BITS_PER_LEVEL)) {
-            break;
-        }
-        count += ctpopl(cur);
+    if (pos == lastpos) {
+        return ctpopl(lev[pos] & first_mask & last_mask);
     }
 
-    if (pos == (end >> BITS_PER_LEVEL)) {
-        /* Drop bits representing the END-th and subsequent items.  */
-        int bit = end & (BITS_PER_LONG - 1);
-        cur &= (1UL << bit) - 1;
-        count += ctpopl(cur);
+    count = ctpopl(lev[pos] & first_mask) + ctpopl(lev[lastpos] & last_mask);
+    for (i = pos + 1; i < lastpos; i = end) {
+        end = MIN(QEMU_ALIGN_UP(i + 1, BITS_PER_LONG), lastpos);
+        if (up[i >> BITS_PER_LEVEL]) {
+            count += hb_accel->popcount(lev + i, end - i);
+        }
     }
 
     return count;
@@ -360,15 +593,10 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
         changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
-        }
+        changed |= hb_accel->fill(&hb->levels[level][i + 1], lastpos - i - 1,
+                                  true);
+        i = lastpos;
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
     changed |= hb_set_elem(&hb->levels[level][i], start, last);
 
@@ -445,15 +673,10 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
             pos++;
         }
 
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
-        }
+        changed |= hb_accel->fill(&hb->levels[level][i + 1], lastpos - i - 1,
+                                  false);
+        i = lastpos;
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
 
     /* Same as above, this time for lastpos.  */
@@ -815,7 +1038,6 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
-    uint64_t j;
 
     if (!hbitmap_can_merge(a, b) || !hbitmap_can_merge(a, result)) {
         return false;
@@ -851,9 +1073,8 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
      */
     assert(a->size == b->size);
     for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
-        }
+        hb_accel->or(result->levels[i], a->levels[i], b->levels[i],
+                     a->sizes[i]);
     }
 
     /* Recompute the dirty count */
@@ -163,6 +163,7 @@ int qemu_init_main_loop(Error **errp)
     }
     qemu_notify_bh = qemu_bh_new(notify_event_cb, NULL);
     gpollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    aio_context_use_g_source(qemu_aio_context);
     src = aio_get_g_source(qemu_aio_context);
     g_source_set_name(src, "aio-context");
     g_source_attach(src, NULL);
@@ -542,6 +543,7 @@ static void iohandler_init(void)
 {
     if (!iohandler_ctx) {
         iohandler_ctx = aio_context_new(&error_abort);
+        aio_context_use_g_source(iohandler_ctx);
     }
 }
 
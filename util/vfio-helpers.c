@@ -172,14 +172,10 @@ void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
 }
 
 /**
- * Initialize device IRQ with @irq_type and and register an event notifier.
+ * Return the number of vectors the device has for @irq_type.
  */
-int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
-                           int irq_type, Error **errp)
+int qemu_vfio_pci_get_irq_count(QEMUVFIOState *s, int irq_type, Error **errp)
 {
-    int r;
-    struct vfio_irq_set *irq_set;
-    size_t irq_set_size;
     struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
 
     irq_info.index = irq_type;
@@ -191,20 +187,46 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
         error_setg(errp, "Device interrupt doesn't support eventfd");
         return -EINVAL;
     }
+    return irq_info.count;
+}
+
+/**
+ * Initialize the first @count vectors of device IRQ with @irq_type and
+ * register one event notifier for each of them.
+ */
+int qemu_vfio_pci_init_irqs(QEMUVFIOState *s, EventNotifier **e, int count,
+                            int irq_type, Error **errp)
+{
+    int i, r;
+    int *fds;
+    struct vfio_irq_set *irq_set;
+    size_t irq_set_size;
+
+    r = qemu_vfio_pci_get_irq_count(s, irq_type, errp);
+    if (r < 0) {
+        return r;
+    }
+    if (count > r) {
+        error_setg(errp, "Device has only %d interrupt vectors", r);
+        return -EINVAL;
+    }
 
-    irq_set_size = sizeof(*irq_set) + sizeof(int);
+    irq_set_size = sizeof(*irq_set) + count * sizeof(int);
     irq_set = g_malloc0(irq_set_size);
 
     /* Get to a known IRQ state */
     *irq_set = (struct vfio_irq_set) {
         .argsz = irq_set_size,
         .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
-        .index = irq_info.index,
+        .index = irq_type,
         .start = 0,
-        .count = 1,
+        .count = count,
     };
 
-    *(int *)&irq_set->data = event_notifier_get_fd(e);
+    fds = (int *)&irq_set->data;
+    for (i = 0; i < count; i++) {
+        fds[i] = event_notifier_get_fd(e[i]);
+    }
     r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
     g_free(irq_set);
     if (r) {
@@ -214,6 +236,15 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
     return 0;
 }
 
+/**
+ * Initialize device IRQ with @irq_type and and register an event notifier.
+ */
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp)
+{
+    return qemu_vfio_pci_init_irqs(s, &e, 1, irq_type, errp);
+}
+
 static int qemu_vfio_pci_read_config(QEMUVFIOState *s, void *buf,
                                      int size, int ofs)
 {